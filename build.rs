@@ -18,6 +18,16 @@ fn extract_inner_token(s: &str) -> Option<String> {
 	None
 }
 
+/// Registering macros to look for, with the prefix of the symbol each one
+/// exports. Benchmarks are only built with the `kbench` feature.
+fn registering_macros() -> Vec<(&'static str, &'static str)> {
+	let mut macros = vec![("create_test!(", "__kernel_test_")];
+	if env::var_os("CARGO_FEATURE_KBENCH").is_some() {
+		macros.push(("create_bench!(", "__kernel_bench_"));
+	}
+	macros
+}
+
 fn search_files_recursively(path: &Path) -> Vec<String> {
 	let mut symbols: Vec<String> = Vec::new();
 
@@ -29,29 +39,36 @@ fn search_files_recursively(path: &Path) -> Vec<String> {
 				&& ext == "rs" {
 					let file = fs::read_to_string(&path).unwrap_or_default();
 
-					let needle = "create_test!(";
-					for (pos, _) in file.match_indices(needle) {
-						let start = pos + needle.len();
-						let rest = &file[start..];
-
-						if let Some(inner) = extract_inner_token(rest) {
+					for (needle, prefix_sym) in registering_macros() {
+						for (pos, _) in file.match_indices(needle) {
 							// compute line number where create_test appears
 							let prefix = &file[..pos];
-							let line_number = prefix.chars().filter(|c| *c == '\n').count() + 1;
-
-							let token = inner.trim();
-
-							// determine exported symbol name exactly as your macro does
-							// - for simple identifier forms (no "::"), macro uses
-							//   "__kernel_test_<ident>_<line>"
-							// - for path forms, macro uses "__kernel_test_<line>"
-							let sym = if token.contains("::") || token.starts_with("crate::") {
-								format!("__kernel_test_{}", line_number)
-							} else {
-								format!("__kernel_test_{}_{}", token, line_number)
-							};
-
-							symbols.push(sym);
+							let line_start = prefix.rfind('\n').map_or(0, |i| i + 1);
+							// examples in doc comments register nothing
+							if file[line_start..pos].trim_start().starts_with("//") {
+								continue;
+							}
+
+							let start = pos + needle.len();
+							let rest = &file[start..];
+
+							if let Some(inner) = extract_inner_token(rest) {
+								let line_number = prefix.chars().filter(|c| *c == '\n').count() + 1;
+
+								let token = inner.trim();
+
+								// determine exported symbol name exactly as your macro does
+								// - for simple identifier forms (no "::"), macro uses
+								//   "<prefix><ident>_<line>"
+								// - for path forms, macro uses "<prefix><line>"
+								let sym = if token.contains("::") || token.starts_with("crate::") {
+									format!("{}{}", prefix_sym, line_number)
+								} else {
+									format!("{}{}_{}", prefix_sym, token, line_number)
+								};
+
+								symbols.push(sym);
+							}
 						}
 					}
 				}
@@ -1,20 +1,52 @@
+#include "include/nullex.h"
+
+uint64_t __nullex_features = 0;
+struct nx_outbuf __nullex_stdout = { 0, NX_BUF_FULL, {0} };
+char** __nx_environ;
+const struct nx_auxv* __nx_auxv;
+
 __attribute__((noreturn))
 static void _exit(int code) {
-    __asm__ volatile (
-        "mov $1, %%rax\n"
-        "mov %0, %%rdi\n"
-        "int $0x80\n"
-        :
-        : "r"((long)code)
-        : "rax", "rdi"
-    );
+    flush();
+    ksyscall(SYS_HALT, (uint64_t)(int64_t)code, 0, 0, 0, 0, 0);
     __builtin_unreachable(); // like unreachable!()
 }
 
-extern int main(void);
+extern int main(int argc, char** argv, char** envp);
+
+/*
+ * The entry point. rsp points at argc, see setup_user_stack in the kernel;
+ * it is handed to __nx_start as it is and the stack realigned for the call.
+ */
+__asm__(
+    ".globl _start\n"
+    ".type _start, @function\n"
+    "_start:\n"
+    "    xor %ebp, %ebp\n"
+    "    mov %rsp, %rdi\n"
+    "    and $-16, %rsp\n"
+    "    call __nx_start\n"
+    "    ud2\n"
+);
+
+__attribute__((noreturn, used)) // same as -> !
+void __nx_start(uint64_t* sp) {
+    int argc = (int)sp[0];
+    char** argv = (char**)(sp + 1);
+    char** envp = argv + argc + 1;
+    char** end = envp;
+    while (*end) {
+        end++;
+    }
+    __nx_environ = envp;
+    __nx_auxv = (const struct nx_auxv*)(end + 1);
 
-__attribute__((noreturn)) // same as -> !
-void _start(void) {
-    int ret = main();
+    // ask over int $0x80 first, a kernel without SYS_FEATS returns -1 here
+    int32_t f = feats();
+    __nullex_features = (f < 0) ? 0 : (uint64_t)f;
+
+    __nx_string_init();
+
+    int ret = main(argc, argv, envp);
     _exit(ret);
-}
\ No newline at end of file
+}
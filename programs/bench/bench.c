@@ -0,0 +1,223 @@
+#include "../include/nullex.h"
+
+/*
+ * Times the syscalls a program makes most with rdtsc.
+ *
+ * Every line reads "bench: <name> <cycles> cycles/op", each the mean over a
+ * fixed number of calls, lower is better. The kernel built with the bench
+ * feature (make bench) starts this program at boot and leaves QEMU with its
+ * exit code, so the serial logs of two commits can be compared line by line.
+ * A syscall failing during a run, or say() formatting a check wrong, makes
+ * the exit code 1.
+ */
+
+#define SCRATCH_PATH "/tmp/scratch"
+#define READ_PATH    "/apps/bench.elf"
+#define NOP_PATH     "/apps/nop.elf"
+#define NO_PATH      ((const char*)0)
+
+#define MAX_SIZE  16384
+/* bytes moved per read and write measurement */
+#define WORK      (1u << 18)
+
+#define CALL_ITERS   4096
+#define SAY_ITERS    32
+#define FORMAT_ITERS 4096
+#define SPLIT_ITERS  64
+
+static uint8_t buf[MAX_SIZE];
+
+static const size_t sizes[] = { 16, 256, 1024, 4096, 16384 };
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static int failed;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void report(const char* name, uint64_t cycles, uint64_t ops) {
+    say("bench: %s %ld cycles/op", name, (long)(ops ? cycles / ops : 0));
+}
+
+static void report_size(const char* name, size_t size, uint64_t cycles, uint64_t ops) {
+    say("bench: %s %ld %ld cycles/op", name, (long)size, (long)(ops ? cycles / ops : 0));
+}
+
+static void check(int32_t ret, const char* what) {
+    if (ret < 0) {
+        say("bench: %s failed", what);
+        failed = 1;
+    }
+}
+
+static void bench_say(void) {
+    // unbuffered, so every call is one syscall
+    setbufmode(NX_BUF_NONE);
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < SAY_ITERS; i++) {
+        say("bench: say %d", i);
+    }
+    uint64_t t1 = rdtsc();
+    setbufmode(NX_BUF_FULL);
+    report("say", t1 - t0, SAY_ITERS);
+}
+
+// what say() queued must read `want` and a newline, checked before timing
+static void check_format(const char* want) {
+    size_t len = __builtin_strlen(want);
+    struct nx_outbuf* out = &__nullex_stdout;
+    int ok = out->len == len + 1 && memcmp(out->data, want, len) == 0 && out->data[len] == '\n';
+    out->len = 0;
+    if (!ok) {
+        say("bench: format \"%s\" failed", want);
+        flush();
+        failed = 1;
+    }
+}
+
+static void test_format(void) {
+    flush();
+    say("%d", (int32_t)-1);
+    check_format("-1");
+    say("%i|%5d|%-4d|", -42, -7, -3);
+    check_format("-42|   -7|-3  |");
+    say("%u %x", (unsigned)-1, (unsigned)-1);
+    check_format("4294967295 ffffffff");
+    say("%ld %lu", (long)-5, (unsigned long)-1);
+    check_format("-5 18446744073709551615");
+    say("%hd %hhd", -1, 255);
+    check_format("-1 -1");
+}
+
+static void bench_format(void) {
+    // formatting alone: what a say() buffered is dropped before the buffer
+    // fills, so no syscall is timed
+    flush();
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < FORMAT_ITERS; i++) {
+        say("bench: fmt %8ld %lx %lu %-6s|", (long)i * 7919, (long)i, (unsigned long)i << 20, "pad");
+        __nullex_stdout.len = 0;
+    }
+    uint64_t t1 = rdtsc();
+    report("format", t1 - t0, FORMAT_ITERS);
+}
+
+static void bench_open_close(void) {
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < CALL_ITERS; i++) {
+        int32_t fd = openf(READ_PATH);
+        check(fd, "openf");
+        check(closef(fd), "closef");
+    }
+    uint64_t t1 = rdtsc();
+    report("openf+closef", t1 - t0, CALL_ITERS);
+}
+
+static void bench_sizef(void) {
+    int32_t fd = openf(READ_PATH);
+    check(fd, "openf");
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < CALL_ITERS; i++) {
+        check(sizef(fd), "sizef");
+    }
+    uint64_t t1 = rdtsc();
+    closef(fd);
+    report("sizef", t1 - t0, CALL_ITERS);
+}
+
+static void bench_readf(size_t size) {
+    int32_t fd = openf(READ_PATH);
+    check(fd, "openf");
+    uint64_t iters = WORK / size;
+    uint64_t cycles = 0;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        uint64_t t0 = rdtsc();
+        int32_t n = readf(fd, buf, size);
+        cycles += rdtsc() - t0;
+        check(n, "readf");
+        if (n < (int32_t)size) {
+            // at the end of the file, start over outside the clock
+            closef(fd);
+            fd = openf(READ_PATH);
+            check(fd, "openf");
+        }
+    }
+    closef(fd);
+    report_size("readf", size, cycles, iters);
+}
+
+static void bench_writef(size_t size) {
+    int32_t fd = openf(SCRATCH_PATH);
+    check(fd, "openf");
+    uint64_t iters = WORK / size;
+
+    uint64_t t0 = rdtsc();
+    for (uint64_t i = 0; i < iters; i++) {
+        check(writef_buf(fd, buf, size), "writef");
+    }
+    uint64_t t1 = rdtsc();
+    closef(fd);
+    report_size("writef", size, t1 - t0, iters);
+}
+
+/* split() a child that exits right away or run()s `path` first, and wait
+ * for it */
+static uint64_t split_cycle(const char* path) {
+    uint64_t t0 = rdtsc();
+    int32_t pid = split();
+    if (pid == 0) {
+        if (path) {
+            char* const argv[] = { (char*)path, (char*)0 };
+            run(path, strlen(path), argv);
+        }
+        halt(path ? 1 : 0);
+    }
+    check(pid, "split");
+    // the child only exits with 0 from nop.elf or without a path
+    if (waiton(pid) != 0) {
+        say("bench: %s failed", path ? "run" : "waiton");
+        failed = 1;
+    }
+    return rdtsc() - t0;
+}
+
+static void bench_split_run(void) {
+    uint64_t split_cycles = 0;
+    uint64_t run_cycles = 0;
+    for (int i = 0; i < SPLIT_ITERS; i++) {
+        split_cycles += split_cycle(NO_PATH);
+        run_cycles += split_cycle(NOP_PATH);
+    }
+    report("split+halt+waiton", split_cycles, SPLIT_ITERS);
+    report("split+run+halt+waiton", run_cycles, SPLIT_ITERS);
+    // what run() adds on top of a bare child
+    report("run", run_cycles > split_cycles ? run_cycles - split_cycles : 0, SPLIT_ITERS);
+}
+
+int main(void) {
+    say("bench: syscall costs in cycles per operation, lower is better");
+
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = (uint8_t)i;
+    }
+
+    bench_say();
+    test_format();
+    bench_format();
+    bench_open_close();
+    bench_sizef();
+    for (size_t i = 0; i < NSIZES; i++) {
+        bench_readf(sizes[i]);
+    }
+    for (size_t i = 0; i < NSIZES; i++) {
+        bench_writef(sizes[i]);
+    }
+    bench_split_run();
+
+    say("bench: done, %s", failed ? "failures" : "ok");
+    return failed;
+}
@@ -0,0 +1,9 @@
+#include "../include/nullex.h"
+
+/*
+ * Does nothing. bench.c run()s it to time replacing a process image.
+ */
+
+int main(void) {
+    return 0;
+}
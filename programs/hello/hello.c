@@ -1,11 +1,13 @@
 #include "../include/nullex.h"
 
-int main(void) {
+int main(int argc, char** argv) {
     for (int i = 0; i < 10; i++) {
         say("Hello!");
     }
+    for (int i = 0; i < argc; i++) {
+        say("argv[%d] = %s", i, argv[i]);
+    }
 
-    size_t bytes_read;
     int fd;
 
     fd = openf("logs/syslog");
@@ -14,13 +16,13 @@ int main(void) {
         return -1;
     }
 
-    size_t file_size = sizef(fd);
-    char buffer[file_size];
-    
-    bytes_read = readf(fd, buffer, sizeof(buffer) - 1);
-
-    const char* content = buffer;
-    say(content);
+    // read the log in place instead of copying it onto the stack
+    const void* content;
+    int32_t len = mapf(fd, &content);
+    if (len > 0) {
+        emit(content, len);
+        unmapf(content);
+    }
 
     writef(fd, "Test!");
 
@@ -34,8 +34,67 @@ typedef signed long long int64_t;
 #define SYS_NAP    10
 #define SYS_SIZEF  11
 
+#define SYS_FEATS  12
+#define SYS_EMIT   13
+#define SYS_READFV  14
+#define SYS_WRITEFV 15
+#define SYS_MAPF    16
+#define SYS_UNMAPF  17
+#define SYS_READLOG 18
+#define SYS_MAPM    19
+#define SYS_UNMAPM  20
+#define SYS_RINGSETUP 21
+#define SYS_RINGENTER 22
+#define SYS_SOCKOPEN    23
+#define SYS_SOCKCONNECT 24
+#define SYS_SOCKLISTEN  25
+#define SYS_SOCKSEND    26
+#define SYS_SOCKRECV    27
+#define SYS_SOCKCLOSE   28
+#define SYS_SOCKSTATE   29
+#define SYS_TRACE       30
+
+/* feature bits reported by SYS_FEATS, see FEAT_* in src/syscall.rs */
+#define NX_FEAT_SYSCALL (1u << 0)
+
+/* filled in by _start() from SYS_FEATS before main() runs */
+extern uint64_t __nullex_features;
+
 /*
- * x86_64 syscall wrapper using the Linux-style syscall register convention:
+ * Program startup, see programs/_start.c.
+ *
+ * The kernel starts a program with argc, the argv and envp arrays (each
+ * ended by a null) and the auxiliary vector on its stack. _start() hands the
+ * first three to int main(int argc, char** argv, char** envp); a main that
+ * takes no arguments works as well.
+ */
+extern char** __nx_environ;
+
+/* auxiliary vector keys, see AT_* in src/arch/x86_64/user.rs */
+#define NX_AT_NULL   0
+#define NX_AT_PAGESZ 6
+#define NX_AT_ENTRY  9
+
+struct nx_auxv {
+    uint64_t key;
+    uint64_t value;
+};
+
+/* the vector, ended by an NX_AT_NULL entry */
+extern const struct nx_auxv* __nx_auxv;
+
+/* value of auxv entry key, 0 if the kernel did not pass it */
+static inline uint64_t nx_auxval(uint64_t key) {
+    for (const struct nx_auxv* a = __nx_auxv; a && a->key != NX_AT_NULL; a++) {
+        if (a->key == key) {
+            return a->value;
+        }
+    }
+    return 0;
+}
+
+/*
+ * x86_64 syscall wrappers using the Linux-style syscall register convention:
  * rax = syscall number (also return)
  * rdi = arg0
  * rsi = arg1
@@ -46,7 +105,7 @@ typedef signed long long int64_t;
  *
  * Clobbers: rcx, r11, memory
  */
-static inline int32_t ksyscall(uint32_t num, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+static inline int32_t ksyscall_int80(uint32_t num, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
     int32_t ret;
     register uint64_t r10 __asm__("r10") = a3; // r10 is special, can't be a constraint
     register uint64_t r8  __asm__("r8")  = a4;
@@ -62,103 +121,193 @@ static inline int32_t ksyscall(uint32_t num, uint64_t a0, uint64_t a1, uint64_t
     return ret;
 }
 
-static inline size_t strlen(const char *str) {
-    size_t length = 0;
-    while (str[length] != '\0') {
-        length++;
+/* same as ksyscall_int80, but through the `syscall` instruction. the cpu puts
+ * rip in rcx and rflags in r11, so the clobbers are the same. */
+static inline int32_t ksyscall_fast(uint32_t num, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    int32_t ret;
+    register uint64_t r10 __asm__("r10") = a3;
+    register uint64_t r8  __asm__("r8")  = a4;
+    register uint64_t r9  __asm__("r9")  = a5;
+
+    __asm__ volatile (
+        "syscall"
+        : "=a"(ret)
+        : "a"(num), "D"(a0), "S"(a1), "d"(a2), "r"(r10), "r"(r8), "r"(r9)
+        : "rcx", "r11", "memory"
+    );
+
+    return ret;
+}
+
+/* uses `syscall` when the kernel advertises it, `int $0x80` otherwise. */
+static inline int32_t ksyscall(uint32_t num, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    if (__builtin_expect(__nullex_features & NX_FEAT_SYSCALL, 1)) {
+        return ksyscall_fast(num, a0, a1, a2, a3, a4, a5);
     }
-    return length;
+    return ksyscall_int80(num, a0, a1, a2, a3, a4, a5);
 }
 
-static inline char* strcpy(char* destination, const char* source) {
-    char *start = destination;
-    while (*source) {
-        *destination++ = *source++;
+/*
+ * String and memory primitives, implemented in libc/string.c.
+ *
+ * Each one exists as byte, word, sse2 and avx2 variants. _start picks the
+ * best variant the cpu supports via CPUID before main() runs, the table is
+ * exposed so benchmarks can call a specific variant.
+ */
+size_t strlen(const char* s);
+char* strcpy(char* dst, const char* src);
+void* memcpy(void* dst, const void* src, size_t n);
+void* memset(void* dst, int c, size_t n);
+int memcmp(const void* a, const void* b, size_t n);
+
+/* cpu feature bits a variant needs, see __nx_cpu_features */
+#define NX_CPU_SSE2 (1u << 0)
+#define NX_CPU_AVX2 (1u << 1)
+
+struct nx_string_impl {
+    const char* name;
+    uint32_t requires;
+    size_t (*strlen)(const char* s);
+    void* (*memcpy)(void* dst, const void* src, size_t n);
+    void* (*memset)(void* dst, int c, size_t n);
+    int (*memcmp)(const void* a, const void* b, size_t n);
+};
+
+#define NX_STRING_NIMPLS 4
+
+/* all variants, slowest first */
+extern const struct nx_string_impl __nx_string_impls[NX_STRING_NIMPLS];
+/* the variant in use */
+extern struct nx_string_impl __nx_string;
+/* NX_CPU_* bits detected at startup */
+extern uint32_t __nx_cpu_features;
+
+int nx_string_impl_usable(const struct nx_string_impl* impl);
+void __nx_string_init(void);
+
+/*
+ * Buffered output.
+ *
+ * say() and emit() append to a single process-wide buffer which is handed to
+ * the kernel with one SYS_EMIT when it fills up, when flush() is called, or
+ * when the program exits through _start. NX_BUF_LINE flushes on every '\n',
+ * NX_BUF_NONE makes every call go straight to the kernel.
+ */
+#define NX_BUF_FULL 0
+#define NX_BUF_LINE 1
+#define NX_BUF_NONE 2
+
+#define NX_OUTBUF_SIZE 4096
+
+struct nx_outbuf {
+    size_t len;
+    int mode;
+    char data[NX_OUTBUF_SIZE];
+};
+
+/* defined in _start.c, one per program */
+extern struct nx_outbuf __nullex_stdout;
+
+static inline int32_t emit_raw(const char* buf, size_t len) {
+    return ksyscall(SYS_EMIT, (uint64_t)buf, (uint64_t)len, 0, 0, 0, 0);
+}
+
+static inline int32_t flush() {
+    struct nx_outbuf* out = &__nullex_stdout;
+    if (out->len == 0) {
+        return 0;
     }
-    *destination = 0; 
-    return start;
-}
-
-// ai thanks.
-static inline int32_t say(const char* format, ...) {
-    char buf[256];
-    char* p = buf;
-    const char* f = format;
-    
-    __builtin_va_list args;
-    __builtin_va_start(args, format);
-    
-    while (*f && p - buf < 255) {
-        if (*f == '%') {
-            f++;
-            if (*f == 'd' || *f == 'i') {
-                long num = __builtin_va_arg(args, long);
-                char nbuf[32];
-                int neg = (num < 0);
-                if (neg) num = -num;
-                
-                int i = 0;
-                if (num == 0) {
-                    nbuf[i++] = '0';
-                } else {
-                    while (num > 0) {
-                        nbuf[i++] = '0' + (num % 10);
-                        num /= 10;
-                    }
-                }
-                if (neg) nbuf[i++] = '-';
-                
-                for (int j = i - 1; j >= 0; j--) {
-                    *p++ = nbuf[j];
-                }
-            } else if (*f == 's') {
-                const char* str = __builtin_va_arg(args, const char*);
-                while (*str && p - buf < 255) {
-                    *p++ = *str++;
-                }
-            } else if (*f == 'c') {
-                char c = __builtin_va_arg(args, int);
-                *p++ = c;
-            } else if (*f == 'x') {
-                long num = __builtin_va_arg(args, long);
-                char nbuf[32];
-                int i = 0;
-                if (num == 0) {
-                    nbuf[i++] = '0';
-                } else {
-                    while (num > 0) {
-                        int digit = num % 16;
-                        nbuf[i++] = (digit < 10) ? ('0' + digit) : ('a' + digit - 10);
-                        num /= 16;
-                    }
-                }
-                for (int j = i - 1; j >= 0; j--) {
-                    *p++ = nbuf[j];
-                }
-            }
-            f++;
-        } else {
-            *p++ = *f++;
+    int32_t ret = emit_raw(out->data, out->len);
+    out->len = 0;
+    return ret < 0 ? ret : 0;
+}
+
+static inline void setbufmode(int mode) {
+    flush();
+    __nullex_stdout.mode = mode;
+}
+
+/* queue len bytes of output, returns 0 or a negative error from the kernel */
+static inline int32_t emit(const char* buf, size_t len) {
+    struct nx_outbuf* out = &__nullex_stdout;
+
+    if (out->mode == NX_BUF_NONE) {
+        int32_t ret = flush();
+        return ret < 0 ? ret : (emit_raw(buf, len) < 0 ? -1 : 0);
+    }
+
+    if (out->len + len > NX_OUTBUF_SIZE) {
+        int32_t ret = flush();
+        if (ret < 0) {
+            return ret;
         }
+        // too big to ever fit, skip the copy and send it as is
+        if (len > NX_OUTBUF_SIZE) {
+            return emit_raw(buf, len) < 0 ? -1 : 0;
+        }
+    }
+
+    int newline = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = buf[i];
+        out->data[out->len + i] = c;
+        newline |= (c == '\n');
     }
-    *p = '\0';
-    __builtin_va_end(args);
-    
-    size_t len = p - buf;
-    return ksyscall(SYS_SAY, (uint64_t)buf, (uint64_t)len, 0, 0, 0, 0);
+    out->len += len;
+
+    if (out->mode == NX_BUF_LINE && newline) {
+        return flush();
+    }
+    return 0;
 }
 
+/*
+ * Formatted output, see libc/format.c.
+ *
+ * say() prints one message and a newline into the stdout buffer, any length.
+ * It knows %d %i %u %x %X %p %c %s and %%, the flags - 0 + space and #, a
+ * field width and a .precision (either one may be *). An integer conversion
+ * takes an int or unsigned, l, ll, z, j and t make it a 64 bit long and h and
+ * hh narrow the value.
+ *
+ * A constant format without a '%' in it is measured at compile time and
+ * copied as is, it is never parsed.
+ */
+int32_t __nx_say(const char* format, ...);
+int32_t __nx_say_text(const char* text, size_t len);
+
+#define __NX_SAY_PLAIN(format) \
+    (__builtin_constant_p(format) && __builtin_strchr((format), '%') == (char*)0)
+
+#define say(format, ...)                                                     \
+    (__NX_SAY_PLAIN(format) ? __nx_say_text((format), __builtin_strlen(format)) \
+                            : __nx_say((format), ##__VA_ARGS__))
+
 // SYS_HALT is in _start.c as _exit()
 static inline int32_t halt(int64_t exit_code) {
+    flush();
     return ksyscall(SYS_HALT, (uint64_t)exit_code, 0, 0, 0, 0, 0);
 }
 
+/*
+ * Returns the child's pid in the parent and 0 in the child. The child gets a
+ * copy-on-write copy of memory and the open files, and runs from here once
+ * the parent gives up the cpu.
+ */
 static inline int32_t split() {
+    // dont let the child inherit (and print again) buffered output
+    flush();
     return ksyscall(SYS_SPLIT, 0, 0, 0, 0, 0, 0);
 }
 
-static inline int32_t waiton() {
-    return ksyscall(SYS_WAITON, 0, 0, 0, 0, 0, 0);
+/*
+ * Blocks until the child `pid` (from split()) exits and returns its exit
+ * code, -1 if pid is not a child of the caller. Other processes run while
+ * the caller waits.
+ */
+static inline int32_t waiton(int32_t pid) {
+    flush();
+    return ksyscall(SYS_WAITON, (uint64_t)pid, 0, 0, 0, 0, 0);
 }
 
 static inline int32_t openf(const char* path) {
@@ -174,19 +323,253 @@ static inline int32_t readf(uint64_t fd, uint8_t* buf, size_t len) {
     return ksyscall(SYS_READF, fd, (uint64_t)buf, (uint64_t)len, 0, 0, 0);
 }
 
-static inline int32_t writef_buf(uint64_t fd, uint8_t* buf, size_t len) {
+static inline int32_t writef_buf(uint64_t fd, const uint8_t* buf, size_t len) {
     return ksyscall(SYS_WRITEF, fd, (uint64_t)buf, (uint64_t)len, 0, 0, 0);
 }
 
+/* the string is handed to the kernel in place, no copy is made */
 static inline int32_t writef_str(uint64_t fd, const char* to_write) {
-    size_t len = strlen(to_write);
-    char destination_array[len];
+    return ksyscall(SYS_WRITEF, fd, (uint64_t)to_write, (uint64_t)strlen(to_write), 0, 0, 0);
+}
 
-    strcpy(destination_array, to_write);
+/* one buffer of a vectored read/write, see IoVec in src/syscall.rs */
+struct iovec {
+    void* base;
+    size_t len;
+};
 
-    uint8_t *buf_ptr = (uint8_t *)destination_array;
+/* the kernel rejects more than this many iovecs per call */
+#define NX_IOV_MAX 1024
 
-    return ksyscall(SYS_WRITEF, fd, (uint64_t)buf_ptr, (uint64_t)len, 0, 0, 0);
+/* fill each buffer in order from the current offset, returns bytes read */
+static inline int32_t readfv(uint64_t fd, const struct iovec* iov, size_t count) {
+    return ksyscall(SYS_READFV, fd, (uint64_t)iov, (uint64_t)count, 0, 0, 0);
+}
+
+/* append all buffers in order in a single trap like writef, returns bytes written */
+static inline int32_t writefv(uint64_t fd, const struct iovec* iov, size_t count) {
+    return ksyscall(SYS_WRITEFV, fd, (uint64_t)iov, (uint64_t)count, 0, 0, 0);
+}
+
+/*
+ * Map the whole file read-only into memory. *addr is set to the start of the
+ * mapping, the return value is the file length (0 for an empty file, nothing
+ * is mapped then) or -1. The mapping does not see later writes to the file.
+ */
+static inline int32_t mapf(uint64_t fd, const void** addr) {
+    return ksyscall(SYS_MAPF, fd, (uint64_t)addr, 0, 0, 0, 0);
+}
+
+/* release a mapping, addr must be what mapf() returned */
+static inline int32_t unmapf(const void* addr) {
+    return ksyscall(SYS_UNMAPF, (uint64_t)addr, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Reserve len bytes (rounded up to whole pages) of zeroed, writable memory.
+ * *addr is set to its start, returns 0 or -1. Pages only cost memory once
+ * they are touched. Most programs want malloc() instead.
+ */
+static inline int32_t mapm(size_t len, void** addr) {
+    return ksyscall(SYS_MAPM, (uint64_t)len, (uint64_t)addr, 0, 0, 0, 0);
+}
+
+/* release a whole region, addr must be what mapm() returned */
+static inline int32_t unmapm(void* addr) {
+    return ksyscall(SYS_UNMAPM, (uint64_t)addr, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Heap, implemented in libc/malloc.c on top of mapm(). Small sizes come from
+ * per size class free lists without a syscall, big ones get a region each.
+ * Pointers are 16 byte aligned.
+ */
+void* malloc(size_t size);
+void* calloc(size_t count, size_t size);
+void* realloc(void* ptr, size_t size);
+void free(void* ptr);
+
+/*
+ * Submission ring, see src/syscall/ring.rs.
+ *
+ * Operations are queued in shared memory and run by the kernel in batches:
+ * on ringenter(), or with NX_RING_POLL on every syscall the program makes.
+ * Each one posts a completion carrying its user_data and the value the
+ * blocking call would have returned. The kernel only takes a submission
+ * when the completion ring has room for its result.
+ */
+#define NX_RING_MAX  4096
+#define NX_RING_POLL (1u << 0)
+
+#define NX_OP_NOP    0
+#define NX_OP_OPENF  1 /* addr = path, len = path length */
+#define NX_OP_CLOSEF 2 /* fd */
+#define NX_OP_READF  3 /* fd, addr = buffer, len */
+#define NX_OP_WRITEF 4 /* fd, addr = buffer, len */
+
+struct nx_ring_header {
+    uint32_t sq_head;  /* written by the kernel */
+    uint32_t sq_tail;  /* written by the program */
+    uint32_t cq_head;  /* written by the program */
+    uint32_t cq_tail;  /* written by the kernel */
+    uint32_t entries;
+    uint32_t flags;
+    uint32_t reserved[10];
+};
+
+struct nx_sqe {
+    uint8_t op;
+    uint8_t reserved[3];
+    uint32_t fd;
+    uint64_t addr;
+    uint64_t len;
+    uint64_t user_data;
+};
+
+struct nx_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+};
+
+struct nx_ring {
+    struct nx_ring_header* hdr;
+    struct nx_sqe* sqes;
+    struct nx_cqe* cqes;
+    uint32_t mask;
+};
+
+/* entries must be a power of two up to NX_RING_MAX, returns 0 or -1 */
+static inline int32_t ringsetup(uint32_t entries, uint32_t flags, struct nx_ring* ring) {
+    void* base;
+    int32_t ret = ksyscall(SYS_RINGSETUP, entries, flags, (uint64_t)&base, 0, 0, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    ring->hdr = base;
+    ring->sqes = (struct nx_sqe*)((uint8_t*)base + sizeof(struct nx_ring_header));
+    ring->cqes = (struct nx_cqe*)(ring->sqes + entries);
+    ring->mask = entries - 1;
+    return 0;
+}
+
+/* the next free submission slot or 0 when the ring is full, fill it in and
+ * queue it with nx_ring_push() */
+static inline struct nx_sqe* nx_ring_next(struct nx_ring* ring) {
+    uint32_t tail = ring->hdr->sq_tail;
+    uint32_t head = __atomic_load_n(&ring->hdr->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head > ring->mask) {
+        return 0;
+    }
+    return &ring->sqes[tail & ring->mask];
+}
+
+static inline void nx_ring_push(struct nx_ring* ring) {
+    __atomic_store_n(&ring->hdr->sq_tail, ring->hdr->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/* one trap for everything queued, returns the submissions taken or -1 */
+static inline int32_t ringenter(void) {
+    return ksyscall(SYS_RINGENTER, 0, 0, 0, 0, 0, 0);
+}
+
+/* the oldest unread completion or 0, release it with nx_ring_seen() */
+static inline struct nx_cqe* nx_ring_peek(struct nx_ring* ring) {
+    uint32_t head = ring->hdr->cq_head;
+    uint32_t tail = __atomic_load_n(&ring->hdr->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return 0;
+    }
+    return &ring->cqes[head & ring->mask];
+}
+
+static inline void nx_ring_seen(struct nx_ring* ring) {
+    __atomic_store_n(&ring->hdr->cq_head, ring->hdr->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * TCP sockets, see src/syscall/socket.rs.
+ *
+ * Nothing blocks: connect and listen return at once, send takes what fits
+ * (0 while the connection is still coming up) and recv returns 0 when
+ * nothing has arrived yet. Poll sockstate() or nap() between tries.
+ */
+#define NX_SOCK_CLOSED      0
+#define NX_SOCK_LISTEN      1
+#define NX_SOCK_CONNECTING  2
+#define NX_SOCK_ESTABLISHED 3
+#define NX_SOCK_CLOSING     4 /* either side closed, data can still be read */
+
+/* a.b.c.d as the ip argument of sockconnect() */
+#define NX_IPV4(a, b, c, d) \
+    (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+/* returns the socket id or -1 */
+static inline int32_t sockopen(void) {
+    return ksyscall(SYS_SOCKOPEN, 0, 0, 0, 0, 0, 0);
+}
+
+static inline int32_t sockconnect(int32_t sock, uint32_t ip, uint16_t port) {
+    return ksyscall(SYS_SOCKCONNECT, (uint64_t)sock, ip, port, 0, 0, 0);
+}
+
+/* the socket turns into the one connection it accepts */
+static inline int32_t socklisten(int32_t sock, uint16_t port) {
+    return ksyscall(SYS_SOCKLISTEN, (uint64_t)sock, port, 0, 0, 0, 0);
+}
+
+static inline int32_t socksend(int32_t sock, const void* buf, size_t len) {
+    return ksyscall(SYS_SOCKSEND, (uint64_t)sock, (uint64_t)buf, (uint64_t)len, 0, 0, 0);
+}
+
+/* -1 once the peer closed and everything it sent was read */
+static inline int32_t sockrecv(int32_t sock, void* buf, size_t len) {
+    return ksyscall(SYS_SOCKRECV, (uint64_t)sock, (uint64_t)buf, (uint64_t)len, 0, 0, 0);
+}
+
+static inline int32_t sockclose(int32_t sock) {
+    return ksyscall(SYS_SOCKCLOSE, (uint64_t)sock, 0, 0, 0, 0, 0);
+}
+
+/* one of NX_SOCK_* or -1 */
+static inline int32_t sockstate(int32_t sock) {
+    return ksyscall(SYS_SOCKSTATE, (uint64_t)sock, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Trace points, see src/utils/trace.rs.
+ *
+ * Records event id (0 to NX_TRACE_ID_MAX) with two values of the caller's
+ * choosing in the kernel's trace ring, next to the scheduler, syscall and
+ * interrupt events. It shows up as NX_TRACE_USER | id. Returns 0, or -1 for
+ * an id out of range; nothing is recorded while tracing is off.
+ */
+#define NX_TRACE_USER   0x8000u
+#define NX_TRACE_ID_MAX 0x7FFFu
+
+static inline int32_t trace(uint32_t id, uint64_t a0, uint64_t a1) {
+    return ksyscall(SYS_TRACE, id, a0, a1, 0, 0, 0);
+}
+
+/* longest single kernel log line, see LOG_RECORD_MAX in the kernel */
+#define NX_LOG_RECORD_MAX 236
+
+/* the kernel logs into a ring per cpu, see MAX_CPUS in the kernel */
+#define NX_LOG_RINGS 8
+
+/* where a reader is in each of the kernel log rings */
+typedef struct {
+    uint64_t next[NX_LOG_RINGS];
+} nx_log_cursor;
+
+/*
+ * Stream the kernel log. Start with a zeroed cursor, every call copies whole
+ * lines after it into buf, oldest first, and moves the cursor on. Returns the
+ * bytes copied, 0 once caught up, or -1. Give it at least NX_LOG_RECORD_MAX
+ * bytes. Lines the kernel overwrote before they were read are skipped.
+ */
+static inline int32_t readlog(nx_log_cursor* cursor, void* buf, size_t len) {
+    return ksyscall(SYS_READLOG, (uint64_t)cursor, (uint64_t)buf, (uint64_t)len, 0, 0, 0);
 }
 
 #define writef(fd, arg) _Generic((arg), \
@@ -196,18 +579,34 @@ static inline int32_t writef_str(uint64_t fd, const char* to_write) {
     const uint8_t*: writef_buf          \
 )(fd, arg)
 
-static inline int32_t run(const char* path, unsigned len) {
-    return ksyscall(SYS_RUN, (uint64_t)path, (uint64_t)len, 0, 0, 0, 0);
+/*
+ * Replace this program with the ELF at path, open files and the environment
+ * are kept. argv is the new program's argument list, ended by a null; a null
+ * argv starts it with just the path. Only returns (-1) on failure. The new
+ * image is paged in from the file as it runs.
+ */
+static inline int32_t run(const char* path, unsigned len, char* const argv[]) {
+    flush();
+    return ksyscall(SYS_RUN, (uint64_t)path, (uint64_t)len, (uint64_t)argv, (uint64_t)__nx_environ, 0, 0);
 }
 
 static inline int32_t stop(uint64_t pid) {
     return ksyscall(SYS_STOP, pid, 0, 0, 0, 0, 0);
 }
 
-static inline int32_t nap(/* todo */) {
-    return ksyscall(SYS_NAP, 0, 0, 0, 0, 0, 0);
+/*
+ * Sleeps for at least `ns` nanoseconds (rounded up to the ~1 ms timer tick)
+ * without using the cpu, returns 0. nap(0) returns right away.
+ */
+static inline int32_t nap(uint64_t ns) {
+    flush();
+    return ksyscall(SYS_NAP, ns, 0, 0, 0, 0, 0);
 }
 
 static inline int32_t sizef(uint64_t fd) {
     return ksyscall(SYS_SIZEF, fd, 0, 0, 0, 0, 0);
+}
+
+static inline int32_t feats() {
+    return ksyscall_int80(SYS_FEATS, 0, 0, 0, 0, 0, 0);
 }   
\ No newline at end of file
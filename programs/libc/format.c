@@ -0,0 +1,304 @@
+/*
+
+    format.c
+
+    The say() format engine.
+
+    A format is walked once: each run of plain text up to the next '%' is
+    copied in one go and every conversion is formatted right into the stdout
+    buffer, so there is no intermediate copy and no length limit. Integers are
+    turned into text two digits at a time from a 200 byte table.
+
+    say() with a constant format and no conversions never gets here in full,
+    the macro in nullex.h measures it at compile time and it is copied as is.
+
+*/
+
+#include "../include/nullex.h"
+
+#define FLAG_LEFT  (1u << 0) /* '-' */
+#define FLAG_ZERO  (1u << 1) /* '0' */
+#define FLAG_PLUS  (1u << 2) /* '+' */
+#define FLAG_SPACE (1u << 3) /* ' ' */
+#define FLAG_ALT   (1u << 4) /* '#' */
+
+/* "00" to "99", the two digits of every number below 100 */
+static const char digit_pairs[200] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char hex_lower[16] = "0123456789abcdef";
+static const char hex_upper[16] = "0123456789ABCDEF";
+
+/* a flush failed somewhere in the current message */
+static int out_error;
+
+/* appends n bytes, flushing whenever the buffer fills up */
+static void out_put(const char* s, size_t n) {
+    struct nx_outbuf* out = &__nullex_stdout;
+    while (n > 0) {
+        size_t room = NX_OUTBUF_SIZE - out->len;
+        if (room == 0) {
+            out_error |= flush() < 0;
+            room = NX_OUTBUF_SIZE;
+        }
+        size_t chunk = n < room ? n : room;
+        memcpy(out->data + out->len, s, chunk);
+        out->len += chunk;
+        s += chunk;
+        n -= chunk;
+    }
+}
+
+/* appends n copies of c */
+static void out_fill(char c, size_t n) {
+    struct nx_outbuf* out = &__nullex_stdout;
+    while (n > 0) {
+        size_t room = NX_OUTBUF_SIZE - out->len;
+        if (room == 0) {
+            out_error |= flush() < 0;
+            room = NX_OUTBUF_SIZE;
+        }
+        size_t chunk = n < room ? n : room;
+        memset(out->data + out->len, c, chunk);
+        out->len += chunk;
+        n -= chunk;
+    }
+}
+
+/* every say() ends its message with a newline, which is where line and
+ * unbuffered mode hand it to the kernel */
+static int32_t out_end(void) {
+    out_put("\n", 1);
+    if (__nullex_stdout.mode != NX_BUF_FULL) {
+        out_error |= flush() < 0;
+    }
+    int err = out_error;
+    out_error = 0;
+    return err ? -1 : 0;
+}
+
+/* writes the decimal digits of v so they end right before end, returns the
+ * first one */
+static char* utoa_dec(char* end, uint64_t v) {
+    while (v >= 100) {
+        uint64_t pair = (v % 100) * 2;
+        v /= 100;
+        end -= 2;
+        end[0] = digit_pairs[pair];
+        end[1] = digit_pairs[pair + 1];
+    }
+    if (v >= 10) {
+        end -= 2;
+        end[0] = digit_pairs[v * 2];
+        end[1] = digit_pairs[v * 2 + 1];
+    } else {
+        *--end = (char)('0' + v);
+    }
+    return end;
+}
+
+static char* utoa_hex(char* end, uint64_t v, const char* digits) {
+    do {
+        *--end = digits[v & 0xF];
+        v >>= 4;
+    } while (v != 0);
+    return end;
+}
+
+/* pads and writes one formatted field: prefix (sign or 0x), zeros up to the
+ * precision, then the digits */
+static void put_field(const char* prefix, size_t prefix_len, const char* body, size_t len,
+                      size_t zeros, uint32_t flags, size_t width) {
+    size_t total = prefix_len + zeros + len;
+    size_t pad = width > total ? width - total : 0;
+    if (!(flags & FLAG_LEFT)) {
+        if (flags & FLAG_ZERO) {
+            zeros += pad;
+        } else {
+            out_fill(' ', pad);
+        }
+    }
+    out_put(prefix, prefix_len);
+    out_fill('0', zeros);
+    out_put(body, len);
+    if (flags & FLAG_LEFT) {
+        out_fill(' ', pad);
+    }
+}
+
+static void put_int(char conv, uint64_t v, int is_signed, uint32_t flags, size_t width, int precision) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char prefix[2];
+    size_t prefix_len = 0;
+
+    if (is_signed) {
+        int64_t s = (int64_t)v;
+        if (s < 0) {
+            prefix[prefix_len++] = '-';
+            v = 0 - v;
+        } else if (flags & FLAG_PLUS) {
+            prefix[prefix_len++] = '+';
+        } else if (flags & FLAG_SPACE) {
+            prefix[prefix_len++] = ' ';
+        }
+    }
+
+    char* start;
+    if (conv == 'x' || conv == 'X' || conv == 'p') {
+        start = utoa_hex(end, v, conv == 'X' ? hex_upper : hex_lower);
+        if ((flags & FLAG_ALT) && (v != 0 || conv == 'p')) {
+            prefix[prefix_len++] = '0';
+            prefix[prefix_len++] = conv == 'X' ? 'X' : 'x';
+        }
+    } else {
+        start = utoa_dec(end, v);
+    }
+    size_t len = (size_t)(end - start);
+
+    // an explicit precision asks for that many digits at least, and turns
+    // off zero padding like in printf
+    size_t zeros = 0;
+    if (precision >= 0) {
+        flags &= ~FLAG_ZERO;
+        if (precision == 0 && v == 0) {
+            len = 0;
+        } else if ((size_t)precision > len) {
+            zeros = (size_t)precision - len;
+        }
+    }
+    put_field(prefix, prefix_len, start, len, zeros, flags, width);
+}
+
+static int32_t vsay(const char* f, __builtin_va_list args) {
+    for (;;) {
+        const char* run = f;
+        while (*f != '\0' && *f != '%') {
+            f++;
+        }
+        out_put(run, (size_t)(f - run));
+        if (*f == '\0') {
+            break;
+        }
+        const char* spec = f++;
+
+        uint32_t flags = 0;
+        for (;; f++) {
+            if (*f == '-') flags |= FLAG_LEFT;
+            else if (*f == '0') flags |= FLAG_ZERO;
+            else if (*f == '+') flags |= FLAG_PLUS;
+            else if (*f == ' ') flags |= FLAG_SPACE;
+            else if (*f == '#') flags |= FLAG_ALT;
+            else break;
+        }
+
+        size_t width = 0;
+        if (*f == '*') {
+            int w = __builtin_va_arg(args, int);
+            if (w < 0) {
+                flags |= FLAG_LEFT;
+                w = -w;
+            }
+            width = (size_t)w;
+            f++;
+        } else {
+            while (*f >= '0' && *f <= '9') {
+                width = width * 10 + (size_t)(*f++ - '0');
+            }
+        }
+
+        int precision = -1;
+        if (*f == '.') {
+            f++;
+            precision = 0;
+            if (*f == '*') {
+                precision = __builtin_va_arg(args, int);
+                f++;
+            } else {
+                while (*f >= '0' && *f <= '9') {
+                    precision = precision * 10 + (*f++ - '0');
+                }
+            }
+        }
+
+        // int and unsigned unless l, ll, z, j or t say a long was passed,
+        // h and hh narrow the value
+        int lng = 0;
+        int narrow = 0;
+        while (*f == 'l' || *f == 'z' || *f == 'j' || *f == 't' || *f == 'h') {
+            narrow += (*f == 'h');
+            lng |= (*f != 'h');
+            f++;
+        }
+
+        char conv = *f;
+        switch (conv) {
+        case 'd':
+        case 'i': {
+            int64_t v = lng ? __builtin_va_arg(args, long) : __builtin_va_arg(args, int);
+            if (narrow == 1) v = (int16_t)v;
+            else if (narrow >= 2) v = (int8_t)v;
+            put_int(conv, (uint64_t)v, 1, flags, width, precision);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X': {
+            uint64_t v = lng ? __builtin_va_arg(args, unsigned long) : __builtin_va_arg(args, unsigned);
+            if (narrow == 1) v = (uint16_t)v;
+            else if (narrow >= 2) v = (uint8_t)v;
+            put_int(conv, v, 0, flags, width, precision);
+            break;
+        }
+        case 'p':
+            put_int(conv, (uint64_t)__builtin_va_arg(args, void*), 0, flags | FLAG_ALT, width, precision);
+            break;
+        case 'c': {
+            char c = (char)__builtin_va_arg(args, int);
+            put_field("", 0, &c, 1, 0, flags & FLAG_LEFT, width);
+            break;
+        }
+        case 's': {
+            const char* s = __builtin_va_arg(args, const char*);
+            if (s == (const char*)0) {
+                s = "(null)";
+            }
+            size_t len = 0;
+            // a precision may cut a string that is not terminated at all
+            while ((precision < 0 || len < (size_t)precision) && s[len] != '\0') {
+                len++;
+            }
+            put_field("", 0, s, len, 0, flags & FLAG_LEFT, width);
+            break;
+        }
+        case '%':
+            out_put("%", 1);
+            break;
+        default:
+            // not a conversion, printed as written
+            if (conv == '\0') {
+                out_put(spec, (size_t)(f - spec));
+                return out_end();
+            }
+            out_put(spec, (size_t)(f + 1 - spec));
+            break;
+        }
+        f++;
+    }
+    return out_end();
+}
+
+int32_t __nx_say(const char* format, ...) {
+    __builtin_va_list args;
+    __builtin_va_start(args, format);
+    int32_t ret = vsay(format, args);
+    __builtin_va_end(args);
+    return ret;
+}
+
+int32_t __nx_say_text(const char* text, size_t len) {
+    out_put(text, len);
+    return out_end();
+}
@@ -0,0 +1,191 @@
+/*
+
+    malloc.c
+
+    Userspace heap on top of mapm().
+
+    Small blocks come in power of two size classes of 32 to 4096 bytes
+    (header included) and are kept on one free list per class, so the common
+    malloc/free pair is a few loads and stores and no syscall. A class that
+    runs dry cuts a batch of blocks from the current arena, a large region
+    reserved with mapm() whose pages the kernel only backs once they are
+    touched. Anything bigger than the largest class gets a region of its own
+    that free() hands straight back.
+
+    Processes are single threaded (split() copies the whole heap), so the
+    free lists need no locking.
+
+*/
+
+#include "../include/nullex.h"
+
+#define NX_NULL ((void*)0)
+
+#define PAGE_SIZE 4096ul
+
+/* smallest class is 1 << MIN_SHIFT bytes, each class doubles the previous */
+#define MIN_SHIFT 5
+#define NCLASSES  8
+#define MAX_SMALL (1ul << (MIN_SHIFT + NCLASSES - 1))
+
+/* address space reserved at a time for small blocks */
+#define ARENA_SIZE (4ul << 20)
+/* bytes cut from the arena at once when a class runs dry */
+#define REFILL_BYTES 4096ul
+
+/* header class of a block with a mapm() region of its own */
+#define CLASS_LARGE 0xFFFFFFFFu
+
+/* in front of every block, keeps the payload 16 byte aligned */
+struct block_header {
+    uint32_t class;
+    uint32_t reserved;
+    /* whole block including this header, the region length for large ones */
+    uint64_t size;
+};
+
+struct free_block {
+    struct free_block* next;
+};
+
+static struct free_block* free_lists[NCLASSES];
+static uint8_t* arena_cur;
+static uint8_t* arena_end;
+
+static inline uint32_t class_of(size_t need) {
+    uint32_t c = 0;
+    while ((1ul << (MIN_SHIFT + c)) < need) {
+        c++;
+    }
+    return c;
+}
+
+static inline void* payload(struct block_header* h) {
+    return (uint8_t*)h + sizeof(struct block_header);
+}
+
+static inline struct block_header* header_of(void* ptr) {
+    return (struct block_header*)((uint8_t*)ptr - sizeof(struct block_header));
+}
+
+/* cuts a batch of class c blocks from the arena, returns one of them and
+ * puts the rest on the free list */
+static struct block_header* refill(uint32_t c) {
+    size_t size = 1ul << (MIN_SHIFT + c);
+    size_t batch = REFILL_BYTES / size;
+    if (batch == 0) {
+        batch = 1;
+    }
+
+    size_t left = (size_t)(arena_end - arena_cur);
+    if (left < size) {
+        // the tail of the old arena is dropped, at most one block's worth
+        void* arena;
+        if (mapm(ARENA_SIZE, &arena) < 0) {
+            return NX_NULL;
+        }
+        arena_cur = arena;
+        arena_end = arena_cur + ARENA_SIZE;
+        left = ARENA_SIZE;
+    }
+    if (batch > left / size) {
+        batch = left / size;
+    }
+
+    uint8_t* first = arena_cur;
+    arena_cur += batch * size;
+    for (size_t i = batch - 1; i > 0; i--) {
+        struct free_block* b = (struct free_block*)(first + i * size);
+        b->next = free_lists[c];
+        free_lists[c] = b;
+    }
+    return (struct block_header*)first;
+}
+
+static void* malloc_large(size_t size) {
+    size_t len = (size + sizeof(struct block_header) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (len < size) {
+        return NX_NULL;
+    }
+    void* region;
+    if (mapm(len, &region) < 0) {
+        return NX_NULL;
+    }
+    struct block_header* h = region;
+    h->class = CLASS_LARGE;
+    h->size = len;
+    return payload(h);
+}
+
+void* malloc(size_t size) {
+    size_t need = size + sizeof(struct block_header);
+    if (need > MAX_SMALL || need < size) {
+        return malloc_large(size);
+    }
+
+    uint32_t c = class_of(need);
+    struct block_header* h;
+    struct free_block* b = free_lists[c];
+    if (__builtin_expect(b != NX_NULL, 1)) {
+        free_lists[c] = b->next;
+        h = (struct block_header*)b;
+    } else {
+        h = refill(c);
+        if (h == NX_NULL) {
+            return NX_NULL;
+        }
+    }
+    h->class = c;
+    h->size = 1ul << (MIN_SHIFT + c);
+    return payload(h);
+}
+
+void free(void* ptr) {
+    if (ptr == NX_NULL) {
+        return;
+    }
+    struct block_header* h = header_of(ptr);
+    if (h->class == CLASS_LARGE) {
+        unmapm(h);
+        return;
+    }
+    // the link overwrites the header, read the class out of it first
+    uint32_t c = h->class;
+    struct free_block* b = (struct free_block*)h;
+    b->next = free_lists[c];
+    free_lists[c] = b;
+}
+
+void* calloc(size_t count, size_t size) {
+    if (size != 0 && count > (size_t)-1 / size) {
+        return NX_NULL;
+    }
+    size_t total = count * size;
+    void* ptr = malloc(total);
+    // a fresh region is zero already, only recycled small blocks need it
+    if (ptr != NX_NULL && header_of(ptr)->class != CLASS_LARGE) {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NX_NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NX_NULL;
+    }
+
+    size_t usable = header_of(ptr)->size - sizeof(struct block_header);
+    if (size <= usable) {
+        return ptr;
+    }
+    void* grown = malloc(size);
+    if (grown != NX_NULL) {
+        memcpy(grown, ptr, usable);
+        free(ptr);
+    }
+    return grown;
+}
@@ -0,0 +1,362 @@
+/*
+
+    string.c
+
+    Freestanding string/memory primitives for userspace programs.
+
+    Every primitive comes in four flavours (byte, word, sse2, avx2). The
+    public strlen/memcpy/memset/memcmp go through __nx_string, which
+    __nx_string_init() points at the fastest flavour the cpu and kernel
+    support. It runs once from _start before main().
+
+*/
+
+#include "../include/nullex.h"
+
+// these loops must stay loops: gcc would otherwise turn them back into calls
+// to memcpy/memset (i.e. into themselves), and the byte/word flavours are
+// only useful as a baseline if they are not auto-vectorised
+#pragma GCC optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")
+
+typedef uint64_t u64_alias __attribute__((may_alias));
+typedef uint64_t u64_unaligned __attribute__((aligned(1), may_alias));
+
+typedef char v16qi __attribute__((vector_size(16), may_alias));
+typedef char v16qi_u __attribute__((vector_size(16), aligned(1), may_alias));
+typedef char v32qi __attribute__((vector_size(32), may_alias));
+typedef char v32qi_u __attribute__((vector_size(32), aligned(1), may_alias));
+
+#define ONES  0x0101010101010101ull
+#define HIGHS 0x8080808080808080ull
+
+/* nonzero iff one of the 8 bytes of x is zero */
+#define HAS_ZERO(x) (((x) - ONES) & ~(x) & HIGHS)
+
+/* ---- byte at a time, the reference implementation ---- */
+
+static size_t strlen_byte(const char* s) {
+    size_t n = 0;
+    while (s[n] != '\0') {
+        n++;
+    }
+    return n;
+}
+
+static void* memcpy_byte(void* dst, const void* src, size_t n) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    while (n--) {
+        *d++ = *s++;
+    }
+    return dst;
+}
+
+static void* memset_byte(void* dst, int c, size_t n) {
+    uint8_t* d = dst;
+    while (n--) {
+        *d++ = (uint8_t)c;
+    }
+    return dst;
+}
+
+static int memcmp_byte(const void* a, const void* b, size_t n) {
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+    for (size_t i = 0; i < n; i++) {
+        if (x[i] != y[i]) {
+            return (int)x[i] - (int)y[i];
+        }
+    }
+    return 0;
+}
+
+/* ---- 8 bytes at a time ---- */
+
+static size_t strlen_word(const char* s) {
+    const char* p = s;
+
+    // walk up to an 8 byte boundary so the word loads never cross a page
+    while ((uint64_t)p & 7) {
+        if (*p == '\0') {
+            return p - s;
+        }
+        p++;
+    }
+
+    const u64_alias* w = (const u64_alias*)p;
+    while (!HAS_ZERO(*w)) {
+        w++;
+    }
+
+    p = (const char*)w;
+    while (*p) {
+        p++;
+    }
+    return p - s;
+}
+
+static void* memcpy_word(void* dst, const void* src, size_t n) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+
+    for (; n >= 8; n -= 8, d += 8, s += 8) {
+        *(u64_unaligned*)d = *(const u64_unaligned*)s;
+    }
+    while (n--) {
+        *d++ = *s++;
+    }
+    return dst;
+}
+
+static void* memset_word(void* dst, int c, size_t n) {
+    uint8_t* d = dst;
+    uint64_t v = (uint8_t)c * ONES;
+
+    for (; n >= 8; n -= 8, d += 8) {
+        *(u64_unaligned*)d = v;
+    }
+    while (n--) {
+        *d++ = (uint8_t)c;
+    }
+    return dst;
+}
+
+static int memcmp_word(const void* a, const void* b, size_t n) {
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+
+    // skip equal words, the byte loop below finds the exact difference
+    for (; n >= 8; n -= 8, x += 8, y += 8) {
+        if (*(const u64_unaligned*)x != *(const u64_unaligned*)y) {
+            break;
+        }
+    }
+    return memcmp_byte(x, y, n);
+}
+
+/* ---- sse2, 16 bytes at a time ---- */
+
+__attribute__((target("sse2")))
+static size_t strlen_sse2(const char* s) {
+    // aligned loads never cross a page, so reading before s is harmless
+    uint64_t off = (uint64_t)s & 15;
+    const v16qi* p = (const v16qi*)(s - off);
+    const v16qi zero = {0};
+
+    uint32_t mask = __builtin_ia32_pmovmskb128(*p == zero);
+    mask &= ~0u << off;
+
+    while (mask == 0) {
+        p++;
+        mask = __builtin_ia32_pmovmskb128(*p == zero);
+    }
+    return (const char*)p + __builtin_ctz(mask) - s;
+}
+
+__attribute__((target("sse2")))
+static void* memcpy_sse2(void* dst, const void* src, size_t n) {
+    if (n < 16) {
+        return memcpy_word(dst, src, n);
+    }
+
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+
+    // the last 16 bytes are copied up front, the loop can then overlap them
+    v16qi tail = *(const v16qi_u*)(s + n - 16);
+    for (size_t i = 0; i + 16 <= n; i += 16) {
+        *(v16qi_u*)(d + i) = *(const v16qi_u*)(s + i);
+    }
+    *(v16qi_u*)(d + n - 16) = tail;
+    return dst;
+}
+
+__attribute__((target("sse2")))
+static void* memset_sse2(void* dst, int c, size_t n) {
+    if (n < 16) {
+        return memset_word(dst, c, n);
+    }
+
+    uint8_t* d = dst;
+    v16qi v = (v16qi){0} + (char)c;
+
+    for (size_t i = 0; i + 16 <= n; i += 16) {
+        *(v16qi_u*)(d + i) = v;
+    }
+    *(v16qi_u*)(d + n - 16) = v;
+    return dst;
+}
+
+__attribute__((target("sse2")))
+static int memcmp_sse2(const void* a, const void* b, size_t n) {
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+
+    for (; n >= 16; n -= 16, x += 16, y += 16) {
+        v16qi vx = *(const v16qi_u*)x;
+        v16qi vy = *(const v16qi_u*)y;
+        uint32_t eq = __builtin_ia32_pmovmskb128(vx == vy);
+        if (eq != 0xffff) {
+            uint32_t i = __builtin_ctz(~eq);
+            return (int)x[i] - (int)y[i];
+        }
+    }
+    return memcmp_word(x, y, n);
+}
+
+/* ---- avx2, 32 bytes at a time ---- */
+
+__attribute__((target("avx2")))
+static size_t strlen_avx2(const char* s) {
+    uint64_t off = (uint64_t)s & 31;
+    const v32qi* p = (const v32qi*)(s - off);
+    const v32qi zero = {0};
+
+    uint32_t mask = __builtin_ia32_pmovmskb256(*p == zero);
+    mask &= ~0u << off;
+
+    while (mask == 0) {
+        p++;
+        mask = __builtin_ia32_pmovmskb256(*p == zero);
+    }
+    return (const char*)p + __builtin_ctz(mask) - s;
+}
+
+__attribute__((target("avx2")))
+static void* memcpy_avx2(void* dst, const void* src, size_t n) {
+    if (n < 32) {
+        return memcpy_sse2(dst, src, n);
+    }
+
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+
+    v32qi tail = *(const v32qi_u*)(s + n - 32);
+    for (size_t i = 0; i + 32 <= n; i += 32) {
+        *(v32qi_u*)(d + i) = *(const v32qi_u*)(s + i);
+    }
+    *(v32qi_u*)(d + n - 32) = tail;
+    return dst;
+}
+
+__attribute__((target("avx2")))
+static void* memset_avx2(void* dst, int c, size_t n) {
+    if (n < 32) {
+        return memset_sse2(dst, c, n);
+    }
+
+    uint8_t* d = dst;
+    v32qi v = (v32qi){0} + (char)c;
+
+    for (size_t i = 0; i + 32 <= n; i += 32) {
+        *(v32qi_u*)(d + i) = v;
+    }
+    *(v32qi_u*)(d + n - 32) = v;
+    return dst;
+}
+
+__attribute__((target("avx2")))
+static int memcmp_avx2(const void* a, const void* b, size_t n) {
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+
+    for (; n >= 32; n -= 32, x += 32, y += 32) {
+        v32qi vx = *(const v32qi_u*)x;
+        v32qi vy = *(const v32qi_u*)y;
+        uint32_t eq = __builtin_ia32_pmovmskb256(vx == vy);
+        if (eq != 0xffffffffu) {
+            uint32_t i = __builtin_ctz(~eq);
+            return (int)x[i] - (int)y[i];
+        }
+    }
+    return memcmp_sse2(x, y, n);
+}
+
+/* ---- selection ---- */
+
+const struct nx_string_impl __nx_string_impls[NX_STRING_NIMPLS] = {
+    { "byte", 0,               strlen_byte, memcpy_byte, memset_byte, memcmp_byte },
+    { "word", 0,               strlen_word, memcpy_word, memset_word, memcmp_word },
+    { "sse2", NX_CPU_SSE2,     strlen_sse2, memcpy_sse2, memset_sse2, memcmp_sse2 },
+    { "avx2", NX_CPU_AVX2,     strlen_avx2, memcpy_avx2, memset_avx2, memcmp_avx2 },
+};
+
+// word-at-a-time is safe on anything, so calls made before init still work
+struct nx_string_impl __nx_string = {
+    "word", 0, strlen_word, memcpy_word, memset_word, memcmp_word
+};
+
+uint32_t __nx_cpu_features = 0;
+
+static inline void cpuid(uint32_t leaf, uint32_t sub, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+static uint32_t detect_cpu_features(void) {
+    uint32_t a, b, c, d;
+    uint32_t feats = 0;
+
+    cpuid(0, 0, &a, &b, &c, &d);
+    uint32_t max_leaf = a;
+
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (d & (1u << 26)) {
+        feats |= NX_CPU_SSE2;
+    }
+
+    // avx needs the kernel to have turned on xsave and the ymm state in xcr0,
+    // otherwise the first ymm instruction faults
+    int os_ymm = 0;
+    if ((c & (1u << 27)) && (c & (1u << 28))) {
+        uint32_t lo, hi;
+        __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        os_ymm = (lo & 0x6) == 0x6;
+    }
+
+    if (os_ymm && max_leaf >= 7) {
+        cpuid(7, 0, &a, &b, &c, &d);
+        if (b & (1u << 5)) {
+            feats |= NX_CPU_AVX2;
+        }
+    }
+
+    return feats;
+}
+
+int nx_string_impl_usable(const struct nx_string_impl* impl) {
+    return (impl->requires & __nx_cpu_features) == impl->requires;
+}
+
+void __nx_string_init(void) {
+    __nx_cpu_features = detect_cpu_features();
+
+    for (int i = NX_STRING_NIMPLS - 1; i >= 0; i--) {
+        if (nx_string_impl_usable(&__nx_string_impls[i])) {
+            __nx_string = __nx_string_impls[i];
+            return;
+        }
+    }
+}
+
+/* ---- public entry points ---- */
+
+size_t strlen(const char* s) {
+    return __nx_string.strlen(s);
+}
+
+char* strcpy(char* dst, const char* src) {
+    __nx_string.memcpy(dst, src, __nx_string.strlen(src) + 1);
+    return dst;
+}
+
+void* memcpy(void* dst, const void* src, size_t n) {
+    return __nx_string.memcpy(dst, src, n);
+}
+
+void* memset(void* dst, int c, size_t n) {
+    return __nx_string.memset(dst, c, n);
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    return __nx_string.memcmp(a, b, n);
+}
@@ -0,0 +1,150 @@
+#include "../include/nullex.h"
+
+/*
+ * Compares the byte/word/sse2/avx2 string primitives from libc/string.c.
+ *
+ * Every usable variant is first checked against the byte version, then timed
+ * with rdtsc over a range of buffer sizes. Results are printed as cycles per
+ * KiB processed, lower is better.
+ */
+
+#define MAX_SIZE  65536
+#define WORK      (1u << 22) /* bytes processed per measurement */
+
+static uint8_t src_buf[MAX_SIZE + 64];
+static uint8_t dst_buf[MAX_SIZE + 64];
+
+static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void fill(uint8_t* buf, size_t len, uint8_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        // never zero, strlen tests terminate the string explicitly
+        buf[i] = (uint8_t)((i * 31 + seed) % 255 + 1);
+    }
+}
+
+static int sign(int v) {
+    return (v > 0) - (v < 0);
+}
+
+/* returns the number of mismatches against the byte-at-a-time reference */
+static int verify(const struct nx_string_impl* ref, const struct nx_string_impl* impl) {
+    int errors = 0;
+
+    for (size_t off = 0; off < 32; off += 7) {
+        for (size_t len = 0; len < 300; len += (len < 40) ? 1 : 37) {
+            uint8_t* s = src_buf + off;
+            uint8_t* d = dst_buf + (off ^ 5);
+
+            fill(src_buf, sizeof(src_buf), (uint8_t)len);
+            impl->memset(dst_buf, 0xAA, sizeof(dst_buf));
+            impl->memcpy(d, s, len);
+            if (ref->memcmp(d, s, len) != 0 || d[len] != 0xAA) {
+                errors++;
+            }
+
+            impl->memset(d, (int)len, len);
+            for (size_t i = 0; i < len; i++) {
+                if (d[i] != (uint8_t)len) {
+                    errors++;
+                    break;
+                }
+            }
+
+            if (len > 0) {
+                ref->memcpy(d, s, len);
+                d[len / 2] ^= 0x40;
+                if (sign(impl->memcmp(s, d, len)) != sign(ref->memcmp(s, d, len))) {
+                    errors++;
+                }
+            }
+
+            s[len] = 0;
+            if (impl->strlen((const char*)s) != len) {
+                errors++;
+            }
+        }
+    }
+
+    return errors;
+}
+
+static uint64_t per_kib(uint64_t cycles, uint64_t bytes) {
+    return bytes ? (cycles * 1024) / bytes : 0;
+}
+
+__attribute__((noinline))
+static void bench(const struct nx_string_impl* impl, size_t size) {
+    if (size == 0 || size > MAX_SIZE) {
+        return;
+    }
+
+    uint64_t iters = WORK / size;
+    uint64_t bytes = iters * size;
+    volatile int sink = 0;
+
+    uint64_t t0 = rdtsc();
+    for (uint64_t i = 0; i < iters; i++) {
+        impl->memcpy(dst_buf, src_buf, size);
+    }
+    uint64_t t1 = rdtsc();
+    for (uint64_t i = 0; i < iters; i++) {
+        impl->memset(dst_buf, (int)i, size);
+    }
+    uint64_t t2 = rdtsc();
+
+    impl->memcpy(dst_buf, src_buf, size);
+    for (uint64_t i = 0; i < iters; i++) {
+        sink += impl->memcmp(dst_buf, src_buf, size);
+    }
+    uint64_t t3 = rdtsc();
+
+    src_buf[size - 1] = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        sink += (int)impl->strlen((const char*)src_buf);
+    }
+    uint64_t t4 = rdtsc();
+    src_buf[size - 1] = 1;
+
+    say("%s %ld: memcpy %ld memset %ld memcmp %ld strlen %ld", impl->name, (long)size,
+        (long)per_kib(t1 - t0, bytes), (long)per_kib(t2 - t1, bytes),
+        (long)per_kib(t3 - t2, bytes), (long)per_kib(t4 - t3, bytes));
+    (void)sink;
+}
+
+int main(void) {
+    const struct nx_string_impl* ref = &__nx_string_impls[0];
+    int failed = 0;
+
+    say("strbench: using %s by default (cpu features %lx)", __nx_string.name, (long)__nx_cpu_features);
+    say("strbench: cycles per KiB, lower is better");
+
+    for (int i = 0; i < NX_STRING_NIMPLS; i++) {
+        const struct nx_string_impl* impl = &__nx_string_impls[i];
+        if (!nx_string_impl_usable(impl)) {
+            say("%s: not supported here, skipped", impl->name);
+            continue;
+        }
+
+        int errors = verify(ref, impl);
+        if (errors) {
+            say("%s: %ld mismatches against byte, not timed", impl->name, (long)errors);
+            failed = 1;
+            continue;
+        }
+
+        fill(src_buf, sizeof(src_buf), 1);
+        for (size_t j = 0; j < NSIZES; j++) {
+            bench(impl, sizes[j]);
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+# trace2json.py
+# Turns a kernel event trace (see src/utils/trace.rs) into Chrome trace event
+# JSON, which Perfetto (ui.perfetto.dev), chrome://tracing and speedscope open
+# as a timeline and flame chart.
+#
+# Input is either a serial log holding the output of the `trace dump` shell
+# command, or a copy of /proc/trace (packed 32 byte records).
+#
+#   make run 2>&1 | tee serial.log     # then `trace on`, ..., `trace dump`
+#   scripts/trace2json.py serial.log --tsc-mhz 3000 > trace.json
+
+import argparse
+import json
+import os
+import re
+import struct
+import sys
+
+# event ids, as TRACE_* in src/utils/trace.rs
+SPAWN = 1
+SWITCH_IN = 2
+SWITCH_OUT = 3
+WAKE = 4
+EXIT = 5
+SYSCALL_ENTER = 6
+SYSCALL_EXIT = 7
+IRQ_ENTER = 8
+IRQ_EXIT = 9
+PAGE_FAULT = 10
+USER = 0x8000
+
+NO_PID = 0xFFFFFFFF
+RECORD = struct.Struct("<QIHHQQ")
+LINE = re.compile(r"trace: ((?:[0-9a-f]+ ){5}[0-9a-f]+)")
+
+SYSCALLS_LIST = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src", "arch", "x86_64", "syscalls.list")
+
+
+def syscall_names():
+    names = {}
+    try:
+        with open(SYSCALLS_LIST) as f:
+            for line in f:
+                fields = line.split("#", 1)[0].split()
+                if len(fields) >= 2 and fields[0].isdigit():
+                    names[int(fields[0])] = fields[1]
+    except OSError:
+        pass
+    return names
+
+
+def read_records(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    text = data.decode("utf-8", errors="replace")
+    lines = LINE.findall(text)
+    if lines:
+        return [tuple(int(field, 16) for field in line.split()) for line in lines]
+    if len(data) % RECORD.size != 0:
+        sys.exit(f"{path}: neither a serial log with trace lines nor packed records")
+    # /proc/trace: tsc, pid, cpu, event, arg0, arg1, reordered like the lines
+    return [(tsc, cpu, pid, event, a0, a1) for tsc, pid, cpu, event, a0, a1 in RECORD.iter_unpack(data)]
+
+
+def convert(records, tsc_mhz):
+    names = syscall_names()
+    records.sort(key=lambda r: r[0])
+    start = records[0][0] if records else 0
+    events = []
+
+    for tsc, cpu, pid, event, a0, a1 in records:
+        base = {
+            "ts": (tsc - start) / tsc_mhz,
+            "pid": 0,
+            "tid": cpu,
+            "args": {"pid": None if pid == NO_PID else pid},
+        }
+        if event == SWITCH_IN:
+            events.append({**base, "ph": "B", "name": f"process {a0}"})
+        elif event == SWITCH_OUT:
+            events.append({**base, "ph": "E", "name": f"process {a0}", "args": {"finished": bool(a1)}})
+        elif event in (SYSCALL_ENTER, SYSCALL_EXIT):
+            name = names.get(a0, f"syscall {a0}")
+            if event == SYSCALL_ENTER:
+                events.append({**base, "ph": "B", "name": name, "cat": "syscall", "args": {"arg0": a1}})
+            else:
+                ret = a1 - (1 << 64) if a1 >= 1 << 63 else a1
+                events.append({**base, "ph": "E", "name": name, "cat": "syscall", "args": {"ret": ret}})
+        elif event in (IRQ_ENTER, IRQ_EXIT):
+            events.append({**base, "ph": "B" if event == IRQ_ENTER else "E", "name": f"irq {a0:#x}", "cat": "irq"})
+        elif event == SPAWN:
+            events.append({**base, "ph": "i", "s": "t", "name": "spawn", "args": {"child": a0, "cpu": a1}})
+        elif event == WAKE:
+            events.append({**base, "ph": "i", "s": "t", "name": "wake", "args": {"process": a0, "cpu": a1}})
+        elif event == EXIT:
+            code = a1 - (1 << 64) if a1 >= 1 << 63 else a1
+            events.append({**base, "ph": "i", "s": "t", "name": "exit", "args": {"process": a0, "code": code}})
+        elif event == PAGE_FAULT:
+            events.append({**base, "ph": "i", "s": "t", "name": "page fault", "args": {"addr": hex(a0), "error": a1}})
+        elif event & USER:
+            events.append({**base, "ph": "i", "s": "t", "name": f"user {event & ~USER}", "cat": "user",
+                           "args": {"pid": pid, "a0": a0, "a1": a1}})
+
+    for cpu in sorted({r[1] for r in records}):
+        events.append({"ph": "M", "name": "thread_name", "pid": 0, "tid": cpu, "args": {"name": f"cpu {cpu}"}})
+    return {"traceEvents": events, "displayTimeUnit": "ns"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a nullex event trace to Chrome trace JSON.")
+    parser.add_argument("input", help="serial log with `trace dump` output, or a copy of /proc/trace")
+    parser.add_argument("--tsc-mhz", type=float, default=1000.0,
+                        help="time stamp counter rate, for timestamps in microseconds (default 1000)")
+    args = parser.parse_args()
+
+    json.dump(convert(read_records(args.input), args.tsc_mhz), sys.stdout)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
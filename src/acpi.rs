@@ -180,6 +180,19 @@ struct InterruptSourceOverride {
 	flags: u16
 }
 
+#[repr(C, packed)]
+#[derive(Debug)]
+struct ProcessorLocalApic {
+	header: MadtTableEntry,
+	processor_id: u8,
+	apic_id: u8,
+	flags: u32
+}
+
+// processor local apic flags
+const LAPIC_ENABLED: u32 = 1 << 0;
+const LAPIC_ONLINE_CAPABLE: u32 = 1 << 1;
+
 /// Finds and returns the specified ACPI table.
 pub unsafe fn find_acpi_table(
 	root_sdt: VirtAddr,
@@ -376,4 +389,42 @@ pub unsafe fn link_isos() {
 			programmed_count
 		);
 	}
-}
\ No newline at end of file
+}
+
+/// Local APIC ids of every processor in the MADT that is enabled or can be
+/// brought online, the BSP included, in table order.
+pub unsafe fn lapic_ids() -> Vec<u8> {
+	let mut ids = Vec::new();
+
+	unsafe {
+		let Some(madt_table) = find_acpi_table(*RSDT.lock(), AcpiTableType::Madt) else {
+			serial_println!("[ACPI] No MADT, assuming a single cpu");
+			return ids;
+		};
+		let madt_table = madt_table as *const MadtTable;
+
+		let base_u8 = madt_table as *const u8;
+		let mut entry_ptr = base_u8.add(size_of::<MadtTable>());
+		let end = base_u8.add((*madt_table).header.length as usize);
+
+		while entry_ptr < end {
+			let entry = read_unaligned(entry_ptr as *const MadtTableEntry);
+			if entry.length == 0 {
+				serial_println!("[ACPI] ERROR: MADT entry length is 0 — aborting");
+				break;
+			}
+
+			if entry.r#type == 0 {
+				let lapic = read_unaligned(entry_ptr as *const ProcessorLocalApic);
+				let (processor_id, apic_id, flags) = (lapic.processor_id, lapic.apic_id, lapic.flags);
+				serial_println!("[ACPI] Processor {}: lapic id {}, flags={:#x}", processor_id, apic_id, flags);
+				if flags & (LAPIC_ENABLED | LAPIC_ONLINE_CAPABLE) != 0 {
+					ids.push(apic_id);
+				}
+			}
+			entry_ptr = entry_ptr.add(entry.length as usize);
+		}
+	}
+
+	ids
+}
@@ -10,7 +10,7 @@ use core::{
 	ptr::null_mut
 };
 
-use linked_list::LinkedListAllocator;
+use magazine::MagazineAllocator;
 
 // allow missing documentation because otherwise
 // it will also be unused as there is only one type of 
@@ -25,6 +25,7 @@ pub mod fixed_size_block;
 pub mod io_alloc;
 #[allow(missing_docs, deprecated)]
 pub mod linked_list;
+pub mod magazine;
 
 
 use x86_64::structures::paging::{
@@ -76,10 +77,8 @@ lazy_static! {
 			size: PhantomData
 		};
 }
-/// A generic starting off kernel allocator. This is just to allocate the global allocator.
-#[allow(deprecated)]
-pub static LOCAL_HEAP_ALLOCATOR: Locked<LinkedListAllocator> =
-	Locked::new(LinkedListAllocator::new());
+/// The kernel heap, per-cpu magazines over the fixed size blocks.
+pub static LOCAL_HEAP_ALLOCATOR: MagazineAllocator = MagazineAllocator::new();
 
 struct GlobalAllocator;
 
@@ -190,7 +189,8 @@ pub struct Locked<A> {
 
 #[allow(deprecated)]
 impl<A> Locked<A> {
-	const fn new(inner: A) -> Self {
+	/// Wraps `inner` in a SpinMutex
+	pub const fn new(inner: A) -> Self {
 		Locked {
 			inner: SpinMutex::new(inner)
 		}
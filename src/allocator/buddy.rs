@@ -28,10 +28,13 @@ pub enum BuddyMemoryAreaRequest {
 	Fail
 }
 
+/// Buddy allocator over one power of two sized area. Addresses are plain
+/// numbers, the manager below feeds it physical memory, the kernel heap a
+/// part of its own virtual range.
 #[derive(Debug)]
 pub struct BuddyAllocator {
-	pub start_addr: PhysAddr,
-	pub end_addr: PhysAddr,
+	pub start_addr: u64,
+	pub end_addr: u64,
 	pub num_levels: u8,
 	pub block_size: u16,
 	pub free_lists: Vec<Vec<u32>>
@@ -42,15 +45,17 @@ impl BuddyAllocator {
 		(self.block_size as usize) << (self.num_levels as usize)
 	}
 
-	pub fn new(start_addr: PhysAddr, end_addr: PhysAddr, block_size: u16) -> BuddyAllocator {
+	pub fn new(start_addr: u64, end_addr: u64, block_size: u16) -> BuddyAllocator {
 		let mut num_levels = 0;
-		while ((block_size as u64) << block_size as u64) < end_addr.as_u64() - start_addr.as_u64() {
+		while ((block_size as u64) << num_levels) < end_addr - start_addr {
 			num_levels += 1;
 		}
 
+		// level `n` never holds more than `2^n` free blocks, sized up front the
+		// lists never grow, so the allocator needs no allocation while it runs
 		let mut free_lists = Vec::with_capacity((num_levels + 1) as usize);
-		for _ in 0..(num_levels + 1) {
-			free_lists.push(Vec::with_capacity(4));
+		for level in 0..(num_levels + 1) {
+			free_lists.push(Vec::with_capacity(1 << level));
 		}
 
 		free_lists[0].push(0);
@@ -64,8 +69,8 @@ impl BuddyAllocator {
 		}
 	}
 
-	pub fn contains(&self, addr: PhysAddr) -> bool {
-		addr.as_u64() >= self.start_addr.as_u64() && addr.as_u64() < self.end_addr.as_u64()
+	pub fn contains(&self, addr: u64) -> bool {
+		addr >= self.start_addr && addr < self.end_addr
 	}
 
 	pub fn req_size_to_level(&self, size: usize) -> Option<usize> {
@@ -112,23 +117,22 @@ impl BuddyAllocator {
 		}
 	}
 
-	pub fn alloc(&mut self, size: usize, alignment: usize) -> Option<PhysAddr> {
+	pub fn alloc(&mut self, size: usize, alignment: usize) -> Option<u64> {
 		let size = cmp::max(size, alignment);
 		self.req_size_to_level(size).and_then(|req_level| {
 			self.get_free_block(req_level).map(|block| {
 				let offset = block as u64 * (self.max_size() >> req_level as usize) as u64;
-				PhysAddr::new(self.start_addr.as_u64() + offset)
+				self.start_addr + offset
 			})
 		})
 	}
 
-	pub fn dealloc(&mut self, addr: PhysAddr, size: usize, alignment: usize) {
+	pub fn dealloc(&mut self, addr: u64, size: usize, alignment: usize) {
 		let size = cmp::max(size, alignment);
 
 		if let Some(req_level) = self.req_size_to_level(size) {
 			let level_block_size = self.max_size() >> req_level;
-			let block_num =
-				((addr.as_u64() - self.start_addr.as_u64()) as usize / level_block_size) as u32;
+			let block_num = ((addr - self.start_addr) as usize / level_block_size) as u32;
 			self.free_lists[req_level].push(block_num);
 			self.merge_buddies(req_level, block_num);
 		}
@@ -148,7 +152,8 @@ impl BuddyAllocatorManager {
 	}
 
 	pub fn add_memory_area(&self, start_addr: PhysAddr, end_addr: PhysAddr, block_size: u16) {
-		let new_buddy_alloc = SpinMutex::new(BuddyAllocator::new(start_addr, end_addr, block_size));
+		let new_buddy_alloc =
+			SpinMutex::new(BuddyAllocator::new(start_addr.as_u64(), end_addr.as_u64(), block_size));
 		self.buddy_allocators.write().push(new_buddy_alloc);
 	}
 
@@ -272,7 +277,7 @@ unsafe impl GlobalAlloc for BuddyAllocatorManager {
 									layout.size()
 								);
 								serial_println!("{:?}", *allocator);
-								allocation
+								PhysAddr::new(allocation)
 							})
 					})
 				});
@@ -284,8 +289,8 @@ unsafe impl GlobalAlloc for BuddyAllocatorManager {
 		if let Some(phys_addr) = unsafe { virt_to_phys(virt_addr) } {
 			for (i, allocator_mtx) in self.buddy_allocators.read().iter().enumerate() {
 				if let Some(mut allocator) = allocator_mtx.try_lock() {
-					if allocator.contains(phys_addr) {
-						allocator.dealloc(phys_addr, layout.size(), layout.align());
+					if allocator.contains(phys_addr.as_u64()) {
+						allocator.dealloc(phys_addr.as_u64(), layout.size(), layout.align());
 
 						serial_println!(
 							" - BuddyAllocator #{} de-allocated {} bytes",
@@ -305,3 +310,23 @@ unsafe impl GlobalAlloc for BuddyAllocatorManager {
 		);
 	}
 }
+
+#[cfg(feature = "kbench")]
+pub mod benches {
+	use core::hint::black_box;
+
+	use crate::{allocator::buddy::BuddyAllocator, utils::ktest::{self, TestError}};
+
+	pub fn bench_buddy_alloc_dealloc() -> Result<(), TestError> {
+		// addresses are only numbers to it, no memory is touched
+		let mut buddy = BuddyAllocator::new(0, 256 * 1024, 64);
+		// one block up to 64 of them, most rounds split and merge a few levels
+		ktest::bench("buddy_alloc_dealloc", 10_000, |i| {
+			let size = 64 << (i % 7);
+			let addr = buddy.alloc(size, 64).unwrap();
+			buddy.dealloc(black_box(addr), size, 64);
+		});
+		Ok(())
+	}
+	crate::create_bench!(bench_buddy_alloc_dealloc);
+}
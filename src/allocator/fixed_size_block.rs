@@ -14,12 +14,12 @@ use crate::{allocator::linked_list, kassert};
 
 /// The block sizes to use.
 /// Must be powers of 2
-const BLOCK_SIZES: &[usize] = &[8, 16, 32, 64, 128, 256, 512, 1024, 2048];
+pub const BLOCK_SIZES: &[usize] = &[8, 16, 32, 64, 128, 256, 512, 1024, 2048];
 
 /// Choose an appropriate block size for the given layout.
 ///
 /// Returns an index into the `BLOCK_SIZES` array.
-fn list_index(layout: &Layout) -> Option<usize> {
+pub fn list_index(layout: &Layout) -> Option<usize> {
 	let required_block_size = layout.size().max(layout.align());
 	BLOCK_SIZES.iter().position(|&s| s >= required_block_size)
 }
@@ -52,6 +52,47 @@ impl FixedSizeBlockAllocator {
 	pub unsafe fn init(&mut self, heap_start: usize, heap_size: usize) {
 		unsafe { self.fallback_allocator.init(heap_start, heap_size) };
 	}
+
+	/// Takes a block of size class `index`, from its list or else cut fresh
+	/// from the fallback allocator. Null when the heap is exhausted.
+	pub fn pop(&mut self, index: usize) -> *mut u8 {
+		match self.list_heads[index].take() {
+			Some(node) => {
+				self.list_heads[index] = node.next.take();
+				node as *mut ListNode as *mut u8
+			}
+			None => {
+				// only creates blocks of the class size, their alignment is
+				// equal as all sizes are powers of two
+				let block_size = BLOCK_SIZES[index];
+				let layout = Layout::from_size_align(block_size, block_size).unwrap();
+				unsafe { self.fallback_allocator.allocate(layout) }
+			}
+		}
+	}
+
+	/// Puts a block of size class `index` back on its list.
+	///
+	/// # Safety
+	/// `ptr` must be an unused block of at least `BLOCK_SIZES[index]` bytes,
+	/// aligned to it.
+	pub unsafe fn push(&mut self, index: usize, ptr: *mut u8) {
+		let new_node = ListNode {
+			next: self.list_heads[index].take()
+		};
+		// verify that block has size and alignment required for storing node
+		kassert!(mem::size_of::<ListNode>() <= BLOCK_SIZES[index], "size of `ListNode` is bigger that BLOCK_SIZE");
+		kassert!(mem::align_of::<ListNode>() <= BLOCK_SIZES[index], "alignment of `ListNode` is bigger that BLOCK_SIZE");
+		let new_node_ptr = ptr as *mut ListNode;
+		unsafe { new_node_ptr.write(new_node) };
+		self.list_heads[index] = Some(unsafe { &mut *new_node_ptr });
+	}
+
+	/// The allocator behind the size classes, for requests bigger than all
+	/// of them.
+	pub fn fallback(&mut self) -> &mut linked_list::LinkedListAllocator {
+		&mut self.fallback_allocator
+	}
 }
 
 impl Default for FixedSizeBlockAllocator {
@@ -64,44 +105,51 @@ unsafe impl GlobalAlloc for Locked<FixedSizeBlockAllocator> {
 	unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
 		let mut allocator = self.lock();
 		match list_index(&layout) {
-			Some(index) => match allocator.list_heads[index].take() {
-				Some(node) => {
-					allocator.list_heads[index] = node.next.take();
-					node as *mut ListNode as *mut u8
-				}
-				None => {
-					// NOTE: GlobalAlloc trait requires returning *mut u8, cannot propagate errors.
-					// Panics here indicate out-of-memory or internal allocator corruption.
-					panic!("alloc error");
-				}
-			},
-			None => {
-				// NOTE: GlobalAlloc trait requires returning *mut u8. Size exceeds all available
-				// block sizes, must use fallback allocator (not yet implemented).
-				panic!("alloc error")
-			}
+			Some(index) => allocator.pop(index),
+			None => unsafe { allocator.fallback().allocate(layout) }
 		}
 	}
 
 	unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
 		let mut allocator = self.lock();
 		match list_index(&layout) {
-			Some(index) => {
-				let new_node = ListNode {
-					next: allocator.list_heads[index].take()
-				};
-				// verify that block has size and alignment required for storing node
-				kassert!(mem::size_of::<ListNode>() <= BLOCK_SIZES[index], "size of `ListNode` is bigger that BLOCK_SIZE");
-				kassert!(mem::align_of::<ListNode>() <= BLOCK_SIZES[index], "alignment of `ListNode` is bigger that BLOCK_SIZE");
-				let new_node_ptr = ptr as *mut ListNode;
-				unsafe { new_node_ptr.write(new_node) };
-				allocator.list_heads[index] = Some(unsafe { &mut *new_node_ptr });
-			}
-			None => {
-				// NOTE: GlobalAlloc trait requires returning unit. Invalid deallocation
-				// (size mismatch) indicates memory corruption or double-free attempt.
-				panic!("dealloc error")
-			}
+			Some(index) => unsafe { allocator.push(index, ptr) },
+			None => unsafe { allocator.fallback().deallocate(ptr, layout) }
 		}
 	}
 }
+
+#[cfg(feature = "kbench")]
+pub mod benches {
+	use alloc::vec;
+	use core::{alloc::Layout, hint::black_box};
+
+	use crate::{
+		allocator::fixed_size_block::{BLOCK_SIZES, FixedSizeBlockAllocator},
+		utils::ktest::{self, TestError}
+	};
+
+	pub fn bench_fixed_size_block() -> Result<(), TestError> {
+		// on a heap of its own, the kernel's allocator is left alone
+		let mut arena = vec![0u64; 8 * 1024];
+		let mut blocks = FixedSizeBlockAllocator::new();
+		unsafe { blocks.init(arena.as_mut_ptr() as usize, arena.len() * 8) };
+		ktest::bench("fixed_size_block_pop_push", 10_000, |i| {
+			let index = i as usize % BLOCK_SIZES.len();
+			let block = blocks.pop(index);
+			assert!(!block.is_null());
+			unsafe { blocks.push(index, black_box(block)) };
+		});
+
+		// the whole way through the global allocator, magazines first
+		let layout = Layout::from_size_align(64, 8).unwrap();
+		ktest::bench("heap_alloc_dealloc_64", 10_000, |_| unsafe {
+			let ptr = alloc::alloc::alloc(layout);
+			assert!(!ptr.is_null());
+			alloc::alloc::dealloc(black_box(ptr), layout);
+		});
+		drop(arena);
+		Ok(())
+	}
+	crate::create_bench!(bench_fixed_size_block);
+}
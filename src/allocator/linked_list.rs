@@ -134,25 +134,28 @@ impl LinkedListAllocator {
 		let size = layout.size().max(mem::size_of::<ListNode>());
 		(size, layout.align())
 	}
-}
-
-impl Default for LinkedListAllocator {
-	fn default() -> Self {
-		Self::new()
-	}
-}
 
-unsafe impl GlobalAlloc for Locked<LinkedListAllocator> {
-	unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+	/// Allocates a block for `layout` from the free list, null when no
+	/// region is big enough.
+	///
+	/// # Safety
+	/// The allocator has to be initialized with `init`.
+	pub unsafe fn allocate(&mut self, layout: Layout) -> *mut u8 {
 		// perform layout adjustments
 		let (size, align) = LinkedListAllocator::size_align(layout);
-		let mut allocator = self.lock();
 
-		if let Some((region, alloc_start)) = allocator.find_region(size, align) {
+		if let Some((region, alloc_start)) = self.find_region(size, align) {
+			let region_start = region.start_addr();
 			let alloc_end = alloc_start.checked_add(size).expect("overflow");
 			let excess_size = region.end_addr() - alloc_end;
 			if excess_size > 0 {
-				unsafe { allocator.add_free_region(alloc_end, excess_size) };
+				unsafe { self.add_free_region(alloc_end, excess_size) };
+			}
+			// give back the gap in front of highly aligned (page sized) blocks,
+			// otherwise every such allocation leaks up to align - 1 bytes
+			let padding = alloc_start - region_start;
+			if padding >= mem::size_of::<ListNode>() {
+				unsafe { self.add_free_region(region_start, padding) };
 			}
 			alloc_start as *mut u8
 		} else {
@@ -160,10 +163,30 @@ unsafe impl GlobalAlloc for Locked<LinkedListAllocator> {
 		}
 	}
 
-	unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+	/// Gives a block from `allocate` back to the free list.
+	///
+	/// # Safety
+	/// `ptr` must come from `allocate` on this allocator with the same `layout`.
+	pub unsafe fn deallocate(&mut self, ptr: *mut u8, layout: Layout) {
 		// perform layout adjustments
 		let (size, _) = LinkedListAllocator::size_align(layout);
 
-		unsafe { self.lock().add_free_region(ptr as usize, size) }
+		unsafe { self.add_free_region(ptr as usize, size) }
+	}
+}
+
+impl Default for LinkedListAllocator {
+	fn default() -> Self {
+		Self::new()
+	}
+}
+
+unsafe impl GlobalAlloc for Locked<LinkedListAllocator> {
+	unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+		unsafe { self.lock().allocate(layout) }
+	}
+
+	unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+		unsafe { self.lock().deallocate(ptr, layout) }
 	}
 }
@@ -0,0 +1,290 @@
+//!
+//! allocator/magazine.rs
+//!
+//! Kernel heap with per-cpu magazine caches in front of the size classes.
+//!
+
+use core::{
+	alloc::{GlobalAlloc, Layout},
+	cell::UnsafeCell,
+	ptr::null_mut
+};
+
+use x86_64::instructions::interrupts;
+
+use super::{
+	buddy::BuddyAllocator,
+	fixed_size_block::{BLOCK_SIZES, FixedSizeBlockAllocator, list_index}
+};
+use crate::{
+	smp::{MAX_CPUS, cpu_id},
+	utils::mutex::{SpinMutex, SpinMutexGuard}
+};
+
+/// Most blocks one magazine holds.
+const MAGAZINE_SLOTS: usize = 32;
+/// Bytes a magazine may keep out of the shared lists, bigger classes get
+/// fewer blocks so idle cpus do not sit on much of the small heap.
+const MAGAZINE_BYTES: usize = 4096;
+/// Smallest block of the buddy part of the heap.
+const BUDDY_BLOCK_SIZE: u16 = 4096;
+
+/// Blocks a magazine of size class `index` holds.
+const fn magazine_limit(index: usize) -> usize {
+	let blocks = MAGAZINE_BYTES / BLOCK_SIZES[index];
+	if blocks > MAGAZINE_SLOTS {
+		MAGAZINE_SLOTS
+	} else if blocks < 2 {
+		2
+	} else {
+		blocks
+	}
+}
+
+/// A stack of free blocks of one size class, owned by one cpu.
+struct Magazine {
+	len: usize,
+	blocks: [*mut u8; MAGAZINE_SLOTS]
+}
+
+impl Magazine {
+	const fn new() -> Self {
+		Self {
+			len: 0,
+			blocks: [null_mut(); MAGAZINE_SLOTS]
+		}
+	}
+}
+
+/// Magazines of one cpu, one per size class.
+#[repr(align(64))]
+struct CpuCache(UnsafeCell<[Magazine; BLOCK_SIZES.len()]>);
+
+/// The kernel heap allocator.
+///
+/// Requests that fit a size class are served from the calling cpu's
+/// magazine, with interrupts off and without any lock or shared cache line.
+/// An empty magazine is refilled with half its capacity from the shared
+/// lists in one go, a full one hands half of it back, so the shared lock is
+/// taken once per batch instead of once per block. Bigger requests go to a
+/// buddy allocator over the upper half of the heap, the linked list behind
+/// the size classes takes what the buddy cannot.
+pub struct MagazineAllocator {
+	caches: [CpuCache; MAX_CPUS],
+	depot: SpinMutex<FixedSizeBlockAllocator>,
+	buddy: SpinMutex<Option<BuddyAllocator>>
+}
+
+// a cpu only touches its own cache and only with interrupts disabled, so no
+// one else can get at it meanwhile, the cached blocks belong to the heap
+unsafe impl Send for MagazineAllocator {}
+unsafe impl Sync for MagazineAllocator {}
+
+/// Locks `mutex` without enabling interrupts while waiting, the caller may be
+/// in the middle of using its magazines.
+fn spin<T>(mutex: &SpinMutex<T>) -> SpinMutexGuard<'_, T> {
+	loop {
+		if let Some(guard) = mutex.try_lock() {
+			return guard;
+		}
+		core::hint::spin_loop();
+	}
+}
+
+impl MagazineAllocator {
+	/// Creates an empty allocator, nothing can be allocated before `init`.
+	pub const fn new() -> Self {
+		Self {
+			caches: [const { CpuCache(UnsafeCell::new([const { Magazine::new() }; BLOCK_SIZES.len()])) }; MAX_CPUS],
+			depot: SpinMutex::new(FixedSizeBlockAllocator::new()),
+			buddy: SpinMutex::new(None)
+		}
+	}
+
+	/// Initialize the allocator with the given heap bounds, the lower half
+	/// backs the size classes, the upper half the buddy allocator.
+	///
+	/// # Safety
+	/// The heap bounds have to be valid and unused, `heap_start` page aligned
+	/// and this allocator already installed as the global one (setting up
+	/// the buddy allocates). Must be called only once.
+	pub unsafe fn init(&self, heap_start: usize, heap_size: usize) {
+		// the largest power of two multiple of the block size that fits in half
+		let mut buddy_size = BUDDY_BLOCK_SIZE as usize;
+		while buddy_size * 2 <= heap_size / 2 {
+			buddy_size *= 2;
+		}
+		let small_size = heap_size - buddy_size;
+
+		unsafe { spin(&self.depot).init(heap_start, small_size) };
+
+		let buddy_start = (heap_start + small_size) as u64;
+		let buddy = BuddyAllocator::new(buddy_start, buddy_start + buddy_size as u64, BUDDY_BLOCK_SIZE);
+		interrupts::without_interrupts(|| *spin(&self.buddy) = Some(buddy));
+	}
+
+	/// The calling cpu's magazine of size class `index`.
+	///
+	/// # Safety
+	/// Interrupts must be disabled for as long as the reference is used.
+	#[allow(clippy::mut_from_ref)]
+	unsafe fn magazine(&self, index: usize) -> &mut Magazine {
+		unsafe { &mut (*self.caches[cpu_id()].0.get())[index] }
+	}
+
+	fn alloc_small(&self, index: usize) -> *mut u8 {
+		interrupts::without_interrupts(|| {
+			let magazine = unsafe { self.magazine(index) };
+			if magazine.len == 0 {
+				let batch = magazine_limit(index) / 2;
+				let mut depot = spin(&self.depot);
+				while magazine.len < batch {
+					let block = depot.pop(index);
+					if block.is_null() {
+						break;
+					}
+					magazine.blocks[magazine.len] = block;
+					magazine.len += 1;
+				}
+				if magazine.len == 0 {
+					return null_mut();
+				}
+			}
+			magazine.len -= 1;
+			magazine.blocks[magazine.len]
+		})
+	}
+
+	fn dealloc_small(&self, index: usize, ptr: *mut u8) {
+		interrupts::without_interrupts(|| {
+			let magazine = unsafe { self.magazine(index) };
+			let limit = magazine_limit(index);
+			if magazine.len == limit {
+				let keep = limit / 2;
+				let mut depot = spin(&self.depot);
+				for &block in &magazine.blocks[keep..limit] {
+					unsafe { depot.push(index, block) };
+				}
+				magazine.len = keep;
+			}
+			magazine.blocks[magazine.len] = ptr;
+			magazine.len += 1;
+		})
+	}
+
+	fn alloc_large(&self, layout: Layout) -> *mut u8 {
+		interrupts::without_interrupts(|| {
+			// an offset in the buddy area is only aligned to the block it is in
+			if layout.align() <= BUDDY_BLOCK_SIZE as usize
+				&& let Some(buddy) = spin(&self.buddy).as_mut()
+				&& let Some(addr) = buddy.alloc(layout.size(), layout.align())
+			{
+				return addr as *mut u8;
+			}
+			unsafe { spin(&self.depot).fallback().allocate(layout) }
+		})
+	}
+
+	fn dealloc_large(&self, ptr: *mut u8, layout: Layout) {
+		interrupts::without_interrupts(|| {
+			if let Some(buddy) = spin(&self.buddy).as_mut()
+				&& buddy.contains(ptr as u64)
+			{
+				buddy.dealloc(ptr as u64, layout.size(), layout.align());
+				return;
+			}
+			unsafe { spin(&self.depot).fallback().deallocate(ptr, layout) }
+		})
+	}
+
+	/// Returns every block cached by the calling cpu to the shared lists.
+	pub fn drain_local(&self) {
+		interrupts::without_interrupts(|| {
+			let mut depot = spin(&self.depot);
+			for index in 0..BLOCK_SIZES.len() {
+				let magazine = unsafe { self.magazine(index) };
+				for &block in &magazine.blocks[..magazine.len] {
+					unsafe { depot.push(index, block) };
+				}
+				magazine.len = 0;
+			}
+		})
+	}
+}
+
+impl Default for MagazineAllocator {
+	fn default() -> Self {
+		Self::new()
+	}
+}
+
+unsafe impl GlobalAlloc for MagazineAllocator {
+	unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+		match list_index(&layout) {
+			Some(index) => self.alloc_small(index),
+			None => self.alloc_large(layout)
+		}
+	}
+
+	unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+		match list_index(&layout) {
+			Some(index) => self.dealloc_small(index, ptr),
+			None => self.dealloc_large(ptr, layout)
+		}
+	}
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use alloc::{boxed::Box, vec::Vec};
+	use core::alloc::Layout;
+
+	use crate::{
+		allocator::{
+			LOCAL_HEAP_ALLOCATOR,
+			fixed_size_block::BLOCK_SIZES,
+			magazine::{MAGAZINE_SLOTS, magazine_limit}
+		},
+		utils::ktest::TestError
+	};
+
+	pub fn test_magazine_reuses_freed_block() -> Result<(), TestError> {
+		let layout = Layout::from_size_align(48, 8).unwrap();
+		unsafe {
+			let a = alloc::alloc::alloc(layout);
+			assert!(!a.is_null());
+			alloc::alloc::dealloc(a, layout);
+			// the block went to this cpu's magazine and comes straight back
+			let b = alloc::alloc::alloc(layout);
+			assert_eq!(a, b);
+			alloc::alloc::dealloc(b, layout);
+		}
+		Ok(())
+	}
+	crate::create_test!(test_magazine_reuses_freed_block);
+
+	pub fn test_magazine_batches_round_trip() -> Result<(), TestError> {
+		for index in 0..BLOCK_SIZES.len() {
+			let limit = magazine_limit(index);
+			assert!((2..=MAGAZINE_SLOTS).contains(&limit));
+		}
+
+		// several refills and flushes of one class, then big blocks that come
+		// from the buddy part
+		let blocks: Vec<Box<[u8; 64]>> = (0..MAGAZINE_SLOTS * 4).map(|i| Box::new([i as u8; 64])).collect();
+		for (i, block) in blocks.iter().enumerate() {
+			assert!(block.iter().all(|b| *b == i as u8));
+		}
+		drop(blocks);
+
+		let big: Vec<Vec<u8>> = (0..4).map(|i| alloc::vec![i as u8; 12 * 1024]).collect();
+		for (i, block) in big.iter().enumerate() {
+			assert!(block.iter().all(|b| *b == i as u8));
+		}
+		drop(big);
+
+		LOCAL_HEAP_ALLOCATOR.drain_local();
+		Ok(())
+	}
+	crate::create_test!(test_magazine_batches_round_trip);
+}
@@ -6,7 +6,7 @@
 
 use core::{
 	ptr::{read_volatile, write_volatile},
-	sync::atomic::AtomicU64
+	sync::atomic::{AtomicU32, AtomicU64, Ordering}
 };
 
 use x86_64::instructions::interrupts;
@@ -21,6 +21,11 @@ pub static APIC_BASE: SpinMutex<usize> = SpinMutex::new(0);
 pub static APIC_TICK_COUNT: AtomicU64 = AtomicU64::new(0);
 /// The TPS (Ticks per second) at which the APIC runs at
 pub static APIC_TPS: AtomicU64 = AtomicU64::new(0);
+/// Rate of the APIC timer interrupt, one `APIC_TICK_COUNT` tick each.
+pub const TIMER_HZ: u32 = 1024;
+/// Initial count of the periodic timer, timer counts per tick. Zero until the
+/// timer is started.
+static TIMER_PERIOD: AtomicU32 = AtomicU32::new(0);
 
 // pic code
 
@@ -50,9 +55,7 @@ const APIC_EOI: usize = 0x0B0;
 const APIC_SVR: usize = 0x0F0;
 #[allow(unused)]
 const APIC_ISR_BASE: usize = 0x100; // ISR 0x100..0x170
-#[allow(unused)]
 const APIC_ICRLO: usize = 0x300;
-#[allow(unused)]
 const APIC_ICRHI: usize = 0x310;
 const APIC_LVT_TIMER: usize = 0x320;
 #[allow(unused)]
@@ -74,6 +77,12 @@ const SVR_APIC_ENABLE: u32 = 1 << 8;
 const LVT_MASK_BIT: u32 = 1 << 16;
 const LVT_MODE_PERIODIC: u32 = 1 << 17;
 
+// interrupt command register (ICR) fields
+const ICR_DELIVERY_INIT: u32 = 0b101 << 8;
+const ICR_DELIVERY_STARTUP: u32 = 0b110 << 8;
+const ICR_DELIVERY_PENDING: u32 = 1 << 12;
+const ICR_LEVEL_ASSERT: u32 = 1 << 14;
+
 #[inline(always)]
 unsafe fn apic_reg_ptr(offset: usize) -> *mut u32 {
 	let base = *APIC_BASE.lock();
@@ -121,6 +130,38 @@ pub unsafe fn send_eoi() {
 	}
 }
 
+/// Writes the ICR and waits until the local APIC has sent the IPI.
+unsafe fn send_icr(lapic_id: u8, low: u32) {
+	// an IPI sent from an interrupt handler in between would change ICRHI
+	interrupts::without_interrupts(|| unsafe {
+		write_register(APIC_ICRHI, (lapic_id as u32) << 24);
+		write_register(APIC_ICRLO, low);
+		while read_register(APIC_ICRLO) & ICR_DELIVERY_PENDING != 0 {
+			core::hint::spin_loop();
+		}
+	});
+}
+
+/// Sends a fixed interrupt with `vector` to the cpu with local APIC `lapic_id`.
+pub unsafe fn send_ipi(lapic_id: u8, vector: u8) {
+	unsafe { send_icr(lapic_id, vector as u32) }
+}
+
+/// Sends an INIT IPI, the first step of starting an application processor.
+pub unsafe fn send_init_ipi(lapic_id: u8) {
+	unsafe { send_icr(lapic_id, ICR_DELIVERY_INIT | ICR_LEVEL_ASSERT) }
+}
+
+/// Sends a STARTUP IPI, the cpu starts in real mode at `page << 12`.
+pub unsafe fn send_startup_ipi(lapic_id: u8, page: u8) {
+	unsafe { send_icr(lapic_id, ICR_DELIVERY_STARTUP | ICR_LEVEL_ASSERT | page as u32) }
+}
+
+/// Local APIC id of the calling cpu.
+pub fn lapic_id() -> u8 {
+	unsafe { (read_register(APIC_ID) >> 24) as u8 }
+}
+
 /// Set the timer divide configuration.
 unsafe fn set_timer_divide(divide_cfg: u32) {
 	unsafe {
@@ -174,6 +215,43 @@ pub unsafe fn start_timer_periodic(timer_vector: u8, initial_count: u32) {
 		set_timer_initial(initial_count);
 		configure_lvt_timer(timer_vector, true, false);
 	}
+	TIMER_PERIOD.store(initial_count, Ordering::Relaxed);
+}
+
+/// Halts for up to `ticks` timer ticks with the periodic interrupt turned off
+/// (tickless idle), or until any other interrupt comes in.
+///
+/// The timer is put into one-shot mode for the whole stretch, afterwards the
+/// ticks that went by are added to `APIC_TICK_COUNT` and the periodic timer is
+/// started again. Must be called with interrupts disabled, returns with them
+/// enabled.
+pub unsafe fn idle_for_ticks(timer_vector: u8, ticks: u64) {
+	let period = TIMER_PERIOD.load(Ordering::Relaxed);
+	if period == 0 || ticks <= 1 {
+		// no timer to reprogram, or the next tick is soon enough anyway
+		interrupts::enable_and_hlt();
+		return;
+	}
+
+	let count = core::cmp::min(ticks * period as u64, u32::MAX as u64) as u32;
+	unsafe {
+		configure_lvt_timer(timer_vector, false, false);
+		set_timer_initial(count);
+	}
+
+	interrupts::enable_and_hlt();
+	interrupts::disable();
+
+	let left = unsafe { read_current_count() };
+	let slept = ((count - left) / period) as u64;
+	// when the one-shot fired its handler already counted one tick
+	let counted = (left == 0) as u64;
+	APIC_TICK_COUNT.fetch_add(slept.saturating_sub(counted), Ordering::Relaxed);
+
+	unsafe {
+		start_timer_periodic(timer_vector, period);
+	}
+	interrupts::enable();
 }
 
 /// Calibrate the LAPIC timer using the RTC
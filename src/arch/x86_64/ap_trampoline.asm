@@ -0,0 +1,83 @@
+; Start code for the application processors.
+;
+; This is never run where it is linked: smp::start_aps copies it to
+; AP_TRAMPOLINE_ADDR (below 1 MiB, the STARTUP IPI can only point there),
+; fills in the parameter block at the end and sends the IPIs. Every address
+; is therefore computed relative to that copy.
+
+global ap_trampoline_start
+global ap_trampoline_params
+global ap_trampoline_end
+
+AP_TRAMPOLINE_ADDR equ 0x8000
+
+%define TRAMP(x) ((x) - ap_trampoline_start + AP_TRAMPOLINE_ADDR)
+
+section .rodata
+bits 16
+ap_trampoline_start:
+    cli
+    cld
+
+    xor ax, ax
+    mov ds, ax
+
+    lgdt [TRAMP(gdt64.pointer)]
+
+    ; PAE
+    mov eax, cr4
+    or eax, 1 << 5
+    mov cr4, eax
+
+    ; the kernel page table, identity maps this page
+    mov eax, [TRAMP(ap_trampoline_params.cr3)]
+    mov cr3, eax
+
+    ; long mode, and NX right away: kernel page tables use the bit
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, (1 << 8) | (1 << 11)
+    wrmsr
+
+    ; protection and paging in one go, straight from real mode to long mode
+    mov eax, cr0
+    or eax, (1 << 31) | (1 << 0)
+    mov cr0, eax
+
+    jmp gdt64.code:TRAMP(long_mode)
+
+bits 64
+long_mode:
+    xor ax, ax
+    mov ss, ax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    mov rsp, [abs TRAMP(ap_trampoline_params.stack)]
+    mov rdi, [abs TRAMP(ap_trampoline_params.cpu)]
+    mov rax, [abs TRAMP(ap_trampoline_params.entry)]
+    call rax
+
+.hang:
+    hlt
+    jmp .hang
+
+align 8
+gdt64:
+    dq 0 ; zero entry
+.code: equ $ - gdt64
+    dq (1<<43) | (1<<44) | (1<<47) | (1<<53) ; code segment
+.pointer:
+    dw $ - gdt64 - 1
+    dq TRAMP(gdt64)
+
+; filled in by smp::start_aps, see `TrampolineParams`
+align 8
+ap_trampoline_params:
+.cr3:   dq 0
+.stack: dq 0
+.entry: dq 0
+.cpu:   dq 0
+ap_trampoline_end:
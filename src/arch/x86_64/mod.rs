@@ -1,3 +1,4 @@
 #[allow(missing_docs)]
 pub mod bootinfo;
+pub mod syscall;
 pub mod user;
\ No newline at end of file
@@ -0,0 +1,239 @@
+//!
+//! syscall.rs
+//!
+//! x86_64 `syscall`/`sysret` fast entry path for the kernel.
+//!
+
+use core::sync::atomic::{AtomicBool, Ordering};
+
+use x86_64::{
+	VirtAddr,
+	registers::{
+		model_specific::{Efer, EferFlags, LStar, SFMask, Star},
+		rflags::RFlags
+	},
+	structures::gdt::SegmentSelector
+};
+
+use crate::{gdt, serial_println, smp::{MAX_CPUS, cpu_id}, syscall::syscall};
+
+/// Set once the STAR/LSTAR/SFMASK MSRs have been programmed and userspace may
+/// use the `syscall` instruction.
+pub static SYSCALL_ENABLED: AtomicBool = AtomicBool::new(false);
+
+// scratch slots used by `syscall_entry_N` before it has a kernel stack, one
+// per cpu. The entry point cannot ask which cpu it runs on (nothing is saved
+// yet and the kernel does not use swapgs), so every cpu gets its own copy of
+// the entry with its slot offset baked in.
+static mut SYSCALL_USER_RSP: [u64; MAX_CPUS] = [0; MAX_CPUS];
+static mut SYSCALL_KERNEL_RSP: [u64; MAX_CPUS] = [0; MAX_CPUS];
+static mut SYSRET_CS: u64 = 0;
+static mut SYSRET_SS: u64 = 0;
+
+/// Frame of the syscall being dispatched on each cpu, for the syscalls that
+/// need the caller's whole register state (`split`).
+static mut CURRENT_SYSCALL_FRAME: [*const SyscallFrame; MAX_CPUS] = [core::ptr::null(); MAX_CPUS];
+
+/// Frame of the syscall the calling cpu is dispatching, null outside of one.
+pub fn current_syscall_frame() -> *const SyscallFrame {
+	unsafe { CURRENT_SYSCALL_FRAME[cpu_id()] }
+}
+
+/// Registers saved on the kernel stack by both syscall entry paths.
+///
+/// The layout of the last five fields matches the frame the CPU pushes for
+/// `int 0x80`, `syscall_entry` builds the same frame by hand so the dispatcher
+/// doesnt care how it was entered.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+#[allow(missing_docs)]
+pub struct SyscallFrame {
+	pub r15: u64,
+	pub r14: u64,
+	pub r13: u64,
+	pub r12: u64,
+	pub r11: u64,
+	pub r10: u64,
+	pub r9: u64,
+	pub r8: u64,
+	pub rbp: u64,
+	pub rdi: u64,
+	pub rsi: u64,
+	pub rdx: u64,
+	pub rcx: u64,
+	pub rbx: u64,
+	pub rax: u64,
+
+	// pushed by the cpu (int 0x80) or by `syscall_entry`
+	pub rip: u64,
+	pub cs: u64,
+	pub rflags: u64,
+	pub rsp: u64,
+	pub ss: u64
+}
+
+/// Common dispatcher for both entry paths. Writes the return value back into
+/// `rax` of the saved frame.
+pub extern "C" fn syscall_dispatch(frame: &mut SyscallFrame) {
+	let cpu = cpu_id();
+	unsafe { CURRENT_SYSCALL_FRAME[cpu] = frame as *const SyscallFrame };
+	let ret = unsafe {
+		syscall(
+			frame.rax as u32,
+			frame.rdi,
+			frame.rsi,
+			frame.rdx,
+			frame.r10,
+			frame.r8
+		)
+	};
+	unsafe { CURRENT_SYSCALL_FRAME[cpu] = core::ptr::null() };
+	frame.rax = ret as i64 as u64;
+}
+
+/// Syscalls returning to a rip at or above this go out through `iretq`.
+/// `sysretq` to a non canonical rip raises #GP while still in ring 0, Linux
+/// draws the line one page lower as well.
+const SYSRET_RIP_END: u64 = 0x0000_7FFF_FFFF_F000;
+
+/// Defines the entry point loaded into LSTAR on cpu `$cpu`.
+///
+/// On entry rcx holds the user rip, r11 the user rflags and rsp is still the
+/// user stack. SFMASK has already cleared IF so nothing can interrupt us
+/// before the stack switch.
+macro_rules! syscall_entry {
+	($name:ident, $cpu:expr) => {
+		#[unsafe(naked)]
+		extern "C" fn $name() {
+			core::arch::naked_asm!(
+				"mov [rip + {user_rsp} + {slot}], rsp",
+				"mov rsp, [rip + {kernel_rsp} + {slot}]",
+
+				// build an iretq-shaped frame so SyscallFrame is identical to int 0x80
+				"push qword ptr [rip + {ss}]",
+				"push qword ptr [rip + {user_rsp} + {slot}]",
+				"push r11",
+				"push qword ptr [rip + {cs}]",
+				"push rcx",
+
+				"push rax",
+				"push rbx",
+				"push rcx",
+				"push rdx",
+				"push rsi",
+				"push rdi",
+				"push rbp",
+				"push r8",
+				"push r9",
+				"push r10",
+				"push r11",
+				"push r12",
+				"push r13",
+				"push r14",
+				"push r15",
+
+				// 20 qwords pushed from a 16 byte aligned top, so rsp is aligned here
+				"mov rdi, rsp",
+				"call {dispatch}",
+
+				"pop r15",
+				"pop r14",
+				"pop r13",
+				"pop r12",
+				"pop r11",
+				"pop r10",
+				"pop r9",
+				"pop r8",
+				"pop rbp",
+				"pop rdi",
+				"pop rsi",
+				"pop rdx",
+				"pop rcx",
+				"pop rbx",
+				"pop rax",
+
+				// sysretq to a non canonical rip faults in ring 0 with the user
+				// stack loaded, such a return goes out through iretq instead
+				"push rax",
+				"mov rax, {sysret_rip_end}",
+				"cmp [rsp + 8], rax",
+				"pop rax",
+				"jae 2f",
+
+				"pop rcx",       // user rip
+				"add rsp, 8",    // cs
+				"pop r11",       // user rflags
+				"pop rsp",       // user rsp
+				"sysretq",
+
+				"2:",
+				"iretq",
+
+				user_rsp = sym SYSCALL_USER_RSP,
+				kernel_rsp = sym SYSCALL_KERNEL_RSP,
+				cs = sym SYSRET_CS,
+				ss = sym SYSRET_SS,
+				dispatch = sym syscall_dispatch,
+				slot = const $cpu * 8,
+				sysret_rip_end = const SYSRET_RIP_END,
+			)
+		}
+	};
+}
+
+syscall_entry!(syscall_entry_0, 0);
+syscall_entry!(syscall_entry_1, 1);
+syscall_entry!(syscall_entry_2, 2);
+syscall_entry!(syscall_entry_3, 3);
+syscall_entry!(syscall_entry_4, 4);
+syscall_entry!(syscall_entry_5, 5);
+syscall_entry!(syscall_entry_6, 6);
+syscall_entry!(syscall_entry_7, 7);
+
+/// LSTAR value of each cpu.
+static SYSCALL_ENTRIES: [extern "C" fn(); MAX_CPUS] = [
+	syscall_entry_0,
+	syscall_entry_1,
+	syscall_entry_2,
+	syscall_entry_3,
+	syscall_entry_4,
+	syscall_entry_5,
+	syscall_entry_6,
+	syscall_entry_7
+];
+
+/// Programs the STAR/LSTAR/SFMASK MSRs of the calling cpu and enables
+/// `syscall`/`sysret` on it.
+///
+/// # Safety
+/// The GDT of this cpu must be loaded (see `gdt::init_cpu`) before calling
+/// this.
+pub unsafe fn init_syscall() {
+	let kernel_cs = SegmentSelector(gdt::kernel_code_selector());
+	let kernel_ss = SegmentSelector(gdt::kernel_data_selector());
+	let user_cs = SegmentSelector(gdt::user_code_selector());
+	let user_ss = SegmentSelector(gdt::user_data_selector());
+
+	if let Err(e) = Star::write(user_cs, user_ss, kernel_cs, kernel_ss) {
+		serial_println!("[WARN] syscall: STAR rejected GDT layout ({}), using int 0x80 only", e);
+		return;
+	}
+
+	unsafe {
+		let cpu = cpu_id();
+		SYSCALL_KERNEL_RSP[cpu] = gdt::interrupt_stack_top();
+		SYSRET_CS = user_cs.0 as u64;
+		SYSRET_SS = user_ss.0 as u64;
+
+		LStar::write(VirtAddr::new(SYSCALL_ENTRIES[cpu] as usize as u64));
+		SFMask::write(RFlags::INTERRUPT_FLAG | RFlags::DIRECTION_FLAG | RFlags::TRAP_FLAG);
+
+		Efer::update(|flags| {
+			*flags |= EferFlags::SYSTEM_CALL_EXTENSIONS;
+		});
+	}
+
+	if !SYSCALL_ENABLED.swap(true, Ordering::SeqCst) {
+		serial_println!("[Info] syscall/sysret enabled.");
+	}
+}
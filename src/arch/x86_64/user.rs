@@ -4,100 +4,211 @@
 //! x86_64 Usermode module for the kernel.
 //! 
 
-use core::{ptr::copy_nonoverlapping, sync::atomic::{AtomicBool, AtomicI32}};
+use core::{ptr::copy_nonoverlapping, sync::atomic::{AtomicBool, AtomicI32, Ordering}};
 
-use alloc::vec::Vec;
 use x86_64::{
+    PhysAddr,
     VirtAddr,
+    registers::control::Cr3,
     structures::paging::{FrameAllocator, Mapper, OffsetPageTable, Page, PageTableFlags, PhysFrame},
 };
 
 use crate::{
-    PHYS_MEM_OFFSET, allocator::ALLOCATOR_INFO, arch::x86_64::bootinfo::{FrameRange, MemoryRegion, MemoryRegionType}, memory::{BootInfoFrameAllocator, phys_to_virt}, serial_println, task::{AddressSpace, Process}
+    PHYS_MEM_OFFSET, allocator::ALLOCATOR_INFO, arch::x86_64::bootinfo::{FrameRange, MemoryRegion, MemoryRegionType}, ensure, error::NullexError, memory::{BootInfoFrameAllocator, phys_to_virt}, smp::{MAX_CPUS, cpu_id}, task::{AddressSpace, Process, UserContext}, utils::boot::{XSAVE_COMPONENTS, XSAVE_ENABLED}
 };
 
 pub static USER_EXIT_REQUESTED: AtomicBool = AtomicBool::new(false);
-pub static USER_EXIT_CODE: AtomicI32 = AtomicI32::new(0);
+/// Exit code of the program each cpu last returned from.
+pub static USER_EXIT_CODE: [AtomicI32; MAX_CPUS] = [const { AtomicI32::new(0) }; MAX_CPUS];
+/// Set when the program left through `park_user_process` instead of `halt`,
+/// it has saved its context and wants to be entered again later. Per cpu.
+pub static USER_PARKED: [AtomicBool; MAX_CPUS] = [const { AtomicBool::new(false) }; MAX_CPUS];
 
-pub static mut KERNEL_RETURN_RSP: u64 = 0;
-pub static mut KERNEL_RETURN_RBP: u64 = 0;
-pub static mut KERNEL_RETURN_ADDR: u64 = 0;
+// where `return_to_kernel` jumps to, set by `enter_user_process` on each cpu
+pub static mut KERNEL_RETURN_RSP: [u64; MAX_CPUS] = [0; MAX_CPUS];
+pub static mut KERNEL_RETURN_RBP: [u64; MAX_CPUS] = [0; MAX_CPUS];
+pub static mut KERNEL_RETURN_ADDR: [u64; MAX_CPUS] = [0; MAX_CPUS];
 
 pub const USER_STACK_TOP: u64 = 0x0000_7FFF_0000_0000;
 const USER_STACK_PAGES: usize = 8;
 
+/// Start of the window `mapf` hands out file mappings from, grows upwards.
+pub const USER_MAP_BASE: u64 = 0x0000_6000_0000_0000;
+
 const TRANSITION_STACK_SIZE: usize = 4096 * 4;
 
 pub static mut KERNEL_CR3: u64 = 0;
 
+/// Bytes `xsave` stores for the x87, SSE and AVX state in the standard
+/// format, `fxsave` only uses the first 512.
+const FPU_STATE_SIZE: usize = 832;
+
+/// x87, SSE and AVX registers of a process while it is not running.
+///
+/// The kernel is built soft-float and never touches them, so what the cpu
+/// holds between a syscall and the next entry is still the program's.
+#[repr(C, align(64))]
+#[derive(Clone)]
+pub struct FpuState([u8; FPU_STATE_SIZE]);
+
+impl FpuState {
+    /// Stores the calling cpu's vector registers here.
+    ///
+    /// # Safety
+    /// `init_simd` must have run on this cpu.
+    pub unsafe fn save(&mut self) {
+        let area = self.0.as_mut_ptr();
+        unsafe {
+            if XSAVE_ENABLED.load(Ordering::Relaxed) {
+                core::arch::asm!(
+                    "xsave64 [{}]",
+                    in(reg) area,
+                    in("eax") XSAVE_COMPONENTS as u32,
+                    in("edx") (XSAVE_COMPONENTS >> 32) as u32,
+                    options(nostack)
+                );
+            } else {
+                core::arch::asm!("fxsave64 [{}]", in(reg) area, options(nostack));
+            }
+        }
+    }
+
+    /// Loads the vector registers of the calling cpu from here.
+    ///
+    /// # Safety
+    /// `init_simd` must have run on this cpu.
+    pub unsafe fn restore(&self) {
+        let area = self.0.as_ptr();
+        unsafe {
+            if XSAVE_ENABLED.load(Ordering::Relaxed) {
+                core::arch::asm!(
+                    "xrstor64 [{}]",
+                    in(reg) area,
+                    in("eax") XSAVE_COMPONENTS as u32,
+                    in("edx") (XSAVE_COMPONENTS >> 32) as u32,
+                    options(nostack)
+                );
+            } else {
+                core::arch::asm!("fxrstor64 [{}]", in(reg) area, options(nostack));
+            }
+        }
+    }
+}
+
+impl Default for FpuState {
+    /// The state a program starts with: all registers zero, every x87 and
+    /// SSE exception masked.
+    fn default() -> Self {
+        let mut area = [0; FPU_STATE_SIZE];
+        // FCW, and MXCSR which `xrstor` loads even for components it resets
+        area[0..2].copy_from_slice(&0x037Fu16.to_le_bytes());
+        area[24..28].copy_from_slice(&0x1F80u32.to_le_bytes());
+        Self(area)
+    }
+}
+
+impl core::fmt::Debug for FpuState {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.write_str("FpuState { .. }")
+    }
+}
+
+/// Runs `f` with the kernel page table loaded, restoring the caller's CR3
+/// afterwards.
+///
+/// Syscalls run on the user page table, which only maps the kernel image, heap
+/// and stacks. Anything that touches page tables or fresh frames through the
+/// physical memory mapping has to go through this.
+///
+/// # Safety
+/// `KERNEL_CR3` must be set (it is, once a user process was entered) and `f`
+/// must not keep pointers that are only valid under the kernel page table.
+pub unsafe fn with_kernel_page_table<R>(f: impl FnOnce() -> R) -> R {
+    let (current, flags) = Cr3::read();
+    let kernel = unsafe { KERNEL_CR3 };
+
+    if kernel == 0 || current.start_address().as_u64() == kernel {
+        return f();
+    }
+
+    let kernel_frame = PhysFrame::containing_address(PhysAddr::new(kernel));
+    unsafe { Cr3::write(kernel_frame, flags) };
+    let result = f();
+    unsafe { Cr3::write(current, flags) };
+    result
+}
+
 #[repr(align(16))]
 struct TransitionStack([u8; TRANSITION_STACK_SIZE]);
 
-static mut TRANSITION_STACK: TransitionStack = TransitionStack([0; TRANSITION_STACK_SIZE]);
+static mut TRANSITION_STACKS: [TransitionStack; MAX_CPUS] =
+    [const { TransitionStack([0; TRANSITION_STACK_SIZE]) }; MAX_CPUS];
 
 #[inline(always)]
 unsafe fn transition_stack_top() -> u64 {
-    let base = unsafe { core::ptr::addr_of!(TRANSITION_STACK.0) as *const u8 as u64 };
+    let base = unsafe { core::ptr::addr_of!(TRANSITION_STACKS[cpu_id()].0) as *const u8 as u64 };
     base + TRANSITION_STACK_SIZE as u64
 }
 
-/// Write bytes to user stack using physical frame alias (NO CR3 SWITCHING)
-unsafe fn push_bytes(
-    stack_frames: &[(u64, PhysFrame)],
-    sp: &mut u64,
-    bytes: &[u8],
-) -> u64 {
-    *sp -= bytes.len() as u64;
-
-    let mut remaining = bytes;
-    let mut cur = *sp;
+/// Bytes the strings, pointers and auxv of a new program may take on its
+/// stack, the rest of the stack is left to the program itself.
+pub const MAX_STACK_ARGS: usize = 4096 * (USER_STACK_PAGES - 2);
 
-    while !remaining.is_empty() {
-        let page_base = cur & !0xFFF;
-        let offset = (cur & 0xFFF) as usize;
+// auxiliary vector keys handed to a new program, as in the SysV ABI and
+// mirrored as NX_AT_* in nullex.h
 
-        let (_, frame) = stack_frames
-            .iter()
-            .find(|(addr, _)| *addr == page_base)
-            .expect("stack page not mapped");
+const AT_NULL: u64 = 0;
+const AT_PAGESZ: u64 = 6;
+const AT_ENTRY: u64 = 9;
 
-        let frame_ptr = unsafe { phys_to_virt(frame.start_address()).as_mut_ptr::<u8>() };
-
-        let to_copy = core::cmp::min(remaining.len(), 4096 - offset);
+/// Frames of a freshly mapped user stack, written through the physical
+/// memory mapping so the process's page table need not be loaded.
+struct StackPages {
+    bottom: u64,
+    frames: [PhysFrame; USER_STACK_PAGES],
+}
 
-        unsafe {
-            copy_nonoverlapping(
-                remaining.as_ptr(),
-                frame_ptr.add(offset),
-                to_copy,
-            );
+impl StackPages {
+    /// Copies `bytes` to user address `addr`, which must lie in the stack.
+    unsafe fn write(&self, mut addr: u64, mut bytes: &[u8]) {
+        while !bytes.is_empty() {
+            // the pages are contiguous, a page's frame is found by its index
+            let frame = self.frames[((addr - self.bottom) / 4096) as usize];
+            let offset = (addr & 0xFFF) as usize;
+            let to_copy = core::cmp::min(bytes.len(), 4096 - offset);
+            unsafe {
+                let frame_ptr = phys_to_virt(frame.start_address()).as_mut_ptr::<u8>();
+                copy_nonoverlapping(bytes.as_ptr(), frame_ptr.add(offset), to_copy);
+            }
+            bytes = &bytes[to_copy..];
+            addr += to_copy as u64;
         }
-
-        remaining = &remaining[to_copy..];
-        cur += to_copy as u64;
     }
 
-    *sp
-}
-
-/// Push a u64 using push_bytes
-unsafe fn push_u64(
-    stack_frames: &[(u64, PhysFrame)],
-    sp: &mut u64,
-    val: u64,
-) {
-    let bytes = val.to_le_bytes();
-    unsafe { push_bytes(stack_frames, sp, &bytes) };
+    unsafe fn write_u64(&self, addr: u64, val: u64) {
+        unsafe { self.write(addr, &val.to_le_bytes()) };
+    }
 }
 
-
+/// Maps the user stack of a new program and lays out its initial frame, the
+/// System V one `_start` expects: argc at the returned stack pointer, then
+/// the argv and envp pointers each ended by a null, then the auxv pairs up to
+/// `AT_NULL`. The strings they point to sit at the top of the stack.
+///
+/// Everything is written in one pass straight from `args` and `envs`.
 pub unsafe fn setup_user_stack(
     address_space: &mut AddressSpace,
     args: &[&str],
     envs: &[&str],
-) -> u64 {
+    entry: u64,
+) -> Result<u64, NullexError> {
+    let auxv = [(AT_PAGESZ, 4096), (AT_ENTRY, entry), (AT_NULL, 0)];
+    let strings: usize = args.iter().chain(envs).map(|s| s.len() + 1).sum();
+    let words = 1 + (args.len() + 1) + (envs.len() + 1) + 2 * auxv.len();
+    ensure!(strings + words * 8 + 16 <= MAX_STACK_ARGS, NullexError::ArgumentsTooLong);
+
     let mut fa_guard = ALLOCATOR_INFO.frame_allocator.lock();
-    let fa_ref = fa_guard.as_mut().unwrap();
+    let fa_ref = fa_guard.as_mut().ok_or(NullexError::FrameAllocatorNotInitialized)?;
     let fa: &mut BootInfoFrameAllocator = &mut **fa_ref;
 
     let table_ptr = unsafe { phys_to_virt(address_space.page_table.start_address()) };
@@ -118,74 +229,125 @@ pub unsafe fn setup_user_stack(
         | PageTableFlags::WRITABLE
         | PageTableFlags::NO_EXECUTE;
 
-    // Track mapped pages → frames
-    let mut stack_frames: Vec<(u64, PhysFrame)> = Vec::new();
-
-    for page in Page::range_inclusive(start_page, end_page) {
-        let frame = fa.allocate_frame().expect("out of frames for user stack");
-
-        unsafe {
-            mapper
-                .map_to(page, frame, flags, fa)
-                .expect("failed to map user stack")
-                .flush();
-        }
-
-        stack_frames.push((page.start_address().as_u64(), frame));
-    }
-
-    let mut sp = USER_STACK_TOP;
-
-    let mut arg_ptrs: Vec<u64> = Vec::with_capacity(args.len());
-    let mut env_ptrs: Vec<u64> = Vec::with_capacity(envs.len());
-
-    // Write env strings
-    for s in envs.iter().rev() {
-        let mut buf = s.as_bytes().to_vec();
-        buf.push(0);
-        let addr = unsafe { push_bytes(&stack_frames.as_slice(), &mut sp, &buf.as_slice()) };
-        env_ptrs.push(addr);
-    }
-
-    // Write arg strings
-    for s in args.iter().rev() {
-        let mut buf = s.as_bytes().to_vec();
-        buf.push(0);
-        let addr = unsafe { push_bytes(&stack_frames.as_slice(), &mut sp, &buf.as_slice()) };
-        arg_ptrs.push(addr);
+    let mut pages = StackPages {
+        bottom: stack_bottom.as_u64(),
+        frames: [PhysFrame::containing_address(PhysAddr::new(0)); USER_STACK_PAGES],
+    };
+    for (index, page) in Page::range_inclusive(start_page, end_page).enumerate() {
+        let frame = fa.allocate_frame().ok_or(NullexError::FrameAllocationFailed)?;
+        unsafe { mapper.map_to(page, frame, flags, fa)?.flush() };
+        pages.frames[index] = frame;
     }
-
-    // Align stack
-    sp &= !0xF;
-
-    // envp NULL
-    unsafe { push_u64(&stack_frames.as_slice(), &mut sp, 0) };
-
-    // envp pointers
-    for &ptr in env_ptrs.iter().rev() {
-        unsafe { push_u64(&stack_frames.as_slice(), &mut sp, ptr) };
-    }
-
-    // argv NULL
-    unsafe { push_u64(&stack_frames.as_slice(), &mut sp, 0) };
-
-    // argv pointers
-    for &ptr in arg_ptrs.iter().rev() {
-        unsafe { push_u64(&stack_frames.as_slice(), &mut sp, ptr) };
-    }
-
-    // argc
-    unsafe { push_u64(&stack_frames.as_slice(), &mut sp, args.len() as u64) };
-
     address_space.regions.push(MemoryRegion {
         range: FrameRange::new(stack_top.as_u64(), stack_bottom.as_u64()),
         region_type: MemoryRegionType::InUse,
     });
 
-    sp
+    let mut string_at = USER_STACK_TOP - strings as u64;
+    let sp = (string_at - words as u64 * 8) & !0xF;
+    let mut word_at = sp;
+
+    unsafe {
+        pages.write_u64(word_at, args.len() as u64);
+        word_at += 8;
+        for list in [args, envs] {
+            for s in list {
+                pages.write(string_at, s.as_bytes());
+                pages.write(string_at + s.len() as u64, &[0]);
+                pages.write_u64(word_at, string_at);
+                string_at += s.len() as u64 + 1;
+                word_at += 8;
+            }
+            // the null ending the list, the stack is not zeroed
+            pages.write_u64(word_at, 0);
+            word_at += 8;
+        }
+        for (key, value) in auxv {
+            pages.write_u64(word_at, key);
+            pages.write_u64(word_at + 8, value);
+            word_at += 16;
+        }
+    }
+
+    Ok(sp)
 }
 
 
+/// Loads every register from `ctx`, switches to the page table at `cr3` and
+/// `iretq`s into the process. `stack_top` is a kernel stack the iret frame is
+/// built on, it has to be mapped in both page tables.
+#[unsafe(naked)]
+unsafe extern "C" fn iret_to_user(ctx: *const UserContext, cr3: u64, stack_top: u64) -> ! {
+    core::arch::naked_asm!(
+        "mov rsp, rdx",
+
+        "push qword ptr [rdi + {ss}]",
+        "push qword ptr [rdi + {rsp}]",
+        "push qword ptr [rdi + {rflags}]",
+        "push qword ptr [rdi + {cs}]",
+        "push qword ptr [rdi + {rip}]",
+
+        "push qword ptr [rdi + {rax}]",
+        "push qword ptr [rdi + {rbx}]",
+        "push qword ptr [rdi + {rcx}]",
+        "push qword ptr [rdi + {rdx}]",
+        "push qword ptr [rdi + {rsi}]",
+        "push qword ptr [rdi + {rdi}]",
+        "push qword ptr [rdi + {rbp}]",
+        "push qword ptr [rdi + {r8}]",
+        "push qword ptr [rdi + {r9}]",
+        "push qword ptr [rdi + {r10}]",
+        "push qword ptr [rdi + {r11}]",
+        "push qword ptr [rdi + {r12}]",
+        "push qword ptr [rdi + {r13}]",
+        "push qword ptr [rdi + {r14}]",
+        "push qword ptr [rdi + {r15}]",
+
+        // ctx may not be mapped in the user table, nothing reads it past here
+        "mov cr3, rsi",
+
+        "pop r15",
+        "pop r14",
+        "pop r13",
+        "pop r12",
+        "pop r11",
+        "pop r10",
+        "pop r9",
+        "pop r8",
+        "pop rbp",
+        "pop rdi",
+        "pop rsi",
+        "pop rdx",
+        "pop rcx",
+        "pop rbx",
+        "pop rax",
+        "iretq",
+
+        ss = const core::mem::offset_of!(UserContext, ss),
+        rsp = const core::mem::offset_of!(UserContext, rsp),
+        rflags = const core::mem::offset_of!(UserContext, rflags),
+        cs = const core::mem::offset_of!(UserContext, cs),
+        rip = const core::mem::offset_of!(UserContext, rip),
+        rax = const core::mem::offset_of!(UserContext, rax),
+        rbx = const core::mem::offset_of!(UserContext, rbx),
+        rcx = const core::mem::offset_of!(UserContext, rcx),
+        rdx = const core::mem::offset_of!(UserContext, rdx),
+        rsi = const core::mem::offset_of!(UserContext, rsi),
+        rdi = const core::mem::offset_of!(UserContext, rdi),
+        rbp = const core::mem::offset_of!(UserContext, rbp),
+        r8 = const core::mem::offset_of!(UserContext, r8),
+        r9 = const core::mem::offset_of!(UserContext, r9),
+        r10 = const core::mem::offset_of!(UserContext, r10),
+        r11 = const core::mem::offset_of!(UserContext, r11),
+        r12 = const core::mem::offset_of!(UserContext, r12),
+        r13 = const core::mem::offset_of!(UserContext, r13),
+        r14 = const core::mem::offset_of!(UserContext, r14),
+        r15 = const core::mem::offset_of!(UserContext, r15),
+    )
+}
+
+/// Runs `process` from its saved context until it calls `halt`, which jumps
+/// back here through `KERNEL_RETURN_*`.
 pub unsafe fn enter_user_process(process: &Process) {
     let address_space = process
         .address_space
@@ -193,48 +355,107 @@ pub unsafe fn enter_user_process(process: &Process) {
         .expect("attempted to enter_user_process on a kernel process");
 
     let trampoline_sp = unsafe { transition_stack_top() };
+    let cpu = cpu_id();
 
     unsafe {
         KERNEL_CR3 = x86_64::registers::control::Cr3::read()
             .0.start_address().as_u64();
     }
 
-    serial_println!("[INFO] About to iretq: rip={:#x} rsp={:#x} cs={:#x} ss={:#x}",
-        process.context.rip,
-        process.context.rsp,
-        process.context.cs,
-        process.context.ss,
-    );
     unsafe {
+        process.context.fpu.restore();
         core::arch::asm!(
             "cli",
 
+            // the program gets every register, keep the callee saved ones
+            // that rust may not list as clobbers (rbp goes via KERNEL_RETURN_RBP)
+            "push rbx",
+            "push r12",
+            "push r13",
+            "push r14",
+            "push r15",
+
             "lea {ret_addr}, [rip + 2f]",
             "mov [{krsp}], rsp",
             "mov [{krbp}], rbp",
             "mov [{kret}], {ret_addr}",
-
-            "mov rsp, {tramp_sp}",
-            "push {ss}",
-            "push {user_rsp}",
-            "push {rflags}",
-            "push {cs}",
-            "push {rip}",
-            "mov cr3, {cr3}",
-            "iretq",
+            "jmp {iret}",
 
             "2:",
+            "pop r15",
+            "pop r14",
+            "pop r13",
+            "pop r12",
+            "pop rbx",
             ret_addr = out(reg) _,
-            krsp = in(reg) core::ptr::addr_of_mut!(KERNEL_RETURN_RSP),
-            krbp = in(reg) core::ptr::addr_of_mut!(KERNEL_RETURN_RBP),
-            kret = in(reg) core::ptr::addr_of_mut!(KERNEL_RETURN_ADDR),
-            tramp_sp = in(reg) trampoline_sp,
-            cr3 = in(reg) address_space.page_table.start_address().as_u64(),
-            user_rsp = in(reg) process.context.rsp,
-            ss = in(reg) crate::gdt::user_data_selector() as u64,
-            rflags = in(reg) process.context.rflags,
-            cs = in(reg) crate::gdt::user_code_selector() as u64,
-            rip = in(reg) process.context.rip,
+            krsp = in(reg) core::ptr::addr_of_mut!(KERNEL_RETURN_RSP[cpu]),
+            krbp = in(reg) core::ptr::addr_of_mut!(KERNEL_RETURN_RBP[cpu]),
+            kret = in(reg) core::ptr::addr_of_mut!(KERNEL_RETURN_ADDR[cpu]),
+            in("rdi") &process.context as *const UserContext,
+            in("rsi") address_space.page_table.start_address().as_u64(),
+            in("rdx") trampoline_sp,
+            iret = sym iret_to_user,
+            clobber_abi("C"),
         );
     }
-}
\ No newline at end of file
+}
+
+/// Starts `process` from its saved context without recording a new kernel
+/// return point, used by `run` to switch the caller to a new image. `halt`
+/// still returns to whoever entered the original image.
+///
+/// # Safety
+/// A user process must have been entered with `enter_user_process` before,
+/// and nothing on the current kernel stack may be needed anymore.
+pub unsafe fn resume_user_process(process: &Process) -> ! {
+    let address_space = process
+        .address_space
+        .as_ref()
+        .expect("attempted to resume_user_process on a kernel process");
+
+    let trampoline_sp = unsafe { transition_stack_top() };
+
+    unsafe {
+        process.context.fpu.restore();
+        iret_to_user(
+            &process.context,
+            address_space.page_table.start_address().as_u64(),
+            trampoline_sp
+        )
+    }
+}
+
+/// Leaves user mode for good from inside a syscall: back to the kernel page
+/// table and stack `enter_user_process` was called from, which then returns.
+///
+/// # Safety
+/// Only from a syscall of a process entered with `enter_user_process`.
+pub unsafe fn return_to_kernel() -> ! {
+    let cpu = cpu_id();
+    unsafe {
+        core::arch::asm!(
+            "mov cr3, {cr3}",
+            "mov rsp, [{krsp}]",
+            "mov rbp, [{krbp}]",
+            "jmp [{kret}]",
+            cr3  = in(reg) KERNEL_CR3,
+            krsp = in(reg) core::ptr::addr_of!(KERNEL_RETURN_RSP[cpu]),
+            krbp = in(reg) core::ptr::addr_of!(KERNEL_RETURN_RBP[cpu]),
+            kret = in(reg) core::ptr::addr_of!(KERNEL_RETURN_ADDR[cpu]),
+            options(noreturn)
+        );
+    }
+}
+
+/// Like `return_to_kernel`, but the program is only put aside: `process`
+/// resumes from `context` the next time it is entered. Its vector registers
+/// are saved with it, other processes run on this cpu meanwhile.
+///
+/// # Safety
+/// Same as `return_to_kernel`, `process` has to be the one running.
+pub unsafe fn park_user_process(process: &mut Process, context: UserContext) -> ! {
+    process.context = context;
+    unsafe { process.context.fpu.save() };
+    USER_PARKED[cpu_id()].store(true, Ordering::SeqCst);
+    unsafe { return_to_kernel() }
+}
@@ -0,0 +1,379 @@
+//!
+//! drivers/ahci.rs
+//!
+//! AHCI SATA driver.
+//!
+//! The q35 machine has no legacy IDE ports, its disks hang off an AHCI
+//! controller. Each disk is driven through its port's command list: a batch
+//! of requests becomes one command per slot, all of them issued with a single
+//! write to the port's command issue register, and the controller moves the
+//! data by DMA straight into the frames of the request. Completion is polled,
+//! the cpu only waits.
+//!
+
+use alloc::vec::Vec;
+use core::ptr::{read_volatile, write_bytes, write_volatile};
+
+use x86_64::{PhysAddr, VirtAddr};
+
+use crate::{
+	ensure,
+	error::NullexError,
+	fs::bcache::{BLOCK_SIZE, BlockDevice, BlockRequest, MAX_REQUEST_BLOCKS},
+	io::pci::{DriverInfo, PciDevice, pci_enable_mmio, register_driver},
+	memory::{dma_alloc, map_mmio},
+	serial_println,
+	utils::mutex::SpinMutex
+};
+
+const AHCI_CLASS: u8 = 0x01;
+const AHCI_SUBCLASS: u8 = 0x06;
+/// The HBA registers are behind BAR 5, the ABAR.
+const ABAR_INDEX: u8 = 5;
+/// Generic host control and all 32 ports.
+const ABAR_SIZE: usize = 0x1100;
+
+// generic host control registers
+const HBA_CAP: usize = 0x00;
+const HBA_GHC: usize = 0x04;
+const HBA_PI: usize = 0x0C;
+const GHC_AHCI_ENABLE: u32 = 1 << 31;
+const CAP_NCS_SHIFT: u32 = 8;
+const CAP_NCS_MASK: u32 = 0x1F;
+
+// port registers, port `n` at `PORT_BASE + n * PORT_SIZE`
+const PORT_BASE: usize = 0x100;
+const PORT_SIZE: usize = 0x80;
+const PX_CLB: usize = 0x00;
+const PX_CLBU: usize = 0x04;
+const PX_FB: usize = 0x08;
+const PX_FBU: usize = 0x0C;
+const PX_IS: usize = 0x10;
+const PX_IE: usize = 0x14;
+const PX_CMD: usize = 0x18;
+const PX_TFD: usize = 0x20;
+const PX_SIG: usize = 0x24;
+const PX_SSTS: usize = 0x28;
+const PX_SERR: usize = 0x30;
+const PX_CI: usize = 0x38;
+
+const CMD_START: u32 = 1 << 0;
+const CMD_FIS_RECEIVE: u32 = 1 << 4;
+const CMD_FIS_RUNNING: u32 = 1 << 14;
+const CMD_LIST_RUNNING: u32 = 1 << 15;
+const IS_TASK_FILE_ERROR: u32 = 1 << 30;
+const TFD_ERR: u32 = 1 << 0;
+const TFD_DRQ: u32 = 1 << 3;
+const TFD_BSY: u32 = 1 << 7;
+const SSTS_DET_MASK: u32 = 0xF;
+const SSTS_DET_PRESENT: u32 = 3;
+/// Signature of a plain SATA disk, not an ATAPI drive or a port multiplier.
+const SIG_ATA: u32 = 0x0000_0101;
+
+const FIS_TYPE_REG_H2D: u8 = 0x27;
+/// The FIS carries a command, not a device control update.
+const FIS_COMMAND: u8 = 0x80;
+const FIS_DWORDS: u32 = 5;
+const DEVICE_LBA: u8 = 1 << 6;
+
+const ATA_IDENTIFY: u8 = 0xEC;
+const ATA_READ_DMA_EXT: u8 = 0x25;
+const ATA_WRITE_DMA_EXT: u8 = 0x35;
+
+const SECTOR_SIZE: usize = 512;
+const SECTORS_PER_BLOCK: u64 = (BLOCK_SIZE / SECTOR_SIZE) as u64;
+
+const MAX_SLOTS: usize = 32;
+const COMMAND_HEADER_SIZE: usize = 32;
+const COMMAND_LIST_SIZE: usize = MAX_SLOTS * COMMAND_HEADER_SIZE;
+const RECEIVED_FIS_SIZE: usize = 256;
+/// The command FIS and ATAPI area, then the PRDT.
+const PRDT_OFFSET: usize = 0x80;
+const PRDT_ENTRY_SIZE: usize = 16;
+const COMMAND_TABLE_SIZE: usize = PRDT_OFFSET + MAX_REQUEST_BLOCKS * PRDT_ENTRY_SIZE;
+const HEADER_WRITE: u32 = 1 << 6;
+const HEADER_PRDTL_SHIFT: u32 = 16;
+
+/// Polls before a command or a port state change is given up on.
+const SPIN_TIMEOUT: usize = 10_000_000;
+
+/// Disks found by the probe, waiting to be taken by a filesystem.
+static AHCI_DISKS: SpinMutex<Vec<AhciDisk>> = SpinMutex::new(Vec::new());
+
+/// A SATA disk on one AHCI port.
+pub struct AhciDisk {
+	/// The port's registers.
+	port: VirtAddr,
+	/// Command headers, then the received FIS area.
+	command_list: VirtAddr,
+	command_list_phys: PhysAddr,
+	/// One command table per slot.
+	tables: VirtAddr,
+	tables_phys: PhysAddr,
+	slots: usize,
+	sectors: u64
+}
+
+impl AhciDisk {
+	/// Sets up the port at `port` with `slots` command slots and identifies
+	/// the disk on it.
+	///
+	/// # Safety
+	/// `port` has to map the registers of an implemented port.
+	unsafe fn new(port: VirtAddr, slots: usize) -> Result<Self, NullexError> {
+		let (command_list, command_list_phys) = dma_alloc(COMMAND_LIST_SIZE + RECEIVED_FIS_SIZE)?;
+		let (tables, tables_phys) = dma_alloc(slots * COMMAND_TABLE_SIZE)?;
+		let mut disk = Self {
+			port,
+			command_list,
+			command_list_phys,
+			tables,
+			tables_phys,
+			slots,
+			sectors: 0
+		};
+
+		unsafe {
+			disk.stop()?;
+			write_bytes(command_list.as_mut_ptr::<u8>(), 0, COMMAND_LIST_SIZE + RECEIVED_FIS_SIZE);
+			write_bytes(tables.as_mut_ptr::<u8>(), 0, slots * COMMAND_TABLE_SIZE);
+
+			let fis = command_list_phys.as_u64() + COMMAND_LIST_SIZE as u64;
+			disk.write(PX_CLB, command_list_phys.as_u64() as u32);
+			disk.write(PX_CLBU, (command_list_phys.as_u64() >> 32) as u32);
+			disk.write(PX_FB, fis as u32);
+			disk.write(PX_FBU, (fis >> 32) as u32);
+			// polled, nothing is left pending from before
+			disk.write(PX_IE, 0);
+			disk.write(PX_SERR, u32::MAX);
+			disk.write(PX_IS, u32::MAX);
+			disk.start()?;
+		}
+
+		let (identify, identify_phys) = dma_alloc(SECTOR_SIZE)?;
+		disk.issue(0, ATA_IDENTIFY, 0, 0, false, &[identify_phys], SECTOR_SIZE);
+		unsafe { disk.write(PX_CI, 1) };
+		disk.wait(1)?;
+
+		// words 100 to 103 are the LBA48 sector count, 60 and 61 the 28 bit one
+		let words = identify.as_ptr::<u16>();
+		let word = |n: usize| unsafe { read_volatile(words.add(n)) as u64 };
+		disk.sectors = word(100) | word(101) << 16 | word(102) << 32 | word(103) << 48;
+		if disk.sectors == 0 {
+			disk.sectors = word(60) | word(61) << 16;
+		}
+		ensure!(disk.sectors >= SECTORS_PER_BLOCK, NullexError::DeviceNotFound);
+		Ok(disk)
+	}
+
+	unsafe fn read(&self, reg: usize) -> u32 {
+		unsafe { read_volatile((self.port.as_u64() + reg as u64) as *const u32) }
+	}
+
+	unsafe fn write(&self, reg: usize, value: u32) {
+		unsafe { write_volatile((self.port.as_u64() + reg as u64) as *mut u32, value) };
+	}
+
+	/// Waits until the bits of `mask` in register `reg` are all clear.
+	fn wait_clear(&self, reg: usize, mask: u32) -> Result<(), NullexError> {
+		for _ in 0..SPIN_TIMEOUT {
+			if unsafe { self.read(reg) } & mask == 0 {
+				return Ok(());
+			}
+			core::hint::spin_loop();
+		}
+		Err(NullexError::AtaTimeout)
+	}
+
+	/// Stops the port from processing its command list.
+	unsafe fn stop(&mut self) -> Result<(), NullexError> {
+		unsafe {
+			self.write(PX_CMD, self.read(PX_CMD) & !CMD_START);
+			self.wait_clear(PX_CMD, CMD_LIST_RUNNING)?;
+			self.write(PX_CMD, self.read(PX_CMD) & !CMD_FIS_RECEIVE);
+		}
+		self.wait_clear(PX_CMD, CMD_FIS_RUNNING)
+	}
+
+	/// Starts the port once the device is idle.
+	unsafe fn start(&mut self) -> Result<(), NullexError> {
+		unsafe { self.write(PX_CMD, self.read(PX_CMD) | CMD_FIS_RECEIVE) };
+		self.wait_clear(PX_TFD, TFD_BSY | TFD_DRQ)?;
+		unsafe { self.write(PX_CMD, self.read(PX_CMD) | CMD_START) };
+		Ok(())
+	}
+
+	/// Fills slot `slot` with ATA command `command` for `sectors` sectors at
+	/// `lba`, moving `len` bytes per frame. Issued by setting its bit in
+	/// `PX_CI`.
+	fn issue(&mut self, slot: usize, command: u8, lba: u64, sectors: u16, write: bool, frames: &[PhysAddr], len: usize) {
+		let table = self.tables.as_u64() + (slot * COMMAND_TABLE_SIZE) as u64;
+		let table_phys = self.tables_phys.as_u64() + (slot * COMMAND_TABLE_SIZE) as u64;
+
+		let lba = lba.to_le_bytes();
+		let count = sectors.to_le_bytes();
+		let fis: [u8; 20] = [
+			FIS_TYPE_REG_H2D, FIS_COMMAND, command, 0,
+			lba[0], lba[1], lba[2], DEVICE_LBA,
+			lba[3], lba[4], lba[5], 0,
+			count[0], count[1], 0, 0,
+			0, 0, 0, 0
+		];
+
+		unsafe {
+			let cfis = table as *mut u32;
+			for (n, dword) in fis.chunks_exact(4).enumerate() {
+				write_volatile(cfis.add(n), u32::from_le_bytes(dword.try_into().unwrap()));
+			}
+
+			for (n, frame) in frames.iter().enumerate() {
+				let entry = (table as usize + PRDT_OFFSET + n * PRDT_ENTRY_SIZE) as *mut u32;
+				write_volatile(entry, frame.as_u64() as u32);
+				write_volatile(entry.add(1), (frame.as_u64() >> 32) as u32);
+				write_volatile(entry.add(2), 0);
+				// byte count minus one, no interrupt on completion
+				write_volatile(entry.add(3), len as u32 - 1);
+			}
+
+			let header = (self.command_list.as_u64() + (slot * COMMAND_HEADER_SIZE) as u64) as *mut u32;
+			let flags = if write { HEADER_WRITE } else { 0 };
+			write_volatile(header, FIS_DWORDS | flags | (frames.len() as u32) << HEADER_PRDTL_SHIFT);
+			// bytes transferred, updated by the controller
+			write_volatile(header.add(1), 0);
+			write_volatile(header.add(2), table_phys as u32);
+			write_volatile(header.add(3), (table_phys >> 32) as u32);
+		}
+	}
+
+	/// Waits for the slots in `issued` to complete.
+	fn wait(&mut self, issued: u32) -> Result<(), NullexError> {
+		for _ in 0..SPIN_TIMEOUT {
+			let status = unsafe { self.read(PX_IS) };
+			if status & IS_TASK_FILE_ERROR != 0 || unsafe { self.read(PX_TFD) } & TFD_ERR != 0 {
+				self.recover();
+				return Err(NullexError::AtaDriveError);
+			}
+			if unsafe { self.read(PX_CI) } & issued == 0 {
+				unsafe { self.write(PX_IS, status) };
+				return Ok(());
+			}
+			core::hint::spin_loop();
+		}
+		self.recover();
+		Err(NullexError::AtaTimeout)
+	}
+
+	/// Drops whatever the port was doing after an error, restarting it
+	/// clears the commands still issued.
+	fn recover(&mut self) {
+		unsafe {
+			let _ = self.stop();
+			self.write(PX_SERR, u32::MAX);
+			self.write(PX_IS, u32::MAX);
+			let _ = self.start();
+		}
+	}
+}
+
+impl BlockDevice for AhciDisk {
+	fn block_count(&self) -> u64 {
+		self.sectors / SECTORS_PER_BLOCK
+	}
+
+	fn submit(&mut self, requests: &[BlockRequest]) -> Result<(), NullexError> {
+		let block_count = self.block_count();
+		for request in requests {
+			ensure!(
+				(1..=MAX_REQUEST_BLOCKS).contains(&request.count)
+					&& request.block + request.count as u64 <= block_count,
+				NullexError::InvalidArgument
+			);
+		}
+
+		// as many in flight as there are slots, the controller runs them back
+		// to back
+		for batch in requests.chunks(self.slots) {
+			let mut issued = 0;
+			for (slot, request) in batch.iter().enumerate() {
+				let command = if request.write { ATA_WRITE_DMA_EXT } else { ATA_READ_DMA_EXT };
+				let sectors = request.count as u64 * SECTORS_PER_BLOCK;
+				self.issue(
+					slot,
+					command,
+					request.block * SECTORS_PER_BLOCK,
+					sectors as u16,
+					request.write,
+					&request.frames[..request.count],
+					BLOCK_SIZE
+				);
+				issued |= 1 << slot;
+			}
+			unsafe { self.write(PX_CI, issued) };
+			self.wait(issued)?;
+		}
+		Ok(())
+	}
+}
+
+/// Registers the AHCI driver with the PCI layer.
+pub fn ahci_driver_init() {
+	serial_println!("[AHCI] Registering driver");
+	register_driver(DriverInfo {
+		vendor: None,
+		device: None,
+		class: Some(AHCI_CLASS),
+		subclass: Some(AHCI_SUBCLASS),
+		probe: Some(ahci_probe)
+	});
+}
+
+/// Probes an AHCI controller and sets up every SATA disk on it.
+pub fn ahci_probe(dev: &mut PciDevice) -> Result<usize, NullexError> {
+	serial_println!("[AHCI] Probing controller {:?}", dev.bdf);
+
+	let abar = map_mmio(PhysAddr::new(pci_enable_mmio(dev, ABAR_INDEX)?), ABAR_SIZE)?;
+	let hba = |reg: usize| (abar.as_u64() + reg as u64) as *mut u32;
+
+	let (slots, implemented) = unsafe {
+		write_volatile(hba(HBA_GHC), read_volatile(hba(HBA_GHC)) | GHC_AHCI_ENABLE);
+		let cap = read_volatile(hba(HBA_CAP));
+		(((cap >> CAP_NCS_SHIFT) & CAP_NCS_MASK) as usize + 1, read_volatile(hba(HBA_PI)))
+	};
+
+	let mut disks = AHCI_DISKS.lock();
+	let before = disks.len();
+	for port in (0..MAX_SLOTS).filter(|port| implemented & (1 << port) != 0) {
+		let regs = abar + (PORT_BASE + port * PORT_SIZE) as u64;
+		let (ssts, sig) = unsafe {
+			(
+				read_volatile((regs.as_u64() + PX_SSTS as u64) as *const u32),
+				read_volatile((regs.as_u64() + PX_SIG as u64) as *const u32)
+			)
+		};
+		if ssts & SSTS_DET_MASK != SSTS_DET_PRESENT || sig != SIG_ATA {
+			continue;
+		}
+
+		match unsafe { AhciDisk::new(regs, slots) } {
+			Ok(disk) => {
+				serial_println!(
+					"[AHCI] Port {}: {} MiB disk, {} command slots",
+					port,
+					disk.sectors * SECTOR_SIZE as u64 >> 20,
+					slots
+				);
+				disks.push(disk);
+			}
+			Err(e) => serial_println!("[AHCI] Port {}: {}", port, e)
+		}
+	}
+
+	ensure!(disks.len() > before, NullexError::DeviceNotFound);
+	Ok(before)
+}
+
+/// Takes the first disk found, for a filesystem to own.
+pub fn take_disk() -> Option<AhciDisk> {
+	let mut disks = AHCI_DISKS.lock();
+	(!disks.is_empty()).then(|| disks.remove(0))
+}
@@ -4,6 +4,7 @@
 //! Driver module declaration.
 //! 
 
+pub mod ahci;
 pub mod keyboard;
 #[allow(unused)]
 pub mod virtio;
@@ -27,10 +27,25 @@ pub const VIRTIO_IO_DEVICE_STATUS: usize = 0x12;
 /// The virtio device interrupt service routine port.
 pub const VIRTIO_IO_ISR: usize = 0x13;
 const VIRTIO_IO_DEVICE_CFG: usize = 0x14; // start of config space
+// with MSI-X enabled two vector registers come first and the config moves
+const VIRTIO_IO_MSI_CONFIG_VECTOR: usize = 0x14;
+const VIRTIO_IO_MSI_QUEUE_VECTOR: usize = 0x16;
+const VIRTIO_IO_DEVICE_CFG_MSIX: usize = 0x18;
+/// Vector register value for no interrupt at all.
+const VIRTIO_MSI_NO_VECTOR: u16 = 0xFFFF;
 
 const VIRTQ_DESC_F_NEXT: u16 = 1;
 const VIRTQ_DESC_F_WRITE: u16 = 2;
 
+/// Driver asks the device not to interrupt on used buffers.
+const VIRTQ_AVAIL_F_NO_INTERRUPT: u16 = 1;
+/// Device asks the driver not to notify it of available buffers.
+const VIRTQ_USED_F_NO_NOTIFY: u16 = 1;
+
+/// `used_event` and `avail_event` replace the ring flags for notification
+/// suppression.
+pub const VIRTIO_RING_F_EVENT_IDX: u64 = 1 << 29;
+
 bitflags! {
 	/// A simple low-level indication of the completed steps in the device
 	/// initialisation.<br>
@@ -167,7 +182,12 @@ pub struct VirtQueue {
 	/// Index identifying this VirtQueue for the device
 	pub queue_index: u16,
 	/// I/O base address for device communication
-	pub io_base: u16
+	pub io_base: u16,
+
+	/// If `VIRTIO_RING_F_EVENT_IDX` was negotiated.
+	pub event_idx: bool,
+	/// Available index the device was last told about, see `notify`.
+	pub notified_idx: u16
 }
 
 unsafe impl Send for VirtQueue {}
@@ -175,7 +195,7 @@ unsafe impl Sync for VirtQueue {}
 
 impl VirtQueue {
 	/// Creates an empty `VirtQueue` with no values inside.
-	pub fn empty() -> VirtQueue {
+	pub const fn empty() -> VirtQueue {
 		VirtQueue {
 			size: 0,
 			desc: null_mut(),
@@ -187,7 +207,9 @@ impl VirtQueue {
 			phys_addr: PhysAddr::zero(),
 			virt_addr: VirtAddr::zero(),
 			queue_index: 0,
-			io_base: 0
+			io_base: 0,
+			event_idx: false,
+			notified_idx: 0
 		}
 	}
 
@@ -229,6 +251,44 @@ impl VirtQueue {
 		Ok(idx)
 	}
 
+	/// Adds `buffers` as one chain of descriptors and returns its head, each
+	/// buffer is its address, length and if the device writes it.
+	fn add_chain(&mut self, buffers: &[(PhysAddr, u32, bool)]) -> Result<u16, NullexError> {
+		ensure!(!buffers.is_empty() && self.num_free as usize >= buffers.len(), NullexError::VirtQueueFull);
+
+		let mut head = 0;
+		let mut prev: Option<u16> = None;
+		for &(phys_addr, len, device_writes) in buffers {
+			let idx = self.add_descriptor(phys_addr, len, device_writes)?;
+			match prev {
+				Some(prev) => unsafe {
+					let desc = &mut *self.desc.add(prev as usize);
+					desc.flags |= VIRTQ_DESC_F_NEXT;
+					desc.next = idx;
+				},
+				None => head = idx
+			}
+			prev = Some(idx);
+		}
+		Ok(head)
+	}
+
+	/// Frees the chain starting at `head`.
+	fn free_chain(&mut self, head: u16) {
+		let mut idx = head;
+		loop {
+			let (flags, next) = unsafe {
+				let desc = &*self.desc.add(idx as usize);
+				(desc.flags, desc.next)
+			};
+			self.free_descriptor(idx);
+			if flags & VIRTQ_DESC_F_NEXT == 0 {
+				break;
+			}
+			idx = next;
+		}
+	}
+
 	fn free_descriptor(&mut self, desc_idx: u16) {
 		unsafe {
 			let desc = &mut *self.desc.add(desc_idx as usize);
@@ -250,6 +310,86 @@ impl VirtQueue {
 		avail.idx = avail.idx.wrapping_add(1);
 	}
 
+	/// `used_event`, after the available ring: the device interrupts once the
+	/// used index goes past it.
+	fn used_event(&self) -> *mut u16 {
+		unsafe {
+			(self.avail as *mut u8)
+				.add(core::mem::size_of::<VirtqueueAvailable>() + self.size as usize * 2) as *mut u16
+		}
+	}
+
+	/// `avail_event`, after the used ring: the device wants a notification
+	/// once the available index goes past it.
+	fn avail_event(&self) -> *const u16 {
+		unsafe {
+			(self.used as *const u8).add(
+				core::mem::size_of::<VirtqueueUsed>() + self.size as usize * core::mem::size_of::<VirtqueueUsedElement>()
+			) as *const u16
+		}
+	}
+
+	/// Tells the device about every buffer made available since the last
+	/// call, if it asked to be told. Any number of `push_avail`s share one
+	/// doorbell write this way.
+	fn notify(&mut self) {
+		// the ring updates have to be visible before the device's wishes
+		// are read
+		fence(Ordering::SeqCst);
+		let new = unsafe { core::ptr::read_volatile(&(*self.avail).idx) };
+		let old = self.notified_idx;
+		if new == old {
+			return;
+		}
+		self.notified_idx = new;
+
+		let wanted = if self.event_idx {
+			let event = unsafe { core::ptr::read_volatile(self.avail_event()) };
+			need_event(event, new, old)
+		} else {
+			unsafe { core::ptr::read_volatile(&(*self.used).flags) & VIRTQ_USED_F_NO_NOTIFY == 0 }
+		};
+		if wanted {
+			self.kick();
+		}
+	}
+
+	/// Asks the device not to interrupt for used buffers, while they are
+	/// being polled anyway.
+	fn disable_interrupts(&mut self) {
+		unsafe {
+			if self.event_idx {
+				// half the index space away, the device will not get there
+				// before interrupts are enabled again
+				core::ptr::write_volatile(self.used_event(), self.last_used.wrapping_add(0x8000));
+			} else {
+				let flags = &raw mut (*self.avail).flags;
+				core::ptr::write_volatile(flags, core::ptr::read_volatile(flags) | VIRTQ_AVAIL_F_NO_INTERRUPT);
+			}
+		}
+	}
+
+	/// Asks for an interrupt at the next used buffer again. Returns if some
+	/// arrived meanwhile, those raise none and have to be polled.
+	fn enable_interrupts(&mut self) -> bool {
+		unsafe {
+			if self.event_idx {
+				core::ptr::write_volatile(self.used_event(), self.last_used);
+			} else {
+				let flags = &raw mut (*self.avail).flags;
+				core::ptr::write_volatile(flags, core::ptr::read_volatile(flags) & !VIRTQ_AVAIL_F_NO_INTERRUPT);
+			}
+		}
+		fence(Ordering::SeqCst);
+		self.has_used()
+	}
+
+	/// If the device has used buffers `pop_used` did not take yet.
+	fn has_used(&self) -> bool {
+		fence(Ordering::Acquire);
+		unsafe { core::ptr::read_volatile(&(*self.used).idx) != self.last_used }
+	}
+
 	fn kick(&self) {
 		unsafe {
 			outw(
@@ -283,17 +423,31 @@ impl VirtQueue {
 	}
 }
 
-fn virtqueue_size(qsize: usize) -> Result<usize, NullexError> {
-	let desc_size = qsize * core::mem::size_of::<VirtqueueDescriptor>();
-	let avail_size =
-		core::mem::size_of::<VirtqueueAvailable>() + qsize * core::mem::size_of::<u16>();
+/// If a notification is due for index `new`, moved on from `old`, when the
+/// other side asked for one once it passes `event`.
+fn need_event(event: u16, new: u16, old: u16) -> bool {
+	new.wrapping_sub(event).wrapping_sub(1) < new.wrapping_sub(old)
+}
 
-	let used_size = core::mem::size_of::<VirtqueueUsed>()
-		+ qsize * core::mem::size_of::<VirtqueueUsedElement>();
+/// Offset of the used ring in a legacy virtqueue of `qsize` entries. The
+/// available ring always ends in `used_event`, negotiated or not.
+fn used_ring_offset(qsize: usize) -> Result<usize, NullexError> {
+	let desc_size = qsize * core::mem::size_of::<VirtqueueDescriptor>();
+	let avail_size = core::mem::size_of::<VirtqueueAvailable>()
+		+ (qsize + 1) * core::mem::size_of::<u16>();
 
 	let used_offset = align_up((desc_size + avail_size).try_into()
 		.map_err(|_| NullexError::Io("Queue offset overflow"))?, 4096);
-	(used_offset as u64 + used_size as u64).try_into()
+	used_offset.try_into().map_err(|_| NullexError::Io("Queue offset overflow"))
+}
+
+fn virtqueue_size(qsize: usize) -> Result<usize, NullexError> {
+	// the used ring ends in `avail_event`
+	let used_size = core::mem::size_of::<VirtqueueUsed>()
+		+ qsize * core::mem::size_of::<VirtqueueUsedElement>()
+		+ core::mem::size_of::<u16>();
+
+	(used_ring_offset(qsize)? as u64 + used_size as u64).try_into()
 		.map_err(|_| NullexError::Io("Queue memory overflow"))
 }
 
@@ -318,3 +472,26 @@ pub trait VirtioDevice {
 	/// Initialise the VirtIO device.
 	fn init(&mut self) -> Result<(), NullexError>;
 }
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use crate::{
+		drivers::virtio::{need_event, used_ring_offset, virtqueue_size},
+		utils::ktest::TestError
+	};
+
+	pub fn test_virtqueue_event_index() -> Result<(), TestError> {
+		// asked for index 5: due when moving 4 -> 6, not 6 -> 8
+		assert!(need_event(5, 6, 4));
+		assert!(!need_event(5, 8, 6));
+		// across the wrap of the 16 bit index
+		assert!(need_event(0xFFFF, 1, 0xFFFE));
+		assert!(!need_event(2, 1, 0xFFFE));
+
+		// 256 entries: 4 KiB of descriptors, the rings start on the next pages
+		assert_eq!(used_ring_offset(256).unwrap(), 8192);
+		assert_eq!(virtqueue_size(256).unwrap(), 8192 + 4 + 256 * 8 + 2);
+		Ok(())
+	}
+	crate::create_test!(test_virtqueue_event_index);
+}
@@ -6,32 +6,41 @@
 
 use alloc::vec::Vec;
 use smoltcp::phy::{Device, DeviceCapabilities, Medium, RxToken, TxToken};
-use core::{intrinsics::copy_nonoverlapping, ptr::write_bytes};
+use core::{
+	ptr::write_bytes,
+	sync::atomic::{AtomicUsize, Ordering}
+};
 
-use x86_64::{align_up, structures::idt::InterruptStackFrame};
+use x86_64::structures::idt::InterruptStackFrame;
 
 use crate::{
-	apic::send_eoi, common::ports::{inb, inw, outl, outw}, drivers::virtio::{
+	apic::{lapic_id, send_eoi}, arch::x86_64::user::with_kernel_page_table, common::ports::{inb, inw, outl, outw}, drivers::virtio::{
 		VIRTIO_IO_DEVICE_CFG,
+		VIRTIO_IO_DEVICE_CFG_MSIX,
 		VIRTIO_IO_DEVICE_FEATURES,
 		VIRTIO_IO_DEVICE_STATUS,
 		VIRTIO_IO_DRIVER_FEATURES,
 		VIRTIO_IO_ISR,
+		VIRTIO_IO_MSI_CONFIG_VECTOR,
+		VIRTIO_IO_MSI_QUEUE_VECTOR,
 		VIRTIO_IO_QUEUE_ADDR,
 		VIRTIO_IO_QUEUE_SELECT,
 		VIRTIO_IO_QUEUE_SIZE,
+		VIRTIO_MSI_NO_VECTOR,
+		VIRTIO_RING_F_EVENT_IDX,
 		VirtIODeviceStatus,
 		VirtQueue,
 		VirtioDevice,
 		VirtqueueAvailable,
 		VirtqueueDescriptor,
 		VirtqueueUsed,
+		used_ring_offset,
 		virtqueue_size
-	}, error::NullexError, gsi::GSI_TABLE, io::{
+	}, ensure, error::NullexError, gsi::GSI_TABLE, interrupts::allocate_and_register_vector, io::{
 		io_read,
 		io_write,
-		pci::{DriverInfo, PciDevice, VIRTIO_PCI_VENDOR_ID, pci_enable_device, register_driver}
-	}, lazy_static, memory::{DmaBuffer, dma_alloc}, net::receive_packet, serial_println, utils::{
+		pci::{DriverInfo, MsixTable, PciDevice, VIRTIO_PCI_VENDOR_ID, pci_enable_device, pci_enable_msix, register_driver}
+	}, lazy_static, memory::{DmaBuffer, dma_alloc}, net::receive_packet, serial_println, smp::{self, MAX_CPUS, cpu_id}, utils::{
 		endian::{Le16, Le32},
 		mutex::SpinMutex,
 		types::{BYTE, QWORD}
@@ -41,20 +50,45 @@ use crate::{
 lazy_static! {
 	/// Static reference to the VirtioNet Device.
 	pub static ref VIRTIO_NET_DEVICE: SpinMutex<Option<VirtioNetDevice>> = SpinMutex::new(None);
-	/// Static reference to the RX Queue
-	pub static ref RX_QUEUE: SpinMutex<VirtQueue> = SpinMutex::new(VirtQueue::empty());
-	/// Static reference to the TX Queue
-	pub static ref TX_QUEUE: SpinMutex<VirtQueue> = SpinMutex::new(VirtQueue::empty());
-	/// Static reference to the RX Buffers
-	pub static ref RX_BUFFERS: SpinMutex<Vec<Option<DmaBuffer>>> =
-		SpinMutex::new(Vec::with_capacity(256));
 	/// Static reference to the VirtIO net instance.
 	pub static ref VIRTIO_NET_INSTANCE: SpinMutex<Option<(VirtioNet, usize)>> =
 		SpinMutex::new(None);
-	/// Static reference to the TX Inflight.
-	pub static ref TX_INFLIGHT: SpinMutex<Vec<Option<DmaBuffer>>> = SpinMutex::new(Vec::new());
 }
 
+/// Most queue pairs driven, one for each cpu.
+pub const MAX_QUEUE_PAIRS: usize = MAX_CPUS;
+
+/// A receive and a transmit queue with the buffers the device holds in them.
+/// Pair `i` is the virtqueues `2i` and `2i + 1` and interrupts cpu `i`.
+pub struct QueuePair {
+	rx: SpinMutex<VirtQueue>,
+	tx: SpinMutex<VirtQueue>,
+	/// Receive buffers by descriptor, taken out while a frame is read.
+	rx_buffers: SpinMutex<Vec<Option<DmaBuffer>>>,
+	/// Transmit buffers by descriptor until the device sent them.
+	tx_inflight: SpinMutex<Vec<Option<DmaBuffer>>>,
+	/// Transmit buffers the device is done with, reused before allocating.
+	tx_free: SpinMutex<Vec<DmaBuffer>>
+}
+
+impl QueuePair {
+	const fn new() -> Self {
+		Self {
+			rx: SpinMutex::new(VirtQueue::empty()),
+			tx: SpinMutex::new(VirtQueue::empty()),
+			rx_buffers: SpinMutex::new(Vec::new()),
+			tx_inflight: SpinMutex::new(Vec::new()),
+			tx_free: SpinMutex::new(Vec::new())
+		}
+	}
+}
+
+static QUEUE_PAIRS: [QueuePair; MAX_QUEUE_PAIRS] = [const { QueuePair::new() }; MAX_QUEUE_PAIRS];
+/// Pairs set up at probe time, frames can arrive on any of them.
+static QUEUE_PAIR_COUNT: AtomicUsize = AtomicUsize::new(0);
+/// Pairs the device steers flows to and transmits are spread over.
+static ACTIVE_PAIRS: AtomicUsize = AtomicUsize::new(1);
+
 /// Structure to store device-specific data for interrupt handler
 pub struct VirtioNetDevice {
 	/// Base IO address
@@ -69,11 +103,29 @@ pub struct VirtioNetDevice {
 const VIRTIO_DEVICE_ID: u8 = 1;
 const VIRTIO_NET_IDT_VECTOR: u8 = 34;
 
-const NET_DRIVER_SUPPORTED_FEATURES: u64 = VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS;
+const NET_DRIVER_SUPPORTED_FEATURES: u64 =
+	VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS | VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ | VIRTIO_RING_F_EVENT_IDX;
+/// Features that need a vector for each queue pair.
+const NET_MSIX_FEATURES: u64 = VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ;
 
+/// Receive buffers shared out over the pairs, each pair gets at least
+/// `MIN_RX_BUFFERS_PER_PAIR`.
 const VIRTIO_NET_RX_BUFFERS: u64 = 256;
+const MIN_RX_BUFFERS_PER_PAIR: usize = 64;
 
-// other virtqueues like (2n+1) arent implemented
+/// Used buffers `poll_pair` takes in one pass before checking again.
+const NAPI_BUDGET: usize = 64;
+
+// control queue commands
+const VIRTIO_NET_CTRL_MQ: u8 = 4;
+const VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET: u8 = 0;
+const VIRTIO_NET_OK: u8 = 0;
+/// Polls of the used ring before a control command is given up on. Runs
+/// with interrupts off, so the timer cannot bound it.
+const CTRL_SPIN_LIMIT: usize = 10_000_000;
+
+/// Size of one transmit buffer, the header and a whole frame fit in it.
+const TX_BUFFER_SIZE: usize = 4096;
 
 // Feature bits
 /// Device handles packets with partial checksum.
@@ -264,7 +316,17 @@ pub struct VirtioNet {
 	/// The transmit queue for the device.
 	pub tx_queue: Option<VirtQueue>,
 	/// The control queue for the device.
-	pub ctrl_queue: Option<VirtQueue>
+	pub ctrl_queue: Option<VirtQueue>,
+	/// Queue pairs set up, see `QUEUE_PAIRS`.
+	pub queue_pairs: usize,
+	/// MSI-X table of the device, entry `i` serves pair `i`.
+	pub msix: Option<MsixTable>,
+	/// Interrupt vector of each queue pair when MSI-X is on.
+	pub queue_vectors: Vec<u8>,
+	/// Where the device configuration starts in the I/O space.
+	pub config_offset: usize,
+	/// Command, argument and ack of the control command in flight.
+	ctrl_buffer: Option<DmaBuffer>
 }
 
 impl VirtioNet {
@@ -285,8 +347,112 @@ impl VirtioNet {
 			negotiated_features: nf,
 			rx_queue: rx,
 			tx_queue: tx,
-			ctrl_queue: ctrl
+			ctrl_queue: ctrl,
+			queue_pairs: 1,
+			msix: None,
+			queue_vectors: Vec::new(),
+			config_offset: VIRTIO_IO_DEVICE_CFG,
+			ctrl_buffer: None
+		}
+	}
+
+	/// Has the device raise `vector` for virtqueue `qidx`, `VIRTIO_MSI_NO_VECTOR`
+	/// for none.
+	fn set_queue_vector(&self, qidx: u16, vector: u16) -> Result<(), NullexError> {
+		let io_base = self.io_base as u16;
+		let set = unsafe {
+			outw(io_base + VIRTIO_IO_QUEUE_SELECT as u16, qidx);
+			outw(io_base + VIRTIO_IO_MSI_QUEUE_VECTOR as u16, vector);
+			inw(io_base + VIRTIO_IO_MSI_QUEUE_VECTOR as u16)
+		};
+		// the device answers NO_VECTOR if it could not take it
+		ensure!(set == vector, NullexError::Io("Device refused MSI-X vector"));
+		Ok(())
+	}
+
+	/// Sets up pair `pair`: receive buffers for the device and, with MSI-X,
+	/// the pair's vector on its receive queue. Transmit completions raise no
+	/// interrupt, they are collected whenever a transmit needs a buffer.
+	fn init_pair(&mut self, pair: usize) -> Result<(), NullexError> {
+		let mut rx_vq = self.alloc_virtqueue(2 * pair as u16)?;
+		let mut tx_vq = self.alloc_virtqueue(2 * pair as u16 + 1)?;
+		if let Some(&vector) = self.queue_vectors.get(pair) {
+			self.set_queue_vector(rx_vq.queue_index, pair as u16)?;
+			self.set_queue_vector(tx_vq.queue_index, VIRTIO_MSI_NO_VECTOR)?;
+			serial_println!("[VIRTIO-NET] Pair {} interrupts on vector {}", pair, vector);
+		}
+		tx_vq.disable_interrupts();
+
+		let rx_queue_size = rx_vq.size as usize;
+		let buffers = (VIRTIO_NET_RX_BUFFERS as usize / self.queue_pairs)
+			.max(MIN_RX_BUFFERS_PER_PAIR)
+			.min(rx_queue_size);
+		serial_println!("[VIRTIO-NET] Pair {}: RX queue size {}, {} buffers", pair, rx_queue_size, buffers);
+
+		let queues = &QUEUE_PAIRS[pair];
+		{
+			let mut rx_buffers = queues.rx_buffers.lock();
+			rx_buffers.clear();
+			rx_buffers.resize_with(rx_queue_size, || None);
+		}
+
+		for _ in 0..buffers {
+			let buf_size = 1500 + core::mem::size_of::<VirtioNetHeader>();
+			let (virt_addr, phys_addr) = dma_alloc(buf_size)?;
+			unsafe { write_bytes(virt_addr.as_mut_ptr::<u8>(), 0, buf_size) }
+
+			let desc_id = rx_vq.add_descriptor(phys_addr, buf_size as u32, true)?;
+			queues.rx_buffers.lock()[desc_id as usize] = Some(DmaBuffer {
+				phys: phys_addr,
+				virt: virt_addr,
+				len: buf_size
+			});
+			rx_vq.push_avail(desc_id);
 		}
+
+		// the device is told about them after DRIVER_OK
+		*queues.rx.lock() = rx_vq;
+		*queues.tx.lock() = tx_vq;
+		Ok(())
+	}
+
+	/// Has the device steer flows over the first `pairs` queue pairs.
+	fn set_queue_pairs(&mut self, pairs: u16) -> Result<(), NullexError> {
+		let buffer = self.ctrl_buffer.ok_or(NullexError::VirtQueueUnavailable)?;
+		let ctrl = self.ctrl_queue.as_mut().ok_or(NullexError::VirtQueueUnavailable)?;
+
+		let bytes = buffer.virt.as_mut_ptr::<u8>();
+		unsafe {
+			bytes.write(VIRTIO_NET_CTRL_MQ);
+			bytes.add(1).write(VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET);
+			(bytes.add(2) as *mut u16).write_unaligned(pairs.to_le());
+			core::ptr::write_volatile(bytes.add(4), !VIRTIO_NET_OK);
+		}
+
+		// header, argument and the ack the device writes back
+		let head = ctrl.add_chain(&[
+			(buffer.phys, 2, false),
+			(buffer.phys + 2u64, 2, false),
+			(buffer.phys + 4u64, 1, true)
+		])?;
+		ctrl.push_avail(head);
+		ctrl.kick();
+
+		let mut done = false;
+		for _ in 0..CTRL_SPIN_LIMIT {
+			if let Some((desc_id, _)) = ctrl.pop_used() {
+				done = desc_id == head;
+				break;
+			}
+			core::hint::spin_loop();
+		}
+		// still the device's if it never answered
+		ensure!(done, NullexError::Io("Control command timed out"));
+		ctrl.free_chain(head);
+
+		let ack = unsafe { core::ptr::read_volatile(bytes.add(4)) };
+		ensure!(ack == VIRTIO_NET_OK, NullexError::Io("Device rejected control command"));
+		Ok(())
 	}
 }
 
@@ -318,25 +484,16 @@ impl VirtioDevice for VirtioNet {
 					.as_mut_ptr::<u8>()
 					.add(core::mem::size_of::<VirtqueueDescriptor>() * size as usize))
 					as *mut VirtqueueAvailable,
-				used: (virt_addr.as_mut_ptr::<u8>().add(
-					align_up(
-						(core::mem::size_of::<VirtqueueDescriptor>() * size as usize
-							+ core::mem::size_of::<VirtqueueAvailable>()
-							+ size as usize * 2)
-							.try_into()
-							.unwrap(),
-						4096
-					)
-					.try_into()
-					.unwrap()
-				)) as *mut VirtqueueUsed,
+				used: (virt_addr.as_mut_ptr::<u8>().add(used_ring_offset(size as usize)?)) as *mut VirtqueueUsed,
 				free_head: 0,
 				last_used: 0,
 				num_free: size,
 				phys_addr,
 				virt_addr,
 				queue_index: qidx,
-				io_base: self.io_base as u16
+				io_base: self.io_base as u16,
+				event_idx: self.negotiated_features & VIRTIO_RING_F_EVENT_IDX != 0,
+				notified_idx: 0
 			};
 			vq.init_free_list();
 			Ok(vq)
@@ -394,76 +551,106 @@ impl VirtioDevice for VirtioNet {
 		let want = supported & NET_DRIVER_SUPPORTED_FEATURES;
 		self.set_driver_features(want);
 
-		let mut rx_vq = self.alloc_virtqueue(0)?;
-		let rx_queue_size = rx_vq.size as usize;
-
-		serial_println!("[VIRTIO-NET] RX queue size: {}", rx_queue_size);
-
-		{
-			let mut rx_buffers = RX_BUFFERS.lock();
-			rx_buffers.clear();
-			rx_buffers.resize_with(rx_queue_size, || None);
+		for pair in 0..self.queue_pairs {
+			self.init_pair(pair)?;
 		}
+		QUEUE_PAIR_COUNT.store(self.queue_pairs, Ordering::Release);
 
-		for _ in 0..rx_queue_size {
-			let buf_size = 1500 + core::mem::size_of::<VirtioNetHeader>();
-			let (virt_addr, phys_addr) = dma_alloc(buf_size).expect("DMA alloc failed");
-			unsafe { write_bytes(virt_addr.as_mut_ptr::<u8>(), 0, buf_size) }
-
-			let desc_id = rx_vq.add_descriptor(phys_addr, buf_size as u32, true)?;
-			{
-				let mut rx_buffers = RX_BUFFERS.lock();
-				if desc_id as usize >= rx_buffers.len() {
-					rx_buffers.resize_with(desc_id as usize + 1, || None);
-				}
-				rx_buffers[desc_id as usize] = Some(DmaBuffer {
-					phys: phys_addr,
-					virt: virt_addr,
-					len: buf_size
-				});
+		if want & VIRTIO_NET_F_CTRL_VQ != 0 {
+			let mut ctrl_vq = self.alloc_virtqueue(2 * self.queue_pairs as u16)?;
+			if self.msix.is_some() {
+				self.set_queue_vector(ctrl_vq.queue_index, VIRTIO_MSI_NO_VECTOR)?;
 			}
+			// commands are waited on by polling
+			ctrl_vq.disable_interrupts();
+			self.ctrl_queue = Some(ctrl_vq);
 
-			rx_vq.push_avail(desc_id as u16);
+			let (virt, phys) = dma_alloc(8)?;
+			self.ctrl_buffer = Some(DmaBuffer { phys, virt, len: 8 });
 		}
 
 		serial_println!(
-			"[VIRTIO-NET] RX queue prepared with {} buffers (kick deferred)",
-			rx_queue_size
+			"[VIRTIO-NET] Device initialized with {} queue pairs (DRIVER_OK not set yet)",
+			self.queue_pairs
 		);
-		*RX_QUEUE.lock() = rx_vq;
+		Ok(())
+	}
+}
 
-		let tx_vq = self.alloc_virtqueue(1)?;
-		*TX_QUEUE.lock() = tx_vq;
+/// A received frame, read in place from the DMA buffer the device wrote it
+/// to. The buffer goes back to the device once the token is dropped.
+pub struct VirtioRxPacket {
+	pair: usize,
+	desc_id: u16,
+	buffer: DmaBuffer,
+	len: usize
+}
+/// Room for one frame on the transmit queue of `pair`.
+pub struct VirtioTxPacket {
+	pair: usize
+}
 
-		serial_println!("[VIRTIO-NET] Device initialized (queues ready, DRIVER_OK not set yet)");
-		Ok(())
+impl VirtioRxPacket {
+	/// Takes the buffer of the used descriptor `desc_id` of `pair` until the
+	/// token is dropped.
+	fn take(pair: usize, desc_id: u16, len: u32) -> Option<Self> {
+		let hdr_len = size_of::<VirtioNetHeader>();
+		let buffer = QUEUE_PAIRS[pair].rx_buffers.lock().get_mut(desc_id as usize).and_then(Option::take);
+		let Some(buffer) = buffer else {
+			serial_println!("[VIRTIO-NET] ERROR: No buffer at desc_id {} of pair {}", desc_id, pair);
+			return None;
+		};
+		let len = (len as usize).min(buffer.len).saturating_sub(hdr_len);
+		Some(Self { pair, desc_id, buffer, len })
+	}
+
+	/// The frame, without the virtio header in front of it.
+	fn frame(&self) -> &[u8] {
+		unsafe {
+			core::slice::from_raw_parts(
+				self.buffer.virt.as_ptr::<u8>().add(size_of::<VirtioNetHeader>()),
+				self.len
+			)
+		}
 	}
 }
 
-pub struct VirtioRxPacket(Vec<u8>);
-pub struct VirtioTxPacket;
+impl Drop for VirtioRxPacket {
+	fn drop(&mut self) {
+		rx_replenish_one(self.pair, self.desc_id, self.buffer);
+	}
+}
 
 impl RxToken for VirtioRxPacket {
 	fn consume<R, F>(self, f: F) -> R
 	where
 		F: FnOnce(&[u8]) -> R 
 	{
-		f(&self.0)
+		f(self.frame())
 	}
 }
 
 impl TxToken for VirtioTxPacket {
-    fn consume<R, F>(self, len: usize, f: F) -> R
-    where
-        F: FnOnce(&mut [u8]) -> R,
-    {
-        let mut buf = vec![0u8; len];
-        let result = f(&mut buf);
-        if let Err(e) = transmit_packet(&buf) {
-            serial_println!("[SMOLTCP] TX error: {:?}", e);
-        }
-        result
-    }
+	fn consume<R, F>(self, len: usize, f: F) -> R
+	where
+		F: FnOnce(&mut [u8]) -> R,
+	{
+		// smoltcp writes the frame straight into the buffer the device reads
+		let buffer = match tx_buffer(self.pair, len) {
+			Ok(buffer) => buffer,
+			Err(e) => {
+				serial_println!("[SMOLTCP] TX error: {:?}", e);
+				let mut scratch = vec![0u8; len];
+				return f(&mut scratch);
+			}
+		};
+		let result = f(unsafe { tx_frame(&buffer, len) });
+		// the doorbell is rung once for the burst, in `flush_queues`
+		if let Err(e) = queue_tx(self.pair, buffer, len) {
+			serial_println!("[SMOLTCP] TX error: {:?}", e);
+		}
+		result
+	}
 }
 
 impl Device for VirtioNet {
@@ -472,40 +659,22 @@ impl Device for VirtioNet {
 
 	fn transmit(&mut self, timestamp: smoltcp::time::Instant) -> Option<Self::TxToken<'_>> {
 		// because smoltcp wants to send the packet, we just give it a token instead
-		Some(VirtioTxPacket)
+		Some(VirtioTxPacket { pair: tx_pair() })
 	}
 
 	fn receive(&mut self, timestamp: smoltcp::time::Instant) -> Option<(Self::RxToken<'_>, Self::TxToken<'_>)> {
-		let packet = {
-			let mut rx_queue = RX_QUEUE.lock();
-			rx_queue.pop_used()
-		};
-
-		if let Some((desc_id, len)) = packet {
-			let hdr_len = size_of::<VirtioNetHeader>();
-			let pkt_len = (len as usize).saturating_sub(hdr_len);
-
-			let data = {
-				let rx_buffers = RX_BUFFERS.lock();
-				let buf = rx_buffers.get(desc_id as usize)?.as_ref()?;
-				let mut data = vec![0u8; pkt_len];
-				unsafe {
-					let src = buf.virt.as_ptr::<u8>().add(hdr_len);
-					copy_nonoverlapping(src, data.as_mut_ptr(), pkt_len);
-				}
-				data
-			};
-
-			{
-				let mut rx_queue = RX_QUEUE.lock();
-				rx_queue.push_avail(desc_id);
-				rx_queue.kick();
+		// this cpu's pair first, the device may have steered to any of them
+		let pairs = QUEUE_PAIR_COUNT.load(Ordering::Acquire);
+		let first = cpu_id();
+		for n in 0..pairs {
+			let pair = (first + n) % pairs;
+			let used = QUEUE_PAIRS[pair].rx.lock().pop_used();
+			if let Some((desc_id, len)) = used {
+				let packet = VirtioRxPacket::take(pair, desc_id, len)?;
+				return Some((packet, VirtioTxPacket { pair: tx_pair() }));
 			}
-
-			Some((VirtioRxPacket(data), VirtioTxPacket))
-		} else {
-			None
 		}
+		None
 	}
 
 	fn capabilities(&self) -> smoltcp::phy::DeviceCapabilities {
@@ -517,52 +686,132 @@ impl Device for VirtioNet {
 	}
 }
 
-fn handle_rx_packet(desc_id: u16, len: u32) {
-	let hdr_len = core::mem::size_of::<VirtioNetHeader>();
-
-	let pkt_ptr = {
-		let rx_buffers = RX_BUFFERS.lock();
-		let buf_opt = rx_buffers.get(desc_id as usize).and_then(|o| o.as_ref());
-		if buf_opt.is_none() {
-			serial_println!("[VIRTIO-NET] ERROR: No buffer at desc_id {}", desc_id);
-			return;
-		}
-		let buf = buf_opt.unwrap();
-		unsafe { buf.virt.as_ptr::<u8>().add(hdr_len) }
+fn handle_rx_packet(pair: usize, desc_id: u16, len: u32) {
+	let Some(packet) = VirtioRxPacket::take(pair, desc_id, len) else {
+		return;
 	};
 
-	let pkt_len = (len as usize).saturating_sub(hdr_len);
 	serial_println!(
 		"[VIRTIO-NET] RX packet ({} bytes) desc_id={}",
-		pkt_len,
+		packet.len,
 		desc_id
 	);
 
-	unsafe {
-		if pkt_len >= 14 {
-			let ethertype = u16::from_be_bytes([
-				core::ptr::read(pkt_ptr.add(12)),
-				core::ptr::read(pkt_ptr.add(13))
-			]);
+	packet.consume(|frame| {
+		if frame.len() >= 14 {
+			let ethertype = u16::from_be_bytes([frame[12], frame[13]]);
 			serial_println!("[VIRTIO-NET] Ethernet ethertype=0x{:04x}", ethertype);
 		}
+
+		// call network stack
+		receive_packet(frame.as_ptr(), frame.len());
+	});
+}
+
+/// Gives a received buffer back to the device under the descriptor it came
+/// in on. The device hears of it with the next `notify` of the queue.
+fn rx_replenish_one(pair: usize, desc_id: u16, buffer: DmaBuffer) {
+	let queues = &QUEUE_PAIRS[pair];
+	queues.rx_buffers.lock()[desc_id as usize] = Some(buffer);
+	queues.rx.lock().push_avail(desc_id);
+}
+
+/// The pair transmits of this cpu go out on.
+fn tx_pair() -> usize {
+	cpu_id() % ACTIVE_PAIRS.load(Ordering::Acquire).max(1)
+}
+
+/// A transmit buffer of `pair` for a frame of `len` bytes with its virtio
+/// header filled in, recycled if the device is done with one.
+fn tx_buffer(pair: usize, len: usize) -> Result<DmaBuffer, NullexError> {
+	const HEADER_SIZE: usize = core::mem::size_of::<VirtioNetHeader>();
+	ensure!(HEADER_SIZE + len <= TX_BUFFER_SIZE, NullexError::Io("Frame too large"));
+
+	let queues = &QUEUE_PAIRS[pair];
+	if queues.tx_free.lock().is_empty() {
+		tx_reclaim(pair);
+	}
+	let recycled = queues.tx_free.lock().pop();
+	let buffer = match recycled {
+		Some(buffer) => buffer,
+		None => {
+			let (virt, phys) = dma_alloc(TX_BUFFER_SIZE)?;
+			DmaBuffer {
+				phys,
+				virt,
+				len: TX_BUFFER_SIZE
+			}
+		}
+	};
+	unsafe { core::ptr::write(buffer.virt.as_mut_ptr::<VirtioNetHeader>(), VirtioNetHeader::default()) };
+	Ok(buffer)
+}
+
+/// The frame part of a buffer from `tx_buffer`.
+///
+/// # Safety
+/// `len` must be the length the buffer was taken for and the buffer not
+/// queued yet.
+#[allow(clippy::mut_from_ref)]
+unsafe fn tx_frame(buffer: &DmaBuffer, len: usize) -> &mut [u8] {
+	let header_size = core::mem::size_of::<VirtioNetHeader>();
+	unsafe { core::slice::from_raw_parts_mut(buffer.virt.as_mut_ptr::<u8>().add(header_size), len) }
+}
+
+/// Puts a filled buffer from `tx_buffer` on the transmit queue of `pair`,
+/// it comes back to the pair's free buffers in `tx_reclaim`. The device only
+/// looks once the queue is notified.
+fn queue_tx(pair: usize, buffer: DmaBuffer, len: usize) -> Result<u16, NullexError> {
+	let total_size = core::mem::size_of::<VirtioNetHeader>() + len;
+	let queues = &QUEUE_PAIRS[pair];
+
+	let mut tx_inflight = queues.tx_inflight.lock();
+	let mut tx_queue = queues.tx.lock();
+
+	let desc_id = match tx_queue.add_descriptor(buffer.phys, total_size as u32, false) {
+		Ok(desc_id) => desc_id,
+		Err(e) => {
+			// the free list is taken after the queue elsewhere
+			drop(tx_queue);
+			drop(tx_inflight);
+			queues.tx_free.lock().push(buffer);
+			return Err(e);
+		}
+	};
+
+	while tx_inflight.len() <= desc_id as usize {
+		tx_inflight.push(None);
 	}
+	tx_inflight[desc_id as usize] = Some(buffer);
 
-	// call network stack
-	crate::net::receive_packet(pkt_ptr, pkt_len);
+	tx_queue.push_avail(desc_id);
+	Ok(desc_id)
+}
 
-	{
-		let mut rx_queue = RX_QUEUE.lock();
-		rx_queue.push_avail(desc_id);
-		rx_queue.kick();
+/// Takes back the transmit buffers of `pair` the device sent.
+fn tx_reclaim(pair: usize) {
+	let queues = &QUEUE_PAIRS[pair];
+	let mut tx_inflight = queues.tx_inflight.lock();
+	let mut tx_free = queues.tx_free.lock();
+	let mut tx_queue = queues.tx.lock();
+	while let Some((desc_id, _len)) = tx_queue.pop_used() {
+		tx_queue.free_descriptor(desc_id);
+		if let Some(buffer) = tx_inflight.get_mut(desc_id as usize).and_then(Option::take) {
+			tx_free.push(buffer);
+		}
 	}
 }
 
-fn _rx_replenish_one(desc_id: u16, _old_buf: DmaBuffer) {
-	serial_println!("[VIRTIO-NET] Replenish: requeue desc_id={}", desc_id);
-	let mut rx_queue = RX_QUEUE.lock();
-	rx_queue.push_avail(desc_id);
-	rx_queue.kick();
+/// Tells the device about everything queued since the last call, one
+/// doorbell write for each queue that has news at most. Called once a
+/// burst of frames is queued.
+pub fn flush_queues() {
+	for pair in 0..QUEUE_PAIR_COUNT.load(Ordering::Acquire) {
+		let queues = &QUEUE_PAIRS[pair];
+		queues.tx.lock().notify();
+		queues.rx.lock().notify();
+		tx_reclaim(pair);
+	}
 }
 
 /// Transmit a packet to the transport queue (TX)
@@ -589,42 +838,19 @@ pub fn transmit_packet(packet: &[u8]) -> Result<(), NullexError> {
 	);
 	serial_println!("  EtherType: 0x{:02X}{:02X}", packet[12], packet[13]);
 
-	const HEADER_SIZE: usize = core::mem::size_of::<VirtioNetHeader>();
-	let total_size = HEADER_SIZE + packet.len();
-	let (virt_addr, phys_addr) = dma_alloc(total_size)?;
-
-	unsafe {
-		let header = VirtioNetHeader::default();
-		let header_ptr = virt_addr.as_mut_ptr::<VirtioNetHeader>();
-		core::ptr::write(header_ptr, header);
-
-		let packet_ptr = virt_addr.as_mut_ptr::<u8>().add(HEADER_SIZE);
-		core::ptr::copy_nonoverlapping(packet.as_ptr(), packet_ptr, packet.len());
-	}
-
-	let tx_buffer = DmaBuffer {
-		phys: phys_addr,
-		virt: virt_addr,
-		len: total_size
-	};
-
-	let mut tx_inflight = TX_INFLIGHT.lock();
-	let mut tx_queue = TX_QUEUE.lock();
-
-	let desc_id = tx_queue.add_descriptor(phys_addr, total_size as u32, false)?;
-	tx_queue.push_avail(desc_id);
-	tx_queue.kick();
-
-	while tx_inflight.len() <= desc_id as usize {
-		tx_inflight.push(None);
-	}
-	tx_inflight[desc_id as usize] = Some(tx_buffer);
+	let pair = tx_pair();
+	let buffer = tx_buffer(pair, packet.len())?;
+	unsafe { tx_frame(&buffer, packet.len()) }.copy_from_slice(packet);
+	let phys_addr = buffer.phys;
+	let desc_id = queue_tx(pair, buffer, packet.len())?;
+	QUEUE_PAIRS[pair].tx.lock().notify();
 
 	serial_println!(
-		"[VIRTIO-NET] TX queued (desc_id={}, phys={:#x}, len={})",
+		"[VIRTIO-NET] TX queued (pair={}, desc_id={}, phys={:#x}, len={})",
+		pair,
 		desc_id,
 		phys_addr.as_u64(),
-		total_size
+		core::mem::size_of::<VirtioNetHeader>() + packet.len()
 	);
 	Ok(())
 }
@@ -671,6 +897,16 @@ pub fn virtio_net_probe(dev: &mut PciDevice) -> Result<usize, NullexError> {
 		None
 	);
 
+	// without MSI-X everything shares the legacy interrupt, one pair is all
+	// that can be told apart then
+	match pci_enable_msix(dev) {
+		Ok(msix) => {
+			virtio_net.config_offset = VIRTIO_IO_DEVICE_CFG_MSIX;
+			virtio_net.msix = Some(msix);
+		}
+		Err(e) => serial_println!("[VIRTIO-NET] No MSI-X ({}), using the legacy interrupt", e)
+	}
+
 	virtio_net.set_driver_status(0);
 	virtio_net.set_driver_status(
 		VirtIODeviceStatus::ACKNOWLEDGE
@@ -679,7 +915,10 @@ pub fn virtio_net_probe(dev: &mut PciDevice) -> Result<usize, NullexError> {
 	);
 
 	let dev_features = virtio_net.device_features();
-	let driv_ok_features = dev_features & NET_DRIVER_SUPPORTED_FEATURES;
+	let mut driv_ok_features = dev_features & NET_DRIVER_SUPPORTED_FEATURES;
+	if virtio_net.msix.is_none() || driv_ok_features & NET_MSIX_FEATURES != NET_MSIX_FEATURES {
+		driv_ok_features &= !NET_MSIX_FEATURES;
+	}
 
 	virtio_net.set_driver_features(driv_ok_features);
 	virtio_net.set_driver_status(VirtIODeviceStatus::FEATURES_OK.bits());
@@ -689,10 +928,11 @@ pub fn virtio_net_probe(dev: &mut PciDevice) -> Result<usize, NullexError> {
 		return Err(NullexError::DeviceRejectedFeatures);
 	}
 
+	let config = io_base + virtio_net.config_offset;
 	let mac = {
 		let mut value = [0u8; 6];
 		for i in 0..6 {
-			value[i] = unsafe { inb((io_base + VIRTIO_IO_DEVICE_CFG + i) as u16) };
+			value[i] = unsafe { inb((config + i) as u16) };
 		}
 		value
 	};
@@ -708,6 +948,25 @@ pub fn virtio_net_probe(dev: &mut PciDevice) -> Result<usize, NullexError> {
 	);
 	virtio_net.config.mac = mac;
 
+	if driv_ok_features & VIRTIO_NET_F_MQ != 0 {
+		let max_pairs = unsafe { inw((config + 8) as u16) };
+		virtio_net.config.max_virtqueue_pairs = Some(max_pairs);
+		let entries = virtio_net.msix.as_ref().map_or(1, |msix| msix.entries() as usize);
+		virtio_net.queue_pairs = (max_pairs as usize).min(MAX_QUEUE_PAIRS).min(entries).max(1);
+		serial_println!("[VIRTIO-NET] Device has {} queue pairs, using {}", max_pairs, virtio_net.queue_pairs);
+	}
+
+	if let Some(msix) = virtio_net.msix.as_mut() {
+		unsafe { outw((io_base + VIRTIO_IO_MSI_CONFIG_VECTOR) as u16, VIRTIO_MSI_NO_VECTOR) };
+		// all on this cpu until the others are up, see `virtio_net_spread_queues`
+		let bsp = lapic_id();
+		for pair in 0..virtio_net.queue_pairs {
+			let vector = allocate_and_register_vector(PAIR_HANDLERS[pair])? as u8;
+			msix.route(pair as u16, vector, bsp)?;
+			virtio_net.queue_vectors.push(vector);
+		}
+	}
+
 	virtio_net.init()?;
 	virtio_net.set_driver_status(VirtIODeviceStatus::DRIVER_OK.bits());
 
@@ -720,14 +979,22 @@ pub fn virtio_net_probe(dev: &mut PciDevice) -> Result<usize, NullexError> {
 		return Err(NullexError::DriverNotOk);
 	}
 
-	{
-		let rx_queue = RX_QUEUE.lock();
-		rx_queue.kick();
-		serial_println!("[VIRTIO-NET] RX queue kicked AFTER DRIVER_OK");
-	}
+	flush_queues();
+	serial_println!("[VIRTIO-NET] RX queues kicked AFTER DRIVER_OK");
 
+	let msix_vector = virtio_net.queue_vectors.first().copied();
 	*VIRTIO_NET_INSTANCE.lock() = Some((virtio_net, io_base));
 
+	if let Some(vector) = msix_vector {
+		*VIRTIO_NET_DEVICE.lock() = Some(VirtioNetDevice {
+			io_base: io_base as u16,
+			gsi: 0,
+			vector
+		});
+		serial_println!("[VIRTIO-NET] Probe complete - queue interrupts through MSI-X");
+		return Ok(0);
+	}
+
 	let gsi = dev.interrupt_line()? as usize;
 	serial_println!("[VIRTIO-NET] Device uses GSI {}", gsi);
 
@@ -780,6 +1047,63 @@ pub fn virtio_net_probe(dev: &mut PciDevice) -> Result<usize, NullexError> {
 	Ok(0)
 }
 
+/// Spreads the queue pairs over the cpus that are up, pair `i` interrupting
+/// cpu `i`, and has the device steer flows over all of them. Called once the
+/// other cpus are started.
+pub fn virtio_net_spread_queues() {
+	let mut instance = VIRTIO_NET_INSTANCE.lock();
+	let Some((virtio_net, _)) = instance.as_mut() else {
+		return;
+	};
+	let pairs = virtio_net.queue_pairs.min(smp::online_cpus());
+	let Some(msix) = virtio_net.msix.as_mut() else {
+		return;
+	};
+	if pairs <= 1 {
+		return;
+	}
+
+	for pair in 0..pairs {
+		if let Err(e) = msix.route(pair as u16, virtio_net.queue_vectors[pair], smp::lapic_id_of(pair)) {
+			serial_println!("[VIRTIO-NET] Failed to route pair {}: {}", pair, e);
+			return;
+		}
+	}
+	match virtio_net.set_queue_pairs(pairs as u16) {
+		Ok(()) => {
+			ACTIVE_PAIRS.store(pairs, Ordering::Release);
+			serial_println!("[VIRTIO-NET] {} queue pairs active, one per cpu", pairs);
+		}
+		Err(e) => serial_println!("[VIRTIO-NET] Failed to enable {} queue pairs: {}", pairs, e)
+	}
+}
+
+/// One MSI-X handler for each queue pair, the table maps pair `i` to the
+/// `i`th of them.
+macro_rules! pair_handlers {
+	($($name:ident => $pair:literal),* $(,)?) => {
+		$(
+			extern "x86-interrupt" fn $name(_stack_frame: InterruptStackFrame) {
+				poll_pair($pair);
+				unsafe { send_eoi() };
+			}
+		)*
+
+		const PAIR_HANDLERS: [extern "x86-interrupt" fn(InterruptStackFrame); MAX_QUEUE_PAIRS] = [$($name),*];
+	};
+}
+
+pair_handlers!(
+	pair0_interrupt_handler => 0,
+	pair1_interrupt_handler => 1,
+	pair2_interrupt_handler => 2,
+	pair3_interrupt_handler => 3,
+	pair4_interrupt_handler => 4,
+	pair5_interrupt_handler => 5,
+	pair6_interrupt_handler => 6,
+	pair7_interrupt_handler => 7
+);
+
 /// VirtioNet Interrupt Handler.
 pub extern "x86-interrupt" fn virtio_net_interrupt_handler(_stack_frame: InterruptStackFrame) {
 	serial_println!("[VIRTIO-NET] Interrupt!");
@@ -797,13 +1121,13 @@ pub extern "x86-interrupt" fn virtio_net_interrupt_handler(_stack_frame: Interru
 		}
 	};
 
+	// reading it also lowers the line
 	let isr = unsafe { inb(io_base as u16 + VIRTIO_IO_ISR as u16) };
 	serial_println!("[VIRTIO-NET] ISR={:#x}", isr);
 
 	if (isr & 0x1) != 0 {
 		serial_println!("[VIRTIO-NET] Queue interrupt");
-		rx_poll();
-		tx_poll();
+		poll_pair(0);
 	}
 
 	unsafe {
@@ -811,49 +1135,60 @@ pub extern "x86-interrupt" fn virtio_net_interrupt_handler(_stack_frame: Interru
 	}
 }
 
-fn tx_poll() {
-	//serial_println!("[VIRTIO-NET] Polling TX queue");
-
-	let completions = {
-		let mut tx_queue = TX_QUEUE.lock();
-		let mut completions = Vec::new();
-		while let Some((desc_id, _len)) = tx_queue.pop_used() {
-			completions.push(desc_id);
-		}
-		completions
-	};
-
-	if !completions.is_empty() {
-		serial_println!(
-			"[VIRTIO-NET] Processing {} TX completions",
-			completions.len()
-		);
-		let mut tx_inflight = TX_INFLIGHT.lock();
-		for desc_id in completions.iter() {
-			serial_println!("[VIRTIO-NET] TX completed desc_id={}", desc_id);
-			if (*desc_id as usize) < tx_inflight.len() {
-				tx_inflight[*desc_id as usize] = None;
+/// Polls `pair` NAPI style: with its receive interrupt off, in passes of up
+/// to `NAPI_BUDGET` frames, until the ring is empty with the interrupt back
+/// on. Frames arriving meanwhile raise no interrupt of their own.
+fn poll_pair(pair: usize) {
+	unsafe {
+		with_kernel_page_table(|| {
+			let queues = &QUEUE_PAIRS[pair];
+			queues.rx.lock().disable_interrupts();
+			loop {
+				let taken = rx_poll_pair(pair, NAPI_BUDGET);
+				// one doorbell for every buffer given back in the pass
+				queues.rx.lock().notify();
+				tx_reclaim(pair);
+				if taken == NAPI_BUDGET {
+					continue;
+				}
+				if !queues.rx.lock().enable_interrupts() {
+					break;
+				}
+				queues.rx.lock().disable_interrupts();
 			}
-		}
+		})
 	}
 }
 
-/// Poll the receive queue. (RX)
-pub fn rx_poll() {
-	//serial_println!("[VIRTIO-NET] Polling RX queue");
+/// Poll the transmit queues (TX), taking back the buffers the device sent.
+pub fn tx_poll() {
+	for pair in 0..QUEUE_PAIR_COUNT.load(Ordering::Acquire) {
+		tx_reclaim(pair);
+	}
+}
 
-	let packets = {
-		let mut rx_queue = RX_QUEUE.lock();
-		let mut packets = Vec::new();
-		while let Some((desc_id, len)) = rx_queue.pop_used() {
-			packets.push((desc_id, len));
-		}
-		packets
-	};
+/// Handles up to `budget` frames received on `pair` and returns how many.
+fn rx_poll_pair(pair: usize, budget: usize) -> usize {
+	// once user sockets are up every frame is theirs to read
+	if crate::net::socket::poll_interrupt() {
+		return 0;
+	}
 
-	for (desc_id, len) in packets.iter() {
-		serial_println!("[VIRTIO-NET] Processing desc_id={}, len={}", desc_id, len);
-		handle_rx_packet(*desc_id, *len);
+	let mut taken = 0;
+	while taken < budget {
+		let Some((desc_id, len)) = QUEUE_PAIRS[pair].rx.lock().pop_used() else {
+			break;
+		};
+		serial_println!("[VIRTIO-NET] Processing pair={}, desc_id={}, len={}", pair, desc_id, len);
+		handle_rx_packet(pair, desc_id, len);
+		taken += 1;
 	}
-	//serial_println!("[VIRTIO-NET] Processed {} packets", packets.len());
-}
\ No newline at end of file
+	taken
+}
+
+/// Poll the receive queues. (RX)
+pub fn rx_poll() {
+	for pair in 0..QUEUE_PAIR_COUNT.load(Ordering::Acquire) {
+		poll_pair(pair);
+	}
+}
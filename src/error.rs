@@ -6,8 +6,9 @@
 
 use alloc::string::String;
 use thiserror::Error;
-use x86_64::{VirtAddr, structures::paging::{PhysFrame, Size4KiB, mapper::MapToError}};
+use x86_64::{VirtAddr, structures::paging::{PhysFrame, Size4KiB, mapper::{MapToError, UnmapError}}};
 use crate::alloc::string::ToString;
+use crate::fs::ramfs::FsError;
 
 #[derive(Error, Debug, Clone, Copy, PartialEq, Eq)]
 /// An enum representing all Nullex Errors
@@ -54,6 +55,9 @@ pub enum NullexError {
     /// The kernel's mapper detects incorrect page table flags.
     #[error("incorrect page table flags")]
     IncorrectPageTableFlags,
+    /// An attempt was made to unmap a virtual page that is not mapped.
+    #[error("page not mapped")]
+    PageNotMapped,
 
     // --- Interrupt Errors --- //
     /// No free slots remain in the Interrupt Descriptor Table or vector list.
@@ -117,6 +121,24 @@ pub enum NullexError {
     /// The kernel cannot find the file specified.
     #[error("file not found")]
     FileNotFound,
+    /// A ramfs operation failed.
+    #[error("filesystem error: {0}")]
+    Fs(FsError),
+    /// A filesystem can only be mounted over an empty directory.
+    #[error("mount point not empty")]
+    MountPointNotEmpty,
+    /// The disk has no free blocks or inodes left.
+    #[error("disk full")]
+    DiskFull,
+    /// A file grew past what the on-disk format can address.
+    #[error("file too large")]
+    FileTooLarge,
+    /// A file or directory name is longer than the on-disk format allows.
+    #[error("name too long")]
+    NameTooLong,
+    /// The on-disk structures do not make sense.
+    #[error("filesystem corrupt: {0}")]
+    FsCorrupt(&'static str),
 
     // --- VirtIO / Network Errors --- //
     /// The handshake or setup process for a VirtIO device failed.
@@ -168,6 +190,12 @@ pub enum NullexError {
     TcpFailedToReceive,
     #[error("invalid http response")]
     HttpInvalidResponse,
+    /// A socket id that is not open, or open by another process.
+    #[error("no such socket")]
+    SocketNotFound,
+    /// Every socket slot of the network stack is in use.
+    #[error("too many open sockets")]
+    TooManySockets,
 
     // --- Serial Output Errors --- //
     /// An unspecified error occurred during serial port communication.
@@ -212,6 +240,12 @@ pub enum NullexError {
     /// The process queue is full and cannot accept new processes.
     #[error("process queue full")]
     ProcessQueueFull,
+    /// Every slot of the process table is in use.
+    #[error("process table full")]
+    ProcessTableFull,
+    /// The arguments and environment of a new program do not fit its stack.
+    #[error("argument list too long")]
+    ArgumentsTooLong,
 
     // --- Process Errors (ELF) --- //
     /// ELF magic number is incorrect
@@ -230,6 +264,12 @@ impl From<&'static str> for NullexError {
 	}
 }
 
+impl From<FsError> for NullexError {
+    fn from(value: FsError) -> Self {
+        NullexError::Fs(value)
+    }
+}
+
 impl From<MapToError<Size4KiB>> for NullexError {
     fn from(value: MapToError<Size4KiB>) -> Self {
         match value {
@@ -240,6 +280,16 @@ impl From<MapToError<Size4KiB>> for NullexError {
     }
 }
 
+impl From<UnmapError> for NullexError {
+    fn from(value: UnmapError) -> Self {
+        match value {
+            UnmapError::ParentEntryHugePage => NullexError::ParentEntryHugePage,
+            UnmapError::PageNotMapped => NullexError::PageNotMapped,
+            UnmapError::InvalidFrameAddress(_) => NullexError::MapToFailed,
+        }
+    }
+}
+
 impl NullexError {
     // do we need this? im not sure if the #[error] does that already.
     /// Represents the Errors as `str`'s
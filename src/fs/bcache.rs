@@ -0,0 +1,368 @@
+//!
+//! fs/bcache.rs
+//!
+//! Block cache in front of a block device.
+//!
+//! Every cached block lives in a page frame of its own that the device moves
+//! data in and out of by DMA, so nothing is copied on the way and the cache
+//! takes no heap. Blocks are evicted least recently used first. Writes stay in
+//! the cache until `sync` or until a dirty block is evicted, and then go out
+//! together, sorted and merged into runs. A miss reads the blocks after it
+//! along in the same request.
+//!
+
+use alloc::{boxed::Box, vec::Vec};
+
+use hashbrown::HashMap;
+use x86_64::{PhysAddr, structures::paging::FrameAllocator};
+
+use crate::{allocator::ALLOCATOR_INFO, ensure, error::NullexError, memory::phys_to_virt};
+
+/// Bytes in a block, the same as a page frame and a file page.
+pub const BLOCK_SIZE: usize = 4096;
+
+/// Most blocks a single request moves, one frame each.
+pub const MAX_REQUEST_BLOCKS: usize = 8;
+
+/// Blocks a miss reads at once, the missed one included.
+const READ_AHEAD: usize = 8;
+
+const _: () = assert!(READ_AHEAD <= MAX_REQUEST_BLOCKS);
+
+/// Block number of a slot that holds nothing.
+const EMPTY: u64 = u64::MAX;
+/// End of the LRU list.
+const NONE: usize = usize::MAX;
+
+/// A transfer of `count` consecutive blocks starting at `block`, block `n`
+/// of it to or from `frames[n]`.
+#[derive(Debug, Clone, Copy)]
+pub struct BlockRequest {
+	/// First block on the device.
+	pub block: u64,
+	/// Whether the frames are written to the device or read into.
+	pub write: bool,
+	/// Blocks in the request, at most `MAX_REQUEST_BLOCKS`.
+	pub count: usize,
+	/// One frame per block.
+	pub frames: [PhysAddr; MAX_REQUEST_BLOCKS]
+}
+
+impl BlockRequest {
+	fn new(block: u64, write: bool) -> Self {
+		Self {
+			block,
+			write,
+			count: 0,
+			frames: [PhysAddr::zero(); MAX_REQUEST_BLOCKS]
+		}
+	}
+}
+
+/// A disk read and written in `BLOCK_SIZE` blocks.
+pub trait BlockDevice: Send {
+	/// Blocks on the device.
+	fn block_count(&self) -> u64;
+
+	/// Carries out every request and returns once all of them are done.
+	/// Devices that can keep several requests in flight should.
+	fn submit(&mut self, requests: &[BlockRequest]) -> Result<(), NullexError>;
+}
+
+struct Slot {
+	block: u64,
+	frame: PhysAddr,
+	dirty: bool,
+	/// Neighbours in the LRU list, towards the most and the least recently
+	/// used one.
+	prev: usize,
+	next: usize
+}
+
+/// A fixed number of blocks of a `BlockDevice`, see the module docs.
+pub struct BlockCache {
+	device: Box<dyn BlockDevice>,
+	slots: Vec<Slot>,
+	/// Slot of every cached block.
+	map: HashMap<u64, usize>,
+	/// Most recently used slot.
+	head: usize,
+	/// Least recently used slot, the next one evicted.
+	tail: usize
+}
+
+impl BlockCache {
+	/// Creates a cache of `capacity` blocks in front of `device`. The frames
+	/// are taken right away and kept for good.
+	pub fn new(device: Box<dyn BlockDevice>, capacity: usize) -> Result<Self, NullexError> {
+		ensure!(capacity > READ_AHEAD, NullexError::InvalidArgument);
+
+		let mut slots = Vec::with_capacity(capacity);
+		{
+			let mut frame_binding = ALLOCATOR_INFO.frame_allocator.lock();
+			let frame_allocator = frame_binding.as_mut().ok_or(NullexError::FrameAllocatorNotInitialized)?;
+			for i in 0..capacity {
+				let frame = frame_allocator.allocate_frame().ok_or(NullexError::FrameAllocationFailed)?;
+				slots.push(Slot {
+					block: EMPTY,
+					frame: frame.start_address(),
+					dirty: false,
+					prev: if i == 0 { NONE } else { i - 1 },
+					next: if i + 1 == capacity { NONE } else { i + 1 }
+				});
+			}
+		}
+
+		Ok(Self {
+			device,
+			slots,
+			map: HashMap::new(),
+			head: 0,
+			tail: capacity - 1
+		})
+	}
+
+	/// Blocks on the device.
+	pub fn block_count(&self) -> u64 {
+		self.device.block_count()
+	}
+
+	/// Runs `f` on block `block`, reading it in first if it is not cached.
+	pub fn read<R>(&mut self, block: u64, f: impl FnOnce(&[u8; BLOCK_SIZE]) -> R) -> Result<R, NullexError> {
+		let slot = self.fetch(block, true)?;
+		Ok(f(self.buffer(slot)))
+	}
+
+	/// Runs `f` on block `block` to change it, reading it in first if it is
+	/// not cached. It is written back later.
+	pub fn write<R>(&mut self, block: u64, f: impl FnOnce(&mut [u8; BLOCK_SIZE]) -> R) -> Result<R, NullexError> {
+		let slot = self.fetch(block, true)?;
+		self.slots[slot].dirty = true;
+		Ok(f(self.buffer(slot)))
+	}
+
+	/// Like `write` for a block `f` fills completely, it is not read in
+	/// first and `f` may find anything in it.
+	pub fn overwrite<R>(&mut self, block: u64, f: impl FnOnce(&mut [u8; BLOCK_SIZE]) -> R) -> Result<R, NullexError> {
+		let slot = self.fetch(block, false)?;
+		self.slots[slot].dirty = true;
+		Ok(f(self.buffer(slot)))
+	}
+
+	/// Writes every dirty block back, runs of neighbouring blocks as one
+	/// request each. Returns the number of blocks written.
+	pub fn sync(&mut self) -> Result<usize, NullexError> {
+		let mut dirty: Vec<usize> = (0..self.slots.len()).filter(|&i| self.slots[i].dirty).collect();
+		if dirty.is_empty() {
+			return Ok(0);
+		}
+		dirty.sort_unstable_by_key(|&i| self.slots[i].block);
+
+		let mut requests: Vec<BlockRequest> = Vec::new();
+		for &i in &dirty {
+			let slot = &self.slots[i];
+			let extends = requests
+				.last()
+				.is_some_and(|last| last.block + last.count as u64 == slot.block && last.count < MAX_REQUEST_BLOCKS);
+			if !extends {
+				requests.push(BlockRequest::new(slot.block, true));
+			}
+			let request = requests.last_mut().unwrap();
+			request.frames[request.count] = slot.frame;
+			request.count += 1;
+		}
+
+		self.device.submit(&requests)?;
+		for &i in &dirty {
+			self.slots[i].dirty = false;
+		}
+		Ok(dirty.len())
+	}
+
+	fn buffer(&mut self, slot: usize) -> &mut [u8; BLOCK_SIZE] {
+		// the frame is the slot's alone and mapped in the physical memory window
+		unsafe { &mut *phys_to_virt(self.slots[slot].frame).as_mut_ptr::<[u8; BLOCK_SIZE]>() }
+	}
+
+	/// Slot holding `block`, read in along with the blocks after it on a miss
+	/// if `read` is set.
+	fn fetch(&mut self, block: u64, read: bool) -> Result<usize, NullexError> {
+		let block_count = self.device.block_count();
+		ensure!(block < block_count, NullexError::InvalidArgument);
+
+		if let Some(&slot) = self.map.get(&block) {
+			self.touch(slot);
+			return Ok(slot);
+		}
+		if !read {
+			return self.claim(block);
+		}
+
+		// up to the next block that is cached already
+		let end = (block + READ_AHEAD as u64).min(block_count);
+		let mut request = BlockRequest::new(block, false);
+		let mut claimed = [0; READ_AHEAD];
+		let mut result = Ok(());
+		for b in block..end {
+			if b != block && self.map.contains_key(&b) {
+				break;
+			}
+			match self.claim(b) {
+				Ok(slot) => {
+					claimed[request.count] = slot;
+					request.frames[request.count] = self.slots[slot].frame;
+					request.count += 1;
+				}
+				Err(e) => {
+					result = Err(e);
+					break;
+				}
+			}
+		}
+		if result.is_ok() {
+			result = self.device.submit(&[request]);
+		}
+
+		if let Err(e) = result {
+			// none of them holds what it is mapped to
+			for &slot in &claimed[..request.count] {
+				self.map.remove(&self.slots[slot].block);
+				self.slots[slot].block = EMPTY;
+			}
+			return Err(e);
+		}
+		// the blocks read ahead are evicted before the one asked for
+		self.touch(claimed[0]);
+		Ok(claimed[0])
+	}
+
+	/// Takes the least recently used slot for `block`. A dirty one is written
+	/// back first, along with everything else dirty so a stream of writes
+	/// larger than the cache still goes out in big batches.
+	fn claim(&mut self, block: u64) -> Result<usize, NullexError> {
+		let slot = self.tail;
+		if self.slots[slot].dirty {
+			self.sync()?;
+		}
+		let old = self.slots[slot].block;
+		if old != EMPTY {
+			self.map.remove(&old);
+		}
+		self.slots[slot].block = block;
+		self.map.insert(block, slot);
+		self.touch(slot);
+		Ok(slot)
+	}
+
+	/// Makes `slot` the most recently used one.
+	fn touch(&mut self, slot: usize) {
+		if self.head == slot {
+			return;
+		}
+		let (prev, next) = (self.slots[slot].prev, self.slots[slot].next);
+		// not the head, so there is a previous one
+		self.slots[prev].next = next;
+		if next == NONE {
+			self.tail = prev;
+		} else {
+			self.slots[next].prev = prev;
+		}
+
+		self.slots[slot].prev = NONE;
+		self.slots[slot].next = self.head;
+		self.slots[self.head].prev = slot;
+		self.head = slot;
+	}
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use alloc::{boxed::Box, sync::Arc, vec::Vec};
+	use core::sync::atomic::{AtomicUsize, Ordering};
+
+	use crate::{
+		error::NullexError,
+		fs::bcache::{BLOCK_SIZE, BlockCache, BlockDevice, BlockRequest, READ_AHEAD},
+		memory::phys_to_virt,
+		utils::{ktest::TestError, mutex::SpinMutex}
+	};
+
+	/// A disk in memory, shared between its clones so it can outlive a cache.
+	#[derive(Clone)]
+	pub struct MemDisk {
+		/// The contents, block after block.
+		pub data: Arc<SpinMutex<Vec<u8>>>,
+		/// Requests submitted so far.
+		pub requests: Arc<AtomicUsize>
+	}
+
+	impl MemDisk {
+		/// A zeroed disk of `blocks` blocks.
+		pub fn new(blocks: usize) -> Self {
+			Self {
+				data: Arc::new(SpinMutex::new(vec![0; blocks * BLOCK_SIZE])),
+				requests: Arc::new(AtomicUsize::new(0))
+			}
+		}
+	}
+
+	impl BlockDevice for MemDisk {
+		fn block_count(&self) -> u64 {
+			(self.data.lock().len() / BLOCK_SIZE) as u64
+		}
+
+		fn submit(&mut self, requests: &[BlockRequest]) -> Result<(), NullexError> {
+			let mut data = self.data.lock();
+			for request in requests {
+				self.requests.fetch_add(1, Ordering::Relaxed);
+				for n in 0..request.count {
+					let start = (request.block as usize + n) * BLOCK_SIZE;
+					let disk = &mut data[start..start + BLOCK_SIZE];
+					let frame = unsafe { &mut *phys_to_virt(request.frames[n]).as_mut_ptr::<[u8; BLOCK_SIZE]>() };
+					if request.write {
+						disk.copy_from_slice(frame);
+					} else {
+						frame.copy_from_slice(disk);
+					}
+				}
+			}
+			Ok(())
+		}
+	}
+
+	pub fn test_block_cache_write_back_and_read_ahead() -> Result<(), TestError> {
+		let disk = MemDisk::new(32);
+		for (n, block) in disk.data.lock().chunks_mut(BLOCK_SIZE).enumerate() {
+			block.fill(n as u8);
+		}
+		let mut cache = BlockCache::new(Box::new(disk.clone()), READ_AHEAD + 2).unwrap();
+
+		assert_eq!(cache.read(0, |b| b[0]).unwrap(), 0);
+		assert_eq!(disk.requests.load(Ordering::Relaxed), 1);
+		// read along with block 0
+		for n in 1..READ_AHEAD as u64 {
+			assert_eq!(cache.read(n, |b| b[BLOCK_SIZE - 1]).unwrap(), n as u8);
+		}
+		assert_eq!(disk.requests.load(Ordering::Relaxed), 1);
+
+		// nothing reaches the disk before a sync
+		cache.write(3, |b| b[0] = 0xAA).unwrap();
+		assert_eq!(disk.data.lock()[3 * BLOCK_SIZE], 3);
+		assert_eq!(cache.sync().unwrap(), 1);
+		assert_eq!(disk.data.lock()[3 * BLOCK_SIZE], 0xAA);
+		assert_eq!(cache.sync().unwrap(), 0);
+
+		// more dirty blocks than fit, the evicted ones are written back
+		for n in 8..32u64 {
+			cache.overwrite(n, |b| b.fill(!(n as u8))).unwrap();
+		}
+		cache.sync().unwrap();
+		let data = disk.data.lock();
+		assert!((8..32).all(|n| data[n * BLOCK_SIZE..(n + 1) * BLOCK_SIZE].iter().all(|&b| b == !(n as u8))));
+		drop(data);
+
+		assert!(matches!(cache.read(32, |_| ()), Err(NullexError::InvalidArgument)));
+		Ok(())
+	}
+	crate::create_test!(test_block_cache_write_back_and_read_ahead);
+}
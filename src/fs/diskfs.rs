@@ -0,0 +1,708 @@
+//!
+//! fs/diskfs.rs
+//!
+//! A ramfs subtree kept on disk.
+//!
+//! Files under the mount point stay ordinary ramfs files and their pages are
+//! the page cache: mounting loads the disk into them, and `sync` writes back
+//! what was created or removed since and every file from the offset it was
+//! first changed at. A page is a block, so one is always written whole and
+//! nothing is read before a write. Writes go through the block cache, which
+//! sends them out sorted and batched. There is no journal, a crash in the
+//! middle of a sync may lose or tear what it was writing.
+//!
+//! On disk: a superblock, the block bitmap, the inode table and then data.
+//! Inode 0 is the mount point itself, every other inode names its parent, so
+//! there are no directory blocks.
+//!
+
+use alloc::{
+	boxed::Box,
+	string::{String, ToString},
+	vec::Vec
+};
+
+use hashbrown::HashMap;
+
+use crate::{
+	drivers::ahci,
+	ensure,
+	error::NullexError,
+	fs::{
+		bcache::{BLOCK_SIZE, BlockCache},
+		pages::FileData,
+		ramfs::{FileSystem, InodeId, Permission},
+		with_fs,
+		with_fs_read
+	},
+	serial_println,
+	task::timer,
+	utils::mutex::SpinMutex
+};
+
+/// Where the disk is mounted at boot.
+pub const MOUNT_POINT: &str = "/logs";
+
+/// Blocks kept in memory, 1 MiB.
+const CACHE_BLOCKS: usize = 256;
+
+/// How often `sync_task` writes back.
+const SYNC_INTERVAL_NS: u64 = 1_000_000_000;
+
+/// Most bytes of a file read in at mount. Only the end of a longer file is
+/// loaded, and written back whole as the file on the next sync, which is
+/// meant for logs.
+const MAX_LOAD_SIZE: u64 = 256 * 1024;
+
+const MAGIC: u64 = u64::from_le_bytes(*b"NULLEXFS");
+const VERSION: u32 = 1;
+
+const INODE_SIZE: usize = 128;
+const INODES_PER_BLOCK: u32 = (BLOCK_SIZE / INODE_SIZE) as u32;
+const DIRECT_BLOCKS: usize = 12;
+const POINTERS_PER_BLOCK: usize = BLOCK_SIZE / 4;
+const MAX_FILE_BLOCKS: usize = DIRECT_BLOCKS + POINTERS_PER_BLOCK;
+const NAME_MAX: usize = 56;
+const NAME_OFFSET: usize = INODE_SIZE - NAME_MAX;
+const ROOT_INODE: u32 = 0;
+
+const KIND_FREE: u8 = 0;
+const KIND_FILE: u8 = 1;
+const KIND_DIR: u8 = 2;
+
+static DISK_FS: SpinMutex<Option<DiskFs>> = SpinMutex::new(None);
+
+/// Block 0. Everything but the block count follows from it, see `layout`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct Superblock {
+	block_count: u32,
+	inode_count: u32,
+	bitmap_start: u32,
+	bitmap_blocks: u32,
+	inode_start: u32,
+	inode_blocks: u32,
+	data_start: u32
+}
+
+impl Superblock {
+	/// Layout of a disk of `block_count` blocks, an inode per 8 blocks and at
+	/// most 2048.
+	fn layout(block_count: u32) -> Self {
+		let bitmap_blocks = block_count.div_ceil(BLOCK_SIZE as u32 * 8);
+		let inode_blocks = (block_count / 256).clamp(1, 64);
+		Self {
+			block_count,
+			inode_count: inode_blocks * INODES_PER_BLOCK,
+			bitmap_start: 1,
+			bitmap_blocks,
+			inode_start: 1 + bitmap_blocks,
+			inode_blocks,
+			data_start: 1 + bitmap_blocks + inode_blocks
+		}
+	}
+
+	fn fields(&self) -> [u32; 7] {
+		[
+			self.block_count,
+			self.inode_count,
+			self.bitmap_start,
+			self.bitmap_blocks,
+			self.inode_start,
+			self.inode_blocks,
+			self.data_start
+		]
+	}
+
+	fn encode(&self, block: &mut [u8; BLOCK_SIZE]) {
+		block.fill(0);
+		block[0..8].copy_from_slice(&MAGIC.to_le_bytes());
+		block[8..12].copy_from_slice(&VERSION.to_le_bytes());
+		for (n, field) in self.fields().iter().enumerate() {
+			block[12 + n * 4..16 + n * 4].copy_from_slice(&field.to_le_bytes());
+		}
+	}
+
+	/// `None` for a disk that was never formatted.
+	fn decode(block: &[u8; BLOCK_SIZE]) -> Result<Option<Self>, NullexError> {
+		if block[0..8] != MAGIC.to_le_bytes() {
+			return Ok(None);
+		}
+		ensure!(read_u32(block, 8) == VERSION, NullexError::FsCorrupt("unknown version"));
+
+		let sb = Self::layout(read_u32(block, 12));
+		let matches = sb.fields().iter().enumerate().all(|(n, &field)| read_u32(block, 12 + n * 4) == field);
+		ensure!(matches, NullexError::FsCorrupt("bad superblock"));
+		Ok(Some(sb))
+	}
+}
+
+fn read_u32(bytes: &[u8], offset: usize) -> u32 {
+	u32::from_le_bytes(bytes[offset..offset + 4].try_into().unwrap())
+}
+
+/// An entry in the inode table.
+#[derive(Debug, Clone, Copy)]
+struct DiskInode {
+	kind: u8,
+	/// Inode of the directory it is in.
+	parent: u32,
+	size: u64,
+	/// Blocks 0 to 11 of a file, 0 if not allocated.
+	direct: [u32; DIRECT_BLOCKS],
+	/// Block holding the pointers to blocks 12 and on.
+	indirect: u32,
+	name: [u8; NAME_MAX],
+	name_len: u8
+}
+
+impl DiskInode {
+	const FREE: Self = Self {
+		kind: KIND_FREE,
+		parent: 0,
+		size: 0,
+		direct: [0; DIRECT_BLOCKS],
+		indirect: 0,
+		name: [0; NAME_MAX],
+		name_len: 0
+	};
+
+	fn new(kind: u8, parent: u32, name: &str) -> Result<Self, NullexError> {
+		ensure!(name.len() <= NAME_MAX, NullexError::NameTooLong);
+		let mut inode = Self { kind, parent, ..Self::FREE };
+		inode.name[..name.len()].copy_from_slice(name.as_bytes());
+		inode.name_len = name.len() as u8;
+		Ok(inode)
+	}
+
+	fn name(&self) -> Result<&str, NullexError> {
+		let len = (self.name_len as usize).min(NAME_MAX);
+		core::str::from_utf8(&self.name[..len]).map_err(|_| NullexError::FsCorrupt("bad name"))
+	}
+
+	fn encode(&self, out: &mut [u8]) {
+		out[..INODE_SIZE].fill(0);
+		out[0] = self.kind;
+		out[1] = self.name_len;
+		out[4..8].copy_from_slice(&self.parent.to_le_bytes());
+		out[8..16].copy_from_slice(&self.size.to_le_bytes());
+		for (n, block) in self.direct.iter().enumerate() {
+			out[16 + n * 4..20 + n * 4].copy_from_slice(&block.to_le_bytes());
+		}
+		out[64..68].copy_from_slice(&self.indirect.to_le_bytes());
+		out[NAME_OFFSET..INODE_SIZE].copy_from_slice(&self.name);
+	}
+
+	fn decode(bytes: &[u8]) -> Self {
+		let mut direct = [0; DIRECT_BLOCKS];
+		for (n, block) in direct.iter_mut().enumerate() {
+			*block = read_u32(bytes, 16 + n * 4);
+		}
+		Self {
+			kind: bytes[0],
+			parent: read_u32(bytes, 4),
+			size: u64::from_le_bytes(bytes[8..16].try_into().unwrap()),
+			direct,
+			indirect: read_u32(bytes, 64),
+			name: bytes[NAME_OFFSET..INODE_SIZE].try_into().unwrap(),
+			name_len: bytes[1]
+		}
+	}
+}
+
+/// An entry under the mount point as last written to disk.
+struct Mounted {
+	index: u32,
+	/// The ramfs file, `None` for a directory.
+	file: Option<InodeId>,
+	inode: DiskInode
+}
+
+/// A mounted disk, see the module docs.
+pub struct DiskFs {
+	cache: BlockCache,
+	sb: Superblock,
+	mount: String,
+	/// The block bitmap, kept in memory whole.
+	bitmap: Vec<u8>,
+	/// Bitmap blocks changed since the last `stage`.
+	bitmap_dirty: Vec<bool>,
+	/// Where the next block search starts, so files grow contiguously.
+	next_block: u32,
+	inode_used: Vec<bool>,
+	/// By path relative to the mount point.
+	entries: HashMap<String, Mounted>
+}
+
+impl DiskFs {
+	/// Mounts the disk behind `cache` at the empty or missing directory `at`
+	/// of `fs` and loads it, formatting it first if it never was.
+	pub fn mount(mut cache: BlockCache, fs: &mut FileSystem, at: &str) -> Result<Self, NullexError> {
+		let mount = at.trim_end_matches('/');
+		ensure!(!mount.is_empty(), NullexError::InvalidArgument);
+		if !fs.exists(mount) {
+			fs.create_dir(mount, Permission::all())?;
+		}
+		ensure!(fs.list_dir(mount)?.is_empty(), NullexError::MountPointNotEmpty);
+
+		let sb = match cache.read(0, Superblock::decode)?? {
+			Some(sb) => sb,
+			None => Self::format(&mut cache)?
+		};
+		ensure!(sb.block_count as u64 <= cache.block_count(), NullexError::FsCorrupt("disk shrank"));
+
+		let mut bitmap = Vec::with_capacity(sb.bitmap_blocks as usize * BLOCK_SIZE);
+		for n in 0..sb.bitmap_blocks {
+			cache.read((sb.bitmap_start + n) as u64, |block| bitmap.extend_from_slice(block))?;
+		}
+
+		let mut disk = Self {
+			cache,
+			sb,
+			mount: mount.to_string(),
+			bitmap,
+			bitmap_dirty: vec![false; sb.bitmap_blocks as usize],
+			next_block: sb.data_start,
+			inode_used: vec![false; sb.inode_count as usize],
+			entries: HashMap::new()
+		};
+		disk.inode_used[ROOT_INODE as usize] = true;
+		disk.load(fs)?;
+		Ok(disk)
+	}
+
+	fn format(cache: &mut BlockCache) -> Result<Superblock, NullexError> {
+		let block_count = cache.block_count().min(u32::MAX as u64) as u32;
+		let sb = Superblock::layout(block_count);
+		ensure!(sb.data_start < block_count, NullexError::DiskFull);
+		serial_println!("[DISKFS] Formatting {} blocks, {} inodes", block_count, sb.inode_count);
+
+		// the metadata blocks are in use
+		for n in 0..sb.bitmap_blocks {
+			let first = n * BLOCK_SIZE as u32 * 8;
+			cache.overwrite((sb.bitmap_start + n) as u64, |block| {
+				block.fill(0);
+				for bit in first..sb.data_start.min(first + BLOCK_SIZE as u32 * 8) {
+					let bit = (bit - first) as usize;
+					block[bit / 8] |= 1 << (bit % 8);
+				}
+			})?;
+		}
+		for n in 0..sb.inode_blocks {
+			cache.overwrite((sb.inode_start + n) as u64, |block| block.fill(0))?;
+		}
+		let root = DiskInode::new(KIND_DIR, ROOT_INODE, "")?;
+		cache.write(sb.inode_start as u64, |block| root.encode(&mut block[..INODE_SIZE]))?;
+		cache.overwrite(0, |block| sb.encode(block))?;
+		cache.sync()?;
+		Ok(sb)
+	}
+
+	/// Recreates every inode on disk under the mount point, parents first.
+	fn load(&mut self, fs: &mut FileSystem) -> Result<(), NullexError> {
+		let mut pending = Vec::new();
+		for index in 1..self.sb.inode_count {
+			let inode = self.read_inode(index)?;
+			if inode.kind != KIND_FREE {
+				self.inode_used[index as usize] = true;
+				pending.push((index, inode));
+			}
+		}
+
+		let mut paths: HashMap<u32, String> = HashMap::new();
+		paths.insert(ROOT_INODE, String::new());
+		while !pending.is_empty() {
+			let before = pending.len();
+			let mut waiting = Vec::new();
+			for (index, inode) in pending {
+				let Some(parent) = paths.get(&inode.parent) else {
+					waiting.push((index, inode));
+					continue;
+				};
+				let name = inode.name()?;
+				let path = if parent.is_empty() { name.to_string() } else { format!("{}/{}", parent, name) };
+				self.load_entry(fs, index, inode, &path)?;
+				if inode.kind == KIND_DIR {
+					paths.insert(index, path);
+				}
+			}
+			pending = waiting;
+
+			if pending.len() == before {
+				// their parents are gone, or they form a loop
+				serial_println!("[DISKFS] Dropping {} orphaned inodes", pending.len());
+				for (index, inode) in pending {
+					self.release(index, inode)?;
+				}
+				break;
+			}
+		}
+		Ok(())
+	}
+
+	fn load_entry(&mut self, fs: &mut FileSystem, index: u32, inode: DiskInode, path: &str) -> Result<(), NullexError> {
+		let full = format!("{}/{}", self.mount, path);
+		if inode.kind == KIND_DIR {
+			fs.create_dir(&full, Permission::all())?;
+			self.entries.insert(path.to_string(), Mounted { index, file: None, inode });
+			return Ok(());
+		}
+		ensure!(inode.kind == KIND_FILE, NullexError::FsCorrupt("bad inode kind"));
+
+		fs.create_file(&full, Permission::all())?;
+		let id = fs.lookup(&full)?;
+		let size = inode.size;
+		ensure!(size <= (MAX_FILE_BLOCKS * BLOCK_SIZE) as u64, NullexError::FsCorrupt("bad file size"));
+
+		let block_size = BLOCK_SIZE as u64;
+		let skip = size.saturating_sub(MAX_LOAD_SIZE).div_ceil(block_size);
+		for n in skip..size.div_ceil(block_size) {
+			let block = self.lookup_block(&inode, n as usize)?;
+			let len = (size - n * block_size).min(block_size) as usize;
+			self.cache.read(block, |data| fs.write_inode(id, &[&data[..len]], false))??;
+		}
+		if skip == 0 {
+			// the same as on disk
+			fs.take_dirty(id);
+		} else {
+			serial_println!("[DISKFS] {} has {} bytes, loaded the last {}", full, size, size - skip * block_size);
+		}
+
+		self.entries.insert(path.to_string(), Mounted { index, file: Some(id), inode });
+		Ok(())
+	}
+
+	/// Brings the disk in line with the subtree under the mount point in the
+	/// block cache, `flush` writes it out.
+	pub fn stage(&mut self, fs: &FileSystem) -> Result<(), NullexError> {
+		let tree = fs.tree(&self.mount)?;
+		let live: HashMap<&str, Option<InodeId>> = tree.iter().map(|(path, file)| (path.as_str(), *file)).collect();
+
+		// removed, or replaced by something else under the same name
+		let stale: Vec<String> = self
+			.entries
+			.iter()
+			.filter(|(path, entry)| live.get(path.as_str()) != Some(&entry.file))
+			.map(|(path, _)| path.clone())
+			.collect();
+		for path in stale {
+			let entry = self.entries.remove(&path).unwrap();
+			self.release(entry.index, entry.inode)?;
+		}
+
+		// parents come before their children
+		for (path, file) in &tree {
+			let fresh = !self.entries.contains_key(path);
+			if fresh {
+				let (parent, name) = match path.rsplit_once('/') {
+					Some((parent, name)) => (self.entries[parent].index, name),
+					None => (ROOT_INODE, path.as_str())
+				};
+				let kind = if file.is_some() { KIND_FILE } else { KIND_DIR };
+				let inode = DiskInode::new(kind, parent, name)?;
+				let index = self.alloc_inode()?;
+				self.write_inode(index, &inode)?;
+				self.entries.insert(path.clone(), Mounted { index, file: *file, inode });
+			}
+
+			let Some(id) = *file else { continue };
+			let dirty = fs.take_dirty(id);
+			if let Some(from) = if fresh { Some(0) } else { dirty } {
+				let entry = &self.entries[path];
+				let (index, mut inode) = (entry.index, entry.inode);
+				let result = self.write_data(&mut inode, &fs.inode(id)?.content, from);
+				// blocks allocated before a failure are still referenced
+				self.write_inode(index, &inode)?;
+				self.entries.get_mut(path).unwrap().inode = inode;
+				result?;
+			}
+		}
+
+		for n in 0..self.bitmap_dirty.len() {
+			if self.bitmap_dirty[n] {
+				let bits = &self.bitmap[n * BLOCK_SIZE..(n + 1) * BLOCK_SIZE];
+				self.cache.overwrite((self.sb.bitmap_start as usize + n) as u64, |block| block.copy_from_slice(bits))?;
+				self.bitmap_dirty[n] = false;
+			}
+		}
+		Ok(())
+	}
+
+	/// Writes everything staged to the disk. Returns the number of blocks
+	/// written.
+	pub fn flush(&mut self) -> Result<usize, NullexError> {
+		self.cache.sync()
+	}
+
+	/// Writes `data` from the page holding offset `from` on and fits the
+	/// inode to its length.
+	fn write_data(&mut self, inode: &mut DiskInode, data: &FileData, from: usize) -> Result<(), NullexError> {
+		let blocks = data.len().div_ceil(BLOCK_SIZE);
+		ensure!(blocks <= MAX_FILE_BLOCKS, NullexError::FileTooLarge);
+
+		for (n, page) in data.pages().iter().enumerate().take(blocks).skip(from / BLOCK_SIZE) {
+			let block = self.block_of(inode, n)?;
+			self.cache.overwrite(block, |buf| buf.copy_from_slice(page.bytes()))?;
+		}
+		self.truncate(inode, blocks)?;
+		inode.size = data.len() as u64;
+		Ok(())
+	}
+
+	/// Block `n` of a file, allocated if it is not yet.
+	fn block_of(&mut self, inode: &mut DiskInode, n: usize) -> Result<u64, NullexError> {
+		if n < DIRECT_BLOCKS {
+			if inode.direct[n] == 0 {
+				inode.direct[n] = self.alloc_block()?;
+			}
+			return Ok(inode.direct[n] as u64);
+		}
+
+		let slot = (n - DIRECT_BLOCKS) * 4;
+		ensure!(slot < BLOCK_SIZE, NullexError::FileTooLarge);
+		if inode.indirect == 0 {
+			inode.indirect = self.alloc_block()?;
+			self.cache.overwrite(inode.indirect as u64, |block| block.fill(0))?;
+		}
+		let indirect = inode.indirect as u64;
+		let mut block = self.cache.read(indirect, |pointers| read_u32(pointers, slot))?;
+		if block == 0 {
+			block = self.alloc_block()?;
+			self.cache.write(indirect, |pointers| pointers[slot..slot + 4].copy_from_slice(&block.to_le_bytes()))?;
+		}
+		Ok(block as u64)
+	}
+
+	/// Block `n` of a file that has it.
+	fn lookup_block(&mut self, inode: &DiskInode, n: usize) -> Result<u64, NullexError> {
+		let block = if n < DIRECT_BLOCKS {
+			inode.direct[n]
+		} else {
+			ensure!(inode.indirect != 0, NullexError::FsCorrupt("bad block pointer"));
+			let slot = (n - DIRECT_BLOCKS) * 4;
+			self.cache.read(inode.indirect as u64, |pointers| read_u32(pointers, slot))?
+		};
+		ensure!(self.is_data_block(block), NullexError::FsCorrupt("bad block pointer"));
+		Ok(block as u64)
+	}
+
+	/// If `block` lies in the data area, where every valid block pointer goes.
+	fn is_data_block(&self, block: u32) -> bool {
+		block >= self.sb.data_start && block < self.sb.block_count
+	}
+
+	/// Frees the blocks of a file from block `keep` on. Bad pointers (see
+	/// `free_block`) are skipped, an indirect block outside the data area is
+	/// not read at all.
+	fn truncate(&mut self, inode: &mut DiskInode, keep: usize) -> Result<(), NullexError> {
+		for n in keep..DIRECT_BLOCKS {
+			if inode.direct[n] != 0 {
+				self.free_block(inode.direct[n]);
+				inode.direct[n] = 0;
+			}
+		}
+		if inode.indirect == 0 {
+			return Ok(());
+		}
+		if !self.is_data_block(inode.indirect) {
+			serial_println!("[DISKFS] Skipping bad indirect block pointer {}", inode.indirect);
+			if keep <= DIRECT_BLOCKS {
+				inode.indirect = 0;
+			}
+			return Ok(());
+		}
+
+		let indirect = inode.indirect as u64;
+		let slots = (keep.saturating_sub(DIRECT_BLOCKS) * 4..BLOCK_SIZE).step_by(4);
+		let freed: Vec<u32> = self.cache.read(indirect, |pointers| {
+			slots.clone().map(|slot| read_u32(pointers, slot)).filter(|&block| block != 0).collect()
+		})?;
+		// only dirtied if there is something to free, a growing file has not
+		if !freed.is_empty() {
+			self.cache.write(indirect, |pointers| {
+				for slot in slots {
+					pointers[slot..slot + 4].fill(0);
+				}
+			})?;
+			for block in freed {
+				self.free_block(block);
+			}
+		}
+		if keep <= DIRECT_BLOCKS {
+			self.free_block(inode.indirect);
+			inode.indirect = 0;
+		}
+		Ok(())
+	}
+
+	/// Frees an inode and its blocks.
+	fn release(&mut self, index: u32, mut inode: DiskInode) -> Result<(), NullexError> {
+		self.truncate(&mut inode, 0)?;
+		self.inode_used[index as usize] = false;
+		self.write_inode(index, &DiskInode::FREE)
+	}
+
+	fn inode_location(&self, index: u32) -> (u64, usize) {
+		(
+			(self.sb.inode_start + index / INODES_PER_BLOCK) as u64,
+			(index % INODES_PER_BLOCK) as usize * INODE_SIZE
+		)
+	}
+
+	fn read_inode(&mut self, index: u32) -> Result<DiskInode, NullexError> {
+		let (block, offset) = self.inode_location(index);
+		self.cache.read(block, |bytes| DiskInode::decode(&bytes[offset..offset + INODE_SIZE]))
+	}
+
+	fn write_inode(&mut self, index: u32, inode: &DiskInode) -> Result<(), NullexError> {
+		let (block, offset) = self.inode_location(index);
+		self.cache.write(block, |bytes| inode.encode(&mut bytes[offset..offset + INODE_SIZE]))
+	}
+
+	fn alloc_inode(&mut self) -> Result<u32, NullexError> {
+		let index = self.inode_used.iter().position(|used| !used).ok_or(NullexError::DiskFull)?;
+		self.inode_used[index] = true;
+		Ok(index as u32)
+	}
+
+	fn alloc_block(&mut self) -> Result<u32, NullexError> {
+		let (start, end) = (self.sb.data_start, self.sb.block_count);
+		for n in 0..end - start {
+			let block = start + (self.next_block - start + n) % (end - start);
+			let (byte, bit) = (block as usize / 8, block % 8);
+			if self.bitmap[byte] & (1 << bit) == 0 {
+				self.bitmap[byte] |= 1 << bit;
+				self.bitmap_dirty[byte / BLOCK_SIZE] = true;
+				self.next_block = if block + 1 == end { start } else { block + 1 };
+				return Ok(block);
+			}
+		}
+		Err(NullexError::DiskFull)
+	}
+
+	/// Marks a data block free. A pointer outside the data area comes from a
+	/// corrupt inode, it is reported and left alone instead of clearing the bit
+	/// of a metadata block (or indexing past the bitmap).
+	fn free_block(&mut self, block: u32) {
+		if !self.is_data_block(block) {
+			serial_println!("[DISKFS] Skipping bad block pointer {}", block);
+			return;
+		}
+		let byte = block as usize / 8;
+		self.bitmap[byte] &= !(1 << (block % 8));
+		self.bitmap_dirty[byte / BLOCK_SIZE] = true;
+	}
+}
+
+/// Mounts the first SATA disk at `MOUNT_POINT`.
+pub fn mount() -> Result<(), NullexError> {
+	let disk = ahci::take_disk().ok_or(NullexError::DeviceNotFound)?;
+	let cache = BlockCache::new(Box::new(disk), CACHE_BLOCKS)?;
+	let disk = with_fs(|fs| DiskFs::mount(cache, fs, MOUNT_POINT))?;
+	serial_println!("[DISKFS] Mounted at {}, {} entries", MOUNT_POINT, disk.entries.len());
+	*DISK_FS.lock() = Some(disk);
+	Ok(())
+}
+
+/// If a disk is mounted.
+pub fn mounted() -> bool {
+	DISK_FS.lock().is_some()
+}
+
+/// Writes the mounted disk back. The filesystem is only read locked while the
+/// changes are copied into the block cache, so files stay usable, and not at
+/// all for the disk I/O. Returns the number of blocks written.
+pub fn sync() -> Result<usize, NullexError> {
+	let mut disk_fs = DISK_FS.lock();
+	let Some(disk) = disk_fs.as_mut() else {
+		return Ok(0);
+	};
+	with_fs_read(|fs| disk.stage(fs))?;
+	disk.flush()
+}
+
+/// Syncs every `SYNC_INTERVAL_NS`, run as a process once a disk is mounted.
+pub async fn sync_task() -> i32 {
+	loop {
+		timer::sleep_ns(SYNC_INTERVAL_NS).await;
+		if let Err(e) = sync() {
+			serial_println!("[DISKFS] Sync failed: {}", e);
+		}
+	}
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use alloc::{boxed::Box, vec::Vec};
+
+	use crate::{
+		fs::{
+			bcache::{BLOCK_SIZE, BlockCache, tests::MemDisk},
+			diskfs::{DiskFs, DiskInode, KIND_FILE, MAGIC},
+			ramfs::{FileSystem, Permission}
+		},
+		utils::ktest::TestError
+	};
+
+	fn remount(disk: &MemDisk) -> (DiskFs, FileSystem) {
+		let mut fs = FileSystem::new();
+		let cache = BlockCache::new(Box::new(disk.clone()), 16).unwrap();
+		let disk_fs = DiskFs::mount(cache, &mut fs, "/m").unwrap();
+		(disk_fs, fs)
+	}
+
+	pub fn test_diskfs_survives_remount() -> Result<(), TestError> {
+		let disk = MemDisk::new(512);
+		let (mut disk_fs, mut fs) = remount(&disk);
+		assert_eq!(disk.data.lock()[0..8], MAGIC.to_le_bytes());
+
+		// past the direct blocks, and more than the cache holds
+		let big: Vec<u8> = (0..14 * BLOCK_SIZE + 100).map(|n| (n % 251) as u8).collect();
+		fs.create_dir("/m/d", Permission::all()).unwrap();
+		fs.create_file("/m/d/big", Permission::all()).unwrap();
+		fs.write_file("/m/d/big", &big, true).unwrap();
+		fs.create_file("/m/log", Permission::all()).unwrap();
+		fs.write_file("/m/log", b"first\n", false).unwrap();
+		disk_fs.stage(&fs).unwrap();
+		disk_fs.flush().unwrap();
+
+		fs.write_file("/m/log", b"second\n", false).unwrap();
+		fs.write_file("/m/d/big", b"small", true).unwrap();
+		fs.create_file("/m/gone", Permission::all()).unwrap();
+		disk_fs.stage(&fs).unwrap();
+		fs.remove("/m/gone", false, false).unwrap();
+		disk_fs.stage(&fs).unwrap();
+		disk_fs.flush().unwrap();
+		let used: u32 = disk_fs.bitmap.iter().map(|byte| byte.count_ones()).sum();
+		drop(disk_fs);
+
+		let (disk_fs, fs) = remount(&disk);
+		assert_eq!(fs.read_file("/m/log").unwrap().as_slice(), b"first\nsecond\n");
+		assert_eq!(fs.read_file("/m/d/big").unwrap().as_slice(), b"small");
+		assert!(!fs.exists("/m/gone"));
+		// a block each for log and big, the rest was freed
+		assert_eq!(used, disk_fs.sb.data_start + 2);
+		Ok(())
+	}
+	crate::create_test!(test_diskfs_survives_remount);
+
+	pub fn test_release_skips_bad_block_pointers() -> Result<(), TestError> {
+		let disk = MemDisk::new(512);
+		let (mut disk_fs, _fs) = remount(&disk);
+		let used = |disk_fs: &DiskFs| -> u32 { disk_fs.bitmap.iter().map(|byte| byte.count_ones()).sum() };
+		let before = used(&disk_fs);
+
+		// pointing into the bitmap, past the end of the disk and, for the
+		// indirect block, at the inode table
+		let mut inode = DiskInode::FREE;
+		inode.kind = KIND_FILE;
+		inode.direct[0] = 1;
+		inode.direct[1] = disk_fs.sb.block_count + 7;
+		inode.indirect = disk_fs.sb.inode_start;
+		let index = disk_fs.alloc_inode().unwrap();
+		disk_fs.release(index, inode).unwrap();
+
+		assert_eq!(used(&disk_fs), before);
+		Ok(())
+	}
+	crate::create_test!(test_release_skips_bad_block_pointers);
+}
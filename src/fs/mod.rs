@@ -6,6 +6,9 @@
 
 #[allow(missing_docs)]
 pub mod ata;
+pub mod bcache;
+pub mod diskfs;
+pub mod pages;
 pub mod ramfs;
 
 use alloc::{
@@ -13,28 +16,39 @@ use alloc::{
 	vec::Vec
 };
 
-use crate::{drivers::keyboard::scancode::CWD, fs::ramfs::FileSystem, utils::mutex::SpinMutex};
+use x86_64::instructions::interrupts;
+
+use crate::{drivers::keyboard::scancode::CWD, fs::ramfs::FileSystem, utils::spin::rwlock::RwLock};
 
 // TODO: maybe lazy_static!
-/// Current `FileSystem` in use.
-pub static FS: SpinMutex<Option<FileSystem>> = SpinMutex::new(None);
+/// Current `FileSystem` in use. The lock only guards the directory tree, file
+/// contents have a lock each, see `FileSystem::inode`.
+pub static FS: RwLock<Option<FileSystem>> = RwLock::new(None);
 
 /// Initialises the kernel's `FileSystem`
 pub fn init_fs(fs: FileSystem) {
-	*FS.lock() = Some(fs);
+	*FS.write() = Some(fs);
 }
 
-/// Use the current `FileSystem` to perform an action.
+/// Use the current `FileSystem` to perform an action that changes the tree:
+/// creating or removing entries. Waits for everyone else to leave it.
 pub fn with_fs<R>(f: impl FnOnce(&mut FileSystem) -> R) -> R {
-	let mut fs_lock = FS.lock();
+	// like `SpinMutex`, nothing may interrupt the holder and want it too
+	interrupts::disable();
+	let mut fs_lock = FS.write();
 	let fs_ref = fs_lock.as_mut().expect("Filesystem must be initialized");
 
-	// release VGA lock before FS operations
-	unsafe { crate::vga_buffer::WRITER.force_unlock() };
-	let result = f(fs_ref);
-	crate::vga_buffer::WRITER.lock();
+	f(fs_ref)
+}
+
+/// Use the current `FileSystem` to look up, read or write files. Any number of
+/// these run at once, each file is only locked while it is accessed.
+pub fn with_fs_read<R>(f: impl FnOnce(&FileSystem) -> R) -> R {
+	interrupts::disable();
+	let fs_lock = FS.read();
+	let fs_ref = fs_lock.as_ref().expect("Filesystem must be initialized");
 
-	result
+	f(fs_ref)
 }
 
 /// Helper function to resolve a file path relative to the current working
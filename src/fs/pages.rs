@@ -0,0 +1,269 @@
+//!
+//! fs/pages.rs
+//!
+//! Page-backed file contents for the ramfs.
+//!
+
+use alloc::{
+	alloc::{alloc_zeroed, handle_alloc_error},
+	boxed::Box,
+	sync::Arc,
+	vec::Vec
+};
+use core::alloc::Layout;
+
+/// Size of one file page in bytes.
+pub const FILE_PAGE_SIZE: usize = 4096;
+
+#[repr(C, align(4096))]
+struct PageBuf([u8; FILE_PAGE_SIZE]);
+
+/// One page aligned, page sized chunk of file data.
+///
+/// The buffer sits in its own heap page (the refcount of the surrounding `Arc`
+/// lives elsewhere), so it can be mapped into userspace without exposing any
+/// other kernel data.
+pub struct FilePage(Box<PageBuf>);
+
+impl FilePage {
+	fn zeroed() -> Self {
+		let layout = Layout::new::<PageBuf>();
+		// allocate in place, a 4 KiB temporary on the kernel stack is wasteful
+		let ptr = unsafe { alloc_zeroed(layout) } as *mut PageBuf;
+		if ptr.is_null() {
+			handle_alloc_error(layout);
+		}
+		Self(unsafe { Box::from_raw(ptr) })
+	}
+
+	/// The bytes of this page.
+	pub fn bytes(&self) -> &[u8; FILE_PAGE_SIZE] {
+		&self.0.0
+	}
+
+	/// Kernel virtual address of the page, page aligned.
+	pub fn addr(&self) -> u64 {
+		self.0.0.as_ptr() as u64
+	}
+}
+
+impl Clone for FilePage {
+	fn clone(&self) -> Self {
+		let mut page = Self::zeroed();
+		page.0.0.copy_from_slice(&self.0.0);
+		page
+	}
+}
+
+/// Contents of a ramfs file, stored as a list of shared pages.
+///
+/// Appends fill the last page and then add new ones, so growing a file never
+/// moves the data already written. Pages are reference counted: `mapf` and the
+/// ELF loader keep clones of them, and a write to a shared page copies it first
+/// so holders keep seeing the old contents.
+#[derive(Clone, Default)]
+pub struct FileData {
+	pages: Vec<Arc<FilePage>>,
+	len: usize
+}
+
+impl FileData {
+	/// An empty file.
+	pub const fn new() -> Self {
+		Self {
+			pages: Vec::new(),
+			len: 0
+		}
+	}
+
+	/// Length in bytes.
+	pub fn len(&self) -> usize {
+		self.len
+	}
+
+	/// If the file holds no data.
+	pub fn is_empty(&self) -> bool {
+		self.len == 0
+	}
+
+	/// The backing pages, the last one may be partially used (its tail is zero).
+	pub fn pages(&self) -> &[Arc<FilePage>] {
+		&self.pages
+	}
+
+	/// Appends `bytes` to the end of the file.
+	pub fn append(&mut self, mut bytes: &[u8]) {
+		while !bytes.is_empty() {
+			let page_idx = self.len / FILE_PAGE_SIZE;
+			let offset = self.len % FILE_PAGE_SIZE;
+
+			if page_idx == self.pages.len() {
+				self.pages.push(Arc::new(FilePage::zeroed()));
+			}
+
+			let n = core::cmp::min(bytes.len(), FILE_PAGE_SIZE - offset);
+			// copies the page only if a mapping still shares it
+			let page = Arc::make_mut(&mut self.pages[page_idx]);
+			page.0.0[offset..offset + n].copy_from_slice(&bytes[..n]);
+
+			self.len += n;
+			bytes = &bytes[n..];
+		}
+	}
+
+	/// Shrinks the file to `len` bytes, keeping pages that are still needed.
+	pub fn truncate(&mut self, len: usize) {
+		if len >= self.len {
+			return;
+		}
+		self.len = len;
+		self.pages.truncate(len.div_ceil(FILE_PAGE_SIZE));
+
+		// keep the tail of the last page zero, it is visible through mappings
+		let offset = len % FILE_PAGE_SIZE;
+		if offset != 0
+			&& let Some(last) = self.pages.last_mut()
+		{
+			Arc::make_mut(last).0.0[offset..].fill(0);
+		}
+	}
+
+	/// Replaces the contents with `parts`, reusing pages nobody else holds.
+	pub fn overwrite(&mut self, parts: &[&[u8]]) {
+		let old_len = self.len;
+		// rewrite from the start, then drop whatever the old contents had beyond
+		self.len = 0;
+		for part in parts {
+			self.append(part);
+		}
+		let new_len = self.len;
+		self.len = core::cmp::max(old_len, new_len);
+		self.truncate(new_len);
+	}
+
+	/// Copies bytes starting at `offset` into `buf`, returns how many were
+	/// copied (0 at or past the end).
+	pub fn read_at(&self, offset: usize, buf: &mut [u8]) -> usize {
+		let total = core::cmp::min(buf.len(), self.len.saturating_sub(offset));
+		let mut done = 0;
+
+		while done < total {
+			let pos = offset + done;
+			let page = &self.pages[pos / FILE_PAGE_SIZE];
+			let in_page = pos % FILE_PAGE_SIZE;
+			let n = core::cmp::min(total - done, FILE_PAGE_SIZE - in_page);
+			buf[done..done + n].copy_from_slice(&page.bytes()[in_page..in_page + n]);
+			done += n;
+		}
+
+		total
+	}
+
+	/// Iterates over the file contents one page sized slice at a time.
+	pub fn chunks(&self) -> impl Iterator<Item = &[u8]> {
+		let len = self.len;
+		self.pages.iter().enumerate().map(move |(i, page)| {
+			let end = core::cmp::min(FILE_PAGE_SIZE, len - i * FILE_PAGE_SIZE);
+			&page.bytes()[..end]
+		})
+	}
+
+	/// Copies the whole file into one contiguous buffer.
+	pub fn to_vec(&self) -> Vec<u8> {
+		let mut out = Vec::with_capacity(self.len);
+		for chunk in self.chunks() {
+			out.extend_from_slice(chunk);
+		}
+		out
+	}
+}
+
+impl core::fmt::Debug for FileData {
+	fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+		f.debug_struct("FileData")
+			.field("len", &self.len)
+			.field("pages", &self.pages.len())
+			.finish()
+	}
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use crate::{fs::pages::{FILE_PAGE_SIZE, FileData}, utils::ktest::TestError};
+
+	pub fn test_append_across_pages() -> Result<(), TestError> {
+		let mut data = FileData::new();
+		let chunk = [0x5au8; 1000];
+		for _ in 0..10 {
+			data.append(&chunk);
+		}
+
+		assert_eq!(data.len(), 10_000);
+		assert_eq!(data.pages().len(), 10_000usize.div_ceil(FILE_PAGE_SIZE));
+
+		let mut buf = [0u8; 300];
+		assert_eq!(data.read_at(FILE_PAGE_SIZE - 100, &mut buf), 300);
+		assert!(buf.iter().all(|b| *b == 0x5a));
+		assert_eq!(data.read_at(9_900, &mut buf), 100);
+		Ok(())
+	}
+	crate::create_test!(test_append_across_pages);
+
+	pub fn test_shared_page_copied_on_write() -> Result<(), TestError> {
+		let mut data = FileData::new();
+		data.append(b"before");
+		let held = data.pages()[0].clone();
+
+		data.overwrite(&[b"after"]);
+
+		assert_eq!(&held.bytes()[..6], b"before");
+		assert_eq!(data.to_vec().as_slice(), b"after");
+		// the tail of the live page has been cleared again
+		assert_eq!(data.pages()[0].bytes()[5], 0);
+		Ok(())
+	}
+	crate::create_test!(test_shared_page_copied_on_write);
+
+	pub fn test_append_keeps_written_pages() -> Result<(), TestError> {
+		let mut data = FileData::new();
+		let line = [b'x'; 96];
+		data.append(&line);
+		let first = data.pages()[0].addr();
+
+		// a syslog's worth of lines, never moving what is already there
+		for _ in 0..2048 {
+			data.append(&line);
+		}
+		assert_eq!(data.pages()[0].addr(), first);
+		assert_eq!(data.pages().len(), (2049 * line.len()).div_ceil(FILE_PAGE_SIZE));
+		Ok(())
+	}
+	crate::create_test!(test_append_keeps_written_pages);
+}
+
+#[cfg(feature = "kbench")]
+pub mod benches {
+	use alloc::vec::Vec;
+
+	use crate::{
+		fs::pages::FileData,
+		utils::ktest::{self, TestError}
+	};
+
+	/// Syslog style appends, the old contiguous `Vec<u8>` storage as the
+	/// baseline against `FileData`.
+	pub fn bench_append() -> Result<(), TestError> {
+		let line = [b'x'; 96];
+
+		let mut flat: Vec<u8> = Vec::new();
+		ktest::bench("file_append_vec", 2048, |_| {
+			flat.extend_from_slice(&line);
+		});
+		let mut paged = FileData::new();
+		ktest::bench("file_append_paged", 2048, |_| {
+			paged.append(&line);
+		});
+		Ok(())
+	}
+	crate::create_bench!(bench_append);
+}
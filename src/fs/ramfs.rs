@@ -9,11 +9,23 @@ use alloc::{
 	string::{String, ToString},
 	vec::Vec
 };
-use core::{fmt, str};
+use core::{fmt, hash::BuildHasher, str};
 
-use hashbrown::HashMap;
+use hashbrown::{DefaultHashBuilder, HashMap};
 
-use crate::{fs::init_fs, utils::elf::HELLO_ELF};
+use crate::{
+	fs::{init_fs, pages::FileData},
+	utils::{
+		elf::{BENCH_ELF, HELLO_ELF, NOP_ELF, STRBENCH_ELF},
+		mutex::{SpinMutex, SpinMutexGuard}
+	}
+};
+
+/// Shards of the dentry cache, each behind its own lock so lookups of
+/// different paths rarely meet.
+const DCACHE_SHARDS: usize = 16;
+/// Paths a shard holds before it is emptied and starts over.
+const DCACHE_SHARD_ENTRIES: usize = 32;
 
 #[derive(Debug, Clone, Copy, PartialEq)]
 /// Permission Levels for file access.
@@ -46,22 +58,39 @@ impl Permission {
 	}
 }
 
+/// Stable identifier for a file in a `FileSystem`. Ids are never reused, so a
+/// handle to a removed file fails its lookup instead of aliasing a new file.
+pub type InodeId = u64;
+
 #[derive(Debug)]
 /// Structure representing a file in the file system.
 pub struct File {
-	/// Content in bytes.
-	pub content: Vec<u8>,
+	/// Content in bytes, stored in shareable pages.
+	pub content: FileData,
 	/// Permission level for the file.
-	pub permission: Permission
+	pub permission: Permission,
+	/// Offset from which the content changed since the last `take_dirty`,
+	/// what a disk under it has to write back.
+	dirty_from: Option<usize>,
+	/// Bumped by every write, what was built from one version of the content
+	/// is stale once it changes.
+	version: u64
 }
 
 impl File {
 	fn new(permission: Permission) -> Self {
 		Self {
-			content: Vec::new(),
-			permission
+			content: FileData::new(),
+			permission,
+			dirty_from: None,
+			version: 0
 		}
 	}
+
+	/// How many times the file was written, see `FileSystem::write_inode`.
+	pub fn version(&self) -> u64 {
+		self.version
+	}
 }
 
 #[derive(Debug)]
@@ -83,11 +112,12 @@ impl Directory {
 
 #[derive(Debug)]
 enum Entry {
-	File(File),
+	/// Files live in the inode table, the directory only names them.
+	File(InodeId),
 	Directory(Box<Directory>)
 }
 
-#[derive(Debug)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
 /// Enum for all filesystem errors.
 pub enum FsError {
 	/// Entry not found
@@ -122,9 +152,18 @@ impl fmt::Display for FsError {
 
 // TODO: put this as a trait.
 /// Structure representing a FileSystem.
+///
+/// Changing the tree takes `&mut self`, everything else `&self`: files are
+/// locked one by one when accessed, and lookups go through the dentry cache.
 pub struct FileSystem {
 	root: Directory,
-	current_path: Vec<String>
+	current_path: Vec<String>,
+	inodes: HashMap<InodeId, SpinMutex<File>>,
+	next_inode: InodeId,
+	/// Canonical absolute path to file, filled by `lookup`. Only files are
+	/// cached, and a file's path keeps naming it until it is removed.
+	dcache: [SpinMutex<HashMap<Box<str>, InodeId>>; DCACHE_SHARDS],
+	dcache_hasher: DefaultHashBuilder
 }
 
 impl FileSystem {
@@ -132,68 +171,116 @@ impl FileSystem {
 	pub fn new() -> FileSystem {
 		Self {
 			root: Directory::new(Permission::all()),
-			current_path: Vec::new()
+			current_path: Vec::new(),
+			inodes: HashMap::new(),
+			next_inode: 1,
+			dcache: core::array::from_fn(|_| SpinMutex::new(HashMap::new())),
+			dcache_hasher: DefaultHashBuilder::default()
 		}
 	}
 
 	/// Creates a new file in the current `FileSystem`, unless one is already created.
 	pub fn create_file(&mut self, path: &str, perm: Permission) -> Result<(), FsError> {
 		let (dir_components, file_name) = Self::split_path(path)?;
-		let dir = self.get_dir_mut_from_components(&dir_components.as_slice())?;
+		let dir = Self::dir_mut(&mut self.root, &dir_components)?;
 
-		if dir.entries.contains_key(&file_name) {
+		if dir.entries.contains_key(file_name) {
 			return Err(FsError::AlreadyExists);
 		}
 
-		dir.entries.insert(file_name, Entry::File(File::new(perm)));
+		let id = self.next_inode;
+		self.next_inode += 1;
+		dir.entries.insert(file_name.to_string(), Entry::File(id));
+		self.inodes.insert(id, SpinMutex::new(File::new(perm)));
 		Ok(())
 	}
 
 	/// Creates a new directory in the current `FileSystem`, unless one is already created.
 	pub fn create_dir(&mut self, path: &str, perm: Permission) -> Result<(), FsError> {
 		let (dir_components, dir_name) = Self::split_path(path)?;
-		let dir = self.get_dir_mut_from_components(&dir_components.as_slice())?;
+		let dir = Self::dir_mut(&mut self.root, &dir_components)?;
 
-		if dir.entries.contains_key(&dir_name) {
+		if dir.entries.contains_key(dir_name) {
 			return Err(FsError::AlreadyExists);
 		}
 
 		dir.entries
-			.insert(dir_name, Entry::Directory(Box::new(Directory::new(perm))));
+			.insert(dir_name.to_string(), Entry::Directory(Box::new(Directory::new(perm))));
 		Ok(())
 	}
 
 	/// Writes to a file that already exists
 	pub fn write_file(
-		&mut self,
+		&self,
 		path: &str,
 		content: &[u8],
 		overwrite: bool
 	) -> Result<(), FsError> {
-		let file = self.get_file_mut(path)?;
+		let id = self.lookup(path)?;
+		self.write_inode(id, &[content], overwrite).map(|_| ())
+	}
+
+	/// Writes several buffers to a file that already exists with a single path
+	/// walk. The parts are written back to back, in order.
+	pub fn write_file_vectored(
+		&self,
+		path: &str,
+		parts: &[&[u8]],
+		overwrite: bool
+	) -> Result<usize, FsError> {
+		let id = self.lookup(path)?;
+		self.write_inode(id, parts, overwrite)
+	}
+
+	/// Writes to an already resolved file, see `lookup`. Returns the number of
+	/// bytes written.
+	pub fn write_inode(
+		&self,
+		id: InodeId,
+		parts: &[&[u8]],
+		overwrite: bool
+	) -> Result<usize, FsError> {
+		let mut file = self.inode(id)?;
 		// check if the file has write permission before appending
 		if !file.permission.write {
 			return Err(FsError::PermissionDenied);
 		}
-		// append the new content instead of overwriting
+		let total: usize = parts.iter().map(|p| p.len()).sum();
+		let changed_from = if overwrite { 0 } else { file.content.len() };
 		if overwrite {
-			file.content = content.to_vec();
+			// reuses the existing pages unless a mapping still holds them
+			file.content.overwrite(parts);
 		} else {
-			file.content.extend_from_slice(content);
+			// append the new content instead of overwriting
+			for part in parts {
+				file.content.append(part);
+			}
 		}
-		Ok(())
+		file.dirty_from = Some(file.dirty_from.map_or(changed_from, |from| from.min(changed_from)));
+		file.version += 1;
+		Ok(total)
+	}
+
+	/// Offset from which file `id` changed since this was last called, `None`
+	/// if it did not.
+	pub fn take_dirty(&self, id: InodeId) -> Option<usize> {
+		self.inode(id).ok()?.dirty_from.take()
 	}
 
 	/// Read the current file.
 	// todo: add read permission checks, forgot to add this before.
-	pub fn read_file(&self, path: &str) -> Result<&[u8], FsError> {
+	///
+	/// File data is paged, this copies it out into one contiguous buffer. Use
+	/// `get_file` and `FileData::read_at` to avoid the copy.
+	pub fn read_file(&self, path: &str) -> Result<Vec<u8>, FsError> {
 		let file = self.get_file(path)?;
-		Ok(&file.content.as_slice())
+		Ok(file.content.to_vec())
 	}
 
 	// ----- HELPER FUNCTIONS ----- //
 
-	fn path_components(path: &str) -> Result<Vec<String>, FsError> {
+	// borrowed from the path, walking it allocates nothing but the list
+	fn path_components(path: &str) -> Result<Vec<&str>, FsError> {
 		let mut components = Vec::new();
 		for component in path.split('/').filter(|s| !s.is_empty()) {
 			if component == "." {
@@ -203,42 +290,66 @@ impl FileSystem {
 					return Err(FsError::InvalidPath);
 				}
 			} else {
-				components.push(component.to_string());
+				components.push(component);
 			}
 		}
 		Ok(components)
 	}
 
-	fn split_path(path: &str) -> Result<(Vec<String>, String), FsError> {
-		let components = Self::path_components(path)?;
-		if components.is_empty() {
-			return Err(FsError::InvalidPath);
-		}
-		let (dir_path, name) = components.split_at(components.len() - 1);
-		Ok((dir_path.to_vec(), name[0].clone()))
+	fn split_path(path: &str) -> Result<(Vec<&str>, &str), FsError> {
+		let mut components = Self::path_components(path)?;
+		let name = components.pop().ok_or(FsError::InvalidPath)?;
+		Ok((components, name))
 	}
 
-	fn resolve_path(&self, path: &str) -> Result<Vec<String>, FsError> {
-		let base = if path.starts_with('/') {
+	fn resolve_path<'a>(&'a self, path: &'a str) -> Result<Vec<&'a str>, FsError> {
+		let mut components: Vec<&str> = if path.starts_with('/') {
 			Vec::new()
 		} else {
-			self.current_path.clone()
+			self.current_path.iter().map(String::as_str).collect()
 		};
-
-		let mut components = base;
 		components.extend(Self::path_components(path)?);
 		Ok(components)
 	}
 
+	/// `path` without a trailing '/' if it is absolute and has no empty, "."
+	/// or ".." components, the one spelling of a file the dentry cache knows.
+	fn canonical(path: &str) -> Option<&str> {
+		let path = path.strip_suffix('/').unwrap_or(path);
+		let rest = path.strip_prefix('/')?;
+		rest.split('/').all(|c| !c.is_empty() && c != "." && c != "..").then_some(path)
+	}
+
+	fn dcache_shard(&self, path: &str) -> &SpinMutex<HashMap<Box<str>, InodeId>> {
+		&self.dcache[self.dcache_hasher.hash_one(path) as usize % DCACHE_SHARDS]
+	}
+
+	/// Drops the cached path of a removed file, or everything when a
+	/// directory went.
+	fn dcache_forget(&self, components: &[&str], name: &str, directory: bool) {
+		if directory {
+			for shard in &self.dcache {
+				shard.lock().clear();
+			}
+			return;
+		}
+		let mut path = String::new();
+		for component in components.iter().chain(core::iter::once(&name)) {
+			path.push('/');
+			path.push_str(component);
+		}
+		self.dcache_shard(&path).lock().remove(path.as_str());
+	}
+
 	fn get_dir(&self, path: &str) -> Result<&Directory, FsError> {
 		let components = self.resolve_path(path)?;
 		self.get_dir_from_components(&components.as_slice())
 	}
 
-	fn get_dir_from_components(&self, components: &[String]) -> Result<&Directory, FsError> {
+	fn get_dir_from_components(&self, components: &[&str]) -> Result<&Directory, FsError> {
 		let mut current = &self.root;
 		for component in components {
-			current = match current.entries.get(component) {
+			current = match current.entries.get(*component) {
 				Some(Entry::Directory(dir)) => &**dir,
 				Some(_) => return Err(FsError::NotADirectory),
 				None => return Err(FsError::EntryNotFound)
@@ -247,13 +358,14 @@ impl FileSystem {
 		Ok(current)
 	}
 
-	fn get_dir_mut_from_components(
-		&mut self,
-		components: &[String]
-	) -> Result<&mut Directory, FsError> {
-		let mut current = &mut self.root;
+	// borrows only the tree so callers can touch the inode table at the same time
+	fn dir_mut<'a>(
+		root: &'a mut Directory,
+		components: &[&str]
+	) -> Result<&'a mut Directory, FsError> {
+		let mut current = root;
 		for component in components {
-			current = match current.entries.get_mut(component) {
+			current = match current.entries.get_mut(*component) {
 				Some(Entry::Directory(dir)) => &mut **dir,
 				Some(_) => return Err(FsError::NotADirectory),
 				None => return Err(FsError::EntryNotFound)
@@ -262,27 +374,44 @@ impl FileSystem {
 		Ok(current)
 	}
 
-	/// Get a specific file from a file path.
-	pub fn get_file(&self, path: &str) -> Result<&File, FsError> {
+	/// Resolves a path to the id of the file it names. Open file handles keep
+	/// the id so later I/O skips the path walk. A path looked up before is
+	/// found in the dentry cache without walking the tree.
+	pub fn lookup(&self, path: &str) -> Result<InodeId, FsError> {
+		let canonical = Self::canonical(path);
+		if let Some(canonical) = canonical
+			&& let Some(&id) = self.dcache_shard(canonical).lock().get(canonical)
+		{
+			return Ok(id);
+		}
+
 		let (dir_components, file_name) = Self::split_path(path)?;
-		let dir = self.get_dir_from_components(&dir_components.as_slice())?;
+		let dir = self.get_dir_from_components(&dir_components)?;
+		let id = match dir.entries.get(file_name) {
+			Some(Entry::File(id)) => *id,
+			Some(_) => return Err(FsError::NotAFile),
+			None => return Err(FsError::EntryNotFound)
+		};
 
-		match dir.entries.get(&file_name) {
-			Some(Entry::File(file)) => Ok(&file),
-			Some(_) => Err(FsError::NotAFile),
-			None => Err(FsError::EntryNotFound)
+		if let Some(canonical) = canonical {
+			let mut shard = self.dcache_shard(canonical).lock();
+			if shard.len() >= DCACHE_SHARD_ENTRIES {
+				shard.clear();
+			}
+			shard.insert(canonical.into(), id);
 		}
+		Ok(id)
 	}
 
-	fn get_file_mut(&mut self, path: &str) -> Result<&mut File, FsError> {
-		let (dir_components, file_name) = Self::split_path(path)?;
-		let dir = self.get_dir_mut_from_components(&dir_components.as_slice())?;
+	/// Get a file by id, see `lookup`. The file stays locked while the guard
+	/// lives, other files do not.
+	pub fn inode(&self, id: InodeId) -> Result<SpinMutexGuard<'_, File>, FsError> {
+		self.inodes.get(&id).map(SpinMutex::lock).ok_or(FsError::EntryNotFound)
+	}
 
-		match dir.entries.get_mut(&file_name) {
-			Some(Entry::File(file)) => Ok(&mut *file),
-			Some(_) => Err(FsError::NotAFile),
-			None => Err(FsError::EntryNotFound)
-		}
+	/// Get a specific file from a file path.
+	pub fn get_file(&self, path: &str) -> Result<SpinMutexGuard<'_, File>, FsError> {
+		self.inode(self.lookup(path)?)
 	}
 
 	/// List all contents of a specified path.
@@ -304,6 +433,28 @@ impl FileSystem {
 			.collect())
 	}
 
+	/// Every entry below the directory at `path`, parents before their
+	/// children. Paths are relative to `path`, files come with their id and
+	/// directories with `None`.
+	pub fn tree(&self, path: &str) -> Result<Vec<(String, Option<InodeId>)>, FsError> {
+		let mut entries = Vec::new();
+		Self::collect_tree(self.get_dir(path)?, "", &mut entries);
+		Ok(entries)
+	}
+
+	fn collect_tree(dir: &Directory, prefix: &str, out: &mut Vec<(String, Option<InodeId>)>) {
+		for (name, entry) in &dir.entries {
+			let path = if prefix.is_empty() { name.clone() } else { format!("{}/{}", prefix, name) };
+			match entry {
+				Entry::File(id) => out.push((path, Some(*id))),
+				Entry::Directory(subdir) => {
+					out.push((path.clone(), None));
+					Self::collect_tree(subdir, &path, out);
+				}
+			}
+		}
+	}
+
 	/// If a path is a directory.
 	pub fn is_dir(&self, path: &str) -> bool {
 		let components = match self.resolve_path(path) {
@@ -318,7 +469,7 @@ impl FileSystem {
 
 		match self.get_dir_from_components(&components[..components.len() - 1]) {
 			Ok(parent_dir) => {
-				if let Some(entry) = parent_dir.entries.get(&components[components.len() - 1]) {
+				if let Some(entry) = parent_dir.entries.get(components[components.len() - 1]) {
 					matches!(entry, Entry::Directory(_))
 				} else {
 					false
@@ -332,50 +483,53 @@ impl FileSystem {
 	pub fn remove(&mut self, path: &str, del_dir: bool, recursive: bool) -> Result<(), FsError> {
 		// split the path into parent components and the name of the entry.
 		let (parent_components, name) = Self::split_path(path)?;
-		let parent_dir = self.get_dir_mut_from_components(&parent_components.as_slice())?;
+		let parent_dir = Self::dir_mut(&mut self.root, &parent_components)?;
 		// remove entry from parent's entries to gain ownership.
 		let entry = parent_dir
 			.entries
-			.remove(&name)
+			.remove(name)
 			.ok_or(FsError::EntryNotFound)?;
 
 		match entry {
 			Entry::Directory(mut dir_box) => {
 				if !del_dir {
 					// caller did not intend to delete a directory.
-					parent_dir.entries.insert(name, Entry::Directory(dir_box));
+					parent_dir.entries.insert(name.to_string(), Entry::Directory(dir_box));
 					return Err(FsError::NotADirectory);
 				}
 
 				if !recursive && !dir_box.entries.is_empty() {
 					// recursive deletion not enabled and directory is not empty.
-					parent_dir.entries.insert(name, Entry::Directory(dir_box));
+					parent_dir.entries.insert(name.to_string(), Entry::Directory(dir_box));
 					return Err(FsError::DirectoryNotEmpty);
 				}
 
 				if recursive {
-					Self::recursive_remove(&mut dir_box);
+					Self::recursive_remove(&mut dir_box, &mut self.inodes);
 				}
+				self.dcache_forget(&parent_components, name, true);
 				// with recursive deletion (or if empty), dropping dir_box completes removal.
 				Ok(())
 			}
-			Entry::File(_) => Ok(())
+			Entry::File(id) => {
+				self.inodes.remove(&id);
+				self.dcache_forget(&parent_components, name, false);
+				Ok(())
+			}
 		}
 	}
 
-	fn recursive_remove(dir: &mut Directory) {
-		// recursively remove all entries inside the directory.
-		// first collect keys to avoid mutable borrow issues.
-		let keys: Vec<String> = dir.entries.keys().cloned().collect();
-		for key in keys {
-			if let Some(entry) = dir.entries.get_mut(&key)
-				&& let Entry::Directory(ref mut subdir) = *entry
-			{
-				Self::recursive_remove(subdir);
+	fn recursive_remove(dir: &mut Directory, inodes: &mut HashMap<InodeId, SpinMutex<File>>) {
+		// recursively remove all entries inside the directory, dropping the
+		// inodes of any files along the way.
+		for (_, entry) in dir.entries.drain() {
+			match entry {
+				Entry::Directory(mut subdir) => Self::recursive_remove(&mut subdir, inodes),
+				Entry::File(id) => {
+					inodes.remove(&id);
+				}
 			}
 		}
-		// clear all entries from the directory.
-		dir.entries.clear();
 	}
 
 	/// If the specified path exists.
@@ -392,7 +546,7 @@ impl FileSystem {
 		if let Ok(parent_dir) = self.get_dir_from_components(&components[..components.len() - 1]) {
 			parent_dir
 				.entries
-				.contains_key(&components[components.len() - 1])
+				.contains_key(components[components.len() - 1])
 		} else {
 			false
 		}
@@ -410,9 +564,139 @@ pub fn setup_system_files(mut fs: FileSystem) {
 	fs.create_dir("/logs", Permission::all()).unwrap();
 	fs.create_dir("/proc", Permission::read()).unwrap();
 	fs.create_dir("/apps", Permission::all()).unwrap();
+	fs.create_dir("/tmp", Permission::all()).unwrap();
+
+	// rewritten from the syscall counters whenever it is opened
+	fs.create_file("/proc/syscalls", Permission::all()).unwrap();
+	// and this one from the trace rings
+	fs.create_file("/proc/trace", Permission::all()).unwrap();
+
+	// programs cannot create files yet, this one is theirs to write
+	fs.create_file("/tmp/scratch", Permission::all()).unwrap();
 
 	fs.create_file("/apps/hello.elf", Permission::all()).unwrap();
 	fs.write_file("/apps/hello.elf", HELLO_ELF, true).unwrap();
 
+	fs.create_file("/apps/strbench.elf", Permission::all()).unwrap();
+	fs.write_file("/apps/strbench.elf", STRBENCH_ELF, true).unwrap();
+
+	fs.create_file("/apps/bench.elf", Permission::all()).unwrap();
+	fs.write_file("/apps/bench.elf", BENCH_ELF, true).unwrap();
+
+	fs.create_file("/apps/nop.elf", Permission::all()).unwrap();
+	fs.write_file("/apps/nop.elf", NOP_ELF, true).unwrap();
+
 	init_fs(fs);
-}
\ No newline at end of file
+}
+#[cfg(feature = "test")]
+pub mod tests {
+	use crate::{fs::ramfs::{FileSystem, FsError, Permission}, utils::ktest::TestError};
+
+	pub fn test_inode_stable_across_writes() -> Result<(), TestError> {
+		let mut fs = FileSystem::new();
+		fs.create_dir("/t", Permission::all()).unwrap();
+		fs.create_file("/t/a", Permission::all()).unwrap();
+
+		let id = fs.lookup("/t/a").unwrap();
+		fs.write_inode(id, &[b"hello ", b"world"], false).unwrap();
+		fs.write_file("/t/a", b"!", false).unwrap();
+
+		assert_eq!(fs.lookup("/t/a").unwrap(), id);
+		assert_eq!(fs.inode(id).unwrap().content.to_vec().as_slice(), b"hello world!");
+		Ok(())
+	}
+	crate::create_test!(test_inode_stable_across_writes);
+
+	pub fn test_removed_inode_not_reused() -> Result<(), TestError> {
+		let mut fs = FileSystem::new();
+		fs.create_file("/a", Permission::all()).unwrap();
+		let old = fs.lookup("/a").unwrap();
+
+		fs.remove("/a", false, false).unwrap();
+		fs.create_file("/a", Permission::all()).unwrap();
+
+		assert_ne!(fs.lookup("/a").unwrap(), old);
+		assert!(matches!(fs.inode(old), Err(FsError::EntryNotFound)));
+		Ok(())
+	}
+	crate::create_test!(test_removed_inode_not_reused);
+
+	pub fn test_dirty_range_tracked() -> Result<(), TestError> {
+		let mut fs = FileSystem::new();
+		fs.create_dir("/d", Permission::all()).unwrap();
+		fs.create_file("/d/a", Permission::all()).unwrap();
+		let id = fs.lookup("/d/a").unwrap();
+		assert_eq!(fs.take_dirty(id), None);
+
+		fs.write_inode(id, &[b"0123456789"], false).unwrap();
+		assert_eq!(fs.take_dirty(id), Some(0));
+		assert_eq!(fs.take_dirty(id), None);
+
+		// appends are dirty from where they start, the earliest one counts
+		fs.write_inode(id, &[b"ab"], false).unwrap();
+		fs.write_inode(id, &[b"cd"], false).unwrap();
+		assert_eq!(fs.take_dirty(id), Some(10));
+		fs.write_inode(id, &[b"x"], true).unwrap();
+		assert_eq!(fs.take_dirty(id), Some(0));
+
+		fs.create_dir("/d/e", Permission::all()).unwrap();
+		fs.create_file("/d/e/b", Permission::all()).unwrap();
+		let mut tree = fs.tree("/d").unwrap();
+		tree.sort();
+		let b = fs.lookup("/d/e/b").unwrap();
+		assert_eq!(tree, [("a".into(), Some(id)), ("e".into(), None), ("e/b".into(), Some(b))]);
+		Ok(())
+	}
+	crate::create_test!(test_dirty_range_tracked);
+
+	pub fn test_dcache_follows_removal() -> Result<(), TestError> {
+		let mut fs = FileSystem::new();
+		fs.create_dir("/c", Permission::all()).unwrap();
+		fs.create_file("/c/f", Permission::all()).unwrap();
+		let old = fs.lookup("/c/f/").unwrap();
+		// other spellings of the path walk the tree, the cached one is the same
+		assert_eq!(fs.lookup("/c/./f").unwrap(), old);
+		assert_eq!(fs.lookup("/c/f").unwrap(), old);
+
+		fs.remove("/c//f", false, false).unwrap();
+		assert!(matches!(fs.lookup("/c/f"), Err(FsError::EntryNotFound)));
+		fs.create_file("/c/f", Permission::all()).unwrap();
+		assert_ne!(fs.lookup("/c/f").unwrap(), old);
+
+		fs.remove("/c", true, true).unwrap();
+		assert!(matches!(fs.lookup("/c/f"), Err(FsError::EntryNotFound)));
+		Ok(())
+	}
+	crate::create_test!(test_dcache_follows_removal);
+}
+
+#[cfg(feature = "kbench")]
+pub mod benches {
+	use core::hint::black_box;
+
+	use crate::{
+		fs::ramfs::{FileSystem, Permission},
+		utils::ktest::{self, TestError}
+	};
+
+	pub fn bench_get_and_write_file() -> Result<(), TestError> {
+		let mut fs = FileSystem::new();
+		fs.create_dir("/b", Permission::all()).unwrap();
+		fs.create_dir("/b/c", Permission::all()).unwrap();
+		fs.create_file("/b/c/f", Permission::all()).unwrap();
+		let line = [b'x'; 96];
+
+		ktest::bench("ramfs_get_file", 10_000, |_| {
+			black_box(fs.get_file("/b/c/f").unwrap().content.len());
+		});
+		ktest::bench("ramfs_write_file_overwrite", 10_000, |_| {
+			fs.write_file("/b/c/f", &line, true).unwrap();
+		});
+		// grows the file by ~100 KiB
+		ktest::bench("ramfs_write_file_append", 1_000, |_| {
+			fs.write_file("/b/c/f", &line, false).unwrap();
+		});
+		Ok(())
+	}
+	crate::create_bench!(bench_get_and_write_file);
+}
@@ -3,103 +3,124 @@
 //! GDT (Global Descriptor Table) module for the kernel.
 //!
 
+use core::sync::atomic::{AtomicU16, Ordering};
+
 use x86_64::{
     VirtAddr,
     structures::{
-        gdt::{Descriptor, GlobalDescriptorTable, SegmentSelector},
+        gdt::{Descriptor, GlobalDescriptorTable},
         tss::TaskStateSegment
     }
 };
-use crate::lazy_static;
+use crate::smp::{MAX_CPUS, cpu_id};
 
 pub(crate) const DOUBLE_FAULT_IST_INDEX: u16 = 0;
 
 const KERNEL_STACK_SIZE: usize = 4096 * 5;
-static mut KERNEL_STACK: [u8; KERNEL_STACK_SIZE] = [0; KERNEL_STACK_SIZE];
+#[repr(align(16))]
+struct KStack([u8; KERNEL_STACK_SIZE]);
+static mut KERNEL_STACKS: [KStack; MAX_CPUS] = [const { KStack([0; KERNEL_STACK_SIZE]) }; MAX_CPUS];
 
 /// Size of the stack when an interrupt is fired.
 pub const INTERRUPT_STACK_SIZE: usize = 4096 * 8;
 #[repr(align(16))]
 struct IStack([u8; INTERRUPT_STACK_SIZE]);
-static mut INTERRUPT_STACK: IStack = IStack([0; INTERRUPT_STACK_SIZE]);
+static mut INTERRUPT_STACKS: [IStack; MAX_CPUS] = [const { IStack([0; INTERRUPT_STACK_SIZE]) }; MAX_CPUS];
 
-/// The top of the Interrupt Stack
-pub fn interrupt_stack_top() -> u64 {
-    unsafe {
-        let base = core::ptr::addr_of!(INTERRUPT_STACK.0) as u64;
-        base + INTERRUPT_STACK_SIZE as u64
-    }
-}
+// one GDT and TSS per cpu, the selectors are the same in all of them
+static mut TSS: [TaskStateSegment; MAX_CPUS] = [const { TaskStateSegment::new() }; MAX_CPUS];
+static mut GDT: [GlobalDescriptorTable; MAX_CPUS] = [const { GlobalDescriptorTable::new() }; MAX_CPUS];
 
-lazy_static! {
-    pub static ref TSS: TaskStateSegment = {
-        let mut tss = TaskStateSegment::new();
+static CODE_SELECTOR: AtomicU16 = AtomicU16::new(0);
+static DATA_SELECTOR: AtomicU16 = AtomicU16::new(0);
+static USER_CODE_SELECTOR: AtomicU16 = AtomicU16::new(0);
+static USER_DATA_SELECTOR: AtomicU16 = AtomicU16::new(0);
 
-        // IST slot 0: dedicated double-fault stack
-        tss.interrupt_stack_table[DOUBLE_FAULT_IST_INDEX as usize] = {
-            let stack_start = VirtAddr::from_ptr(core::ptr::addr_of!(KERNEL_STACK));
-            stack_start + KERNEL_STACK_SIZE
-        };
-
-        // rsp0: kernel stack for ring 3 -> ring 0 transitions (interrupts, syscalls)
-        tss.privilege_stack_table[0] = VirtAddr::new(interrupt_stack_top());
+/// The top of the calling cpu's Interrupt Stack
+pub fn interrupt_stack_top() -> u64 {
+    interrupt_stack_top_of(cpu_id())
+}
 
-        tss
-    };
+/// The top of the Interrupt Stack of `cpu`.
+pub fn interrupt_stack_top_of(cpu: usize) -> u64 {
+    let base = unsafe { core::ptr::addr_of!(INTERRUPT_STACKS[cpu].0) as u64 };
+    base + INTERRUPT_STACK_SIZE as u64
 }
 
-lazy_static! {
-    static ref GDT: (GlobalDescriptorTable, Selectors) = {
-        let mut gdt = GlobalDescriptorTable::new();
-        let code_selector = gdt.add_entry(Descriptor::kernel_code_segment());
-        let tss_selector = gdt.add_entry(Descriptor::tss_segment(&TSS));
-        // user_data must come before user_code for sysret compatibility
-        let user_data_selector = gdt.add_entry(Descriptor::user_data_segment());
-        let user_code_selector = gdt.add_entry(Descriptor::user_code_segment());
-        (gdt, Selectors {
-            code_selector,
-            tss_selector,
-            user_code_selector,
-            user_data_selector,
-        })
-    };
+/// Returns the raw u16 selector value of the kernel code segment.
+pub fn kernel_code_selector() -> u16 {
+    CODE_SELECTOR.load(Ordering::Relaxed)
 }
 
-struct Selectors {
-    code_selector: SegmentSelector,
-    tss_selector: SegmentSelector,
-    user_code_selector: SegmentSelector,
-    user_data_selector: SegmentSelector,
+/// Returns the raw u16 selector value of the kernel data segment.
+pub fn kernel_data_selector() -> u16 {
+    DATA_SELECTOR.load(Ordering::Relaxed)
 }
 
 /// Returns the raw u16 selector value with RPL=3 bits set.
 pub fn user_code_selector() -> u16 {
-    GDT.1.user_code_selector.0 | 3
+    USER_CODE_SELECTOR.load(Ordering::Relaxed) | 3
 }
 
 /// Returns the raw u16 selector value of the user data with RPL=3 bits set.
 pub fn user_data_selector() -> u16 {
-    GDT.1.user_data_selector.0 | 3
+    USER_DATA_SELECTOR.load(Ordering::Relaxed) | 3
 }
 
-/// Sets the kernel stack to the value passed.
+/// Sets the kernel stack of the calling cpu to the value passed.
 pub fn set_kernel_stack(stack_top: u64) {
     unsafe {
-        let tss = &*TSS as *const TaskStateSegment as *mut TaskStateSegment;
+        let tss = core::ptr::addr_of_mut!(TSS[cpu_id()]);
         (*tss).privilege_stack_table[0] = VirtAddr::new(stack_top);
     }
 }
 
-/// Initialises the GDT (Global Descriptor Table)
+/// Initialises the GDT (Global Descriptor Table) of the BSP
 pub fn init() {
+    init_cpu(0);
+}
+
+/// Builds and loads the GDT and TSS of `cpu`, on that cpu.
+pub fn init_cpu(cpu: usize) {
     use x86_64::instructions::{
-        segmentation::{CS, Segment},
+        segmentation::{CS, DS, SS, Segment},
         tables::load_tss
     };
 
-    GDT.0.load();
+    let (tss, gdt) = unsafe {
+        let tss = &mut *core::ptr::addr_of_mut!(TSS[cpu]);
+
+        // IST slot 0: dedicated double-fault stack
+        tss.interrupt_stack_table[DOUBLE_FAULT_IST_INDEX as usize] = {
+            let stack_start = VirtAddr::from_ptr(core::ptr::addr_of!(KERNEL_STACKS[cpu]));
+            stack_start + KERNEL_STACK_SIZE
+        };
+
+        // rsp0: kernel stack for ring 3 -> ring 0 transitions (interrupts, syscalls)
+        tss.privilege_stack_table[0] = VirtAddr::new(interrupt_stack_top_of(cpu));
+
+        (&*core::ptr::addr_of!(TSS[cpu]), &mut *core::ptr::addr_of_mut!(GDT[cpu]))
+    };
+
+    let code_selector = gdt.add_entry(Descriptor::kernel_code_segment());
+    // kernel_data must directly follow kernel_code, `syscall` loads SS = CS + 8
+    let data_selector = gdt.add_entry(Descriptor::kernel_data_segment());
+    let tss_selector = gdt.add_entry(Descriptor::tss_segment(tss));
+    // user_data must come before user_code for sysret compatibility
+    let user_data_selector = gdt.add_entry(Descriptor::user_data_segment());
+    let user_code_selector = gdt.add_entry(Descriptor::user_code_segment());
+
+    CODE_SELECTOR.store(code_selector.0, Ordering::Relaxed);
+    DATA_SELECTOR.store(data_selector.0, Ordering::Relaxed);
+    USER_CODE_SELECTOR.store(user_code_selector.0, Ordering::Relaxed);
+    USER_DATA_SELECTOR.store(user_data_selector.0, Ordering::Relaxed);
+
+    let gdt: &'static GlobalDescriptorTable = gdt;
+    gdt.load();
     unsafe {
-        CS::set_reg(GDT.1.code_selector);
-        load_tss(GDT.1.tss_selector);
+        CS::set_reg(code_selector);
+        SS::set_reg(data_selector);
+        DS::set_reg(data_selector);
+        load_tss(tss_selector);
     }
-}
\ No newline at end of file
+}
@@ -12,14 +12,14 @@ use core::{
 use ::x86_64::structures::idt::{InterruptDescriptorTable, InterruptStackFrame, PageFaultErrorCode};
 
 use crate::{
-	apic::{APIC_TICK_COUNT, PIC_EOI, PIC1_CMD, PIC2_CMD, send_eoi}, common::ports::{inb, outb}, drivers::keyboard::queue::add_scancode, error::NullexError, gdt, hlt_loop, lazy_static, println, rtc::{
+	apic::{APIC_TICK_COUNT, PIC_EOI, PIC1_CMD, PIC2_CMD, send_eoi}, arch::x86_64::syscall::syscall_dispatch, common::ports::{inb, outb}, drivers::keyboard::queue::add_scancode, error::NullexError, gdt, hlt_loop, lazy_static, println, rtc::{
 		CMOS_DATA,
 		CMOS_INDEX,
 		NMI_BIT,
 		REG_C,
 		RTC_TICKS,
 		send_rtc_eoi
-	}, serial::add_byte, serial_println, syscall::syscall, task::executor::CURRENT_PROCESS, utils::{bits::BitMap, mutex::SpinMutex}
+	}, serial::add_byte, serial_println, smp::online_cpus, task::executor, utils::{bits::BitMap, mutex::SpinMutex, trace::{self, TRACE_IRQ_ENTER, TRACE_IRQ_EXIT, TRACE_PAGE_FAULT}}
 };
 
 pub(crate) const APIC_TIMER_VECTOR: u8 = 32;
@@ -27,6 +27,8 @@ const KEYBOARD_VECTOR: u8 = 33;
 const SERIAL_VECTOR: u8 = 36;
 const RTC_VECTOR: u8 = 0x70; // irq 8 - 15 is mapped from 0x70 to 0x77;
 const SYSCALL_VECTOR: u8 = 0x80;
+/// IPI sent to an idle cpu when work was queued for it, see `smp::kick`.
+pub(crate) const RESCHEDULE_VECTOR: u8 = 0xFE;
 
 // TODO: remove the maybeuninit, just move to a safe lazy_static!
 static mut IDT_STORAGE: MaybeUninit<InterruptDescriptorTable> = MaybeUninit::uninit();
@@ -37,6 +39,7 @@ lazy_static! {
 	pub static ref VECTOR_TABLE: SpinMutex<BitMap> = {
 		let mut bmp = BitMap::new(256);
 		bmp.set_idxs((0..31).into(), true);
+		bmp.set_idx(RESCHEDULE_VECTOR as usize, true);
 		bmp.set_idx(255, true);
 		SpinMutex::new(bmp)
 	};
@@ -64,6 +67,7 @@ pub unsafe fn init_idt() {
 		local_idt[KEYBOARD_VECTOR as usize].set_handler_fn(keyboard_interrupt_handler);
 		local_idt[SERIAL_VECTOR as usize].set_handler_fn(serial_input_interrupt_handler);
 		local_idt[RTC_VECTOR as usize].set_handler_fn(rtc_timer_handler);
+		local_idt[RESCHEDULE_VECTOR as usize].set_handler_fn(reschedule_handler);
 
 		// syscall handler
 		local_idt[SYSCALL_VECTOR as usize].set_handler_fn(syscall_handler)
@@ -83,6 +87,16 @@ pub unsafe fn init_idt() {
 	}
 }
 
+/// Loads the IDT built by `init_idt` on the calling cpu, every cpu shares
+/// the one table.
+pub unsafe fn load_idt() {
+	assert!(IDT_INITED.load(Ordering::SeqCst), "load_idt before init_idt");
+	unsafe {
+		let idt_ptr = core::ptr::addr_of!(IDT_STORAGE) as *const InterruptDescriptorTable;
+		(*idt_ptr).load();
+	}
+}
+
 /// Adds an IDT entry and sets a handler function.
 pub unsafe fn add_idt_entry(
 	vector: usize,
@@ -111,6 +125,29 @@ extern "x86-interrupt" fn page_fault_handler(
     use ::x86_64::registers::control::Cr2;
 
     let addr = Cr2::read();
+    trace::trace(TRACE_PAGE_FAULT, [addr.as_u64(), error_code.bits()]);
+
+    // first touch of a demand paged ELF page, map it and retry
+    if !error_code.contains(PageFaultErrorCode::PROTECTION_VIOLATION)
+        && unsafe { crate::utils::elf::fault_in_image_page(addr) }
+    {
+        return;
+    }
+
+    // first touch of mapm memory, hand out a zeroed page and retry
+    if !error_code.contains(PageFaultErrorCode::PROTECTION_VIOLATION)
+        && unsafe { crate::memory::fault_in_anon_page(addr) }
+    {
+        return;
+    }
+
+    // write to a page shared with a split child or parent, copy it and retry
+    if error_code.contains(PageFaultErrorCode::PROTECTION_VIOLATION | PageFaultErrorCode::CAUSED_BY_WRITE)
+        && unsafe { crate::memory::resolve_cow_fault(addr) }
+    {
+        return;
+    }
+
     serial_println!("EXCEPTION: PAGE FAULT");
     serial_println!("Accessed Address: {:?}", addr);
     serial_println!("Error Code: {:?}", error_code);
@@ -158,22 +195,31 @@ extern "x86-interrupt" fn double_fault_handler(
 extern "x86-interrupt" fn keyboard_interrupt_handler(_stack_frame: InterruptStackFrame) {
 	use ::x86_64::instructions::port::Port;
 
+	trace::trace(TRACE_IRQ_ENTER, [KEYBOARD_VECTOR as u64, 0]);
 	let mut port = Port::new(0x60);
 	let scancode: u8 = unsafe { port.read() };
 
-	{
-		let mut lock = CURRENT_PROCESS.lock();
-		if let Some(proc) = lock.as_mut() {
-			if let Ok(queue) = proc.scancode_queue.try_get()
-				&& queue.push(scancode).is_ok()
-			{
-				proc.waker.wake();
-			}
-		} else {
-			add_scancode(scancode);
+	// a process reading the keyboard may be running on any cpu, skip slots
+	// another cpu is changing right now instead of spinning in the handler
+	let mut delivered = false;
+	for cpu in 0..online_cpus() {
+		let Some(slot) = executor::current_process_slot(cpu).try_lock() else {
+			continue;
+		};
+		if let Some(proc) = slot.as_ref()
+			&& let Ok(queue) = proc.scancode_queue.try_get()
+			&& queue.push(scancode).is_ok()
+		{
+			proc.waker.wake();
+			delivered = true;
+			break;
 		}
 	}
+	if !delivered {
+		add_scancode(scancode);
+	}
 
+	trace::trace(TRACE_IRQ_EXIT, [KEYBOARD_VECTOR as u64, 0]);
 	unsafe {
 		send_eoi();
 	}
@@ -182,6 +228,7 @@ extern "x86-interrupt" fn keyboard_interrupt_handler(_stack_frame: InterruptStac
 extern "x86-interrupt" fn serial_input_interrupt_handler(_stack_frame: InterruptStackFrame) {
 	use ::x86_64::instructions::port::Port;
 
+	trace::trace(TRACE_IRQ_ENTER, [SERIAL_VECTOR as u64, 0]);
 	loop {
 		let mut lsb = Port::<u8>::new(0x3FD);
 		let lsb_data = unsafe { lsb.read() };
@@ -194,6 +241,7 @@ extern "x86-interrupt" fn serial_input_interrupt_handler(_stack_frame: Interrupt
 		add_byte(byte);
 	}
 
+	trace::trace(TRACE_IRQ_EXIT, [SERIAL_VECTOR as u64, 0]);
 	unsafe {
 		send_eoi();
 	}
@@ -206,17 +254,29 @@ extern "x86-interrupt" fn spurious_interrupt_handler(_stack_frame: InterruptStac
 }
 
 
+/// Reschedule IPI handler, only there to get an idle cpu out of `hlt`.
+extern "x86-interrupt" fn reschedule_handler(_stack_frame: InterruptStackFrame) {
+	trace::trace(TRACE_IRQ_ENTER, [RESCHEDULE_VECTOR as u64, 0]);
+	trace::trace(TRACE_IRQ_EXIT, [RESCHEDULE_VECTOR as u64, 0]);
+	unsafe {
+		send_eoi();
+	}
+}
+
 /// APIC Timer Interrupt Handler.
 ///
 /// This handler is invoked when the APIC timer fires.
 extern "x86-interrupt" fn apic_timer_handler(_stack_frame: InterruptStackFrame) {
+	trace::trace(TRACE_IRQ_ENTER, [APIC_TIMER_VECTOR as u64, 0]);
 	APIC_TICK_COUNT.fetch_add(1, Ordering::Relaxed);
+	trace::trace(TRACE_IRQ_EXIT, [APIC_TIMER_VECTOR as u64, 0]);
 	unsafe {
 		send_eoi();
 	}
 }
 
 extern "x86-interrupt" fn rtc_timer_handler(_stack_frame: InterruptStackFrame) {
+	trace::trace(TRACE_IRQ_ENTER, [RTC_VECTOR as u64, 0]);
 	// ack
 	unsafe {
 		outb(CMOS_INDEX, REG_C | NMI_BIT);
@@ -224,6 +284,7 @@ extern "x86-interrupt" fn rtc_timer_handler(_stack_frame: InterruptStackFrame) {
 	}
 
 	RTC_TICKS.fetch_add(1, Ordering::Relaxed);
+	trace::trace(TRACE_IRQ_EXIT, [RTC_VECTOR as u64, 0]);
 
 	unsafe {
 		outb(PIC2_CMD, PIC_EOI);
@@ -233,37 +294,53 @@ extern "x86-interrupt" fn rtc_timer_handler(_stack_frame: InterruptStackFrame) {
 }
 
 // 64-BIT! currently.
+/// Legacy `int 0x80` syscall entry. Kept for userspace that doesnt check
+/// for `syscall` support, see `arch::x86_64::syscall` for the fast path.
 #[unsafe(naked)]
 extern "x86-interrupt" fn syscall_handler(_stack_frame: InterruptStackFrame) {
     core::arch::naked_asm!(
-        // save what we are about to clobber during the arg shuffle
-        "push rdi",
-        "push rsi",
+        // save every gpr so the frame matches `SyscallFrame`, userspace only
+        // expects rax (and rcx/r11) to change across a syscall.
+        "push rax",
+        "push rbx",
+        "push rcx",
         "push rdx",
-        // shuffle (rax, rdi, rsi, rdx) -> (rdi, rsi, rdx, rcx) for SysV inner call
-        "mov rcx, rdx",
-        "mov rdx, rsi",
-        "mov rsi, rdi",
-        "mov edi, eax",
+        "push rsi",
+        "push rdi",
+        "push rbp",
+        "push r8",
+        "push r9",
+        "push r10",
+        "push r11",
+        "push r12",
+        "push r13",
+        "push r14",
+        "push r15",
         // Stack accounting:
-        // CPU pushed 5 qwords (40), we pushed 3 (24), total 64. 64%16=0.
-        // 'call' will push 8 more -> misaligned, so sub 8 first.
-        "sub rsp, 8",
-        "call {inner}",
-        "add rsp, 8",
-        // restore user registers (in reverse)
-        "pop rdx",
-        "pop rsi",
+        // CPU pushed 5 qwords (40) onto a 16 byte aligned stack, we pushed 15 (120),
+        // total 160. 160%16=0 so the call is aligned.
+        "mov rdi, rsp",
+        "call {dispatch}",
+        "pop r15",
+        "pop r14",
+        "pop r13",
+        "pop r12",
+        "pop r11",
+        "pop r10",
+        "pop r9",
+        "pop r8",
+        "pop rbp",
         "pop rdi",
+        "pop rsi",
+        "pop rdx",
+        "pop rcx",
+        "pop rbx",
+        "pop rax",
         "iretq",
-        inner = sym syscall_handler_inner,
+        dispatch = sym syscall_dispatch,
     )
 }
 
-extern "C" fn syscall_handler_inner(num: u32, a1: u64, a2: u64, a3: u64) -> i32 {
-    unsafe { syscall(num, a1, a2, a3, 0, 0) }
-}
-
 // extern "x86-interrupt" fn gsi_interrupt_dispatcher(_stack_frame:
 // InterruptStackFrame) { 	let mut handled = false;
 // 	{
@@ -49,7 +49,7 @@ pub fn tab_completion(line: &mut String) {
 		return;
 	}
 
-	fs::with_fs(|fs| {
+	fs::with_fs_read(|fs| {
 		let files = fs.list_dir(&CWD.lock());
 		let file_types = fs
 			.list_dir_entry_types(&CWD.lock())
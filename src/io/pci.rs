@@ -5,9 +5,12 @@
 //! 
 
 use alloc::vec::Vec;
+use core::ptr::write_volatile;
+
+use x86_64::{PhysAddr, VirtAddr};
 
 use crate::{
-	allocator::io_alloc::IO_ALLOC, common::ports::{inl, outb, outl, outq, outw}, error::NullexError, lazy_static, serial_println, utils::{
+	allocator::io_alloc::IO_ALLOC, common::ports::{inl, outb, outl, outq, outw}, ensure, error::NullexError, lazy_static, memory::map_mmio, serial_println, utils::{
 		mutex::SpinMutex,
 		types::{DWORD, WORD}
 	}
@@ -19,8 +22,26 @@ pub const VIRTIO_PCI_VENDOR_ID: u16 = 0x1af4;
 pub const INTEL_VENDOR_ID: u16 = 0x8086;
 
 const PCI_COMMAND_IO: u16 = 0x0001;
+const PCI_COMMAND_MEMORY: u16 = 0x0002;
 const PCI_BUS_MASTER: u16 = 0x0004;
 
+/// Status register bit: the device has a capability list.
+const PCI_STATUS_CAP_LIST: u16 = 1 << 4;
+const PCI_CAPABILITIES_POINTER: u8 = 0x34;
+const PCI_CAP_ID_MSIX: u8 = 0x11;
+
+// message control, the upper half of the first MSI-X capability dword
+const MSIX_ENABLE: u32 = 1 << 31;
+const MSIX_FUNCTION_MASK: u32 = 1 << 30;
+const MSIX_TABLE_SIZE_SHIFT: u32 = 16;
+const MSIX_TABLE_SIZE_MASK: u32 = 0x7FF;
+/// Bytes of one MSI-X table entry: address low, address high, data, control.
+const MSIX_ENTRY_SIZE: usize = 16;
+const MSIX_ENTRY_MASKED: u32 = 1;
+/// Messages written here are delivered to the local APIC whose id is in bits
+/// 12..20.
+const MSI_ADDRESS_BASE: u32 = 0xFEE0_0000;
+
 const PCI_CONFIG_ADDRESS: u16 = 0xCF8;
 const PCI_CONFIG_DATA: u16 = 0xCFC;
 
@@ -448,6 +469,142 @@ pub fn pci_enable_device(dev: &mut PciDevice) -> Result<(), NullexError> {
 	}
 }
 
+/// Enables memory decoding and bus mastering for a device driven through the
+/// memory BAR `bar`, and returns the BAR's physical address.
+pub fn pci_enable_mmio(dev: &mut PciDevice, bar: u8) -> Result<u64, NullexError> {
+	let address = pci_bar_address(dev.bdf, bar)?;
+
+	let mut cmd = pci_config_read::<WORD>(dev.bdf, 0x04)
+		.map_err(|_| NullexError::Io("Failed to read command register"))?;
+	cmd |= PCI_COMMAND_MEMORY;
+	cmd |= PCI_BUS_MASTER;
+	pci_config_write::<WORD>(dev.bdf, 0x04, cmd)?;
+	dev.mmio_base = Some(address as usize);
+
+	serial_println!("[PCI] Device: {:?} enabled (BAR{} at {:#x})", dev.bdf, bar, address);
+	Ok(address)
+}
+
+/// Finds capability `id` in the capability list of `bdf` and returns its
+/// offset in the config space.
+pub fn pci_find_capability(bdf: Bdf, id: u8) -> Option<u8> {
+	let status = pci_config_read::<WORD>(bdf, 0x06).ok()?;
+	if status & PCI_STATUS_CAP_LIST == 0 {
+		return None;
+	}
+
+	let mut offset = pci_config_read::<u8>(bdf, PCI_CAPABILITIES_POINTER).ok()? & 0xFC;
+	// bounded, a broken list could point back at itself
+	for _ in 0..48 {
+		if offset == 0 {
+			return None;
+		}
+		if pci_config_read::<u8>(bdf, offset).ok()? == id {
+			return Some(offset);
+		}
+		offset = pci_config_read::<u8>(bdf, offset + 1).ok()? & 0xFC;
+	}
+	None
+}
+
+/// Physical address of memory BAR `index` of `bdf`.
+pub fn pci_bar_address(bdf: Bdf, index: u8) -> Result<u64, NullexError> {
+	let offset = 0x10 + index * 4;
+	let low = pci_config_read::<DWORD>(bdf, offset)
+		.map_err(|_| NullexError::Io("Failed to read BAR"))?;
+	ensure!(low & 1 == 0, NullexError::Io("Not a memory BAR"));
+
+	let mut address = (low & !0xF) as u64;
+	// type 2 is a 64 bit BAR, the next one holds the upper half
+	if (low >> 1) & 0x3 == 0x2 {
+		let high = pci_config_read::<DWORD>(bdf, offset + 4)
+			.map_err(|_| NullexError::Io("Failed to read BAR"))?;
+		address |= (high as u64) << 32;
+	}
+	ensure!(address != 0, NullexError::Io("Memory BAR not assigned"));
+	Ok(address)
+}
+
+/// The MSI-X table of a device, one message for each interrupt it raises.
+pub struct MsixTable {
+	table: VirtAddr,
+	entries: u16
+}
+
+unsafe impl Send for MsixTable {}
+
+impl MsixTable {
+	/// Number of entries in the table.
+	pub fn entries(&self) -> u16 {
+		self.entries
+	}
+
+	fn entry(&self, index: u16) -> *mut u32 {
+		(self.table.as_u64() + index as u64 * MSIX_ENTRY_SIZE as u64) as *mut u32
+	}
+
+	/// Sends entry `index` as `vector` to the cpu with local APIC id
+	/// `lapic_id` and unmasks it.
+	pub fn route(&mut self, index: u16, vector: u8, lapic_id: u8) -> Result<(), NullexError> {
+		ensure!(index < self.entries, NullexError::InvalidArgument);
+		let entry = self.entry(index);
+		unsafe {
+			// masked while it is half written
+			write_volatile(entry.add(3), MSIX_ENTRY_MASKED);
+			write_volatile(entry, MSI_ADDRESS_BASE | (lapic_id as u32) << 12);
+			write_volatile(entry.add(1), 0);
+			// fixed delivery, edge triggered
+			write_volatile(entry.add(2), vector as u32);
+			write_volatile(entry.add(3), 0);
+		}
+		Ok(())
+	}
+
+	/// Masks entry `index`, the device holds its message back meanwhile.
+	pub fn mask(&mut self, index: u16) {
+		if index < self.entries {
+			unsafe { write_volatile(self.entry(index).add(3), MSIX_ENTRY_MASKED) };
+		}
+	}
+}
+
+/// Turns on MSI-X for `dev` with every entry masked, the device no longer
+/// raises its legacy interrupt from then on.
+pub fn pci_enable_msix(dev: &PciDevice) -> Result<MsixTable, NullexError> {
+	let cap = pci_find_capability(dev.bdf, PCI_CAP_ID_MSIX).ok_or(NullexError::Io("No MSI-X capability"))?;
+
+	// read and written as whole dwords, the message control is the upper half
+	let header = pci_config_read::<DWORD>(dev.bdf, cap)
+		.map_err(|_| NullexError::Io("Failed to read MSI-X capability"))?;
+	let entries = ((header >> MSIX_TABLE_SIZE_SHIFT) & MSIX_TABLE_SIZE_MASK) as u16 + 1;
+	let table_reg = pci_config_read::<DWORD>(dev.bdf, cap + 4)
+		.map_err(|_| NullexError::Io("Failed to read MSI-X table offset"))?;
+	let bar = (table_reg & 0x7) as u8;
+	let phys = pci_bar_address(dev.bdf, bar)? + (table_reg & !0x7) as u64;
+	let table = map_mmio(PhysAddr::new(phys), entries as usize * MSIX_ENTRY_SIZE)?;
+
+	let mut cmd = pci_config_read::<WORD>(dev.bdf, 0x04)
+		.map_err(|_| NullexError::Io("Failed to read command register"))?;
+	cmd |= PCI_COMMAND_MEMORY;
+	pci_config_write::<WORD>(dev.bdf, 0x04, cmd)?;
+
+	// enabled with the whole function masked until every entry is masked
+	pci_config_write::<DWORD>(dev.bdf, cap, header | MSIX_ENABLE | MSIX_FUNCTION_MASK)?;
+	let mut msix = MsixTable { table, entries };
+	for index in 0..entries {
+		msix.mask(index);
+	}
+	pci_config_write::<DWORD>(dev.bdf, cap, (header | MSIX_ENABLE) & !MSIX_FUNCTION_MASK)?;
+
+	serial_println!(
+		"[PCI] Device: {:?} MSI-X enabled ({} entries, table at {:#x})",
+		dev.bdf,
+		entries,
+		phys
+	);
+	Ok(msix)
+}
+
 /// Find the PCI index from the GSI number.
 pub fn pci_find_index_from_gsi(gsi: usize) -> Option<usize> {
 	let devs = PCI_DEVICES.lock();
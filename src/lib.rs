@@ -41,6 +41,7 @@ pub mod pit;
 pub mod rtc;
 #[allow(deprecated)]
 pub mod serial;
+pub mod smp;
 pub mod syscall;
 pub mod task;
 pub mod utils;
@@ -50,8 +51,7 @@ use alloc::boxed::Box;
 use core::{
 	future::Future,
 	pin::Pin,
-	sync::atomic::Ordering,
-	task::{Context, Poll}
+	sync::atomic::Ordering
 };
 
 use x86_64::{
@@ -64,7 +64,7 @@ use crate::{
 	allocator::ALLOCATOR_INFO,
 	apic::{APIC_BASE, APIC_TPS},
 	common::ports::outb,
-	fs::ramfs::{FileSystem, setup_system_files},
+	fs::{diskfs, ramfs::{FileSystem, setup_system_files}},
 	interrupts::APIC_TIMER_VECTOR,
 	io::{
 		keyboard::line_editor::print_keypresses,
@@ -73,12 +73,12 @@ use crate::{
 	ioapic::{IOAPIC, dump_gsi},
 	memory::{BootInfoFrameAllocator, init_global_alloc},
 	task::{
-		Process, ProcessId, executor::{self, CURRENT_PROCESS, EXECUTOR}, keyboard
+		ProcessId, executor, keyboard
 	},
-	utils::{boot::init_efer, multiboot2::parse_multiboot2, mutex::SpinMutex, process::spawn_process}
+	utils::{boot::{init_efer, init_simd, init_write_protect}, logger::sinks::syslog::drain_syslog, multiboot2::parse_multiboot2, mutex::SpinMutex, process::spawn_process}
 };
 
-use crate::drivers::virtio::net::virtio_net_driver_init;
+use crate::drivers::{ahci::ahci_driver_init, virtio::net::{virtio_net_driver_init, virtio_net_spread_queues}};
 
 lazy_static! {
 	/// Static reference to the physical memory offset for the kernel.
@@ -91,6 +91,7 @@ fn init() {
 	serial_println!("[Info] GDT done.");
 	unsafe { interrupts::init_idt() };
 	serial_println!("[Info] Finished IDT Init.");
+	unsafe { arch::x86_64::syscall::init_syscall() };
 	serial_println!("[Info] Done.");
 }
 
@@ -107,6 +108,10 @@ pub unsafe extern "C" fn kernel_main(mbi_addr: usize) -> ! {
 	println!("[Info] Starting Kernel Init...");
 
 	init_efer();
+	init_simd();
+	init_write_protect();
+	// the heap caches are per cpu
+	smp::init_bsp();
 
 	// Parse boot info and initialize memory
 	let boot_info = unsafe { parse_multiboot2(mbi_addr) };
@@ -141,7 +146,7 @@ pub unsafe extern "C" fn kernel_main(mbi_addr: usize) -> ! {
 	}
 
 	rtc::init_rtc();
-	match apic::calibrate(1024) {
+	match apic::calibrate(apic::TIMER_HZ) {
 		Ok((ticks_per_sec, initial_count)) => {
 			serial_println!("APIC ticks/sec = {}", ticks_per_sec);
 			APIC_TPS.store(ticks_per_sec, Ordering::SeqCst);
@@ -174,6 +179,7 @@ pub unsafe extern "C" fn kernel_main(mbi_addr: usize) -> ! {
 
 	serial_println!("[PCI] Registering platform drivers before PCI discovery...");
 	virtio_net_driver_init();
+	ahci_driver_init();
 
 	discover_pci_devices();
 
@@ -187,6 +193,11 @@ pub unsafe extern "C" fn kernel_main(mbi_addr: usize) -> ! {
 		panic!("Failed to finalize PCI devices: {}", e);
 	}
 
+	// before anything logs to /logs/syslog, the disk's copy goes first
+	if let Err(e) = diskfs::mount() {
+		serial_println!("[DISKFS] Nothing mounted at {}: {}", diskfs::MOUNT_POINT, e);
+	}
+
 	serial_println!("[INIT] Enabling CPU interrupts...");
 	enable();
 	serial_println!("[INIT] Interrupts enabled successfully!");
@@ -270,61 +281,60 @@ pub unsafe extern "C" fn kernel_main(mbi_addr: usize) -> ! {
 		}
 	};
 
-	// Main executor loop
-	let process_queue = EXECUTOR.lock().process_queue.clone();
-	loop {
-		if let Some(pid) = process_queue.pop() {
-			if let Some(process_arc) = EXECUTOR.lock().processes.get(&pid) {
-				process_arc
-					.lock()
-					.state
-					.queued
-					.store(false, Ordering::Release);
-			}
+	let _syslog_pid = match spawn_process(
+		|_state| Box::pin(drain_syslog()) as Pin<Box<dyn Future<Output = i32>>>,
+		false
+	) {
+		Ok(pid) => pid,
+		Err(e) => {
+			serial_println!("[ERROR] Failed to spawn syslog drain process: {}", e);
+			ProcessId::new(0)
+		}
+	};
 
-			let process_arc = {
-				let executor = EXECUTOR.lock();
-				executor.processes.get(&pid).cloned()
-			};
-			if let Some(process_arc) = process_arc {
-				*CURRENT_PROCESS.lock() = Some(process_arc.lock().state.clone());
-
-				let mut process = process_arc.lock();
-				let process_state = process.state.clone();
-				unsafe {
-					executor::CURRENT_PROCESS_GUARD = &mut *process as *mut Process;
-				}
-				let waker = {
-					let mut executor = EXECUTOR.lock();
-					executor
-						.waker_cache
-						.entry(pid)
-						.or_insert_with(|| {
-							executor::ProcessWaker::new_waker(
-								pid,
-								process_queue.clone(),
-								process_state
-							)
-						})
-						.clone()
-				};
-				let mut context = Context::from_waker(&waker);
-				let result = process.future.as_mut().poll(&mut context);
-				unsafe {
-					executor::CURRENT_PROCESS_GUARD = core::ptr::null_mut();
-				}
-				if let Poll::Ready(exit_code) = result {
-					let mut executor = EXECUTOR.lock();
-					executor.processes.remove(&pid);
-					executor.waker_cache.remove(&pid);
-					serial_println!("Process {} exited with code: {}", pid.get(), exit_code);
-				}
-				*CURRENT_PROCESS.lock() = None;
-			}
-		} else {
-			EXECUTOR.lock().sleep_if_idle();
+	let _vga_flush_pid = match spawn_process(
+		|_state| Box::pin(vga_buffer::flush_task()) as Pin<Box<dyn Future<Output = i32>>>,
+		false
+	) {
+		Ok(pid) => pid,
+		Err(e) => {
+			serial_println!("[ERROR] Failed to spawn VGA flush process: {}", e);
+			ProcessId::new(0)
+		}
+	};
+
+	if diskfs::mounted() {
+		if let Err(e) = spawn_process(
+			|_state| Box::pin(diskfs::sync_task()) as Pin<Box<dyn Future<Output = i32>>>,
+			false
+		) {
+			serial_println!("[ERROR] Failed to spawn disk sync process: {}", e);
 		}
 	}
+
+	// `make test`: the registered tests run and QEMU exits with the result
+	#[cfg(feature = "test")]
+	if let Err(e) = spawn_process(
+		|_state| Box::pin(crate::utils::ktest::run_all_tests()) as Pin<Box<dyn Future<Output = i32>>>,
+		false
+	) {
+		serial_println!("[ERROR] Failed to spawn tests: {}", e);
+		qemu_exit(1);
+	}
+
+	// `make bench`: the benchmarks run instead of an interactive session
+	#[cfg(feature = "bench")]
+	if let Err(e) = crate::utils::process::spawn_bench() {
+		serial_println!("[ERROR] Failed to spawn bench: {}", e);
+		qemu_exit(1);
+	}
+
+	// bring up the other cpus last, everything they share is set up by now
+	smp::start_aps();
+	// then give each of them its own network queue
+	virtio_net_spread_queues();
+
+	executor::run()
 }
 
 #[allow(unused)]
@@ -344,6 +354,16 @@ fn qemu_exit(code: u32) -> ! {
 /// This function is called on panic.
 #[panic_handler]
 fn panic(info: &core::panic::PanicInfo) -> ! {
+	// the flush process may never run again
+	vga_buffer::stop_deferring();
 	println!("{}", info);
-	crate::hlt_loop();
+	// a failed assert in a test, `make test` should not hang on it
+	#[cfg(feature = "test")]
+	{
+		serial_println!("{}", info);
+		serial_println!("test result: FAILED");
+		qemu_exit(1)
+	}
+	#[cfg(not(feature = "test"))]
+	crate::hlt_loop()
 }
\ No newline at end of file
@@ -4,13 +4,14 @@
 //! Memory module for the kernel.
 //!
 
-use alloc::{boxed::Box, vec::Vec};
+use alloc::{boxed::Box, collections::BTreeMap, vec::Vec};
 
 use x86_64::{
 	PhysAddr,
 	VirtAddr,
 	structures::paging::{
 		FrameAllocator,
+		FrameDeallocator,
 		Mapper,
 		OffsetPageTable,
 		Page,
@@ -18,12 +19,12 @@ use x86_64::{
 		PageTableFlags,
 		PhysFrame,
 		Size4KiB,
-		Translate, page::PageRange
+		Translate, mapper::{MapToError, UnmapError}, page::PageRange
 	}
 };
 
 use crate::{
-	PHYS_MEM_OFFSET, allocator::{self, ALLOCATOR_INFO}, arch::x86_64::bootinfo::{MemoryMap, MemoryRegionType}, error::NullexError, kassert, lazy_static, println, serial_println, task::AddressSpace, utils::{
+	PHYS_MEM_OFFSET, allocator::{self, ALLOCATOR_INFO}, arch::x86_64::bootinfo::{MemoryMap, MemoryRegionType}, arch::x86_64::user::with_kernel_page_table, error::NullexError, kassert, lazy_static, println, serial_println, task::{AddressSpace, executor}, utils::{
 		multiboot2::{__link_phys_base, _end, compute_phys_map_offset},
 		mutex::SpinMutex
 	}
@@ -37,6 +38,14 @@ lazy_static! {
 
 static mut NEXT_DMA_VIRT: u64 = 0x5555_0000_0000;
 
+/// Marks a user page shared copy-on-write after `split`. Such pages are mapped
+/// read-only, the first write to one goes through `resolve_cow_fault`.
+pub const PAGE_COW: PageTableFlags = PageTableFlags::BIT_9;
+
+/// How many address spaces map each copy-on-write frame, by physical address.
+/// Frames that are no longer shared are dropped from the map.
+static COW_SHARES: SpinMutex<BTreeMap<u64, u32>> = SpinMutex::new(BTreeMap::new());
+
 #[derive(Clone, Copy)]
 /// Structure representing a buffer of DMA (Direct Memory Access) information
 pub struct DmaBuffer {
@@ -57,12 +66,11 @@ pub fn init_global_alloc(
 	kassert!(allocator::init_heap(&mut mapper, &mut frame_allocator).is_ok(), "heap not allocated.");
 
 	unsafe {
-		allocator::LOCAL_HEAP_ALLOCATOR
-			.lock()
-			.init(allocator::HEAP_START, allocator::HEAP_SIZE);
-
+		// installed first, setting up the buddy part of the heap allocates
 		let allocator_ref = &allocator::LOCAL_HEAP_ALLOCATOR;
 		ALLOCATOR_INFO.strategy.write().replace(allocator_ref);
+
+		allocator::LOCAL_HEAP_ALLOCATOR.init(allocator::HEAP_START, allocator::HEAP_SIZE);
 	}
 
 	println!("[Info] Heap Initialized. Promoting structures to 'static...");
@@ -133,12 +141,18 @@ pub fn map_ioapic(
 	println!("[Info] IOAPIC mapped at virt {:#X}", ioapic_virt.as_u64());
 }
 
+/// End of the real mode memory, never handed out by the frame allocator.
+const LOW_MEMORY_END: u64 = 0x10_0000;
+
 /// A FrameAllocator that returns usable frames from the bootloader's memory
-/// map.
+/// map. Frames handed back are reused before the map is walked any further.
 #[derive(Clone, Copy)]
 pub struct BootInfoFrameAllocator {
 	memory_map: &'static MemoryMap,
-	next: usize
+	next: usize,
+	/// Head of the freed frames, each holds the address of the next one (0
+	/// ends the list) in its first word.
+	free: Option<PhysFrame>
 }
 
 impl BootInfoFrameAllocator {
@@ -146,7 +160,8 @@ impl BootInfoFrameAllocator {
 	pub fn init(memory_map: &'static MemoryMap) -> Self {
 		BootInfoFrameAllocator { 
 			memory_map,
-			next: 0
+			next: 0,
+			free: None
 		}
 	}
 
@@ -163,7 +178,9 @@ impl BootInfoFrameAllocator {
 
 		let frame_addresses = addr_ranges.flat_map(|r| r.step_by(4096));
 
+		// the first MiB is left alone, the AP trampoline is copied there
 		frame_addresses
+			.filter(|addr| *addr >= LOW_MEMORY_END)
 			.filter(move |addr| (addr < &kernel_start) || (addr >= &kernel_end))
 			.map(|addr| PhysFrame::containing_address(PhysAddr::new(addr)))
 	}
@@ -171,12 +188,26 @@ impl BootInfoFrameAllocator {
 
 unsafe impl FrameAllocator<Size4KiB> for BootInfoFrameAllocator {
 	fn allocate_frame(&mut self) -> Option<PhysFrame> {
+		if let Some(frame) = self.free {
+			let next = unsafe { phys_to_virt(frame.start_address()).as_ptr::<u64>().read() };
+			self.free = (next != 0).then(|| PhysFrame::containing_address(PhysAddr::new(next)));
+			return Some(frame);
+		}
+
 		let frame = self.usable_frames().nth(self.next);
 		self.next += 1;
 		frame
 	}
 }
 
+impl FrameDeallocator<Size4KiB> for BootInfoFrameAllocator {
+	unsafe fn deallocate_frame(&mut self, frame: PhysFrame) {
+		let next = self.free.map_or(0, |f| f.start_address().as_u64());
+		unsafe { phys_to_virt(frame.start_address()).as_mut_ptr::<u64>().write(next) };
+		self.free = Some(frame);
+	}
+}
+
 /// Translates the given virtual address to the mapped physical address, or
 /// `None` if the address is not mapped.
 /// # Safety
@@ -187,6 +218,20 @@ pub unsafe fn virt_to_phys(addr: VirtAddr) -> Option<PhysAddr> {
 	unsafe { OffsetPageTable::new(level_4_table, pmo) }.translate_addr(addr)
 }
 
+/// If user memory at `start..end` would land in a PML4 slot that every
+/// address space shares with the kernel (see `AddressSpace::new`). Mapping it
+/// would write the kernel's own tables.
+pub fn overlaps_kernel_slots(start: u64, end: u64) -> bool {
+	if start >= end {
+		return false;
+	}
+	let pml4 = unsafe { active_level_4_table(*PHYS_MEM_OFFSET.lock()) };
+	(start >> 39..=(end - 1) >> 39).any(|slot| {
+		let flags = pml4[slot as usize % 512].flags();
+		slot != 0 && flags.contains(PageTableFlags::PRESENT) && !flags.contains(PageTableFlags::USER_ACCESSIBLE)
+	})
+}
+
 /// Returns a mutable reference to the active level 4 table.
 pub unsafe fn active_level_4_table(physical_memory_offset: VirtAddr) -> &'static mut PageTable {
 	use x86_64::registers::control::Cr3;
@@ -266,6 +311,31 @@ pub fn dma_alloc(size: usize) -> Result<(VirtAddr, PhysAddr), NullexError> {
 	Ok((virt_addr, first_phys))
 }
 
+/// Maps `size` bytes of device memory at `phys` uncached at its place in the
+/// physical memory window, like the APIC, and returns its virtual address.
+pub fn map_mmio(phys: PhysAddr, size: usize) -> Result<VirtAddr, NullexError> {
+	let offset = *PHYS_MEM_OFFSET.lock();
+	let mut mapper_binding = ALLOCATOR_INFO.mapper.lock();
+	let mapper_slot = mapper_binding.as_mut().ok_or(NullexError::MapperNotInitialized)?;
+	let mut frame_binding = ALLOCATOR_INFO.frame_allocator.lock();
+	let frame_slot = frame_binding.as_mut().ok_or(NullexError::FrameAllocatorNotInitialized)?;
+
+	let flags = PageTableFlags::PRESENT | PageTableFlags::WRITABLE | PageTableFlags::NO_CACHE;
+	let first = PhysFrame::<Size4KiB>::containing_address(phys);
+	let last = PhysFrame::containing_address(phys + (size.max(1) as u64 - 1));
+	for frame in PhysFrame::range_inclusive(first, last) {
+		let page = Page::containing_address(offset + frame.start_address().as_u64());
+		match unsafe { mapper_slot.map_to(page, frame, flags, *frame_slot) } {
+			Ok(flush) => flush.flush(),
+			// the window already reaches it
+			Err(MapToError::PageAlreadyMapped(_) | MapToError::ParentEntryHugePage) => {}
+			Err(e) => return Err(e.into())
+		}
+	}
+
+	Ok(offset + phys.as_u64())
+}
+
 /// Maps a range of memory within a `Process`'s `AddressSpace`.
 pub fn map_range(addr_space: &mut AddressSpace, pages: PageRange, flags: PageTableFlags) -> Result<(), NullexError> {
 	let mut frame_binding = ALLOCATOR_INFO.frame_allocator.lock();
@@ -285,3 +355,456 @@ pub fn map_range(addr_space: &mut AddressSpace, pages: PageRange, flags: PageTab
 	Ok(())
 }
 
+/// Maps existing `frames` at consecutive pages from `start` in a `Process`'s
+/// `AddressSpace`. Only page table frames are allocated.
+///
+/// Page tables are written through the physical memory mapping, so the kernel
+/// page table has to be active (see `user::with_kernel_page_table`).
+pub fn map_frames(
+	addr_space: &mut AddressSpace,
+	start: Page,
+	frames: &[PhysFrame],
+	flags: PageTableFlags
+) -> Result<(), NullexError> {
+	let mut frame_binding = ALLOCATOR_INFO.frame_allocator.lock();
+	let frame_allocator = frame_binding.as_mut().ok_or(NullexError::FrameAllocatorNotInitialized)?;
+
+	let table_ptr = unsafe { phys_to_virt(addr_space.page_table.start_address()) };
+	let mut mapper = unsafe { OffsetPageTable::new(&mut *table_ptr.as_mut_ptr(), *PHYS_MEM_OFFSET.lock()) };
+
+	for (i, frame) in frames.iter().enumerate() {
+		unsafe { mapper.map_to(start + i as u64, *frame, flags, *frame_allocator)?.flush(); }
+	}
+
+	Ok(())
+}
+
+/// Unmaps a range of pages from a `Process`'s `AddressSpace`. Like `map_frames`
+/// this needs the kernel page table active.
+///
+/// The frames themselves are left alone, whoever owns them frees them.
+pub fn unmap_range(addr_space: &mut AddressSpace, pages: PageRange) -> Result<(), NullexError> {
+	let table_ptr = unsafe { phys_to_virt(addr_space.page_table.start_address()) };
+	let mut mapper = unsafe { OffsetPageTable::new(&mut *table_ptr.as_mut_ptr(), *PHYS_MEM_OFFSET.lock()) };
+
+	for page in pages {
+		let (_frame, flush) = mapper.unmap(page)?;
+		flush.flush();
+	}
+
+	Ok(())
+}
+
+/// Like `unmap_range`, but skips pages of the range that were never mapped
+/// (demand paged memory that was not touched).
+pub fn unmap_present(addr_space: &mut AddressSpace, pages: PageRange) -> Result<(), NullexError> {
+	let table_ptr = unsafe { phys_to_virt(addr_space.page_table.start_address()) };
+	let mut mapper = unsafe { OffsetPageTable::new(&mut *table_ptr.as_mut_ptr(), *PHYS_MEM_OFFSET.lock()) };
+
+	for page in pages {
+		match mapper.unmap(page) {
+			Ok((_frame, flush)) => flush.flush(),
+			Err(UnmapError::PageNotMapped) => {}
+			Err(e) => return Err(e.into())
+		}
+	}
+
+	Ok(())
+}
+
+/// Builds the page tables for a `split` child of the address space rooted at
+/// `parent` and returns the child's PML4.
+///
+/// Writable user pages are made read-only and `PAGE_COW` in both trees, which
+/// then point at the same frames. Tables with nothing user accessible below
+/// them (the kernel image, heap and stacks, the upper half) are not copied at
+/// all, both PML4s point at the same ones. Needs the kernel page table active.
+pub fn fork_page_table(parent: PhysFrame) -> Result<PhysFrame, NullexError> {
+	let mut frame_binding = ALLOCATOR_INFO.frame_allocator.lock();
+	let frame_allocator = frame_binding.as_mut().ok_or(NullexError::FrameAllocatorNotInitialized)?;
+	let mut shares = COW_SHARES.lock();
+
+	unsafe { fork_table(parent, 4, &mut **frame_allocator, &mut shares) }
+}
+
+unsafe fn fork_table(
+	table: PhysFrame,
+	level: u8,
+	frame_allocator: &mut impl FrameAllocator<Size4KiB>,
+	shares: &mut BTreeMap<u64, u32>
+) -> Result<PhysFrame, NullexError> {
+	let child = frame_allocator.allocate_frame().ok_or(NullexError::FrameAllocationFailed)?;
+	let parent_table = unsafe { &mut *phys_to_virt(table.start_address()).as_mut_ptr::<PageTable>() };
+	let child_table = unsafe { &mut *phys_to_virt(child.start_address()).as_mut_ptr::<PageTable>() };
+	child_table.zero();
+
+	for (i, entry) in parent_table.iter_mut().enumerate() {
+		let flags = entry.flags();
+		if !flags.contains(PageTableFlags::PRESENT) {
+			continue;
+		}
+
+		if !flags.contains(PageTableFlags::USER_ACCESSIBLE) || flags.contains(PageTableFlags::HUGE_PAGE) {
+			child_table[i] = entry.clone();
+			continue;
+		}
+
+		if level > 1 {
+			let sub = unsafe {
+				fork_table(PhysFrame::containing_address(entry.addr()), level - 1, frame_allocator, shares)?
+			};
+			child_table[i].set_addr(sub.start_address(), flags);
+			continue;
+		}
+
+		if flags.contains(PageTableFlags::WRITABLE) {
+			entry.set_flags((flags - PageTableFlags::WRITABLE) | PAGE_COW);
+		}
+		if entry.flags().contains(PAGE_COW) {
+			// a frame that was only ours counts as one owner before this
+			*shares.entry(entry.addr().as_u64()).or_insert(1) += 1;
+		}
+		child_table[i] = entry.clone();
+	}
+
+	Ok(child)
+}
+
+/// Frees the page tables of `address_space` and the user frames it owns.
+///
+/// Only tables below user accessible entries are its own, the others are the
+/// kernel's and shared by every address space (see `fork_page_table`). A
+/// copy-on-write frame that others still map just loses an owner, frames
+/// borrowed from files and images are left to them. Needs the kernel page
+/// table active, and `address_space` must not be the one in CR3.
+pub fn free_page_table(address_space: &AddressSpace) -> Result<(), NullexError> {
+	let mut frame_binding = ALLOCATOR_INFO.frame_allocator.lock();
+	let frame_allocator = frame_binding.as_mut().ok_or(NullexError::FrameAllocatorNotInitialized)?;
+	let mut shares = COW_SHARES.lock();
+
+	unsafe {
+		free_table(address_space, address_space.page_table, 4, 0, &mut **frame_allocator, &mut shares);
+		frame_allocator.deallocate_frame(address_space.page_table);
+	}
+	Ok(())
+}
+
+unsafe fn free_table(
+	address_space: &AddressSpace,
+	table: PhysFrame,
+	level: u8,
+	base: u64,
+	frame_allocator: &mut impl FrameDeallocator<Size4KiB>,
+	shares: &mut BTreeMap<u64, u32>
+) {
+	let page_table = unsafe { &*phys_to_virt(table.start_address()).as_ptr::<PageTable>() };
+
+	for (i, entry) in page_table.iter().enumerate() {
+		let flags = entry.flags();
+		if !flags.contains(PageTableFlags::PRESENT | PageTableFlags::USER_ACCESSIBLE)
+			|| flags.contains(PageTableFlags::HUGE_PAGE)
+		{
+			continue;
+		}
+		let frame = PhysFrame::containing_address(entry.addr());
+		let addr = base + ((i as u64) << (12 + 9 * (level as u64 - 1)));
+
+		if level > 1 {
+			unsafe {
+				free_table(address_space, frame, level - 1, addr, frame_allocator, shares);
+				frame_allocator.deallocate_frame(frame);
+			}
+			continue;
+		}
+
+		if address_space.borrows(Page::containing_address(VirtAddr::new(addr)), frame) {
+			continue;
+		}
+		if flags.contains(PAGE_COW) {
+			let owners = shares.remove(&entry.addr().as_u64()).unwrap_or(1);
+			if owners > 1 {
+				// the address spaces still sharing the frame keep it
+				shares.insert(entry.addr().as_u64(), owners - 1);
+				continue;
+			}
+		}
+		unsafe { frame_allocator.deallocate_frame(frame) };
+	}
+}
+
+/// Page fault hook for copy-on-write pages. Gives the running user process a
+/// writable page at `addr`, copying the frame if another address space still
+/// shares it. Returns false if `addr` is not a copy-on-write page.
+///
+/// # Safety
+/// Only to be called from the page fault handler for a write protection fault.
+pub unsafe fn resolve_cow_fault(addr: VirtAddr) -> bool {
+	let process = executor::current_guard();
+	if process.is_null() {
+		return false;
+	}
+	let Some(address_space) = (unsafe { &*process }).address_space.as_ref() else {
+		return false;
+	};
+	let pml4 = address_space.page_table;
+
+	let result = unsafe { with_kernel_page_table(|| cow_copy_page(pml4, Page::containing_address(addr))) };
+	match result {
+		Ok(resolved) => resolved,
+		Err(e) => {
+			serial_println!("[ERROR] copy-on-write at {:#x} failed: {}", addr.as_u64(), e);
+			false
+		}
+	}
+}
+
+fn cow_copy_page(pml4: PhysFrame, page: Page) -> Result<bool, NullexError> {
+	let mut table = pml4;
+	let indices = [page.p4_index(), page.p3_index(), page.p2_index()];
+	for index in indices {
+		let pt = unsafe { &*phys_to_virt(table.start_address()).as_ptr::<PageTable>() };
+		let entry = &pt[index];
+		if !entry.flags().contains(PageTableFlags::PRESENT) || entry.flags().contains(PageTableFlags::HUGE_PAGE) {
+			return Ok(false);
+		}
+		table = PhysFrame::containing_address(entry.addr());
+	}
+
+	let pt = unsafe { &mut *phys_to_virt(table.start_address()).as_mut_ptr::<PageTable>() };
+	let entry = &mut pt[page.p1_index()];
+	let flags = entry.flags();
+	if !flags.contains(PageTableFlags::PRESENT | PAGE_COW) {
+		return Ok(false);
+	}
+	let writable = (flags - PAGE_COW) | PageTableFlags::WRITABLE;
+
+	let mut shares = COW_SHARES.lock();
+	let frame_addr = entry.addr().as_u64();
+	let owners = shares.get(&frame_addr).copied().unwrap_or(1);
+
+	if owners <= 1 {
+		// everyone else has copied already, take the frame over
+		shares.remove(&frame_addr);
+		entry.set_flags(writable);
+	} else {
+		let copy = {
+			let mut frame_binding = ALLOCATOR_INFO.frame_allocator.lock();
+			let frame_allocator = frame_binding.as_mut().ok_or(NullexError::FrameAllocatorNotInitialized)?;
+			frame_allocator.allocate_frame().ok_or(NullexError::FrameAllocationFailed)?
+		};
+		unsafe {
+			core::ptr::copy_nonoverlapping(
+				phys_to_virt(entry.addr()).as_ptr::<u8>(),
+				phys_to_virt(copy.start_address()).as_mut_ptr::<u8>(),
+				4096
+			);
+		}
+		entry.set_addr(copy.start_address(), writable);
+		shares.insert(frame_addr, owners - 1);
+	}
+
+	x86_64::instructions::tlb::flush(page.start_address());
+	Ok(true)
+}
+
+/// Page fault hook for `mapm` memory. Maps a zeroed page at `addr` if it
+/// lies in an anonymous region of the running user process, returns false if
+/// it does not.
+///
+/// # Safety
+/// Only to be called from the page fault handler for a not-present fault.
+pub unsafe fn fault_in_anon_page(addr: VirtAddr) -> bool {
+	let process = executor::current_guard();
+	if process.is_null() {
+		return false;
+	}
+	let Some(address_space) = (unsafe { &mut *process }).address_space.as_mut() else {
+		return false;
+	};
+	if !address_space.anon.iter().any(|region| region.contains(addr.as_u64())) {
+		return false;
+	}
+
+	let page = Page::containing_address(addr);
+	match unsafe { with_kernel_page_table(|| map_zeroed_page(address_space, page)) } {
+		Ok(()) => true,
+		Err(e) => {
+			serial_println!("[ERROR] anonymous page at {:#x} failed: {}", addr.as_u64(), e);
+			false
+		}
+	}
+}
+
+/// Maps a fresh zero filled, writable, non executable user page at `page`.
+/// Needs the kernel page table active.
+pub fn map_zeroed_page(address_space: &mut AddressSpace, page: Page) -> Result<(), NullexError> {
+	let frame = {
+		let mut frame_binding = ALLOCATOR_INFO.frame_allocator.lock();
+		let frame_allocator = frame_binding.as_mut().ok_or(NullexError::FrameAllocatorNotInitialized)?;
+		frame_allocator.allocate_frame().ok_or(NullexError::FrameAllocationFailed)?
+	};
+	unsafe { core::ptr::write_bytes(phys_to_virt(frame.start_address()).as_mut_ptr::<u8>(), 0, 4096) };
+
+	let flags = PageTableFlags::PRESENT
+		| PageTableFlags::WRITABLE
+		| PageTableFlags::USER_ACCESSIBLE
+		| PageTableFlags::NO_EXECUTE;
+	map_frames(address_space, page, &[frame], flags)
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use x86_64::{
+		VirtAddr,
+		structures::paging::{
+			OffsetPageTable,
+			Page,
+			PageTable,
+			PageTableFlags,
+			FrameAllocator,
+			FrameDeallocator,
+			PhysFrame,
+			Translate,
+			mapper::{MappedFrame, TranslateResult}
+		}
+	};
+
+	use crate::{
+		PHYS_MEM_OFFSET,
+		allocator::{ALLOCATOR_INFO, HEAP_START},
+		memory::{
+			PAGE_COW,
+			active_level_4_table,
+			cow_copy_page,
+			map_range,
+			map_zeroed_page,
+			overlaps_kernel_slots,
+			phys_to_virt,
+			unmap_present
+		},
+		task::{AddressSpace, AnonRegion},
+		utils::ktest::TestError
+	};
+
+	fn leaf(pml4: PhysFrame, addr: VirtAddr) -> (PhysFrame, PageTableFlags) {
+		let table = unsafe { &mut *phys_to_virt(pml4.start_address()).as_mut_ptr::<PageTable>() };
+		let mapper = unsafe { OffsetPageTable::new(table, *PHYS_MEM_OFFSET.lock()) };
+		match mapper.translate(addr) {
+			TranslateResult::Mapped {
+				frame: MappedFrame::Size4KiB(frame),
+				flags,
+				..
+			} => (frame, flags),
+			_ => panic!("page not mapped")
+		}
+	}
+
+	pub fn test_fork_shares_then_copies_on_write() -> Result<(), TestError> {
+		let addr = VirtAddr::new(0x1000_0000);
+		let page: Page = Page::containing_address(addr);
+		let flags = PageTableFlags::PRESENT | PageTableFlags::WRITABLE | PageTableFlags::USER_ACCESSIBLE;
+
+		let mut parent = AddressSpace::new().unwrap();
+		map_range(&mut parent, Page::range(page, page + 1), flags).unwrap();
+		let (frame, _) = leaf(parent.page_table, addr);
+		unsafe { *phys_to_virt(frame.start_address()).as_mut_ptr::<u8>() = 0x42 };
+
+		let child = parent.fork().unwrap();
+		let (parent_frame, parent_flags) = leaf(parent.page_table, addr);
+		let (child_frame, child_flags) = leaf(child.page_table, addr);
+		assert_eq!(parent_frame, child_frame);
+		assert!(parent_flags.contains(PAGE_COW) && !parent_flags.contains(PageTableFlags::WRITABLE));
+		assert!(child_flags.contains(PAGE_COW) && !child_flags.contains(PageTableFlags::WRITABLE));
+
+		// the first writer gets a copy, the last one keeps the frame
+		assert!(cow_copy_page(child.page_table, page).unwrap());
+		let (child_frame, child_flags) = leaf(child.page_table, addr);
+		assert_ne!(child_frame, frame);
+		assert!(child_flags.contains(PageTableFlags::WRITABLE));
+		assert_eq!(unsafe { *phys_to_virt(child_frame.start_address()).as_ptr::<u8>() }, 0x42);
+
+		assert!(cow_copy_page(parent.page_table, page).unwrap());
+		let (parent_frame, parent_flags) = leaf(parent.page_table, addr);
+		assert_eq!(parent_frame, frame);
+		assert!(parent_flags.contains(PageTableFlags::WRITABLE) && !parent_flags.contains(PAGE_COW));
+		Ok(())
+	}
+	crate::create_test!(test_fork_shares_then_copies_on_write);
+
+	pub fn test_anon_pages_zeroed_and_unmapped() -> Result<(), TestError> {
+		let region = AnonRegion { start: 0x2000_0000, pages: 4 };
+		assert!(region.contains(0x2000_0000) && region.contains(0x2000_3FFF));
+		assert!(!region.contains(0x2000_4000) && !region.contains(0x1FFF_FFFF));
+
+		let mut space = AddressSpace::new().unwrap();
+		let first: Page = Page::containing_address(VirtAddr::new(region.start));
+		map_zeroed_page(&mut space, first + 1).unwrap();
+		let (frame, flags) = leaf(space.page_table, VirtAddr::new(region.start + 4096));
+		assert!(flags.contains(PageTableFlags::WRITABLE | PageTableFlags::USER_ACCESSIBLE | PageTableFlags::NO_EXECUTE));
+		let bytes = unsafe { core::slice::from_raw_parts(phys_to_virt(frame.start_address()).as_ptr::<u8>(), 4096) };
+		assert!(bytes.iter().all(|b| *b == 0));
+
+		// only one of the four pages was touched, the rest is skipped
+		unmap_present(&mut space, Page::range(first, first + region.pages)).unwrap();
+		let table = unsafe { &mut *phys_to_virt(space.page_table.start_address()).as_mut_ptr::<PageTable>() };
+		let mapper = unsafe { OffsetPageTable::new(table, *PHYS_MEM_OFFSET.lock()) };
+		assert!(mapper.translate_addr(VirtAddr::new(region.start + 4096)).is_none());
+		Ok(())
+	}
+	crate::create_test!(test_anon_pages_zeroed_and_unmapped);
+
+	pub fn test_freed_frames_are_reused() -> Result<(), TestError> {
+		let mut frame_binding = ALLOCATOR_INFO.frame_allocator.lock();
+		let frame_allocator = frame_binding.as_mut().unwrap();
+
+		let first = frame_allocator.allocate_frame().unwrap();
+		let second = frame_allocator.allocate_frame().unwrap();
+		unsafe {
+			frame_allocator.deallocate_frame(first);
+			frame_allocator.deallocate_frame(second);
+		}
+		assert_eq!(frame_allocator.allocate_frame(), Some(second));
+		assert_eq!(frame_allocator.allocate_frame(), Some(first));
+		Ok(())
+	}
+	crate::create_test!(test_freed_frames_are_reused);
+
+	pub fn test_dropped_child_gives_up_cow_share() -> Result<(), TestError> {
+		let addr = VirtAddr::new(0x1000_0000);
+		let page: Page = Page::containing_address(addr);
+		let flags = PageTableFlags::PRESENT | PageTableFlags::WRITABLE | PageTableFlags::USER_ACCESSIBLE;
+
+		let mut parent = AddressSpace::new().unwrap();
+		map_range(&mut parent, Page::range(page, page + 1), flags).unwrap();
+		let (frame, _) = leaf(parent.page_table, addr);
+		drop(parent.fork().unwrap());
+
+		// the parent is the only owner again, its write keeps the frame
+		assert!(cow_copy_page(parent.page_table, page).unwrap());
+		let (parent_frame, parent_flags) = leaf(parent.page_table, addr);
+		assert_eq!(parent_frame, frame);
+		assert!(parent_flags.contains(PageTableFlags::WRITABLE));
+		Ok(())
+	}
+	crate::create_test!(test_dropped_child_gives_up_cow_share);
+
+	pub fn test_new_space_shares_kernel_tables() -> Result<(), TestError> {
+		let space = AddressSpace::new().unwrap();
+		let table = unsafe { &mut *phys_to_virt(space.page_table.start_address()).as_mut_ptr::<PageTable>() };
+		let kernel = unsafe { active_level_4_table(*PHYS_MEM_OFFSET.lock()) };
+
+		let heap = VirtAddr::new(HEAP_START as u64);
+		assert_eq!(table[heap.p4_index()].addr(), kernel[heap.p4_index()].addr());
+		assert!(overlaps_kernel_slots(heap.as_u64(), heap.as_u64() + 1));
+		assert!(!overlaps_kernel_slots(0x40_0000, 0x50_0000));
+
+		// the kernel image stays reachable, this function is in it
+		let code = VirtAddr::new(test_new_space_shares_kernel_tables as usize as u64);
+		let mapper = unsafe { OffsetPageTable::new(table, *PHYS_MEM_OFFSET.lock()) };
+		let kernel_mapper = unsafe { OffsetPageTable::new(kernel, *PHYS_MEM_OFFSET.lock()) };
+		assert!(mapper.translate_addr(code).is_some());
+		assert_eq!(mapper.translate_addr(code), kernel_mapper.translate_addr(code));
+		Ok(())
+	}
+	crate::create_test!(test_new_space_shares_kernel_tables);
+}
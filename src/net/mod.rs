@@ -10,6 +10,7 @@ pub mod ethernet;
 pub mod http;
 pub mod icmp;
 pub mod ipv4;
+pub mod socket;
 pub mod tcp;
 pub mod udp;
 
@@ -0,0 +1,312 @@
+//!
+//! net/socket.rs
+//!
+//! TCP sockets of user processes, all on one shared smoltcp interface.
+//!
+
+use alloc::vec::Vec;
+use core::{
+	net::Ipv4Addr,
+	sync::atomic::{AtomicBool, Ordering}
+};
+
+use smoltcp::{
+	iface::{Config, Interface, SocketHandle, SocketSet},
+	socket::tcp::{Socket, SocketBuffer, State},
+	time::Instant,
+	wire::{EthernetAddress, IpAddress, IpCidr, IpEndpoint}
+};
+
+use crate::{
+	arch::x86_64::user::with_kernel_page_table,
+	drivers::virtio::net::{VIRTIO_NET_INSTANCE, VirtioNet, flush_queues},
+	ensure,
+	error::NullexError,
+	net::{GATEWAY_IP, OUR_IP},
+	task::{ProcessId, timer},
+	utils::mutex::SpinMutex
+};
+
+const SOCKET_RX_BUFFER_SIZE: usize = 4 * 1024;
+const SOCKET_TX_BUFFER_SIZE: usize = 4 * 1024;
+/// Kernel heap all socket buffers together may take, closed sockets still
+/// shutting down included.
+const SOCKET_HEAP_BUDGET: usize = crate::allocator::HEAP_SIZE / 8;
+/// Most sockets open at once, over all processes.
+pub const MAX_SOCKETS: usize = SOCKET_HEAP_BUDGET / (SOCKET_RX_BUFFER_SIZE + SOCKET_TX_BUFFER_SIZE);
+/// First local port handed to a connecting socket.
+const EPHEMERAL_PORT_START: u16 = 49152;
+
+// socket states as reported to user processes, mirrored as NX_SOCK_* in nullex.h
+
+pub const SOCK_CLOSED: i32 = 0;
+pub const SOCK_LISTEN: i32 = 1;
+pub const SOCK_CONNECTING: i32 = 2;
+pub const SOCK_ESTABLISHED: i32 = 3;
+/// Either side has closed, what was received can still be read.
+pub const SOCK_CLOSING: i32 = 4;
+
+struct UserSocket {
+	owner: ProcessId,
+	handle: SocketHandle
+}
+
+/// Which process holds which socket. A socket id is the index of its slot,
+/// freed ids are reused lowest first like file descriptors.
+#[derive(Default)]
+struct SocketTable {
+	slots: Vec<Option<UserSocket>>
+}
+
+impl SocketTable {
+	fn insert(&mut self, owner: ProcessId, handle: SocketHandle) -> Result<u32, NullexError> {
+		let index = match self.slots.iter().position(Option::is_none) {
+			Some(index) => index,
+			None => {
+				ensure!(self.slots.len() < MAX_SOCKETS, NullexError::TooManySockets);
+				self.slots.push(None);
+				self.slots.len() - 1
+			}
+		};
+		self.slots[index] = Some(UserSocket { owner, handle });
+		Ok(index as u32)
+	}
+
+	fn get(&self, owner: ProcessId, sock: u32) -> Result<SocketHandle, NullexError> {
+		match self.slots.get(sock as usize) {
+			Some(Some(socket)) if socket.owner == owner => Ok(socket.handle),
+			_ => Err(NullexError::SocketNotFound)
+		}
+	}
+
+	fn remove(&mut self, owner: ProcessId, sock: u32) -> Result<SocketHandle, NullexError> {
+		let handle = self.get(owner, sock)?;
+		self.slots[sock as usize] = None;
+		Ok(handle)
+	}
+
+	/// Removes every socket of `owner`.
+	fn remove_owned(&mut self, owner: ProcessId) -> Vec<SocketHandle> {
+		self.slots
+			.iter_mut()
+			.filter(|slot| slot.as_ref().is_some_and(|socket| socket.owner == owner))
+			.filter_map(|slot| slot.take().map(|socket| socket.handle))
+			.collect()
+	}
+}
+
+/// The interface and every user socket on it.
+pub struct NetStack {
+	iface: Interface,
+	sockets: SocketSet<'static>,
+	table: SocketTable,
+	/// Closed by their process but still saying goodbye to the peer, dropped
+	/// once the connection is done.
+	closing: Vec<SocketHandle>,
+	next_port: u16
+}
+
+static STACK: SpinMutex<Option<NetStack>> = SpinMutex::new(None);
+/// Set once the stack is up. From then on every received frame goes to it
+/// instead of `net::receive_packet`.
+static STACK_UP: AtomicBool = AtomicBool::new(false);
+
+fn now() -> Instant {
+	// a tick is about a millisecond
+	Instant::from_millis(timer::now() as i64)
+}
+
+impl NetStack {
+	fn new(device: &mut VirtioNet) -> Self {
+		let config = Config::new(EthernetAddress(device.config.mac).into());
+		let mut iface = Interface::new(config, device, now());
+		iface.update_ip_addrs(|addrs| {
+			addrs
+				.push(IpCidr::new(IpAddress::Ipv4(Ipv4Addr::from_octets(OUR_IP)), 24))
+				.unwrap();
+		});
+		iface
+			.routes_mut()
+			.add_default_ipv4_route(Ipv4Addr::from_octets(GATEWAY_IP))
+			.unwrap();
+
+		Self {
+			iface,
+			sockets: SocketSet::new(Vec::new()),
+			table: SocketTable::default(),
+			closing: Vec::new(),
+			next_port: EPHEMERAL_PORT_START
+		}
+	}
+
+	/// Moves frames both ways and drops closed sockets that are done.
+	fn poll(&mut self, device: &mut VirtioNet) {
+		self.iface.poll(now(), device, &mut self.sockets);
+		// one doorbell for the whole burst, sent buffers go back to the
+		// driver's pool before the next one
+		flush_queues();
+
+		let sockets = &mut self.sockets;
+		self.closing.retain(|handle| {
+			let done = matches!(sockets.get::<Socket>(*handle).state(), State::Closed | State::TimeWait);
+			if done {
+				sockets.remove(*handle);
+			}
+			!done
+		});
+	}
+
+	/// Opens a socket for `owner` and returns its id.
+	pub fn open(&mut self, owner: ProcessId) -> Result<u32, NullexError> {
+		// the ones in `closing` still hold their buffers
+		let held = self.table.slots.iter().flatten().count() + self.closing.len();
+		ensure!(held < MAX_SOCKETS, NullexError::TooManySockets);
+
+		let socket = Socket::new(
+			SocketBuffer::new(vec![0u8; SOCKET_RX_BUFFER_SIZE]),
+			SocketBuffer::new(vec![0u8; SOCKET_TX_BUFFER_SIZE])
+		);
+		let handle = self.sockets.add(socket);
+		self.table.insert(owner, handle).inspect_err(|_| {
+			self.sockets.remove(handle);
+		})
+	}
+
+	/// The socket `sock` of `owner`.
+	pub fn socket(&mut self, owner: ProcessId, sock: u32) -> Result<&mut Socket<'static>, NullexError> {
+		let handle = self.table.get(owner, sock)?;
+		Ok(self.sockets.get_mut::<Socket>(handle))
+	}
+
+	/// Starts connecting `sock` to `ip`:`port` from the next ephemeral port.
+	pub fn connect(&mut self, owner: ProcessId, sock: u32, ip: [u8; 4], port: u16) -> Result<(), NullexError> {
+		let handle = self.table.get(owner, sock)?;
+		let local = self.next_port;
+		self.next_port = self.next_port.checked_add(1).unwrap_or(EPHEMERAL_PORT_START);
+
+		let remote = IpEndpoint::new(IpAddress::Ipv4(Ipv4Addr::from_octets(ip)), port);
+		self.sockets
+			.get_mut::<Socket>(handle)
+			.connect(self.iface.context(), remote, local)
+			.map_err(|_| NullexError::TcpConnectionFailed)
+	}
+
+	/// Closes `sock`, the connection is shut down in the background.
+	pub fn close(&mut self, owner: ProcessId, sock: u32) -> Result<(), NullexError> {
+		let handle = self.table.remove(owner, sock)?;
+		self.sockets.get_mut::<Socket>(handle).close();
+		self.closing.push(handle);
+		Ok(())
+	}
+
+	/// Closes every socket `owner` still has open.
+	pub fn close_owned(&mut self, owner: ProcessId) {
+		for handle in self.table.remove_owned(owner) {
+			self.sockets.get_mut::<Socket>(handle).close();
+			self.closing.push(handle);
+		}
+	}
+}
+
+/// Runs `f` on the stack, bringing the stack up on first use. The interface
+/// is polled before `f`, so it sees what arrived, and after it, so what it
+/// queued goes out right away.
+///
+/// `f` runs on whatever page table is loaded, the polls on the kernel's.
+pub fn with_stack<R>(f: impl FnOnce(&mut NetStack) -> Result<R, NullexError>) -> Result<R, NullexError> {
+	let mut guard = STACK.lock();
+	let mut instance = VIRTIO_NET_INSTANCE.lock();
+	let (device, _) = instance.as_mut().ok_or(NullexError::MissingVirtIOInstance)?;
+
+	if guard.is_none() {
+		*guard = Some(unsafe { with_kernel_page_table(|| NetStack::new(device)) });
+		STACK_UP.store(true, Ordering::Release);
+	}
+	let stack = guard.as_mut().unwrap();
+
+	unsafe { with_kernel_page_table(|| stack.poll(device)) };
+	let result = f(stack);
+	unsafe { with_kernel_page_table(|| stack.poll(device)) };
+	result
+}
+
+/// Polls the stack from the network interrupt. Returns false if the stack is
+/// not up, the frames are then the caller's to handle.
+pub fn poll_interrupt() -> bool {
+	if !STACK_UP.load(Ordering::Acquire) {
+		return false;
+	}
+	// whoever holds the locks polls on the way out and takes these frames too
+	if let Some(mut stack) = STACK.try_lock()
+		&& let Some(stack) = stack.as_mut()
+		&& let Some(mut instance) = VIRTIO_NET_INSTANCE.try_lock()
+		&& let Some((device, _)) = instance.as_mut()
+	{
+		unsafe { with_kernel_page_table(|| stack.poll(device)) };
+	}
+	true
+}
+
+/// Closes the sockets of a process that ended.
+pub fn release_owned(owner: ProcessId) {
+	if !STACK_UP.load(Ordering::Acquire) {
+		return;
+	}
+	if let Some(stack) = STACK.lock().as_mut() {
+		stack.close_owned(owner);
+	}
+}
+
+/// Socket state as reported to user processes, one of the `SOCK_*` values.
+pub fn user_state(socket: &Socket) -> i32 {
+	match socket.state() {
+		State::Closed | State::TimeWait => SOCK_CLOSED,
+		State::Listen => SOCK_LISTEN,
+		State::SynSent | State::SynReceived => SOCK_CONNECTING,
+		State::Established => SOCK_ESTABLISHED,
+		_ => SOCK_CLOSING
+	}
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use alloc::vec::Vec;
+
+	use smoltcp::{
+		iface::SocketSet,
+		socket::tcp::{Socket, SocketBuffer}
+	};
+
+	use crate::{
+		error::NullexError,
+		net::socket::{MAX_SOCKETS, SocketTable},
+		task::ProcessId,
+		utils::ktest::TestError
+	};
+
+	pub fn test_socket_table_owner_and_reuse() -> Result<(), TestError> {
+		let mut sockets = SocketSet::new(Vec::new());
+		let handle = sockets.add(Socket::new(SocketBuffer::new(vec![0u8; 64]), SocketBuffer::new(vec![0u8; 64])));
+		let (a, b) = (ProcessId::new(1), ProcessId::new(2));
+
+		let mut table = SocketTable::default();
+		let first = table.insert(a, handle).unwrap();
+		let second = table.insert(a, handle).unwrap();
+		assert_eq!((first, second), (0, 1));
+		// another process cannot reach it
+		assert!(matches!(table.get(b, first), Err(NullexError::SocketNotFound)));
+		assert!(table.remove(b, first).is_err());
+
+		table.remove(a, first).unwrap();
+		assert_eq!(table.insert(b, handle).unwrap(), first);
+		assert_eq!(table.remove_owned(a).len(), 1);
+		assert!(table.get(a, second).is_err());
+		assert!(table.get(b, first).is_ok());
+
+		while table.insert(a, handle).is_ok() {}
+		assert_eq!(table.slots.len(), MAX_SOCKETS);
+		assert!(matches!(table.insert(a, handle), Err(NullexError::TooManySockets)));
+		Ok(())
+	}
+	crate::create_test!(test_socket_table_owner_and_reuse);
+}
@@ -54,20 +54,30 @@ impl TcpConnection  {
     }
 
     pub fn recv(&self, sockets: &mut SocketSet<'_>) -> Result<Vec<u8>, NullexError> {
-        let socket = sockets.get_mut::<Socket>(self.handle);
-        if !socket.can_recv() {
+        if !sockets.get::<Socket>(self.handle).can_recv() {
             return Ok(vec![]);
         }
 
         let mut buf = vec![0u8; TCP_RX_BUFFER_SIZE];
-        let n = socket.recv_slice(&mut buf).map_err(|e| {
-            serial_println!("[TCP] Recv Error: {:?}", e);
-            NullexError::TcpFailedToReceive
-        })?;
+        let n = self.recv_into(sockets, &mut buf)?;
         buf.truncate(n);
         Ok(buf)
     }
 
+    /// Copies what was received straight from the socket buffer into `buf`,
+    /// returns the bytes copied.
+    pub fn recv_into(&self, sockets: &mut SocketSet<'_>, buf: &mut [u8]) -> Result<usize, NullexError> {
+        let socket = sockets.get_mut::<Socket>(self.handle);
+        if !socket.can_recv() {
+            return Ok(0);
+        }
+
+        socket.recv_slice(buf).map_err(|e| {
+            serial_println!("[TCP] Recv Error: {:?}", e);
+            NullexError::TcpFailedToReceive
+        })
+    }
+
     pub fn close(&self, sockets: &mut SocketSet<'_>) {
         sockets.get_mut::<Socket>(self.handle).close();
     }
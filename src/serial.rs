@@ -22,6 +22,9 @@ use crate::{
 	utils::{serial_kfunc::run_serial_command, mutex::SpinMutex, oncecell::spin::OnceCell}
 };
 
+/// Depth of the 16550 transmit FIFO, enabled by `SerialPort::init`.
+const TX_FIFO_DEPTH: usize = 16;
+
 #[derive(Debug)]
 /// Structure representing a port to the Serial I/O lines.
 pub struct SerialPort(u16);
@@ -101,6 +104,40 @@ impl SerialPort {
 		}
 	}
 
+	/// Sends a run of bytes, filling the transmit FIFO in one go each time it
+	/// drains instead of polling the line status before every byte.
+	fn send_bulk(&mut self, bytes: &[u8]) {
+		let mut room = 0;
+		for &data in bytes {
+			let needed = match data {
+				8 | 0x7F => 3,
+				0x0A => 2,
+				_ => 1
+			};
+			if room < needed {
+				while !self.line_sts().contains(LineStatusFlags::OUTPUT_EMPTY) {
+					spin_loop();
+				}
+				room = TX_FIFO_DEPTH;
+			}
+			unsafe {
+				match data {
+					8 | 0x7F => {
+						outb(self.port_data(), 8);
+						outb(self.port_data(), b' ');
+						outb(self.port_data(), 8);
+					}
+					0x0A => {
+						outb(self.port_data(), 0x0D);
+						outb(self.port_data(), 0x0A);
+					}
+					data => outb(self.port_data(), data)
+				}
+			}
+			room -= needed;
+		}
+	}
+
 	fn send_raw(&mut self, data: u8) {
 		loop {
 			if let Ok(ok) = self.try_send_raw(data) {
@@ -325,16 +362,18 @@ pub fn _print(args: ::core::fmt::Arguments) {
 	});
 }
 
-#[doc(hidden)]
-pub fn _send_raw_serial(bytes: &[u8]) {
+/// Writes a whole byte buffer to `SERIAL1` under a single lock.
+pub fn write_bytes(bytes: &[u8]) {
 	interrupts::without_interrupts(|| {
-		let mut serial = SERIAL1.lock();
-		for &b in bytes {
-			serial.send(b);
-		}
+		SERIAL1.lock().send_bulk(bytes);
 	})
 }
 
+#[doc(hidden)]
+pub fn _send_raw_serial(bytes: &[u8]) {
+	write_bytes(bytes)
+}
+
 /// Prints to the host through the serial interface.
 #[macro_export]
 macro_rules! serial_print {
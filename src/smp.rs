@@ -0,0 +1,239 @@
+//!
+//! smp.rs
+//!
+//! Bring-up of the application processors and per-cpu bookkeeping.
+//!
+
+use core::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, AtomicUsize, Ordering, fence};
+
+use x86_64::{
+	PhysAddr,
+	instructions::interrupts,
+	registers::{control::Cr3, model_specific::Msr}
+};
+
+use crate::{
+	acpi, apic, arch, gdt, interrupts::load_idt, memory::phys_to_virt, serial_println, task::{executor, timer}, utils::boot::{init_efer, init_simd, init_write_protect}
+};
+
+/// Most cpus the kernel runs on, extra ones in the MADT stay halted.
+pub const MAX_CPUS: usize = 8;
+
+/// Where the AP start code is copied to, page aligned and below 1 MiB.
+const AP_TRAMPOLINE_ADDR: u64 = 0x8000;
+/// Ticks (~1 ms each) an AP gets to come up before it is given up on.
+const AP_START_TIMEOUT: u64 = 100;
+
+const AP_STACK_SIZE: usize = 4096 * 16;
+
+#[repr(C, align(16))]
+struct ApStack([u8; AP_STACK_SIZE]);
+
+// cpu 0 keeps running on the boot stack
+static mut AP_STACKS: [ApStack; MAX_CPUS - 1] = [const { ApStack([0; AP_STACK_SIZE]) }; MAX_CPUS - 1];
+
+/// Local APIC id of each cpu index, the destination of IPIs sent to it.
+static LAPIC_IDS: [AtomicU32; MAX_CPUS] = [const { AtomicU32::new(0) }; MAX_CPUS];
+/// Number of cpus running the executor. Indices are handed out densely, so
+/// cpus `0..online_cpus()` are the online ones.
+static ONLINE_CPUS: AtomicUsize = AtomicUsize::new(1);
+/// Bit `n` is set while cpu `n` is halted in the idle loop.
+static IDLE_CPUS: AtomicU64 = AtomicU64::new(0);
+/// Set by an AP once it is far enough to no longer need the trampoline.
+static AP_STARTED: AtomicBool = AtomicBool::new(false);
+
+unsafe extern "C" {
+	static ap_trampoline_start: u8;
+	static ap_trampoline_params: u8;
+	static ap_trampoline_end: u8;
+}
+
+const IA32_KERNEL_GS_BASE: u32 = 0xC000_0102;
+
+/// Parameter block at the end of `ap_trampoline.asm`.
+#[repr(C)]
+struct TrampolineParams {
+	cr3: u64,
+	stack: u64,
+	entry: u64,
+	cpu: u64
+}
+
+/// Index of the calling cpu, 0 for the BSP.
+///
+/// Kept in `IA32_KERNEL_GS_BASE`: the kernel never runs `swapgs`, and unlike
+/// the live GS base a user program cannot change it by loading a selector.
+#[inline]
+pub fn cpu_id() -> usize {
+	unsafe { Msr::new(IA32_KERNEL_GS_BASE).read() as usize }
+}
+
+fn set_cpu_id(cpu: usize) {
+	unsafe { Msr::new(IA32_KERNEL_GS_BASE).write(cpu as u64) }
+}
+
+/// Number of cpus running the executor.
+#[inline]
+pub fn online_cpus() -> usize {
+	ONLINE_CPUS.load(Ordering::Acquire)
+}
+
+/// Local APIC id of online cpu `cpu`, where interrupts for it are sent.
+pub fn lapic_id_of(cpu: usize) -> u8 {
+	LAPIC_IDS[cpu].load(Ordering::Relaxed) as u8
+}
+
+/// Marks the calling cpu as idle (or busy again). While it is idle, work
+/// queued for it has to be announced with `kick`.
+pub fn set_idle(idle: bool) {
+	let bit = 1 << cpu_id();
+	if idle {
+		IDLE_CPUS.fetch_or(bit, Ordering::SeqCst);
+	} else {
+		IDLE_CPUS.fetch_and(!bit, Ordering::SeqCst);
+	}
+}
+
+/// If every online cpu but the caller is idle.
+pub fn others_idle() -> bool {
+	let online = (1u64 << online_cpus()) - 1;
+	let others = online & !(1 << cpu_id());
+	IDLE_CPUS.load(Ordering::SeqCst) & others == others
+}
+
+/// Wakes `cpu` with a reschedule IPI if it is halted in the idle loop.
+pub fn kick(cpu: usize) {
+	// orders the caller's queue push before reading the idle bits, pairs with
+	// the re-check in the idle loop after `set_idle`
+	fence(Ordering::SeqCst);
+	if cpu == cpu_id() || IDLE_CPUS.load(Ordering::SeqCst) & (1 << cpu) == 0 {
+		return;
+	}
+	let lapic_id = LAPIC_IDS[cpu].load(Ordering::Relaxed) as u8;
+	unsafe { apic::send_ipi(lapic_id, crate::interrupts::RESCHEDULE_VECTOR) };
+}
+
+/// Wakes one idle cpu (not the caller) so it can steal the work just queued.
+pub fn kick_idle() {
+	fence(Ordering::SeqCst);
+	let idle = IDLE_CPUS.load(Ordering::SeqCst) & !(1 << cpu_id());
+	if idle != 0 {
+		kick(idle.trailing_zeros() as usize);
+	}
+}
+
+/// Records the BSP as cpu 0. Must run before the per-cpu tables are set up.
+pub fn init_bsp() {
+	set_cpu_id(0);
+}
+
+/// Starts every application processor listed in the MADT, one at a time,
+/// with the INIT / STARTUP / STARTUP sequence. Needs the APIC timer running
+/// and interrupts enabled for the delays.
+pub fn start_aps() {
+	let bsp = apic::lapic_id();
+	LAPIC_IDS[0].store(bsp as u32, Ordering::Relaxed);
+	let ids = unsafe { acpi::lapic_ids() };
+
+	let start = core::ptr::addr_of!(ap_trampoline_start) as u64;
+	let end = core::ptr::addr_of!(ap_trampoline_end) as u64;
+	let params_offset = core::ptr::addr_of!(ap_trampoline_params) as u64 - start;
+
+	let trampoline = unsafe { phys_to_virt(PhysAddr::new(AP_TRAMPOLINE_ADDR)) };
+	unsafe {
+		core::ptr::copy_nonoverlapping(start as *const u8, trampoline.as_mut_ptr::<u8>(), (end - start) as usize);
+	}
+	let params = (trampoline.as_u64() + params_offset) as *mut TrampolineParams;
+
+	let cr3 = Cr3::read().0.start_address().as_u64();
+	if cr3 > u32::MAX as u64 {
+		serial_println!("[SMP] Kernel page table above 4 GiB, APs cannot load it, staying single cpu");
+		return;
+	}
+
+	for lapic_id in ids.into_iter().filter(|id| *id != bsp) {
+		let cpu = online_cpus();
+		if cpu >= MAX_CPUS {
+			serial_println!("[SMP] More than {} cpus, ignoring the rest", MAX_CPUS);
+			break;
+		}
+
+		let stack_top = unsafe { &raw mut AP_STACKS[cpu - 1] as u64 } + AP_STACK_SIZE as u64;
+		unsafe {
+			params.write_volatile(TrampolineParams {
+				cr3,
+				stack: stack_top,
+				entry: ap_main as usize as u64,
+				cpu: cpu as u64
+			});
+		}
+		LAPIC_IDS[cpu].store(lapic_id as u32, Ordering::Relaxed);
+		AP_STARTED.store(false, Ordering::SeqCst);
+
+		unsafe {
+			apic::send_init_ipi(lapic_id);
+			wait_ticks(10);
+			for _ in 0..2 {
+				apic::send_startup_ipi(lapic_id, (AP_TRAMPOLINE_ADDR >> 12) as u8);
+				wait_ticks(1);
+				if AP_STARTED.load(Ordering::SeqCst) {
+					break;
+				}
+			}
+		}
+
+		let deadline = timer::now() + AP_START_TIMEOUT;
+		while !AP_STARTED.load(Ordering::SeqCst) && timer::now() < deadline {
+			core::hint::spin_loop();
+		}
+		if !AP_STARTED.load(Ordering::SeqCst) {
+			// it may still wake up later on these parameters, do not hand
+			// them to another cpu
+			serial_println!("[SMP] cpu with lapic id {} did not come up, not starting the rest", lapic_id);
+			break;
+		}
+
+		// the AP only takes its index once the executor may hand it work
+		ONLINE_CPUS.store(cpu + 1, Ordering::Release);
+		serial_println!("[SMP] cpu {} (lapic id {}) online", cpu, lapic_id);
+	}
+
+	serial_println!("[SMP] {} cpu(s) online", online_cpus());
+}
+
+/// Busy waits for at least `ticks` timer ticks.
+fn wait_ticks(ticks: u64) {
+	let deadline = timer::now() + ticks + 1;
+	while timer::now() < deadline {
+		interrupts::enable();
+		core::hint::spin_loop();
+	}
+}
+
+/// First Rust code of an application processor, called by the trampoline on
+/// its own stack with the kernel page table loaded.
+extern "C" fn ap_main(cpu: u64) -> ! {
+	let cpu = cpu as usize;
+	set_cpu_id(cpu);
+
+	init_efer();
+	init_simd();
+	init_write_protect();
+
+	gdt::init_cpu(cpu);
+	unsafe {
+		load_idt();
+		arch::x86_64::syscall::init_syscall();
+		apic::enable_apic(0xFF);
+	}
+
+	AP_STARTED.store(true, Ordering::SeqCst);
+	while online_cpus() <= cpu {
+		core::hint::spin_loop();
+	}
+
+	// no local timer here, time is kept by the BSP and the AP is woken by
+	// reschedule IPIs
+	interrupts::enable();
+	executor::run()
+}
@@ -7,19 +7,29 @@
 //! to me and others without resembling too much of UNIX/Linux
 //!
 
-use alloc::{string::ToString, sync::Arc};
-use core::sync::atomic::{AtomicBool, Ordering};
+pub mod ring;
+pub mod socket;
+pub mod stats;
+
+use alloc::{boxed::Box, string::{String, ToString}, sync::Arc, vec::Vec};
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
 
 use futures::task::AtomicWaker;
+use x86_64::{VirtAddr, registers::control::Cr3, structures::paging::{Page, PageTableFlags, PhysFrame}};
 
 use crate::{
-	arch::x86_64::user::{KERNEL_CR3, KERNEL_RETURN_ADDR, KERNEL_RETURN_RBP, KERNEL_RETURN_RSP, USER_EXIT_CODE}, fs::{self, resolve_path}, println, serial_println, task::{
+	arch::x86_64::{syscall::{SYSCALL_ENABLED, current_syscall_frame}, user::{MAX_STACK_ARGS, USER_EXIT_CODE, park_user_process, resume_user_process, return_to_kernel, with_kernel_page_table}}, ensure, error::NullexError, fs::{self, pages::FilePage, resolve_path}, memory::{map_frames, unmap_present, unmap_range, virt_to_phys}, serial, serial_println, smp::{MAX_CPUS, cpu_id}, task::{
+		AnonRegion,
+		FileMapping,
 		OpenFile,
+		Park,
 		Process,
 		ProcessId,
 		ProcessState,
-		executor::{self, CURRENT_PROCESS, EXECUTOR}
-	}, utils::{elf::parse_elf, oncecell::spin::OnceCell}
+		UserContext,
+		executor::{self, EXECUTOR},
+		timer
+	}, utils::{elf::load_elf, logger::{ring::read_merged, sinks::syslog::SYSLOG_RINGS}, oncecell::spin::OnceCell, process::run_user_process, trace::{self, TRACE_SYSCALL_ENTER, TRACE_SYSCALL_EXIT, TRACE_USER}}, vga_buffer
 };
 
 // syscall ids
@@ -36,6 +46,49 @@ const SYS_RUN: u32 = 8;
 const SYS_STOP: u32 = 9;
 const SYS_NAP: u32 = 10;
 const SYS_SIZEF: u32 = 11;
+const SYS_FEATS: u32 = 12;
+const SYS_EMIT: u32 = 13;
+const SYS_READFV: u32 = 14;
+const SYS_WRITEFV: u32 = 15;
+const SYS_MAPF: u32 = 16;
+const SYS_UNMAPF: u32 = 17;
+const SYS_READLOG: u32 = 18;
+const SYS_MAPM: u32 = 19;
+const SYS_UNMAPM: u32 = 20;
+const SYS_RINGSETUP: u32 = 21;
+const SYS_RINGENTER: u32 = 22;
+const SYS_SOCKOPEN: u32 = 23;
+const SYS_SOCKCONNECT: u32 = 24;
+const SYS_SOCKLISTEN: u32 = 25;
+const SYS_SOCKSEND: u32 = 26;
+const SYS_SOCKRECV: u32 = 27;
+const SYS_SOCKCLOSE: u32 = 28;
+const SYS_SOCKSTATE: u32 = 29;
+const SYS_TRACE: u32 = 30;
+
+const _: () = assert!(SYS_TRACE as usize + 1 == stats::NR_SYSCALLS);
+
+/// Most argument and environment strings `run` passes on.
+const RUN_MAX_STRINGS: usize = 256;
+/// Upper bound on the iovec count accepted by `readfv`/`writefv`.
+const IOV_MAX: usize = 1024;
+/// Largest region a single `mapm` hands out.
+const MAPM_MAX: usize = 1 << 30;
+
+/// One buffer of a vectored read or write, mirrors `struct iovec` in nullex.h.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct IoVec {
+	/// Start of the user buffer.
+	pub base: u64,
+	/// Length of the user buffer in bytes.
+	pub len: u64
+}
+
+// feature bits returned by SYS_FEATS, mirrored in nullex.h
+
+/// The kernel has programmed LSTAR and userspace may use `syscall`.
+pub const FEAT_SYSCALL: i32 = 1 << 0;
 
 /// System call handler function. Called when the `syscall` or `int 0x80` instruction
 /// is called.
@@ -58,9 +111,29 @@ pub unsafe fn syscall(
 	arg1: u64,
 	arg2: u64,
 	arg3: u64,
-	_arg4: u64,
+	arg4: u64,
 	_arg5: u64
 ) -> i32 {
+	// a polled ring is drained whenever the process enters the kernel
+	ring::poll_current();
+
+	// a user trace point is an event of its own, not a syscall in the trace
+	let traced = syscall_id != SYS_TRACE;
+	if traced {
+		trace::trace(TRACE_SYSCALL_ENTER, [syscall_id as u64, arg1]);
+	}
+	stats::enter(syscall_id);
+	let start = stats::now();
+	let ret = unsafe { dispatch(syscall_id, arg1, arg2, arg3, arg4) };
+	stats::exit(syscall_id, start, ret);
+	if traced {
+		trace::trace(TRACE_SYSCALL_EXIT, [syscall_id as u64, ret as u64]);
+	}
+	ret
+}
+
+/// Runs syscall `syscall_id`, see `syscall`.
+unsafe fn dispatch(syscall_id: u32, arg1: u64, arg2: u64, arg3: u64, arg4: u64) -> i32 {
 	match syscall_id {
 		SYS_SAY => {
 			let ptr = arg1 as *const u8;
@@ -72,24 +145,11 @@ pub unsafe fn syscall(
 		}
 		SYS_HALT => {
 			let exit_code = arg1 as i32;
-			USER_EXIT_CODE.store(exit_code, Ordering::SeqCst);
-
-			unsafe {
-				core::arch::asm!(
-					"mov cr3, {cr3}",
-					"mov rsp, [{krsp}]",
-					"mov rbp, [{krbp}]",
-					"jmp [{kret}]",
-					cr3  = in(reg) KERNEL_CR3,
-					krsp = in(reg) core::ptr::addr_of!(KERNEL_RETURN_RSP),
-					krbp = in(reg) core::ptr::addr_of!(KERNEL_RETURN_RBP),
-					kret = in(reg) core::ptr::addr_of!(KERNEL_RETURN_ADDR),
-					options(noreturn)
-				);
-			}
+			USER_EXIT_CODE[cpu_id()].store(exit_code, Ordering::SeqCst);
+			unsafe { return_to_kernel() }
 		}
 		SYS_SPLIT => sys_split(),
-		SYS_WAITON => sys_waiton(),
+		SYS_WAITON => sys_waiton(arg1),
 		SYS_OPENF => {
 			let path_ptr = arg1 as *const u8;
 			let path_len = arg2 as usize;
@@ -116,17 +176,87 @@ pub unsafe fn syscall(
 			let path_ptr = arg1 as *const u8;
 			let path_len = arg2 as usize;
 			let path = unsafe { core::str::from_raw_parts(path_ptr, path_len) };
-			sys_run(path)
+			let argv = arg3 as *const *const u8;
+			let envp = arg4 as *const *const u8;
+			unsafe { sys_run(path, argv, envp) }
 		}
 		SYS_STOP => sys_stop(arg1),
-		SYS_NAP => {
-			serial_println!("i go nap nap now. sleep is a) broken, and b) unsafe :(");
-			0
-		},
+		SYS_NAP => sys_nap(arg1),
 		SYS_SIZEF => {
 			let fd = arg1 as u32;
 			sys_sizef(fd)
 		}
+		SYS_FEATS => sys_feats(),
+		SYS_EMIT => {
+			let ptr = arg1 as *const u8;
+			let len = arg2 as usize;
+			let bytes = unsafe { core::slice::from_raw_parts(ptr, len) };
+			sys_emit(bytes)
+		}
+		SYS_READFV => {
+			let fd = arg1 as u32;
+			let iov = arg2 as *const IoVec;
+			let count = arg3 as usize;
+			unsafe { sys_readfv(fd, iov, count) }
+		}
+		SYS_WRITEFV => {
+			let fd = arg1 as u32;
+			let iov = arg2 as *const IoVec;
+			let count = arg3 as usize;
+			unsafe { sys_writefv(fd, iov, count) }
+		}
+		SYS_MAPF => {
+			let fd = arg1 as u32;
+			let out = arg2 as *mut u64;
+			unsafe { sys_mapf(fd, out) }
+		}
+		SYS_UNMAPF => sys_unmapf(arg1),
+		SYS_READLOG => {
+			let cursor = arg1 as *mut [u64; MAX_CPUS];
+			let buf_ptr = arg2 as *mut u8;
+			let len = arg3 as usize;
+			unsafe { sys_readlog(cursor, buf_ptr, len) }
+		}
+		SYS_MAPM => {
+			let len = arg1 as usize;
+			let out = arg2 as *mut u64;
+			unsafe { sys_mapm(len, out) }
+		}
+		SYS_UNMAPM => sys_unmapm(arg1),
+		SYS_RINGSETUP => {
+			let entries = arg1 as u32;
+			let flags = arg2 as u32;
+			let out = arg3 as *mut u64;
+			unsafe { ring::sys_ringsetup(entries, flags, out) }
+		}
+		SYS_RINGENTER => ring::sys_ringenter(),
+		SYS_SOCKOPEN => socket::sys_sockopen(),
+		SYS_SOCKCONNECT => {
+			let sock = arg1 as u32;
+			let ip = arg2 as u32;
+			let port = arg3 as u16;
+			socket::sys_sockconnect(sock, ip, port)
+		}
+		SYS_SOCKLISTEN => {
+			let sock = arg1 as u32;
+			let port = arg2 as u16;
+			socket::sys_socklisten(sock, port)
+		}
+		SYS_SOCKSEND => {
+			let sock = arg1 as u32;
+			let buf_ptr = arg2 as *const u8;
+			let len = arg3 as usize;
+			unsafe { socket::sys_socksend(sock, buf_ptr, len) }
+		}
+		SYS_SOCKRECV => {
+			let sock = arg1 as u32;
+			let buf_ptr = arg2 as *mut u8;
+			let len = arg3 as usize;
+			unsafe { socket::sys_sockrecv(sock, buf_ptr, len) }
+		}
+		SYS_SOCKCLOSE => socket::sys_sockclose(arg1 as u32),
+		SYS_SOCKSTATE => socket::sys_sockstate(arg1 as u32),
+		SYS_TRACE => sys_trace(arg1 as u32, arg2, arg3),
 		_ => {
 			serial_println!("Invalid syscall ID: {}", syscall_id);
 			-1 // error code for unhandled syscall
@@ -134,64 +264,186 @@ pub unsafe fn syscall(
 	}
 }
 
+/// Creates a child of the calling user process. The child gets a
+/// copy-on-write copy of the parent's address space and fd table and starts
+/// right after the `split` call with 0 in rax, the parent gets the child's pid.
+///
+/// The child is queued on the executor and runs once the parent has given up
+/// the cpu.
 fn sys_split() -> i32 {
-	serial_println!("sys_split called");
-	let current_state = {
-		let locked = CURRENT_PROCESS.lock();
-		locked
-			.as_ref()
-			.expect("No current process during sys_split")
-			.clone()
-	};
-	let future_fn_clone = current_state.future_fn.clone();
-	let mut executor = EXECUTOR.lock();
-	let child_pid = executor.create_pid();
-	let child_state = Arc::new(ProcessState {
-		id: child_pid,
-		is_child: true,
-		future_fn: future_fn_clone,
-		queued: AtomicBool::new(false),
-		scancode_queue: OnceCell::uninit(),
-		waker: AtomicWaker::new()
-	});
-	let child_process = Process::new(child_state).expect("Process created incorrectly.");
-	match executor.spawn_process(child_process) {
-		Ok(()) => child_pid.get() as i32,
-		Err(_) => -1, // Return error code on spawn failure
+	unsafe {
+		if executor::current_guard().is_null() || current_syscall_frame().is_null() {
+			serial_println!("sys_split: No current process guard");
+			return -1;
+		}
+		let parent = &mut *executor::current_guard();
+		let Some(parent_space) = parent.address_space.as_ref() else {
+			serial_println!("sys_split: Not a user process");
+			return -1;
+		};
+
+		let address_space = match with_kernel_page_table(|| parent_space.fork()) {
+			Ok(space) => space,
+			Err(e) => {
+				serial_println!("sys_split: {}", e);
+				return -1;
+			}
+		};
+
+		let mut context = UserContext::from_syscall_frame(&*current_syscall_frame());
+		context.rax = 0;
+		// the child goes on with the parent's vector registers too
+		context.fpu.save();
+
+		let mut executor = EXECUTOR.lock();
+		let child_pid = match executor.create_pid() {
+			Ok(pid) => pid,
+			Err(e) => {
+				serial_println!("sys_split: {}", e);
+				return -1;
+			}
+		};
+		let child_state = Arc::new(ProcessState {
+			id: child_pid,
+			is_child: true,
+			parent: Some(parent.state.id),
+			future_fn: Arc::new(|_| Box::pin(run_user_process())),
+			queued: AtomicBool::new(false),
+			cpu: AtomicUsize::new(0),
+			exited: AtomicBool::new(false),
+			scancode_queue: OnceCell::uninit(),
+			waker: AtomicWaker::new()
+		});
+
+		let mut child = match Process::new(child_state) {
+			Ok(child) => child,
+			Err(_) => {
+				executor.release_pid(child_pid);
+				return -1;
+			}
+		};
+		child.context = context;
+		child.address_space = Some(address_space);
+		child.open_files = parent.open_files.clone();
+		child.next_fd = parent.next_fd;
+
+		match executor.spawn_process(child) {
+			Ok(()) => child_pid.get() as i32,
+			Err(e) => {
+				serial_println!("sys_split: {}", e);
+				-1
+			}
+		}
 	}
 }
 
-fn sys_waiton() -> i32 {
+/// Waits for the child `pid` of the caller to exit and returns its exit code,
+/// -1 if `pid` is not a child of the caller (or was already collected).
+///
+/// If the child is still running the caller is parked: it leaves the cpu, and
+/// the child's exit wakes it through the `waker` in the child's state.
+fn sys_waiton(pid: u64) -> i32 {
 	unsafe {
-		if executor::CURRENT_PROCESS_GUARD.is_null() {
-			serial_println!("sys_wait: No current process guard");
+		if executor::current_guard().is_null() || current_syscall_frame().is_null() {
+			serial_println!("sys_waiton: No current process guard");
 			return -1;
 		}
-		let _process = &mut *executor::CURRENT_PROCESS_GUARD;
-		0
+		let process = &mut *executor::current_guard();
+		let me = process.state.id;
+		let child = ProcessId::new(pid);
+
+		{
+			let mut executor = EXECUTOR.lock();
+			if let Some(code) = executor.take_exit_code(child, me) {
+				return code;
+			}
+			let Some(child_state) = executor.state(child) else {
+				serial_println!("sys_waiton: No child {}", pid);
+				return -1;
+			};
+			drop(executor);
+			let Some(waker) = process.run_waker.clone() else {
+				serial_println!("sys_waiton: Caller is not run by the executor");
+				return -1;
+			};
+
+			if child_state.parent != Some(me) {
+				serial_println!("sys_waiton: {} is not a child of {}", pid, me.get());
+				return -1;
+			}
+			child_state.waker.register(&waker);
+		}
+
+		// resumes right after the syscall, `run_user_process` puts the exit
+		// code into rax once the child is gone
+		process.parked = Some(Park::Child(child));
+		park_user_process(process, UserContext::from_syscall_frame(&*current_syscall_frame()))
+	}
+}
+
+/// Sleeps the caller for at least `ns` nanoseconds, rounded up to timer
+/// ticks. The caller is parked on the executor's timer wheel meanwhile, so it
+/// takes no cpu and is not on the run queue.
+fn sys_nap(ns: u64) -> i32 {
+	if ns == 0 {
+		return 0;
+	}
+	unsafe {
+		if executor::current_guard().is_null() || current_syscall_frame().is_null() {
+			serial_println!("sys_nap: No current process guard");
+			return -1;
+		}
+		let process = &mut *executor::current_guard();
+		let deadline = timer::now() + timer::ticks_from_ns(ns);
+
+		// `run_user_process` resumes it with 0 in rax once the deadline passed
+		process.parked = Some(Park::Nap(deadline));
+		park_user_process(process, UserContext::from_syscall_frame(&*current_syscall_frame()))
 	}
 }
 
 fn sys_say(s: &str) {
-	println!("{}", s);
+	console_write(s.as_bytes());
+	console_write(b"\n");
+}
+
+/// Bulk console write for buffered userspace output. Unlike `sys_say` no
+/// newline is appended, the bytes go out exactly as the program buffered them.
+fn sys_emit(bytes: &[u8]) -> i32 {
+	console_write(bytes);
+	bytes.len() as i32
+}
+
+/// Writes userspace output to the VGA console and mirrors it to serial, taking
+/// each lock once for the whole buffer.
+fn console_write(bytes: &[u8]) {
+	vga_buffer::write_bytes(bytes);
+	serial::write_bytes(bytes);
 }
 
 fn sys_openf(path: &str) -> i32 {
 	unsafe {
-		if executor::CURRENT_PROCESS_GUARD.is_null() {
+		if executor::current_guard().is_null() {
 			serial_println!("sys_openf: No current process guard");
 			return -1;
 		}
-		let process = &mut *executor::CURRENT_PROCESS_GUARD;
+		let process = &mut *executor::current_guard();
 		let path_r = resolve_path(path);
-		let exists = fs::with_fs(|fs| fs.get_file(&path_r).is_ok());
-		if !exists {
+		// read as of the moment it is opened
+		if path_r == stats::PROC_PATH {
+			stats::publish();
+		} else if path_r == trace::PROC_PATH {
+			trace::publish();
+		}
+		// the only path walk for this fd, everything after goes by inode
+		let Ok(inode) = fs::with_fs_read(|fs| fs.lookup(&path_r)) else {
 			serial_println!("sys_openf: File not found: {}", path);
 			return -1;
-		}
+		};
 		let fd = process.next_fd;
 		process.open_files.insert(fd, OpenFile {
 			path: path.to_string(),
+			inode,
 			offset: 0
 		});
 		process.next_fd += 1;
@@ -201,11 +453,11 @@ fn sys_openf(path: &str) -> i32 {
 
 fn sys_closef(fd: u32) -> i32 {
 	unsafe {
-		if executor::CURRENT_PROCESS_GUARD.is_null() {
+		if executor::current_guard().is_null() {
 			serial_println!("sys_closef: No current process guard");
 			return -1;
 		}
-		let process = &mut *executor::CURRENT_PROCESS_GUARD;
+		let process = &mut *executor::current_guard();
 		if process.open_files.remove(&fd).is_some() {
 			0 // success
 		} else {
@@ -219,21 +471,21 @@ fn sys_closef(fd: u32) -> i32 {
 /// `buf_ptr` needs to be a valid pointer or else undefined behaviour
 unsafe fn sys_readf(fd: u32, buf_ptr: *mut u8, len: usize) -> i32 {
 	unsafe {
-		if executor::CURRENT_PROCESS_GUARD.is_null() {
+		if executor::current_guard().is_null() {
 			serial_println!("sys_readf: No current process guard");
 			return -1;
 		}
-		let process = &mut *executor::CURRENT_PROCESS_GUARD;
+		let process = &mut *executor::current_guard();
 		if let Some(open_file) = process.open_files.get_mut(&fd) {
 			let path = &open_file.path;
 			let offset = open_file.offset;
-			fs::with_fs(|fs| {
-				if let Ok(file) = fs.get_file(path.as_str()) {
+			fs::with_fs_read(|fs| {
+				if let Ok(file) = fs.inode(open_file.inode) {
 					let bytes_to_read =
 						core::cmp::min(len, file.content.len().saturating_sub(offset));
 					if bytes_to_read > 0 {
 						let buf = core::slice::from_raw_parts_mut(buf_ptr, bytes_to_read);
-						buf.copy_from_slice(&file.content[offset..offset + bytes_to_read]);
+						file.content.read_at(offset, buf);
 						open_file.offset += bytes_to_read;
 						bytes_to_read as i32
 					} else {
@@ -253,18 +505,20 @@ unsafe fn sys_readf(fd: u32, buf_ptr: *mut u8, len: usize) -> i32 {
 
 fn sys_sizef(fd: u32) -> i32 {
 	unsafe {
-		if executor::CURRENT_PROCESS_GUARD.is_null() {
+		if executor::current_guard().is_null() {
 			serial_println!("sys_writef: No current process guard");
 			return -1;
 		}
 
-		let process = &mut *executor::CURRENT_PROCESS_GUARD;
+		let process = &mut *executor::current_guard();
 		if let Some(open_file) = process.open_files.get(&fd) {
-			let path = &open_file.path;
-			fs::with_fs(|fs| {
-				if !fs.exists(path) || fs.is_dir(path) { return -1isize }
-				return fs.get_file(path).unwrap().content.len().try_into().unwrap()
-			}).try_into().unwrap()
+			fs::with_fs_read(|fs| match fs.inode(open_file.inode) {
+				Ok(file) => file.content.len() as i32,
+				Err(_) => {
+					serial_println!("sys_sizef: File no longer exists: {}", open_file.path);
+					-1
+				}
+			})
 		} else {
 			serial_println!("sys_sizef: Invalid file descriptor: {}", fd);
 			-1
@@ -276,16 +530,17 @@ fn sys_sizef(fd: u32) -> i32 {
 /// `buf_ptr` needs to be a valid pointer or else undefined behaviour
 unsafe fn sys_writef(fd: u32, buf_ptr: *const u8, len: usize) -> i32 {
 	unsafe {
-		if executor::CURRENT_PROCESS_GUARD.is_null() {
+		if executor::current_guard().is_null() {
 			serial_println!("sys_writef: No current process guard");
 			return -1;
 		}
-		let process = &mut *executor::CURRENT_PROCESS_GUARD;
+		let process = &mut *executor::current_guard();
 		if let Some(open_file) = process.open_files.get(&fd) {
 			let path = &open_file.path;
-			let buf = core::slice::from_raw_parts(buf_ptr, len);
-			fs::with_fs(|fs| {
-				if fs.write_file(path.as_str(), buf, false).is_ok() {
+			// the user buffer is copied straight into the file, no staging copy
+			let buf: &[u8] = if len == 0 { &[] } else { core::slice::from_raw_parts(buf_ptr, len) };
+			fs::with_fs_read(|fs| {
+				if fs.write_inode(open_file.inode, &[buf], false).is_ok() {
 					len as i32 // number of bytes written
 				} else {
 					serial_println!("sys_writef: Write failed: {}", path);
@@ -299,19 +554,413 @@ unsafe fn sys_writef(fd: u32, buf_ptr: *const u8, len: usize) -> i32 {
 	}
 }
 
-fn sys_run(path: &str) -> i32 {
-	let maybe_bytes = fs::with_fs(|fs| fs.get_file(path).ok().map(|f| f.content.clone()));
-	let elf_bytes = match maybe_bytes {
-		Some(b) => b,
-		None => {
+/// Turns a user iovec array into a slice, rejecting oversized counts.
+unsafe fn iovecs<'a>(iov: *const IoVec, count: usize) -> Option<&'a [IoVec]> {
+	if count > IOV_MAX || (count > 0 && iov.is_null()) {
+		return None;
+	}
+	if count == 0 {
+		return Some(&[]);
+	}
+	Some(unsafe { core::slice::from_raw_parts(iov, count) })
+}
+
+/// Scatter read: fills each iovec in turn from the current offset, walking the
+/// filesystem once for the whole call.
+unsafe fn sys_readfv(fd: u32, iov: *const IoVec, count: usize) -> i32 {
+	unsafe {
+		if executor::current_guard().is_null() {
+			serial_println!("sys_readfv: No current process guard");
+			return -1;
+		}
+		let Some(iov) = iovecs(iov, count) else {
+			serial_println!("sys_readfv: Invalid iovec array ({} entries)", count);
+			return -1;
+		};
+		let process = &mut *executor::current_guard();
+		if let Some(open_file) = process.open_files.get_mut(&fd) {
+			let path = &open_file.path;
+			let mut offset = open_file.offset;
+			let read = fs::with_fs_read(|fs| {
+				let Ok(file) = fs.inode(open_file.inode) else {
+					serial_println!("sys_readfv: File not found: {}", path);
+					return -1;
+				};
+				let start = offset;
+				for v in iov {
+					let n = core::cmp::min(v.len as usize, file.content.len().saturating_sub(offset));
+					if n == 0 {
+						break; // eof
+					}
+					let buf = core::slice::from_raw_parts_mut(v.base as *mut u8, n);
+					file.content.read_at(offset, buf);
+					offset += n;
+				}
+				(offset - start) as i32
+			});
+			if read > 0 {
+				open_file.offset = offset;
+			}
+			read
+		} else {
+			serial_println!("sys_readfv: Invalid file descriptor: {}", fd);
+			-1 // invalid fd
+		}
+	}
+}
+
+/// Gather write: appends every iovec to the file in order with one filesystem
+/// walk, the same as that many `writef` calls.
+unsafe fn sys_writefv(fd: u32, iov: *const IoVec, count: usize) -> i32 {
+	unsafe {
+		if executor::current_guard().is_null() {
+			serial_println!("sys_writefv: No current process guard");
+			return -1;
+		}
+		let Some(iov) = iovecs(iov, count) else {
+			serial_println!("sys_writefv: Invalid iovec array ({} entries)", count);
+			return -1;
+		};
+		let process = &mut *executor::current_guard();
+		if let Some(open_file) = process.open_files.get(&fd) {
+			let path = &open_file.path;
+			let parts: Vec<&[u8]> = iov
+				.iter()
+				.filter(|v| v.len > 0)
+				.map(|v| core::slice::from_raw_parts(v.base as *const u8, v.len as usize))
+				.collect();
+			fs::with_fs_read(|fs| match fs.write_inode(open_file.inode, &parts, false) {
+				Ok(written) => written as i32,
+				Err(_) => {
+					serial_println!("sys_writefv: Write failed: {}", path);
+					-1
+				}
+			})
+		} else {
+			serial_println!("sys_writefv: Invalid file descriptor: {}", fd);
+			-1 // invalid fd
+		}
+	}
+}
+
+/// Maps the whole file behind `fd` read-only into the caller, writing the user
+/// address to `out`. Returns the file length, 0 for an empty file (nothing is
+/// mapped then).
+///
+/// The file's own pages are mapped, nothing is copied. The mapping keeps them
+/// alive and writes to the file copy any shared page first, so the mapping is
+/// a snapshot of the file at `mapf` time.
+unsafe fn sys_mapf(fd: u32, out: *mut u64) -> i32 {
+	unsafe {
+		if executor::current_guard().is_null() {
+			serial_println!("sys_mapf: No current process guard");
+			return -1;
+		}
+		if out.is_null() {
+			serial_println!("sys_mapf: Null address pointer");
+			return -1;
+		}
+		let process = &mut *executor::current_guard();
+		let Some(open_file) = process.open_files.get(&fd) else {
+			serial_println!("sys_mapf: Invalid file descriptor: {}", fd);
+			return -1;
+		};
+		let inode = open_file.inode;
+		let Some(address_space) = process.address_space.as_mut() else {
+			serial_println!("sys_mapf: Not a user process");
+			return -1;
+		};
+
+		let mapped = with_kernel_page_table(|| {
+			fs::with_fs_read(|fs| -> Result<(u64, usize), NullexError> {
+				let file = fs.inode(inode).map_err(|_| NullexError::FileNotFound)?;
+				let len = file.content.len();
+				if len == 0 {
+					return Ok((0, 0));
+				}
+				ensure!(len <= i32::MAX as usize, NullexError::InvalidArgument);
+
+				let pages: Vec<Arc<FilePage>> = file.content.pages().to_vec();
+				let frames = pages
+					.iter()
+					.map(|p| {
+						virt_to_phys(VirtAddr::new(p.addr()))
+							.map(PhysFrame::containing_address)
+							.ok_or(NullexError::PageNotMapped)
+					})
+					.collect::<Result<Vec<PhysFrame>, NullexError>>()?;
+
+				let start = address_space.next_map;
+				let flags = PageTableFlags::PRESENT
+					| PageTableFlags::USER_ACCESSIBLE
+					| PageTableFlags::NO_EXECUTE;
+				let page = Page::containing_address(VirtAddr::new(start));
+				map_frames(address_space, page, &frames, flags)?;
+
+				// leave an unmapped guard page between mappings
+				address_space.next_map += (frames.len() as u64 + 1) * 4096;
+				address_space.mappings.push(FileMapping { start, pages });
+				Ok((start, len))
+			})
+		});
+
+		match mapped {
+			Ok((addr, len)) => {
+				*out = addr;
+				len as i32
+			}
+			Err(e) => {
+				serial_println!("sys_mapf: {}", e);
+				-1
+			}
+		}
+	}
+}
+
+/// Removes a mapping made by `mapf`, `addr` must be the address it returned.
+fn sys_unmapf(addr: u64) -> i32 {
+	unsafe {
+		if executor::current_guard().is_null() {
+			serial_println!("sys_unmapf: No current process guard");
+			return -1;
+		}
+		let process = &mut *executor::current_guard();
+		let Some(address_space) = process.address_space.as_mut() else {
+			serial_println!("sys_unmapf: Not a user process");
+			return -1;
+		};
+		let Some(idx) = address_space.mappings.iter().position(|m| m.start == addr) else {
+			serial_println!("sys_unmapf: No mapping at {:#x}", addr);
+			return -1;
+		};
+
+		let mapping = address_space.mappings.swap_remove(idx);
+		let first = Page::containing_address(VirtAddr::new(mapping.start));
+		let pages = Page::range(first, first + mapping.pages.len() as u64);
+		// the file pages are released when `mapping` drops, after the unmap
+		match with_kernel_page_table(|| unmap_range(address_space, pages)) {
+			Ok(()) => 0,
+			Err(e) => {
+				serial_println!("sys_unmapf: {}", e);
+				-1
+			}
+		}
+	}
+}
+
+/// Reserves `len` bytes (rounded up to whole pages) of zeroed, writable
+/// memory and writes its address to `*out`. Returns 0 or -1.
+///
+/// Only the region is recorded here, each page gets a frame when it is
+/// first touched, so reserving more than will be used is cheap.
+unsafe fn sys_mapm(len: usize, out: *mut u64) -> i32 {
+	unsafe {
+		if executor::current_guard().is_null() {
+			serial_println!("sys_mapm: No current process guard");
+			return -1;
+		}
+		if out.is_null() {
+			serial_println!("sys_mapm: Null address pointer");
+			return -1;
+		}
+		if len == 0 || len > MAPM_MAX {
+			serial_println!("sys_mapm: Invalid length: {}", len);
+			return -1;
+		}
+		let process = &mut *executor::current_guard();
+		let Some(address_space) = process.address_space.as_mut() else {
+			serial_println!("sys_mapm: Not a user process");
+			return -1;
+		};
+
+		let start = address_space.next_map;
+		let pages = len.div_ceil(4096) as u64;
+		// leave an unmapped guard page between mappings
+		address_space.next_map += (pages + 1) * 4096;
+		address_space.anon.push(AnonRegion { start, pages });
+
+		*out = start;
+		0
+	}
+}
+
+/// Releases a `mapm` region, `addr` must be the address it returned.
+fn sys_unmapm(addr: u64) -> i32 {
+	unsafe {
+		if executor::current_guard().is_null() {
+			serial_println!("sys_unmapm: No current process guard");
+			return -1;
+		}
+		let process = &mut *executor::current_guard();
+		let Some(address_space) = process.address_space.as_mut() else {
+			serial_println!("sys_unmapm: Not a user process");
+			return -1;
+		};
+		let Some(idx) = address_space.anon.iter().position(|r| r.start == addr) else {
+			serial_println!("sys_unmapm: No region at {:#x}", addr);
+			return -1;
+		};
+
+		let region = address_space.anon.swap_remove(idx);
+		let first = Page::containing_address(VirtAddr::new(region.start));
+		let pages = Page::range(first, first + region.pages);
+		match with_kernel_page_table(|| unmap_present(address_space, pages)) {
+			Ok(()) => 0,
+			Err(e) => {
+				serial_println!("sys_unmapm: {}", e);
+				-1
+			}
+		}
+	}
+}
+
+/// Streams the kernel log rings, merged in time order. `cursor` holds one
+/// position per ring (`MAX_CPUS` of them), whole records after them are copied
+/// into the buffer and the positions advanced. Returns the bytes copied (0
+/// once the caller has caught up). A position its ring has overrun skips
+/// forward to the oldest record still there.
+///
+/// # Safety
+/// `cursor` and `buf_ptr` need to be valid pointers or else undefined behaviour
+unsafe fn sys_readlog(cursor: *mut [u64; MAX_CPUS], buf_ptr: *mut u8, len: usize) -> i32 {
+	if cursor.is_null() || buf_ptr.is_null() {
+		serial_println!("sys_readlog: Null pointer");
+		return -1;
+	}
+	let len = core::cmp::min(len, i32::MAX as usize);
+	unsafe {
+		let buf = core::slice::from_raw_parts_mut(buf_ptr, len);
+		let mut pos = *cursor;
+		let read = read_merged(&SYSLOG_RINGS, &mut pos, buf);
+		*cursor = pos;
+		read.copied as i32
+	}
+}
+
+/// Copies the strings of the null ended user array `list` into `out`. A null
+/// `list` is an empty one.
+///
+/// # Safety
+/// `list` needs to be a valid pointer or else undefined behaviour
+unsafe fn copy_user_strings(list: *const *const u8, out: &mut Vec<String>) -> Result<(), NullexError> {
+	if list.is_null() {
+		return Ok(());
+	}
+	for i in 0.. {
+		let ptr = unsafe { *list.add(i) };
+		if ptr.is_null() {
+			break;
+		}
+		ensure!(out.len() < RUN_MAX_STRINGS, NullexError::ArgumentsTooLong);
+		// a string longer than the stack room could never be passed anyway
+		let len = (0..MAX_STACK_ARGS)
+			.position(|n| unsafe { *ptr.add(n) } == 0)
+			.ok_or(NullexError::ArgumentsTooLong)?;
+		let bytes = unsafe { core::slice::from_raw_parts(ptr, len) };
+		out.push(String::from_utf8_lossy(bytes).into_owned());
+	}
+	Ok(())
+}
+
+/// Replaces the caller's image with the ELF at `path`, keeping its open files.
+/// Only returns (with -1) if the new image could not be set up. The new
+/// program is started with the null ended `argv` and `envp`, without any
+/// `argv` the path is its `argv[0]`.
+///
+/// Nothing of the file is copied here, the new address space pages the
+/// segments in from the file on first touch. Running an unchanged file again
+/// does not even parse it, see `elf::load_elf`.
+///
+/// # Safety
+/// `argv` and `envp` need to be valid pointers or else undefined behaviour
+unsafe fn sys_run(path: &str, argv: *const *const u8, envp: *const *const u8) -> i32 {
+	let path_r = resolve_path(path);
+	let image = match load_elf(&path_r) {
+		Ok(image) => image,
+		Err(NullexError::FileNotFound) => {
 			serial_println!("sys_run: file not found: {}", path);
 			return -1;
 		}
+		Err(e) => {
+			serial_println!("sys_run: {}", e);
+			return -1;
+		}
 	};
-	let _e = parse_elf(&elf_bytes);
-	0
+
+	// copied out while the caller's pages are still mapped, the new image is
+	// built on the kernel page table
+	let (mut arg_strings, mut env_strings) = (Vec::new(), Vec::new());
+	let copied = unsafe {
+		copy_user_strings(argv, &mut arg_strings).and_then(|_| copy_user_strings(envp, &mut env_strings))
+	};
+	if let Err(e) = copied {
+		serial_println!("sys_run: {}", e);
+		return -1;
+	}
+	if arg_strings.is_empty() {
+		arg_strings.push(path.to_string());
+	}
+	let args: Vec<&str> = arg_strings.iter().map(String::as_str).collect();
+	let envs: Vec<&str> = env_strings.iter().map(String::as_str).collect();
+
+	unsafe {
+		if executor::current_guard().is_null() {
+			serial_println!("sys_run: No current process guard");
+			return -1;
+		}
+		let process = &mut *executor::current_guard();
+		if process.address_space.is_none() {
+			serial_println!("sys_run: Not a user process");
+			return -1;
+		}
+
+		let (address_space, context) = match with_kernel_page_table(|| Process::load_image(&image, &args, &envs)) {
+			Ok(built) => built,
+			Err(e) => {
+				serial_println!("sys_run: {}", e);
+				return -1;
+			}
+		};
+
+		// `resume_user_process` does not return, whatever is still alive on
+		// this stack then is never dropped. The image stays cached and the
+		// segments hold on to the file
+		drop(image);
+		drop(args);
+		drop(envs);
+		drop(arg_strings);
+		drop(env_strings);
+		drop(path_r);
+
+		// the old image goes away with the address space it lived in, which
+		// can only be freed once CR3 points somewhere else
+		let (_, flags) = Cr3::read();
+		Cr3::write(address_space.page_table, flags);
+		let old = process.address_space.replace(address_space);
+		process.context = context;
+		drop(old);
+
+		resume_user_process(process)
+	}
 }
 
+fn sys_feats() -> i32 {
+	let mut feats = 0;
+	if SYSCALL_ENABLED.load(Ordering::Relaxed) {
+		feats |= FEAT_SYSCALL;
+	}
+	feats
+}
+
+/// Records user event `id` with `a0` and `a1` in the trace, if tracing is on.
+fn sys_trace(id: u32, a0: u64, a1: u64) -> i32 {
+	if id >= TRACE_USER as u32 {
+		serial_println!("sys_trace: Invalid event id: {}", id);
+		return -1;
+	}
+	trace::trace(TRACE_USER | id as u16, [a0, a1]);
+	0
+}
 
 fn sys_stop(pid: u64) -> i32 {
 	EXECUTOR.lock().end_process(ProcessId::new(pid), -2);
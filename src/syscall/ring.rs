@@ -0,0 +1,270 @@
+//!
+//! syscall/ring.rs
+//!
+//! Submission and completion ring shared with a user process.
+//!
+
+use core::sync::atomic::{AtomicU32, Ordering};
+
+use x86_64::{VirtAddr, structures::paging::Page};
+
+use crate::{
+	arch::x86_64::user::with_kernel_page_table,
+	error::NullexError,
+	memory::map_zeroed_page,
+	serial_println,
+	task::executor
+};
+
+/// Most entries a ring can have, mirrored as `NX_RING_MAX` in nullex.h.
+pub const RING_MAX_ENTRIES: u32 = 4096;
+
+/// Setup flag: drain the ring on every syscall the process makes, not only
+/// on `ringenter`.
+pub const RING_POLL: u32 = 1 << 0;
+
+// operations of a submission entry, mirrored as NX_OP_* in nullex.h
+
+const OP_NOP: u8 = 0;
+const OP_OPENF: u8 = 1;
+const OP_CLOSEF: u8 = 2;
+const OP_READF: u8 = 3;
+const OP_WRITEF: u8 = 4;
+
+/// Start of the ring region, both rings' indices. Mirrors
+/// `struct nx_ring_header`; the entries follow at `SQES_OFFSET`.
+#[repr(C)]
+struct RingHeader {
+	/// Next submission the kernel takes, written by the kernel.
+	sq_head: AtomicU32,
+	/// One past the last submission queued, written by the process.
+	sq_tail: AtomicU32,
+	/// Next completion the process reads, written by the process.
+	cq_head: AtomicU32,
+	/// One past the last completion posted, written by the kernel.
+	cq_tail: AtomicU32,
+	entries: u32,
+	flags: u32,
+	reserved: [u32; 10]
+}
+
+/// Offset of the submission entries in the ring region.
+const SQES_OFFSET: u64 = size_of::<RingHeader>() as u64;
+
+/// One queued operation, mirrors `struct nx_sqe`.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct Sqe {
+	op: u8,
+	reserved: [u8; 3],
+	fd: u32,
+	/// Path for `OP_OPENF`, the buffer for reads and writes.
+	addr: u64,
+	len: u64,
+	/// Handed back untouched in the completion.
+	user_data: u64
+}
+
+/// Result of one operation, mirrors `struct nx_cqe`.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct Cqe {
+	user_data: u64,
+	/// What the matching blocking syscall would have returned.
+	res: i32,
+	flags: u32
+}
+
+/// The ring of an address space. Only what the kernel decided at setup is
+/// kept here, everything in the shared pages is the process's to scribble
+/// over and is checked on every use.
+#[derive(Debug, Clone, Copy)]
+pub struct IoRing {
+	/// User address of the `RingHeader`.
+	pub addr: u64,
+	/// Entries of each ring, a power of two.
+	pub entries: u32,
+	/// `RING_*` setup flags.
+	pub flags: u32
+}
+
+impl IoRing {
+	fn region_len(entries: u32) -> u64 {
+		SQES_OFFSET + entries as u64 * (size_of::<Sqe>() + size_of::<Cqe>()) as u64
+	}
+
+	/// Takes every queued submission the completion ring has room for, runs
+	/// it and posts its completion. Returns the submissions taken.
+	///
+	/// # Safety
+	/// Must run in a syscall of the process owning the ring, its pages are
+	/// reached through the user page table.
+	unsafe fn drain(&self) -> Result<u32, NullexError> {
+		let header = unsafe { &*(self.addr as *const RingHeader) };
+		let sqes = (self.addr + SQES_OFFSET) as *const Sqe;
+		let cqes = unsafe { sqes.add(self.entries as usize) } as *mut Cqe;
+		let mask = self.entries - 1;
+
+		let mut sq_head = header.sq_head.load(Ordering::Relaxed);
+		let sq_tail = header.sq_tail.load(Ordering::Acquire);
+		let cq_head = header.cq_head.load(Ordering::Acquire);
+		let mut cq_tail = header.cq_tail.load(Ordering::Relaxed);
+		if sq_tail.wrapping_sub(sq_head) > self.entries || cq_tail.wrapping_sub(cq_head) > self.entries {
+			return Err(NullexError::InvalidArgument);
+		}
+
+		let mut taken = 0;
+		while sq_head != sq_tail && cq_tail.wrapping_sub(cq_head) < self.entries {
+			// copied out first, the process may change the slot meanwhile
+			let sqe = unsafe { sqes.add((sq_head & mask) as usize).read_volatile() };
+			let res = unsafe { run_sqe(&sqe) };
+			unsafe {
+				cqes.add((cq_tail & mask) as usize).write_volatile(Cqe {
+					user_data: sqe.user_data,
+					res,
+					flags: 0
+				});
+			}
+
+			sq_head = sq_head.wrapping_add(1);
+			cq_tail = cq_tail.wrapping_add(1);
+			taken += 1;
+			// publish each completion as it is done, a later operation may be
+			// the one that faults
+			header.cq_tail.store(cq_tail, Ordering::Release);
+			header.sq_head.store(sq_head, Ordering::Release);
+		}
+
+		Ok(taken)
+	}
+}
+
+/// Runs one submission through the same code as its blocking syscall.
+unsafe fn run_sqe(sqe: &Sqe) -> i32 {
+	let len = sqe.len as usize;
+	unsafe {
+		match sqe.op {
+			OP_NOP => 0,
+			OP_OPENF => {
+				let path = core::str::from_raw_parts(sqe.addr as *const u8, len);
+				super::sys_openf(path)
+			}
+			OP_CLOSEF => super::sys_closef(sqe.fd),
+			OP_READF => super::sys_readf(sqe.fd, sqe.addr as *mut u8, len),
+			OP_WRITEF => super::sys_writef(sqe.fd, sqe.addr as *const u8, len),
+			op => {
+				serial_println!("ring: Invalid operation: {}", op);
+				-1
+			}
+		}
+	}
+}
+
+/// The ring of the calling process, if it has one.
+fn current_ring() -> Option<IoRing> {
+	let process = executor::current_guard();
+	if process.is_null() {
+		return None;
+	}
+	unsafe { (*process).address_space.as_ref()?.ring }
+}
+
+/// Gives the calling process a ring of `entries` submission and completion
+/// entries and writes the address of its header to `*out`. A process has at
+/// most one ring, a `split` child gets its own copy of it.
+///
+/// # Safety
+/// `out` needs to be a valid pointer or else undefined behaviour
+pub(super) unsafe fn sys_ringsetup(entries: u32, flags: u32, out: *mut u64) -> i32 {
+	unsafe {
+		if executor::current_guard().is_null() {
+			serial_println!("sys_ringsetup: No current process guard");
+			return -1;
+		}
+		if out.is_null() {
+			serial_println!("sys_ringsetup: Null address pointer");
+			return -1;
+		}
+		if !entries.is_power_of_two() || entries > RING_MAX_ENTRIES || flags & !RING_POLL != 0 {
+			serial_println!("sys_ringsetup: Invalid entries {} or flags {:#x}", entries, flags);
+			return -1;
+		}
+		let process = &mut *executor::current_guard();
+		let Some(address_space) = process.address_space.as_mut() else {
+			serial_println!("sys_ringsetup: Not a user process");
+			return -1;
+		};
+		if address_space.ring.is_some() {
+			serial_println!("sys_ringsetup: Process already has a ring");
+			return -1;
+		}
+
+		let start = address_space.next_map;
+		let pages = IoRing::region_len(entries).div_ceil(4096);
+		let first = Page::containing_address(VirtAddr::new(start));
+		let mapped = with_kernel_page_table(|| {
+			Page::range(first, first + pages).try_for_each(|page| map_zeroed_page(address_space, page))
+		});
+		if let Err(e) = mapped {
+			serial_println!("sys_ringsetup: {}", e);
+			return -1;
+		}
+		// leave an unmapped guard page between mappings
+		address_space.next_map += (pages + 1) * 4096;
+
+		let header = &mut *(start as *mut RingHeader);
+		header.entries = entries;
+		header.flags = flags;
+		address_space.ring = Some(IoRing { addr: start, entries, flags });
+
+		*out = start;
+		0
+	}
+}
+
+/// Runs the queued submissions of the caller's ring and returns how many
+/// were taken. Every operation completes before this returns, the file
+/// system never makes one wait.
+pub(super) fn sys_ringenter() -> i32 {
+	let Some(ring) = current_ring() else {
+		serial_println!("sys_ringenter: No ring set up");
+		return -1;
+	};
+	match unsafe { ring.drain() } {
+		Ok(taken) => taken as i32,
+		Err(e) => {
+			serial_println!("sys_ringenter: {}", e);
+			-1
+		}
+	}
+}
+
+/// Drains the caller's ring if it was set up with `RING_POLL`, called on
+/// every syscall entry.
+pub(super) fn poll_current() {
+	if let Some(ring) = current_ring()
+		&& ring.flags & RING_POLL != 0
+		&& let Err(e) = unsafe { ring.drain() }
+	{
+		serial_println!("ring: {}", e);
+	}
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use crate::{
+		syscall::ring::{Cqe, IoRing, RingHeader, SQES_OFFSET, Sqe},
+		utils::ktest::TestError
+	};
+
+	pub fn test_ring_layout_matches_header() -> Result<(), TestError> {
+		// nullex.h places the entries right after a 64 byte header
+		assert_eq!(SQES_OFFSET, 64);
+		assert_eq!(size_of::<RingHeader>(), 64);
+		assert_eq!(size_of::<Sqe>(), 32);
+		assert_eq!(size_of::<Cqe>(), 16);
+		assert_eq!(IoRing::region_len(4096).div_ceil(4096), 49);
+		Ok(())
+	}
+	crate::create_test!(test_ring_layout_matches_header);
+}
@@ -0,0 +1,127 @@
+//!
+//! syscall/socket.rs
+//!
+//! TCP socket syscalls on the shared network stack.
+//!
+//! Every call is non-blocking: it polls the interface, does what can be done
+//! right now and returns. A program waits for a connection (or for data) by
+//! asking again, `sockstate` tells it where a socket is at.
+//!
+
+use smoltcp::socket::tcp::State;
+
+use crate::{
+	error::NullexError,
+	net::socket::{NetStack, user_state, with_stack},
+	serial_println,
+	task::{ProcessId, executor}
+};
+
+/// Pid of the calling process.
+fn current_pid() -> Option<ProcessId> {
+	let process = executor::current_guard();
+	if process.is_null() {
+		return None;
+	}
+	Some(unsafe { (*process).state.id })
+}
+
+/// Runs `f` on the stack for the calling process, logging a failure as
+/// `name` and turning it into -1.
+fn socket_call(name: &str, f: impl FnOnce(&mut NetStack, ProcessId) -> Result<i32, NullexError>) -> i32 {
+	let Some(pid) = current_pid() else {
+		serial_println!("{}: No current process guard", name);
+		return -1;
+	};
+	match with_stack(|stack| f(stack, pid)) {
+		Ok(ret) => ret,
+		Err(e) => {
+			serial_println!("{}: {}", name, e);
+			-1
+		}
+	}
+}
+
+/// Opens a TCP socket and returns its id.
+pub(super) fn sys_sockopen() -> i32 {
+	socket_call("sys_sockopen", |stack, pid| stack.open(pid).map(|sock| sock as i32))
+}
+
+/// Starts connecting `sock` to `ip` (most significant byte first) on `port`.
+/// Returns once the SYN is queued, the socket is `SOCK_ESTABLISHED` when the
+/// peer answered.
+pub(super) fn sys_sockconnect(sock: u32, ip: u32, port: u16) -> i32 {
+	socket_call("sys_sockconnect", |stack, pid| {
+		stack.connect(pid, sock, ip.to_be_bytes(), port).map(|_| 0)
+	})
+}
+
+/// Makes `sock` wait for one connection on `port`. The socket itself becomes
+/// that connection, a server opens the next socket to keep accepting.
+pub(super) fn sys_socklisten(sock: u32, port: u16) -> i32 {
+	socket_call("sys_socklisten", |stack, pid| {
+		stack
+			.socket(pid, sock)?
+			.listen(port)
+			.map(|_| 0)
+			.map_err(|_| NullexError::InvalidArgument)
+	})
+}
+
+/// Queues up to `len` bytes from `buf` and returns how many were taken, 0
+/// while the connection is coming up or the send buffer is full.
+///
+/// # Safety
+/// `buf` needs to be a valid pointer or else undefined behaviour
+pub(super) unsafe fn sys_socksend(sock: u32, buf: *const u8, len: usize) -> i32 {
+	let len = len.min(i32::MAX as usize);
+	socket_call("sys_socksend", |stack, pid| {
+		let socket = stack.socket(pid, sock)?;
+		if matches!(socket.state(), State::Listen | State::SynSent | State::SynReceived) {
+			return Ok(0);
+		}
+		// copied from the caller straight into the socket's send buffer
+		let data = unsafe { core::slice::from_raw_parts(buf, len) };
+		socket
+			.send_slice(data)
+			.map(|n| n as i32)
+			.map_err(|_| NullexError::TcpFailedToSend)
+	})
+}
+
+/// Copies up to `len` received bytes into `buf` and returns how many, 0 when
+/// nothing has arrived yet and -1 once the peer closed and everything it sent
+/// was read.
+///
+/// # Safety
+/// `buf` needs to be a valid pointer or else undefined behaviour
+pub(super) unsafe fn sys_sockrecv(sock: u32, buf: *mut u8, len: usize) -> i32 {
+	let len = len.min(i32::MAX as usize);
+	socket_call("sys_sockrecv", |stack, pid| {
+		let socket = stack.socket(pid, sock)?;
+		if socket.can_recv() {
+			// copied from the socket's receive buffer straight to the caller
+			let out = unsafe { core::slice::from_raw_parts_mut(buf, len) };
+			return socket
+				.recv_slice(out)
+				.map(|n| n as i32)
+				.map_err(|_| NullexError::TcpFailedToReceive);
+		}
+		if socket.may_recv() || matches!(socket.state(), State::Listen | State::SynSent | State::SynReceived) {
+			Ok(0)
+		} else {
+			// end of stream, not worth a log line
+			Ok(-1)
+		}
+	})
+}
+
+/// Closes `sock`. What was queued is still sent, the id is free right away.
+pub(super) fn sys_sockclose(sock: u32) -> i32 {
+	socket_call("sys_sockclose", |stack, pid| stack.close(pid, sock).map(|_| 0))
+}
+
+/// The state of `sock`, one of the `SOCK_*` values.
+pub(super) fn sys_sockstate(sock: u32) -> i32 {
+	socket_call("sys_sockstate", |stack, pid| Ok(user_state(stack.socket(pid, sock)?)))
+}
@@ -0,0 +1,202 @@
+//!
+//! syscall/stats.rs
+//!
+//! Per-syscall call counts, error counts and cycle histograms.
+//!
+//! Every cpu counts into its own cache lines and only ever while in a
+//! syscall, with interrupts masked, so an update is a plain load and store.
+//! The cpus are summed up when the numbers are read.
+//!
+
+use alloc::string::String;
+use core::{
+	fmt::Write,
+	sync::atomic::{AtomicU64, Ordering}
+};
+
+use crate::{
+	fs,
+	smp::{MAX_CPUS, cpu_id}
+};
+
+/// File the report is published to, refreshed whenever it is opened.
+pub const PROC_PATH: &str = "/proc/syscalls";
+
+/// Syscall names by id, as in syscalls.list.
+const SYSCALL_NAMES: [&str; 31] = [
+	"say",
+	"halt",
+	"split",
+	"waiton",
+	"openf",
+	"closef",
+	"readf",
+	"writef",
+	"run",
+	"stop",
+	"nap",
+	"sizef",
+	"feats",
+	"emit",
+	"readfv",
+	"writefv",
+	"mapf",
+	"unmapf",
+	"readlog",
+	"mapm",
+	"unmapm",
+	"ringsetup",
+	"ringenter",
+	"sockopen",
+	"sockconnect",
+	"socklisten",
+	"socksend",
+	"sockrecv",
+	"sockclose",
+	"sockstate",
+	"trace"
+];
+
+pub(super) const NR_SYSCALLS: usize = SYSCALL_NAMES.len();
+/// Bucket `i` counts calls of `2^i` to `2^(i+1) - 1` cycles, the last one
+/// everything longer.
+const BUCKETS: usize = 32;
+
+/// Counters of one syscall on one cpu.
+struct SyscallStats {
+	calls: AtomicU64,
+	errors: AtomicU64,
+	cycles: AtomicU64,
+	histogram: [AtomicU64; BUCKETS]
+}
+
+impl SyscallStats {
+	const fn new() -> Self {
+		Self {
+			calls: AtomicU64::new(0),
+			errors: AtomicU64::new(0),
+			cycles: AtomicU64::new(0),
+			histogram: [const { AtomicU64::new(0) }; BUCKETS]
+		}
+	}
+}
+
+#[repr(align(64))]
+struct CpuStats([SyscallStats; NR_SYSCALLS]);
+
+static STATS: [CpuStats; MAX_CPUS] =
+	[const { CpuStats([const { SyscallStats::new() }; NR_SYSCALLS]) }; MAX_CPUS];
+
+/// Adds `n` to a counter only the calling cpu writes.
+fn bump(counter: &AtomicU64, n: u64) {
+	counter.store(counter.load(Ordering::Relaxed).wrapping_add(n), Ordering::Relaxed);
+}
+
+fn bucket(cycles: u64) -> usize {
+	(cycles.max(1).ilog2() as usize).min(BUCKETS - 1)
+}
+
+/// Cycle counter that `exit` measures from.
+#[inline(always)]
+pub(super) fn now() -> u64 {
+	unsafe { core::arch::x86_64::_rdtsc() }
+}
+
+/// Counts a call of `id`. Calls that never return to the caller, like
+/// `halt`, `run` or a parked `waiton`, are only counted here.
+pub(super) fn enter(id: u32) {
+	if let Some(stats) = STATS[cpu_id()].0.get(id as usize) {
+		bump(&stats.calls, 1);
+	}
+}
+
+/// Records the time and result of a call of `id` that started at `start`.
+pub(super) fn exit(id: u32, start: u64, ret: i32) {
+	let Some(stats) = STATS[cpu_id()].0.get(id as usize) else {
+		return;
+	};
+	let cycles = now().wrapping_sub(start);
+	bump(&stats.cycles, cycles);
+	bump(&stats.histogram[bucket(cycles)], 1);
+	if ret < 0 {
+		bump(&stats.errors, 1);
+	}
+}
+
+/// Counters of `id` summed over all cpus: calls, errors, cycles, histogram.
+fn totals(id: usize) -> (u64, u64, u64, [u64; BUCKETS]) {
+	let mut histogram = [0; BUCKETS];
+	let (mut calls, mut errors, mut cycles) = (0, 0, 0);
+	for cpu in &STATS {
+		let stats = &cpu.0[id];
+		calls += stats.calls.load(Ordering::Relaxed);
+		errors += stats.errors.load(Ordering::Relaxed);
+		cycles += stats.cycles.load(Ordering::Relaxed);
+		for (total, count) in histogram.iter_mut().zip(&stats.histogram) {
+			*total += count.load(Ordering::Relaxed);
+		}
+	}
+	(calls, errors, cycles, histogram)
+}
+
+/// The counters of every syscall that was called, one line each followed
+/// by its histogram as `2^bucket:count` pairs.
+pub fn report() -> String {
+	let mut out = String::new();
+	let _ = writeln!(out, "syscall calls errors mean_cycles");
+	for (id, name) in SYSCALL_NAMES.iter().enumerate() {
+		let (calls, errors, cycles, histogram) = totals(id);
+		if calls == 0 {
+			continue;
+		}
+		let timed: u64 = histogram.iter().sum();
+		let mean = if timed == 0 { 0 } else { cycles / timed };
+		let _ = writeln!(out, "{} {} {} {}", name, calls, errors, mean);
+
+		let _ = write!(out, " ");
+		for (bucket, count) in histogram.iter().enumerate().filter(|(_, count)| **count != 0) {
+			let _ = write!(out, " 2^{}:{}", bucket, count);
+		}
+		let _ = writeln!(out);
+	}
+	out
+}
+
+/// Writes the current report to `PROC_PATH`.
+pub fn publish() {
+	let report = report();
+	let _ = fs::with_fs_read(|fs| fs.write_file(PROC_PATH, report.as_bytes(), true));
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use crate::{
+		syscall::stats::{BUCKETS, NR_SYSCALLS, bucket, enter, exit, now, totals},
+		utils::ktest::TestError
+	};
+
+	pub fn test_syscall_stats_buckets() -> Result<(), TestError> {
+		assert_eq!(bucket(0), 0);
+		assert_eq!(bucket(1), 0);
+		assert_eq!(bucket(1023), 9);
+		assert_eq!(bucket(1024), 10);
+		assert_eq!(bucket(u64::MAX), BUCKETS - 1);
+
+		// one failed, one fine call of the last id, out of range ids are ignored
+		let id = NR_SYSCALLS - 1;
+		let (calls, errors, _, histogram) = totals(id);
+		for ret in [-1, 0] {
+			enter(id as u32);
+			exit(id as u32, now(), ret);
+		}
+		enter(NR_SYSCALLS as u32);
+		exit(NR_SYSCALLS as u32, now(), -1);
+
+		let (calls_after, errors_after, _, histogram_after) = totals(id);
+		assert_eq!(calls_after - calls, 2);
+		assert_eq!(errors_after - errors, 1);
+		assert_eq!(histogram_after.iter().sum::<u64>() - histogram.iter().sum::<u64>(), 2);
+		Ok(())
+	}
+	crate::create_test!(test_syscall_stats_buckets);
+}
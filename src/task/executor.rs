@@ -4,96 +4,191 @@
 //! Process execution logic for the kernel.
 //! 
 
-use alloc::{collections::BTreeMap, sync::Arc, task::Wake};
-use core::{sync::atomic::Ordering, task::Waker};
+use alloc::{
+	sync::{Arc, Weak},
+	task::Wake,
+	vec::Vec
+};
+use core::{
+	future::Future,
+	sync::atomic::{AtomicPtr, Ordering},
+	task::{Context, Poll, Waker}
+};
 
 use crossbeam_queue::ArrayQueue;
+use x86_64::instructions::interrupts;
 
-use super::{Process, ProcessId, ProcessState};
-use crate::{error::NullexError, lazy_static, println, serial_println, utils::mutex::SpinMutex};
+use super::{Process, ProcessId, ProcessState, table::ProcessTable, timer};
+use crate::{
+	apic,
+	error::NullexError,
+	interrupts::APIC_TIMER_VECTOR,
+	lazy_static,
+	println,
+	serial_println,
+	smp::{self, MAX_CPUS, cpu_id},
+	utils::{
+		mutex::SpinMutex,
+		trace::{self, TRACE_EXIT, TRACE_SPAWN, TRACE_SWITCH_IN, TRACE_SWITCH_OUT, TRACE_WAKE}
+	}
+};
+
+/// Processes `EXECUTOR` holds at once, live or waiting for their parent to
+/// collect the exit code.
+pub const PROCESS_CAPACITY: usize = 256;
+/// Room in each cpu's run queue. A process is queued once at most, so with
+/// the default table size no queue can overflow.
+const RUN_QUEUE_CAPACITY: usize = PROCESS_CAPACITY;
+
+/// A spawned process, as the executor and the run queues hold it.
+pub type ProcessRef = Arc<SpinMutex<Process>>;
 
 lazy_static! {
-	/// Static reference to the current process that is running.
-	pub static ref CURRENT_PROCESS: SpinMutex<Option<Arc<ProcessState>>> = SpinMutex::new(None);
 	/// Static reference to the current executor that the kernel is running.
 	pub static ref EXECUTOR: SpinMutex<Executor> = SpinMutex::new(Executor::new());
+	/// Runnable processes of each cpu. Spawning and wakers fill them, `run`
+	/// drains its own and steals from the others once it is empty.
+	static ref RUN_QUEUES: Vec<ArrayQueue<ProcessRef>> =
+		(0..MAX_CPUS).map(|_| ArrayQueue::new(RUN_QUEUE_CAPACITY)).collect();
 }
 
-/// Pointer to the current process.
-pub static mut CURRENT_PROCESS_GUARD: *mut Process = core::ptr::null_mut();
+/// State of the process each cpu is polling.
+static CURRENT_PROCESS: [SpinMutex<Option<Arc<ProcessState>>>; MAX_CPUS] =
+	[const { SpinMutex::new(None) }; MAX_CPUS];
+
+/// Pointer to the process each cpu is polling.
+static CURRENT_PROCESS_GUARD: [AtomicPtr<Process>; MAX_CPUS] =
+	[const { AtomicPtr::new(core::ptr::null_mut()) }; MAX_CPUS];
+
+/// Slot holding the state of the process `cpu` is polling.
+pub fn current_process_slot(cpu: usize) -> &'static SpinMutex<Option<Arc<ProcessState>>> {
+	&CURRENT_PROCESS[cpu]
+}
+
+/// Pointer to the process the calling cpu is polling, null outside of a
+/// poll. The process is locked for as long as it is set.
+pub fn current_guard() -> *mut Process {
+	CURRENT_PROCESS_GUARD[cpu_id()].load(Ordering::Relaxed)
+}
 
 /// The process executor of the kernel.
+///
+/// Only the bookkeeping lives behind `EXECUTOR`: spawning, exiting and
+/// looking up processes. Picking the next process to run goes through the
+/// per-cpu run queues and never takes the lock.
 pub struct Executor {
-	/// Tree map showing all mapped processes.
-	pub processes: BTreeMap<ProcessId, Arc<SpinMutex<Process>>>,
-	/// The queue of all processes waiting to run.
-	pub process_queue: Arc<ArrayQueue<ProcessId>>,
-	/// Cache of all wakers for a process.
-	pub waker_cache: BTreeMap<ProcessId, Waker>,
-	/// Next `ProcessId` to be run.
-	pub next_pid: ProcessId
+	/// All spawned processes, indexed by pid.
+	pub processes: ProcessTable<ProcessEntry>
+}
+
+/// A process of the executor.
+pub struct ProcessEntry {
+	/// The process itself, locked while it is polled.
+	pub process: ProcessRef,
+	/// Its state, readable without locking the process (which may be running
+	/// on another cpu).
+	pub state: Arc<ProcessState>
 }
 
 impl Executor {
 	/// Creates a new process executor
 	pub fn new() -> Self {
+		Self::with_capacity(PROCESS_CAPACITY)
+	}
+
+	/// Creates a process executor with room for `capacity` processes.
+	pub fn with_capacity(capacity: usize) -> Self {
 		Executor {
-			processes: BTreeMap::new(),
-			process_queue: Arc::new(ArrayQueue::new(100)),
-			waker_cache: BTreeMap::new(),
-			next_pid: ProcessId::new(0)
+			processes: ProcessTable::with_capacity(capacity)
 		}
 	}
 
-
-	/// Spawns a new process.
+	/// Spawns a new process on the cpu with the shortest run queue. Its pid
+	/// must come from `create_pid`.
 	pub fn spawn_process(&mut self, process: Process) -> Result<(), NullexError> {
 		let pid = process.state.id;
+		let state = process.state.clone();
 		let process_arc = Arc::new(SpinMutex::new(process));
-		if self.processes.insert(pid, process_arc).is_some() {
-			return Err(NullexError::ProcessAlreadyExists);
+		self.processes.insert(pid, ProcessEntry {
+			process: process_arc.clone(),
+			state: state.clone()
+		})?;
+
+		let cpu = shortest_run_queue();
+		state.queued.store(true, Ordering::Release);
+		match enqueue(cpu, process_arc) {
+			Ok(cpu) => {
+				state.cpu.store(cpu, Ordering::Relaxed);
+				trace::trace(TRACE_SPAWN, [pid.get(), cpu as u64]);
+				if cpu == cpu_id() {
+					// queued behind the caller, let an idle cpu steal it
+					smp::kick_idle();
+				} else {
+					smp::kick(cpu);
+				}
+				Ok(())
+			}
+			Err(_) => {
+				self.processes.remove(pid, None, 0);
+				Err(NullexError::ProcessQueueFull)
+			}
 		}
-		self.process_queue.push(pid).map_err(|_| NullexError::ProcessQueueFull)?;
-		Ok(())
 	}
 
-	/// Sleeps the executor if there are no pending processes.
-	pub fn sleep_if_idle(&self) {
-		use x86_64::instructions::interrupts;
-		interrupts::disable();
-		if self.process_queue.is_empty() {
-			interrupts::enable_and_hlt();
-		} else {
-			interrupts::enable();
-		}
+	/// Creates a new `Process ID` for a `Process`, pids of processes that
+	/// are gone are reused. Give it back with `release_pid` if the process
+	/// is never spawned.
+	pub fn create_pid(&mut self) -> Result<ProcessId, NullexError> {
+		self.processes.reserve()
+	}
+
+	/// Returns a pid from `create_pid` that no process was spawned with.
+	pub fn release_pid(&mut self, pid: ProcessId) {
+		self.processes.release(pid);
 	}
 
-	/// Creates a new `Process ID` for a `Process`
-	pub fn create_pid(&mut self) -> ProcessId {
-		let pid = self.next_pid;
-		self.next_pid = ProcessId::new(pid.0 + 1);
-		pid
+	/// State of the live process `pid`.
+	pub fn state(&self, pid: ProcessId) -> Option<Arc<ProcessState>> {
+		self.processes.get(pid).map(|entry| entry.state.clone())
 	}
 
 	/// Lists the running processes.
 	pub fn list_processes(&self) {
 		println!("Running processes:");
-		for pid in self.processes.keys() {
+		for (pid, _) in self.processes.iter() {
 			println!("  Process {}", pid.0);
 		}
 	}
 
 	/// Ends a running process.
+	///
+	/// A child's exit code is kept until its parent collects it with
+	/// `take_exit_code`, and whoever is parked on the child is woken.
 	pub fn end_process(&mut self, pid: ProcessId, exit_code: i32) {
-		let process_arc = self.processes.get(&pid).unwrap();
-		let process = process_arc.lock();
-		let pid_to_remove = pid;
-		drop(process);
-		self.processes.remove(&pid_to_remove);
-		self.waker_cache.remove(&pid_to_remove);
+		let parent = match self.processes.get(pid) {
+			Some(entry) => entry.state.parent,
+			None => {
+				serial_println!("end_process: no process {}", pid.get());
+				return;
+			}
+		};
+		if let Some(entry) = self.processes.remove(pid, parent, exit_code) {
+			// also when it is stopped from outside, wherever it is queued
+			entry.state.exited.store(true, Ordering::Release);
+			entry.state.waker.wake();
+		}
+		// its sockets are on the shared stack, not in the process
+		crate::net::socket::release_owned(pid);
+		trace::trace(TRACE_EXIT, [pid.get(), exit_code as u64]);
 
 		serial_println!("Process {} exited with code: {}", pid.get(), exit_code);
 	}
+
+	/// Removes and returns the exit code of `child` if it has finished and
+	/// `parent` is the one allowed to collect it.
+	pub fn take_exit_code(&mut self, child: ProcessId, parent: ProcessId) -> Option<i32> {
+		self.processes.take_exit_code(child, parent)
+	}
 }
 
 impl Default for Executor {
@@ -102,40 +197,189 @@ impl Default for Executor {
 	}
 }
 
+/// Online cpu with the fewest runnable processes.
+fn shortest_run_queue() -> usize {
+	(0..smp::online_cpus())
+		.min_by_key(|cpu| RUN_QUEUES[*cpu].len())
+		.unwrap_or(0)
+}
+
+/// Queues `process` on `cpu`, or on the next online cpu with room if that
+/// queue is full. Returns the cpu it went to.
+fn enqueue(cpu: usize, mut process: ProcessRef) -> Result<usize, ProcessRef> {
+	let online = smp::online_cpus();
+	for i in 0..online {
+		let target = (cpu + i) % online;
+		match RUN_QUEUES[target].push(process) {
+			Ok(()) => return Ok(target),
+			Err(back) => process = back
+		}
+	}
+	Err(process)
+}
+
+/// Next process for `cpu`: its own queue first, then one stolen from the
+/// other cpus, nearest first.
+fn next_runnable(cpu: usize) -> Option<ProcessRef> {
+	if let Some(process) = RUN_QUEUES[cpu].pop() {
+		return Some(process);
+	}
+	let online = smp::online_cpus();
+	(1..online).find_map(|i| RUN_QUEUES[(cpu + i) % online].pop())
+}
+
+/// If any online cpu has something queued.
+fn has_runnable() -> bool {
+	RUN_QUEUES[..smp::online_cpus()].iter().any(|queue| !queue.is_empty())
+}
+
+/// Runs processes on the calling cpu, forever. Every cpu ends up here once
+/// it is initialised.
+pub fn run() -> ! {
+	let cpu = cpu_id();
+	loop {
+		match next_runnable(cpu) {
+			Some(process_arc) => poll_process(cpu, process_arc),
+			None => sleep_if_idle(cpu)
+		}
+		timer::run_expired();
+	}
+}
+
+/// Polls `process_arc` once on `cpu`.
+fn poll_process(cpu: usize, process_arc: ProcessRef) {
+	let enabled = interrupts::are_enabled();
+	poll_once(cpu, process_arc);
+	// `SpinMutex::lock` leaves interrupts off, put them back as they were
+	if enabled {
+		interrupts::enable();
+	}
+}
+
+fn poll_once(cpu: usize, process_arc: ProcessRef) {
+	let Some(mut guard) = process_arc.try_lock() else {
+		// woken while it is still being polled elsewhere, look again later
+		if enqueue(cpu, process_arc.clone()).is_err() {
+			serial_println!("Warning: run queues full, dropping a wake of a busy process");
+		}
+		return;
+	};
+	let process: &mut Process = &mut guard;
+	let state = process.state.clone();
+	if state.exited.load(Ordering::Acquire) {
+		// a wake that raced with the exit, nothing left to run
+		return;
+	}
+
+	// interrupt handlers on this cpu look the current process up, they must
+	// not find it half published
+	interrupts::without_interrupts(|| {
+		state.queued.store(false, Ordering::Release);
+		state.cpu.store(cpu, Ordering::Relaxed);
+		*CURRENT_PROCESS[cpu].lock() = Some(state.clone());
+		CURRENT_PROCESS_GUARD[cpu].store(&mut *process as *mut Process, Ordering::Relaxed);
+	});
+	trace::trace(TRACE_SWITCH_IN, [state.id.get(), 0]);
+
+	let waker = process
+		.run_waker
+		.get_or_insert_with(|| ProcessWaker::new_waker(Arc::downgrade(&process_arc), state.clone()))
+		.clone();
+	let mut context = Context::from_waker(&waker);
+	let result = process.future.as_mut().poll(&mut context);
+	trace::trace(TRACE_SWITCH_OUT, [state.id.get(), result.is_ready() as u64]);
+
+	CURRENT_PROCESS_GUARD[cpu].store(core::ptr::null_mut(), Ordering::Relaxed);
+	if result.is_ready() {
+		state.exited.store(true, Ordering::Release);
+	}
+	drop(guard);
+
+	if let Poll::Ready(exit_code) = result {
+		EXECUTOR.lock().end_process(state.id, exit_code);
+	}
+	*CURRENT_PROCESS[cpu].lock() = None;
+}
+
+/// Sleeps the calling cpu until there is something to run.
+///
+/// The BSP keeps time for everyone, once every other cpu is idle as well it
+/// idles tickless: the timer interrupt is held off until the earliest
+/// sleeper is due, so a machine with nothing but napping processes stays
+/// halted instead of waking 1024 times a second. The other cpus have no
+/// timer and wait for a reschedule IPI.
+fn sleep_if_idle(cpu: usize) {
+	interrupts::disable();
+	smp::set_idle(true);
+	// a waker that queued work before the idle bit was set did not kick us
+	if has_runnable() {
+		smp::set_idle(false);
+		interrupts::enable();
+		return;
+	}
+
+	if cpu != 0 || !smp::others_idle() {
+		interrupts::enable_and_hlt();
+		smp::set_idle(false);
+		return;
+	}
+
+	let ticks = match timer::next_deadline() {
+		Some(deadline) => deadline.saturating_sub(timer::now()),
+		None => u64::MAX
+	};
+	if ticks == 0 {
+		// a sleeper is already due, `timer::run_expired` queues it
+		smp::set_idle(false);
+		interrupts::enable();
+		return;
+	}
+	unsafe {
+		apic::idle_for_ticks(APIC_TIMER_VECTOR, ticks);
+	}
+	smp::set_idle(false);
+}
+
 /// Structure representing a waker, to be able to 'wake' a process up.
+///
+/// Puts the process back on the run queue of the cpu it last ran on, which
+/// still has its data in cache, and kicks that cpu if it is idle.
 pub struct ProcessWaker {
-	/// The `ProcessId` to wake up.
-	pub pid: ProcessId,
-	/// The list of `ProcessId`'s to wake up.
-	pub process_queue: Arc<ArrayQueue<ProcessId>>,
+	/// The process to wake up, gone once it exited.
+	pub process: Weak<SpinMutex<Process>>,
 	/// The current state of the process which will be waking up.
 	pub state: Arc<ProcessState>
 }
 
 impl ProcessWaker {
-	/// Wakes the current process inside of `self.pid`
+	/// Wakes the process inside of `self.process`
 	pub fn wake_process(&self) {
 		// use self.state directly no need to lock the process
-		if !self.state.queued.swap(true, Ordering::AcqRel)
-			&& self.process_queue.push(self.pid).is_err()
-		{
-			serial_println!(
-				"Warning: process_queue full, skipping wake for process {}",
-				self.pid.0
-			);
-			self.state.queued.store(false, Ordering::Release);
+		if self.state.exited.load(Ordering::Acquire) || self.state.queued.swap(true, Ordering::AcqRel) {
+			return;
+		}
+		let Some(process) = self.process.upgrade() else {
+			return;
+		};
+		match enqueue(self.state.cpu.load(Ordering::Relaxed), process) {
+			Ok(cpu) => {
+				trace::trace(TRACE_WAKE, [self.state.id.get(), cpu as u64]);
+				smp::kick(cpu)
+			}
+			Err(_) => {
+				serial_println!(
+					"Warning: run queues full, skipping wake for process {}",
+					self.state.id.0
+				);
+				self.state.queued.store(false, Ordering::Release);
+			}
 		}
 	}
 
-	/// Creates a new waker for a `ProcessId`
-	pub fn new_waker(
-		pid: ProcessId,
-		process_queue: Arc<ArrayQueue<ProcessId>>,
-		state: Arc<ProcessState>
-	) -> Waker {
+	/// Creates a new waker for a process
+	pub fn new_waker(process: Weak<SpinMutex<Process>>, state: Arc<ProcessState>) -> Waker {
 		Waker::from(Arc::new(ProcessWaker {
-			pid,
-			process_queue,
+			process,
 			state
 		}))
 	}
@@ -149,4 +393,40 @@ impl Wake for ProcessWaker {
 	fn wake_by_ref(self: &Arc<Self>) {
 		self.wake_process();
 	}
-}
\ No newline at end of file
+}
+
+#[cfg(feature = "kbench")]
+pub mod benches {
+	use alloc::boxed::Box;
+	use core::{future::Future, hint::black_box, pin::Pin};
+
+	use crossbeam_queue::ArrayQueue;
+
+	use crate::{
+		task::executor::RUN_QUEUE_CAPACITY,
+		utils::{
+			ktest::{self, TestError},
+			process::spawn_process
+		}
+	};
+
+	pub fn bench_spawn_process() -> Result<(), TestError> {
+		// each holds a pid until it ran, stay well inside the table
+		ktest::bench("executor_spawn_process", 32, |_| {
+			spawn_process(|_state| Box::pin(async { 0 }) as Pin<Box<dyn Future<Output = i32>>>, false).unwrap();
+		});
+		Ok(())
+	}
+	crate::create_bench!(bench_spawn_process);
+
+	pub fn bench_run_queue_push_pop() -> Result<(), TestError> {
+		// the queue type and size each cpu's run queue has
+		let queue = ArrayQueue::new(RUN_QUEUE_CAPACITY);
+		ktest::bench("array_queue_push_pop", 100_000, |i| {
+			queue.push(i).unwrap();
+			black_box(queue.pop());
+		});
+		Ok(())
+	}
+	crate::create_bench!(bench_run_queue_push_pop);
+}
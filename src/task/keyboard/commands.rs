@@ -191,6 +191,24 @@ pub fn init_commands() {
 		help: "Ping a hostname",
 		cmd_type: CommandType::Generic
 	});
+	register_command(Command {
+		name: "sysstats",
+		func: sysstats,
+		help: "Syscall counts and cycle histograms",
+		cmd_type: CommandType::Generic
+	});
+	register_command(Command {
+		name: "trace",
+		func: trace,
+		help: "Event trace: trace on|off|clear|dump",
+		cmd_type: CommandType::Generic
+	});
+	register_command(Command {
+		name: "sync",
+		func: sync,
+		help: "Write /logs to disk now",
+		cmd_type: CommandType::Generic
+	});
 	register_command(Command {
 		name: "netpoll",
 		func: netpoll,
@@ -228,7 +246,7 @@ fn help(_args: &[&str]) {
 
 fn ls(args: &[&str]) {
 	let path = resolve_path(if args.is_empty() { "." } else { args[0] });
-	fs::with_fs(|fs| match fs.list_dir(&path) {
+	fs::with_fs_read(|fs| match fs.list_dir(&path) {
 		Ok(entries) => {
 			for entry in entries {
 				print!("{} ", entry);
@@ -245,9 +263,9 @@ fn cat(args: &[&str]) {
 		return;
 	}
 	let path = resolve_path(args[0]);
-	fs::with_fs(|fs| match fs.read_file(&path) {
+	fs::with_fs_read(|fs| match fs.read_file(&path) {
 		Ok(content) => {
-			let s = String::from_utf8_lossy(content);
+			let s = String::from_utf8_lossy(&content);
 			println!("{}", s)
 		}
 		Err(_) => println!("cat: {}: No such file ", path)
@@ -261,7 +279,7 @@ fn cd(args: &[&str]) {
 		resolve_path(args[0])
 	};
 
-	fs::with_fs(|fs| {
+	fs::with_fs_read(|fs| {
 		if fs.is_dir(&path) {
 			*CWD.lock() = path;
 		} else {
@@ -353,7 +371,7 @@ fn write_file(args: &[&str]) {
 	}
 	let path = resolve_path(args[0]);
 	let content = args[1..].join(" ");
-	fs::with_fs(|fs| {
+	fs::with_fs_read(|fs| {
 		if fs.write_file(&path, content.as_bytes(), false).is_err() {
 			println!("write: failed to write to '{}'", args[0]);
 		}
@@ -427,6 +445,39 @@ fn ping(args: &[&str]) {
 	}
 }
 
+fn sysstats(_args: &[&str]) {
+	let report = crate::syscall::stats::report();
+	print!("{}", report);
+	serial_println!("{}", report);
+}
+
+fn trace(args: &[&str]) {
+	use crate::utils::trace;
+
+	match args.first().copied() {
+		Some("on") => trace::set_enabled(true),
+		Some("off") => trace::set_enabled(false),
+		Some("clear") => trace::clear(),
+		Some("dump") => {
+			// not recording what the dump itself does
+			let was_enabled = trace::enabled();
+			trace::set_enabled(false);
+			let records = trace::snapshot();
+			trace::dump(&records);
+			println!("Dumped {} records to serial.", records.len());
+			trace::set_enabled(was_enabled);
+		}
+		_ => println!("usage: trace on|off|clear|dump")
+	}
+}
+
+fn sync(_args: &[&str]) {
+	match crate::fs::diskfs::sync() {
+		Ok(blocks) => println!("{} blocks written", blocks),
+		Err(e) => println!("sync: {}", e)
+	}
+}
+
 fn netpoll(_args: &[&str]) {
 	println!("=== Manual Network Poll ===");
 	crate::drivers::virtio::net::rx_poll();
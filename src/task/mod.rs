@@ -6,41 +6,65 @@
 
 pub mod executor;
 pub mod keyboard;
+pub mod table;
+pub mod timer;
 
 use alloc::{boxed::Box, string::String, sync::Arc, vec::Vec};
-use x86_64::{VirtAddr, structures::paging::{FrameAllocator, Mapper, OffsetPageTable, Page, PageTable, PageTableFlags, PhysFrame, Size4KiB, Translate}};
+use x86_64::{VirtAddr, registers::control::Cr3, structures::paging::{FrameAllocator, Mapper, OffsetPageTable, Page, PageTable, PageTableFlags, PhysFrame, Size4KiB, Translate}};
 use core::{
-	arch::asm, fmt::Debug, future::Future, pin::Pin, ptr::write_bytes, sync::atomic::AtomicBool, task::{Context, Poll}
+	fmt::Debug, future::Future, pin::Pin, sync::atomic::{AtomicBool, AtomicUsize}, task::{Context, Poll, Waker}
 };
 
 use crossbeam_queue::ArrayQueue;
 use futures::task::AtomicWaker;
 use hashbrown::HashMap;
 
-use crate::{PHYS_MEM_OFFSET, allocator::ALLOCATOR_INFO, arch::x86_64::{bootinfo::MemoryRegion, user::setup_user_stack}, error::NullexError, gdt::{INTERRUPT_STACK_SIZE, interrupt_stack_top, user_code_selector, user_data_selector}, memory::{active_level_4_table, phys_to_virt}, serial_println, utils::{elf::{load_segment, parse_elf}, oncecell::spin::OnceCell}};
-
-const KERNEL_STACK_PAGES_TO_MAP: usize = 8;
+use crate::{PHYS_MEM_OFFSET, allocator::ALLOCATOR_INFO, arch::x86_64::{bootinfo::MemoryRegion, syscall::SyscallFrame, user::{FpuState, USER_MAP_BASE, setup_user_stack, with_kernel_page_table}}, error::NullexError, fs::{pages::FilePage, ramfs::InodeId}, gdt::{user_code_selector, user_data_selector}, memory::{active_level_4_table, fork_page_table, free_page_table, phys_to_virt}, serial_println, syscall::ring::IoRing, utils::{elf::{ImageSegment, LoadedImage}, oncecell::spin::OnceCell}};
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
 /// Wrapper for a process id.
 pub struct ProcessId(u64);
 
 impl ProcessId {
+	/// Low bits of a pid, the process table slot.
+	pub const SLOT_BITS: u32 = 16;
+	/// Bits above the slot count how often it was reused, 15 of them so a pid
+	/// always fits a positive `i32`.
+	pub const GENERATION_MASK: u16 = 0x7FFF;
+
 	/// Creates a new `ProcessId` with the specified id.
 	pub fn new(id: u64) -> Self {
 		ProcessId(id)
 	}
 
+	/// The pid of generation `generation` of table slot `slot`.
+	pub fn from_slot(slot: usize, generation: u16) -> Self {
+		ProcessId(((generation & Self::GENERATION_MASK) as u64) << Self::SLOT_BITS | slot as u64)
+	}
+
 	/// Returns the `ProcessId`'s id.
 	pub fn get(&self) -> u64 {
 		self.0
 	}
+
+	/// Process table slot of this pid.
+	pub fn slot(&self) -> usize {
+		(self.0 & ((1 << Self::SLOT_BITS) - 1)) as usize
+	}
+
+	/// Generation of the slot this pid was handed out for.
+	pub fn generation(&self) -> u16 {
+		(self.0 >> Self::SLOT_BITS) as u16
+	}
 }
 
 /// Struct to represent an open file in a process
+#[derive(Clone)]
 pub struct OpenFile {
-	/// The path to the open file.
+	/// The path to the open file, kept for diagnostics.
 	pub path: String,
+	/// The file resolved by `openf`, reads and writes go through this.
+	pub inode: InodeId,
 	/// The current read offset to the open file.
 	pub offset: usize
 }
@@ -52,17 +76,33 @@ pub struct ProcessState {
 	pub id: ProcessId,
 	/// Whether or not the running process is a child of another process.
 	pub is_child: bool,
+	/// The process that split this one off, it is the one that can collect
+	/// the exit code with `waiton`.
+	pub parent: Option<ProcessId>,
 	/// The function that this process will be running.
 	pub future_fn:
 		Arc<dyn Fn(Arc<ProcessState>) -> Pin<Box<dyn Future<Output = i32>>> + Send + Sync>,
 	/// Whether or not is it in the queued inside of the executor.
 	pub queued: AtomicBool,
+	/// Cpu the process last ran on, its wakers queue it there again.
+	pub cpu: AtomicUsize,
+	/// Set once the process ended, a late wake must not poll it again.
+	pub exited: AtomicBool,
 	/// Scancode queue incase some functions need the keyboard.
 	pub scancode_queue: OnceCell<ArrayQueue<u8>>,
 	/// Waker for functions that need the process now.
 	pub waker: AtomicWaker
 }
 
+/// Why a user process left the cpu in the middle of a syscall.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Park {
+	/// `waiton`, until the child exits.
+	Child(ProcessId),
+	/// `nap`, until the given timer tick.
+	Nap(u64)
+}
+
 /// Structure representing a process running in the kernel.
 pub struct Process {
 	/// Current state of the process running.
@@ -77,6 +117,12 @@ pub struct Process {
 	pub open_files: HashMap<u32, OpenFile>,
 	/// The next available file descriptor.
 	pub next_fd: u32,
+	/// What the process is parked on, if it left user mode in a blocking
+	/// syscall.
+	pub parked: Option<Park>,
+	/// Waker that puts the process back on a run queue, made on its first
+	/// poll.
+	pub run_waker: Option<Waker>,
 }
 
 impl Process {
@@ -89,41 +135,52 @@ impl Process {
 			context: UserContext::default(),
 			address_space: None,
 			open_files: HashMap::new(),
-			next_fd: 0 // start file descriptors at 0
+			next_fd: 0, // start file descriptors at 0
+			parked: None,
+			run_waker: None
 		})
 	}
 
 	/// Creates a new process from an ELF binary.
-	pub fn from_elf(state: Arc<ProcessState>, elf_bytes: &[u8], args: &[&str], envs: &[&str]) -> Result<Process, NullexError> {
-		let elf = parse_elf(elf_bytes)?;
+	///
+	/// The image is not copied: its PT_LOAD segments are only recorded and
+	/// their pages faulted in on first use, see `ImageSegment`.
+	pub fn from_elf(state: Arc<ProcessState>, image: &LoadedImage, args: &[&str], envs: &[&str]) -> Result<Process, NullexError> {
+		let (address_space, context) = Self::load_image(image, args, envs)?;
+		let future = (state.future_fn)(state.clone());
 
+		Ok(Process {
+			state,
+			future,
+			context,
+			address_space: Some(address_space),
+			open_files: HashMap::new(),
+			next_fd: 0,
+			parked: None,
+			run_waker: None
+		})
+	}
+
+	/// Builds a fresh address space and initial registers for an ELF image.
+	/// Needs the kernel page table active.
+	pub fn load_image(image: &LoadedImage, args: &[&str], envs: &[&str]) -> Result<(AddressSpace, UserContext), NullexError> {
 		let mut address_space = AddressSpace::new()?;
 
-		for seg in &elf.segments {
-			load_segment(&mut address_space, elf_bytes, seg)?;
-		}
+		// already checked when the image was loaded, see `elf::load_elf`
+		address_space.segments.extend(image.segments.iter().cloned());
 
 		let stack_top = unsafe {
-			setup_user_stack(&mut address_space, args, envs)
+			setup_user_stack(&mut address_space, args, envs, image.entry)?
 		};
 
 		let mut context = UserContext::default();
-		context.rip = elf.entry;
+		context.rip = image.entry;
         context.rsp = stack_top;
 		context.cs = user_code_selector() as u64;
 		context.ss = user_data_selector() as u64;
         context.rflags = 0x202;
 
-		let future = (state.future_fn)(state.clone());
-
-		Ok(Process {
-			state,
-			future,
-			context,
-			address_space: Some(address_space),
-			open_files: HashMap::new(),
-			next_fd: 0
-		})
+		Ok((address_space, context))
 	}
 
 	/// Tries to get the final result and signs the task up for a callback if its still pending.
@@ -134,26 +191,29 @@ impl Process {
 unsafe impl Send for Process {}
 
 /// Structure representing all saved registers for a process.
-#[derive(Debug, Default)]
+///
+/// `repr(C)` because `user::iret_to_user` loads it by field offset.
+#[repr(C)]
+#[derive(Debug, Default, Clone)]
 #[allow(unused)]
 pub struct UserContext {
 	// data registers saved by the software (pushaq/push)
-	rax: u64,
-	rbx: u64,
-	rcx: u64,
-	rdx: u64,
-	rsi: u64,
-	rdi: u64,
-	rbp: u64,
-
-	r8: u64,
-	r9: u64,
-	r10: u64,
-	r11: u64,
-	r12: u64,
-	r13: u64,
-	r14: u64,
-	r15: u64,
+	pub(crate) rax: u64,
+	pub(crate) rbx: u64,
+	pub(crate) rcx: u64,
+	pub(crate) rdx: u64,
+	pub(crate) rsi: u64,
+	pub(crate) rdi: u64,
+	pub(crate) rbp: u64,
+
+	pub(crate) r8: u64,
+	pub(crate) r9: u64,
+	pub(crate) r10: u64,
+	pub(crate) r11: u64,
+	pub(crate) r12: u64,
+	pub(crate) r13: u64,
+	pub(crate) r14: u64,
+	pub(crate) r15: u64,
 
 	// pushed by isr
 	int_no: u64,
@@ -170,6 +230,69 @@ pub struct UserContext {
 	pub rsp: u64,
 	/// SS register
 	pub ss: u64,
+
+	/// Vector registers, only loaded and saved around whole runs of the
+	/// process, see `FpuState`.
+	pub(crate) fpu: FpuState,
+}
+
+impl UserContext {
+	/// The registers a process had when it entered the syscall that saved
+	/// `frame`, entering this context resumes right after that syscall. The
+	/// frame holds no vector registers, `fpu` is left in its initial state.
+	pub fn from_syscall_frame(frame: &SyscallFrame) -> Self {
+		Self {
+			rax: frame.rax,
+			rbx: frame.rbx,
+			rcx: frame.rcx,
+			rdx: frame.rdx,
+			rsi: frame.rsi,
+			rdi: frame.rdi,
+			rbp: frame.rbp,
+			r8: frame.r8,
+			r9: frame.r9,
+			r10: frame.r10,
+			r11: frame.r11,
+			r12: frame.r12,
+			r13: frame.r13,
+			r14: frame.r14,
+			r15: frame.r15,
+			int_no: 0,
+			err_no: 0,
+			rip: frame.rip,
+			cs: frame.cs,
+			rflags: frame.rflags,
+			rsp: frame.rsp,
+			ss: frame.ss,
+			fpu: FpuState::default(),
+		}
+	}
+}
+
+/// A file mapped into an `AddressSpace` by `mapf`.
+#[derive(Clone)]
+pub struct FileMapping {
+	/// First user address of the mapping, page aligned.
+	pub start: u64,
+	/// The file pages mapped, held so they outlive writes to the file.
+	pub pages: Vec<Arc<FilePage>>,
+}
+
+/// Anonymous memory handed out by `mapm`. Nothing is mapped up front, each
+/// page is zero filled on first touch.
+#[derive(Debug, Clone, Copy)]
+pub struct AnonRegion {
+	/// First user address of the region, page aligned.
+	pub start: u64,
+	/// Length of the region in pages.
+	pub pages: u64,
+}
+
+impl AnonRegion {
+	/// If `addr` lies inside this region.
+	pub fn contains(&self, addr: u64) -> bool {
+		addr >= self.start && (addr - self.start) / 4096 < self.pages
+	}
 }
 
 /// Structure representing the memory region each `Process` has.
@@ -178,103 +301,138 @@ pub struct AddressSpace {
 	pub page_table: PhysFrame,
 	/// Regions of the memory.
 	pub regions: Vec<MemoryRegion>,
+	/// Live `mapf` mappings.
+	pub mappings: Vec<FileMapping>,
+	/// PT_LOAD segments of the running image, paged in on demand.
+	pub segments: Vec<ImageSegment>,
+	/// Live `mapm` regions, paged in on demand.
+	pub anon: Vec<AnonRegion>,
+	/// The submission ring from `ringsetup`, if any.
+	pub ring: Option<IoRing>,
+	/// Where the next `mapf` or `mapm` mapping goes.
+	pub next_map: u64,
 }
 
 impl AddressSpace {
 	/// Creates a new `AddressSpace` from the available memory.
+	///
+	/// The kernel has to stay mapped for syscalls and interrupts, so its PML4
+	/// entries are shared as they are, apart from the first one, which holds the
+	/// user image as well. That slot gets tables of its own with the kernel
+	/// image's 2 MiB pages copied in (the stacks are statics in it) and the
+	/// local APIC. Needs the kernel page table active.
     pub fn new() -> Result<AddressSpace, NullexError> {
         let mut frame_binding = ALLOCATOR_INFO.frame_allocator.lock();
         let frame_allocator = frame_binding
             .as_mut()
             .ok_or(NullexError::FrameAllocatorNotInitialized)?;
 
-        let pml4_frame = frame_allocator
-            .allocate_frame()
-            .ok_or(NullexError::FrameAllocationFailed)?;
-
-        let table_ptr = unsafe { phys_to_virt(pml4_frame.start_address()) };
-        unsafe { write_bytes(table_ptr.as_mut_ptr::<u8>(), 0, 4096); }
-
         let phys_offset = *PHYS_MEM_OFFSET.lock();
         let kernel_pml4 = unsafe { active_level_4_table(phys_offset) };
-        let new_pml4 = unsafe { &mut *table_ptr.as_mut_ptr::<PageTable>() };
 
-        for i in 216..512 {
+        let (pml4_frame, new_pml4) = zeroed_table(&mut **frame_allocator)?;
+        for i in 1..512 {
             if kernel_pml4[i].flags().contains(PageTableFlags::PRESENT) {
                 new_pml4[i] = kernel_pml4[i].clone();
             }
         }
 
-        let mut new_mapper = unsafe { OffsetPageTable::new(new_pml4, phys_offset) };
-        let old_mapper = unsafe { OffsetPageTable::new(kernel_pml4, phys_offset) };
+        // our own tables are linked user accessible, so `fork` copies them and
+        // dropping the space frees them, the leaves decide what user code sees
+        let own = PageTableFlags::PRESENT | PageTableFlags::WRITABLE | PageTableFlags::USER_ACCESSIBLE;
+        let (pdpt_frame, pdpt) = zeroed_table(&mut **frame_allocator)?;
+        let (pd_frame, pd) = zeroed_table(&mut **frame_allocator)?;
+        new_pml4[0].set_addr(pdpt_frame.start_address(), own);
+        pdpt[0].set_addr(pd_frame.start_address(), own);
 
-        let mut map_page = |virt: u64| -> Result<(), NullexError> {
-            let page: Page<Size4KiB> = Page::containing_address(VirtAddr::new(virt));
-            if new_mapper.translate_addr(page.start_address()).is_some() {
-                return Ok(());
-            }
-            if let Some(phys) = old_mapper.translate_addr(page.start_address()) {
-                let frame = PhysFrame::containing_address(phys);
-                unsafe {
-                    new_mapper.map_to(
-                        page,
-                        frame,
-                        PageTableFlags::PRESENT | PageTableFlags::WRITABLE,
-                        *frame_allocator,
-                    )
-                    .map_err(|_| NullexError::FrameAllocationFailed)?
-                    .flush();
-                }
-            }
-            Ok(())
-        };
+        let kernel_pdpt = unsafe { &*phys_to_virt(kernel_pml4[0].addr()).as_ptr::<PageTable>() };
+        let kernel_pd = unsafe { &*phys_to_virt(kernel_pdpt[0].addr()).as_ptr::<PageTable>() };
 
         unsafe extern "C" {
-            static __link_phys_base: u8;
             static _end: u8;
         }
-        let kernel_start = core::ptr::addr_of!(__link_phys_base) as u64;
-        let kernel_end   = core::ptr::addr_of!(_end) as u64;
-
-        serial_println!("[INFO] Kernel Addresses: {:#x} .. {:#x}", kernel_start, kernel_end);
-
-        let mut addr = 0x1000u64;
-        while addr < (kernel_end + 0xFFF) & !0xFFF {
-            map_page(addr)?;
-            addr += 0x1000;
+        let kernel_end = core::ptr::addr_of!(_end) as u64;
+        for i in 0..kernel_end.div_ceil(0x20_0000) as usize {
+            pd[i] = kernel_pd[i].clone();
         }
 
-		map_page(0xFEE00000)?;
-
-        let heap_start = crate::allocator::HEAP_START as u64;
-        let heap_size  = crate::allocator::HEAP_SIZE as u64;
-        let mut addr = heap_start & !0xFFF;
-        while addr < (heap_start + heap_size + 0xFFF) & !0xFFF {
-            map_page(addr)?;
-            addr += 0x1000;
-        }
-
-        let mut rsp: u64;
-        unsafe { asm!("mov {}, rsp", out(reg) rsp); }
-        for i in 0..KERNEL_STACK_PAGES_TO_MAP {
-            let addr = match rsp.checked_sub((i as u64) * 0x1000) {
-                Some(v) => v,
-                None => break,
-            };
-            map_page(addr)?;
-        }
+        let mut new_mapper = unsafe { OffsetPageTable::new(new_pml4, phys_offset) };
+        let old_mapper = unsafe { OffsetPageTable::new(kernel_pml4, phys_offset) };
 
-        let int_stack_top = interrupt_stack_top();
-        for i in 0..(INTERRUPT_STACK_SIZE / 4096) {
-            let addr = int_stack_top - 1 - (i as u64) * 0x1000;
-            map_page(addr)?;
+        let apic: Page<Size4KiB> = Page::containing_address(VirtAddr::new(0xFEE00000));
+        if let Some(phys) = old_mapper.translate_addr(apic.start_address()) {
+            let flags = PageTableFlags::PRESENT | PageTableFlags::WRITABLE | PageTableFlags::NO_CACHE;
+            unsafe {
+                new_mapper
+                    .map_to_with_table_flags(apic, PhysFrame::containing_address(phys), flags, own, &mut **frame_allocator)
+                    .map_err(|_| NullexError::FrameAllocationFailed)?
+                    .flush();
+            }
         }
 
         Ok(AddressSpace {
             page_table: pml4_frame,
             regions: Vec::new(),
+            mappings: Vec::new(),
+            segments: Vec::new(),
+            anon: Vec::new(),
+            ring: None,
+            next_map: USER_MAP_BASE,
         })
     }
+
+	/// Copy of this address space for a `split` child.
+	///
+	/// Only page tables are copied. Writable user pages end up read-only and
+	/// shared copy-on-write by both sides, the kernel tables (everything not
+	/// user accessible) are shared as they are. Needs the kernel page table
+	/// active.
+	pub fn fork(&self) -> Result<AddressSpace, NullexError> {
+		Ok(AddressSpace {
+			page_table: fork_page_table(self.page_table)?,
+			regions: self.regions.clone(),
+			mappings: self.mappings.clone(),
+			segments: self.segments.clone(),
+			anon: self.anon.clone(),
+			ring: self.ring,
+			next_map: self.next_map,
+		})
+	}
+
+	/// If `frame`, mapped at `page`, belongs to someone else: a file page from
+	/// `mapf` or a page of the image. Those are not freed with the address
+	/// space.
+	pub fn borrows(&self, page: Page, frame: PhysFrame) -> bool {
+		let addr = page.start_address().as_u64();
+		self.mappings
+			.iter()
+			.any(|m| addr >= m.start && (addr - m.start) / 4096 < m.pages.len() as u64)
+			|| self.segments.iter().any(|seg| seg.borrows(page, frame))
+	}
+}
+
+/// A zeroed page table of our own.
+fn zeroed_table(
+	frame_allocator: &mut impl FrameAllocator<Size4KiB>
+) -> Result<(PhysFrame, &'static mut PageTable), NullexError> {
+	let frame = frame_allocator.allocate_frame().ok_or(NullexError::FrameAllocationFailed)?;
+	let table = unsafe { &mut *phys_to_virt(frame.start_address()).as_mut_ptr::<PageTable>() };
+	table.zero();
+	Ok((frame, table))
+}
+
+impl Drop for AddressSpace {
+	fn drop(&mut self) {
+		if Cr3::read().0 == self.page_table {
+			// the tables are still in use, leaking them beats running on freed frames
+			serial_println!("[ERROR] address space dropped while active, leaking it");
+			return;
+		}
+
+		if let Err(e) = unsafe { with_kernel_page_table(|| free_page_table(self)) } {
+			serial_println!("[ERROR] freeing address space: {}", e);
+		}
+	}
 }
 /// A future that never completes.
 pub struct ForeverPending;
@@ -0,0 +1,266 @@
+//!
+//! table.rs
+//!
+//! Process table of the executor, a slab indexed by pid.
+//!
+
+use alloc::vec::Vec;
+
+use super::ProcessId;
+use crate::error::NullexError;
+
+/// Most slots a table can have, a pid keeps the slot in its low bits.
+pub const MAX_TABLE_CAPACITY: usize = 1 << ProcessId::SLOT_BITS;
+
+/// Exit code of a finished child, kept for its parent's `waiton`.
+#[derive(Debug, Clone, Copy)]
+pub struct ExitStatus {
+	/// The process allowed to collect the code.
+	pub parent: ProcessId,
+	/// Value the child exited with.
+	pub code: i32
+}
+
+enum Slot<T> {
+	Free,
+	/// Handed out by `reserve`, the process is still being built.
+	Reserved,
+	Live(T),
+	/// Exited, the slot is kept until the parent collects the code.
+	Exited(ExitStatus)
+}
+
+struct Entry<T> {
+	generation: u16,
+	slot: Slot<T>
+}
+
+/// A generation tagged slab of processes.
+///
+/// A pid is the slot index plus the generation of the slot, so a lookup is
+/// one bounds check and one compare, and a pid that outlived its process
+/// (its slot was reused since) simply stops matching. Freed slots are reused
+/// last in, first out, the most recently used memory is the warmest.
+pub struct ProcessTable<T> {
+	entries: Vec<Entry<T>>,
+	free: Vec<u16>,
+	live: usize,
+	capacity: usize
+}
+
+impl<T> ProcessTable<T> {
+	/// An empty table with room for `capacity` processes (live or waiting to
+	/// be collected). Slots are only allocated as they are used.
+	pub const fn with_capacity(capacity: usize) -> Self {
+		assert!(capacity <= MAX_TABLE_CAPACITY, "process table capacity above the pid slot range");
+		Self {
+			entries: Vec::new(),
+			free: Vec::new(),
+			live: 0,
+			capacity
+		}
+	}
+
+	/// Most processes the table holds at once.
+	pub fn capacity(&self) -> usize {
+		self.capacity
+	}
+
+	/// Number of live processes.
+	pub fn len(&self) -> usize {
+		self.live
+	}
+
+	/// If no process is live.
+	pub fn is_empty(&self) -> bool {
+		self.live == 0
+	}
+
+	fn entry(&self, pid: ProcessId) -> Option<&Entry<T>> {
+		self.entries
+			.get(pid.slot())
+			.filter(|entry| entry.generation == pid.generation())
+	}
+
+	fn entry_mut(&mut self, pid: ProcessId) -> Option<&mut Entry<T>> {
+		self.entries
+			.get_mut(pid.slot())
+			.filter(|entry| entry.generation == pid.generation())
+	}
+
+	/// Picks the pid for a new process. The slot stays reserved until
+	/// `insert` or `release`.
+	pub fn reserve(&mut self) -> Result<ProcessId, NullexError> {
+		let index = match self.free.pop() {
+			Some(index) => index as usize,
+			None => {
+				if self.entries.len() >= self.capacity {
+					return Err(NullexError::ProcessTableFull);
+				}
+				self.entries.push(Entry {
+					generation: 0,
+					slot: Slot::Free
+				});
+				self.entries.len() - 1
+			}
+		};
+		let entry = &mut self.entries[index];
+		entry.slot = Slot::Reserved;
+		Ok(ProcessId::from_slot(index, entry.generation))
+	}
+
+	/// Fills the slot reserved for `pid`.
+	pub fn insert(&mut self, pid: ProcessId, value: T) -> Result<(), NullexError> {
+		let entry = self.entry_mut(pid).ok_or(NullexError::ProcessNotFound)?;
+		match entry.slot {
+			Slot::Reserved => {
+				entry.slot = Slot::Live(value);
+				self.live += 1;
+				Ok(())
+			}
+			_ => Err(NullexError::ProcessAlreadyExists)
+		}
+	}
+
+	/// Gives back a pid from `reserve` that never got a process.
+	pub fn release(&mut self, pid: ProcessId) {
+		let reserved = self.entry(pid).is_some_and(|entry| matches!(entry.slot, Slot::Reserved));
+		if reserved {
+			self.free_slot(pid.slot());
+		}
+	}
+
+	fn free_slot(&mut self, index: usize) {
+		let entry = &mut self.entries[index];
+		entry.slot = Slot::Free;
+		entry.generation = (entry.generation + 1) & ProcessId::GENERATION_MASK;
+		self.free.push(index as u16);
+	}
+
+	/// The live process `pid`.
+	pub fn get(&self, pid: ProcessId) -> Option<&T> {
+		match &self.entry(pid)?.slot {
+			Slot::Live(value) => Some(value),
+			_ => None
+		}
+	}
+
+	/// If `pid` is a live process.
+	pub fn contains(&self, pid: ProcessId) -> bool {
+		self.get(pid).is_some()
+	}
+
+	/// Removes the live process `pid` and returns it.
+	///
+	/// With a `parent` that is still live the exit code is kept (and the slot
+	/// with it) until the parent collects it with `take_exit_code`, otherwise
+	/// the slot is free right away. Codes of children `pid` never collected
+	/// are dropped as well, nobody can ask for them anymore.
+	pub fn remove(&mut self, pid: ProcessId, parent: Option<ProcessId>, code: i32) -> Option<T> {
+		if !matches!(self.entry(pid)?.slot, Slot::Live(_)) {
+			return None;
+		}
+
+		let keep = parent.filter(|parent| self.contains(*parent));
+		let entry = self.entry_mut(pid)?;
+		let old = match keep {
+			Some(parent) => core::mem::replace(&mut entry.slot, Slot::Exited(ExitStatus { parent, code })),
+			None => core::mem::replace(&mut entry.slot, Slot::Free)
+		};
+		if keep.is_none() {
+			self.free_slot(pid.slot());
+		}
+		self.live -= 1;
+
+		let orphans: Vec<usize> = self
+			.entries
+			.iter()
+			.enumerate()
+			.filter(|(_, entry)| matches!(entry.slot, Slot::Exited(status) if status.parent == pid))
+			.map(|(index, _)| index)
+			.collect();
+		for index in orphans {
+			self.free_slot(index);
+		}
+
+		match old {
+			Slot::Live(value) => Some(value),
+			_ => None
+		}
+	}
+
+	/// Removes and returns the exit code of `child` if it has finished and
+	/// `parent` is the one allowed to collect it.
+	pub fn take_exit_code(&mut self, child: ProcessId, parent: ProcessId) -> Option<i32> {
+		let status = match self.entry(child)?.slot {
+			Slot::Exited(status) if status.parent == parent => status,
+			_ => return None
+		};
+		self.free_slot(child.slot());
+		Some(status.code)
+	}
+
+	/// Iterates over the live processes.
+	pub fn iter(&self) -> impl Iterator<Item = (ProcessId, &T)> {
+		self.entries.iter().enumerate().filter_map(|(index, entry)| match &entry.slot {
+			Slot::Live(value) => Some((ProcessId::from_slot(index, entry.generation), value)),
+			_ => None
+		})
+	}
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use crate::{
+		error::NullexError,
+		task::table::ProcessTable,
+		utils::ktest::TestError
+	};
+
+	pub fn test_table_recycles_pids() -> Result<(), TestError> {
+		let mut table: ProcessTable<u32> = ProcessTable::with_capacity(2);
+		let a = table.reserve().unwrap();
+		table.insert(a, 1).unwrap();
+		let b = table.reserve().unwrap();
+		table.insert(b, 2).unwrap();
+		assert!(matches!(table.reserve(), Err(NullexError::ProcessTableFull)));
+
+		assert_eq!(table.remove(a, None, 0), Some(1));
+		let c = table.reserve().unwrap();
+		// same slot, new generation: the old pid no longer finds anything
+		assert_eq!(c.slot(), a.slot());
+		assert_ne!(c, a);
+		table.insert(c, 3).unwrap();
+		assert_eq!(table.get(a), None);
+		assert_eq!(table.get(c), Some(&3));
+		assert_eq!(table.len(), 2);
+		Ok(())
+	}
+	crate::create_test!(test_table_recycles_pids);
+
+	pub fn test_exit_code_only_for_parent() -> Result<(), TestError> {
+		let mut table: ProcessTable<u32> = ProcessTable::with_capacity(8);
+		let parent = table.reserve().unwrap();
+		table.insert(parent, 0).unwrap();
+		let child = table.reserve().unwrap();
+		table.insert(child, 1).unwrap();
+		let other = table.reserve().unwrap();
+		table.insert(other, 2).unwrap();
+
+		table.remove(child, Some(parent), 42);
+		assert_eq!(table.take_exit_code(child, other), None);
+		assert_eq!(table.take_exit_code(child, parent), Some(42));
+		// collected once
+		assert_eq!(table.take_exit_code(child, parent), None);
+
+		// a parent that is gone leaves nothing behind
+		let orphan = table.reserve().unwrap();
+		table.insert(orphan, 3).unwrap();
+		table.remove(parent, None, 0);
+		table.remove(orphan, Some(parent), 7);
+		assert_eq!(table.take_exit_code(orphan, parent), None);
+		assert_eq!(table.len(), 1);
+		Ok(())
+	}
+	crate::create_test!(test_exit_code_only_for_parent);
+}
@@ -0,0 +1,317 @@
+//!
+//! timer.rs
+//!
+//! Sleep queue for the executor, a hierarchical timer wheel on APIC ticks.
+//!
+
+use alloc::vec::Vec;
+use core::{
+	future::Future,
+	pin::Pin,
+	sync::atomic::{AtomicU64, Ordering},
+	task::{Context, Poll, Waker}
+};
+
+use crate::{
+	apic::{APIC_TICK_COUNT, TIMER_HZ},
+	smp::{self, cpu_id},
+	utils::mutex::SpinMutex
+};
+
+/// log2 of the slots per level.
+const WHEEL_BITS: u32 = 6;
+/// Slots per level.
+const WHEEL_SLOTS: usize = 1 << WHEEL_BITS;
+/// Levels, each slot of level `n` spans `64^n` ticks. Four levels cover
+/// 2^24 ticks (about 4.5 hours at 1024 Hz), later deadlines wait in the top
+/// level and are placed again whenever its slot comes around.
+const WHEEL_LEVELS: usize = 4;
+
+/// Sleepers of the executor.
+pub static TIMERS: SpinMutex<TimerWheel> = SpinMutex::new(TimerWheel::new());
+/// Tick `TIMERS` was last advanced to, read without the lock.
+static WHEEL_NOW: AtomicU64 = AtomicU64::new(0);
+
+struct Timer {
+	deadline: u64,
+	waker: Waker
+}
+
+/// A hierarchical timing wheel.
+///
+/// Level 0 has one slot per tick, a slot of level `n` covers 64 slots of
+/// level `n - 1` and is spread into them when the wheel reaches it, so
+/// inserting and expiring are O(1) (amortised) no matter how many sleepers
+/// there are. Time only moves through `advance`.
+pub struct TimerWheel {
+	now: u64,
+	len: usize,
+	levels: [[Vec<Timer>; WHEEL_SLOTS]; WHEEL_LEVELS]
+}
+
+impl TimerWheel {
+	/// An empty wheel at tick 0.
+	pub const fn new() -> Self {
+		Self {
+			now: 0,
+			len: 0,
+			levels: [const { [const { Vec::new() }; WHEEL_SLOTS] }; WHEEL_LEVELS]
+		}
+	}
+
+	/// Current tick of the wheel.
+	pub fn now(&self) -> u64 {
+		self.now
+	}
+
+	/// Number of pending timers.
+	pub fn len(&self) -> usize {
+		self.len
+	}
+
+	/// If no timer is pending.
+	pub fn is_empty(&self) -> bool {
+		self.len == 0
+	}
+
+	/// Wakes `waker` once the wheel reaches `deadline`. A deadline that has
+	/// already passed is handed back to be woken right away.
+	pub fn insert(&mut self, deadline: u64, waker: Waker) -> Option<Waker> {
+		if deadline <= self.now {
+			return Some(waker);
+		}
+		self.place(Timer { deadline, waker });
+		self.len += 1;
+		None
+	}
+
+	fn place(&mut self, timer: Timer) {
+		// the lowest level whose slots still tell the deadline apart from now,
+		// which never puts a timer into a slot the wheel has already passed
+		let mut level = 0;
+		while level < WHEEL_LEVELS - 1
+			&& (timer.deadline >> (level as u32 * WHEEL_BITS)) - (self.now >> (level as u32 * WHEEL_BITS))
+				>= WHEEL_SLOTS as u64
+		{
+			level += 1;
+		}
+		let slot = (timer.deadline >> (level as u32 * WHEEL_BITS)) as usize & (WHEEL_SLOTS - 1);
+		self.levels[level][slot].push(timer);
+	}
+
+	/// Moves the wheel forward to `now` and pushes the wakers of every timer
+	/// that expired on the way into `expired`.
+	pub fn advance(&mut self, now: u64, expired: &mut Vec<Waker>) {
+		if now <= self.now {
+			return;
+		}
+		if self.len == 0 {
+			self.now = now;
+			return;
+		}
+
+		if now - self.now > WHEEL_SLOTS as u64 {
+			// after a long idle stretch it is cheaper to sort every timer again
+			// than to walk all the ticks in between
+			self.rebuild(now, expired);
+			return;
+		}
+
+		while self.now < now {
+			self.now += 1;
+
+			// spread the higher slots that start at this tick, top down so a
+			// timer can move more than one level
+			for level in (1..WHEEL_LEVELS).rev() {
+				let shift = level as u32 * WHEEL_BITS;
+				if self.now & ((1 << shift) - 1) == 0 {
+					let slot = (self.now >> shift) as usize & (WHEEL_SLOTS - 1);
+					let timers = core::mem::take(&mut self.levels[level][slot]);
+					self.requeue(timers, expired);
+				}
+			}
+
+			let slot = self.now as usize & (WHEEL_SLOTS - 1);
+			let timers = core::mem::take(&mut self.levels[0][slot]);
+			self.requeue(timers, expired);
+		}
+	}
+
+	fn rebuild(&mut self, now: u64, expired: &mut Vec<Waker>) {
+		let mut timers = Vec::with_capacity(self.len);
+		for level in self.levels.iter_mut() {
+			for slot in level.iter_mut() {
+				timers.append(slot);
+			}
+		}
+		self.now = now;
+		self.requeue(timers, expired);
+	}
+
+	fn requeue(&mut self, timers: Vec<Timer>, expired: &mut Vec<Waker>) {
+		for timer in timers {
+			if timer.deadline <= self.now {
+				self.len -= 1;
+				expired.push(timer.waker);
+			} else {
+				self.place(timer);
+			}
+		}
+	}
+
+	/// Earliest pending deadline. Walks every slot, meant for the idle path
+	/// only.
+	pub fn next_deadline(&self) -> Option<u64> {
+		if self.len == 0 {
+			return None;
+		}
+		self.levels
+			.iter()
+			.flat_map(|level| level.iter())
+			.flat_map(|slot| slot.iter())
+			.map(|timer| timer.deadline)
+			.min()
+	}
+}
+
+impl Default for TimerWheel {
+	fn default() -> Self {
+		Self::new()
+	}
+}
+
+/// Current tick of the timer interrupt.
+pub fn now() -> u64 {
+	APIC_TICK_COUNT.load(Ordering::Relaxed)
+}
+
+/// Ticks covering at least `ns` nanoseconds.
+pub fn ticks_from_ns(ns: u64) -> u64 {
+	(ns as u128 * TIMER_HZ as u128).div_ceil(1_000_000_000) as u64
+}
+
+/// Wakes every sleeper whose deadline has passed. Cheap when the tick has
+/// not moved, the executor calls it on every turn.
+pub fn run_expired() {
+	let now = now();
+	if WHEEL_NOW.load(Ordering::Relaxed) >= now {
+		return;
+	}
+
+	let mut expired = Vec::new();
+	{
+		let mut timers = TIMERS.lock();
+		timers.advance(now, &mut expired);
+		WHEEL_NOW.store(timers.now(), Ordering::Relaxed);
+	}
+	// outside the lock, a wake may run arbitrary code
+	for waker in expired {
+		waker.wake();
+	}
+}
+
+/// Earliest deadline any sleeper waits for.
+pub fn next_deadline() -> Option<u64> {
+	TIMERS.lock().next_deadline()
+}
+
+/// Resolves once the tick count reaches `deadline`. The process is off the
+/// run queue until then.
+pub fn sleep_until(deadline: u64) -> Sleep {
+	Sleep { deadline, armed: false }
+}
+
+/// Sleeps for at least `ns` nanoseconds.
+pub fn sleep_ns(ns: u64) -> Sleep {
+	sleep_until(now() + ticks_from_ns(ns))
+}
+
+/// Future returned by `sleep_until`.
+pub struct Sleep {
+	deadline: u64,
+	armed: bool
+}
+
+impl Future for Sleep {
+	type Output = ();
+
+	fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<()> {
+		if now() >= self.deadline {
+			return Poll::Ready(());
+		}
+		// the timer stays queued across spurious polls, one entry is enough
+		if !self.armed {
+			self.armed = true;
+			if let Some(waker) = TIMERS.lock().insert(self.deadline, cx.waker().clone()) {
+				waker.wake();
+			}
+			// an idle BSP may be tickless past this deadline, have it look again
+			if cpu_id() != 0 {
+				smp::kick(0);
+			}
+		}
+		Poll::Pending
+	}
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use alloc::{sync::Arc, task::Wake, vec::Vec};
+	use core::{
+		sync::atomic::{AtomicUsize, Ordering},
+		task::Waker
+	};
+
+	use crate::{task::timer::TimerWheel, utils::ktest::TestError};
+
+	struct CountWaker(AtomicUsize);
+
+	impl Wake for CountWaker {
+		fn wake(self: Arc<Self>) {
+			self.0.fetch_add(1, Ordering::Relaxed);
+		}
+	}
+
+	pub fn test_wheel_expires_in_order() -> Result<(), TestError> {
+		let mut wheel = TimerWheel::new();
+		let counts: Vec<Arc<CountWaker>> = (0..3).map(|_| Arc::new(CountWaker(AtomicUsize::new(0)))).collect();
+		// level 0, level 1 and level 2 deadlines
+		for (count, deadline) in counts.iter().zip([5u64, 300, 10_000]) {
+			assert!(wheel.insert(deadline, Waker::from(count.clone())).is_none());
+		}
+		assert_eq!(wheel.next_deadline(), Some(5));
+
+		let mut expired = Vec::new();
+		for tick in 1..=10_000u64 {
+			wheel.advance(tick, &mut expired);
+			expired.drain(..).for_each(Waker::wake);
+
+			let fired: usize = counts.iter().map(|c| c.0.load(Ordering::Relaxed)).sum();
+			let want = [5u64, 300, 10_000].iter().filter(|d| **d <= tick).count();
+			assert_eq!(fired, want);
+		}
+		assert!(wheel.is_empty());
+		Ok(())
+	}
+	crate::create_test!(test_wheel_expires_in_order);
+
+	pub fn test_wheel_long_jump() -> Result<(), TestError> {
+		let mut wheel = TimerWheel::new();
+		let count = Arc::new(CountWaker(AtomicUsize::new(0)));
+		wheel.insert(70, Waker::from(count.clone()));
+		wheel.insert(90_000, Waker::from(count.clone()));
+		// a deadline in the past is handed straight back
+		assert!(wheel.insert(0, Waker::from(count.clone())).is_some());
+
+		let mut expired = Vec::new();
+		wheel.advance(80_000, &mut expired);
+		assert_eq!(expired.len(), 1);
+		wheel.advance(89_999, &mut expired);
+		assert_eq!(expired.len(), 1);
+		wheel.advance(90_000, &mut expired);
+		assert_eq!(expired.len(), 2);
+		assert_eq!(wheel.len(), 0);
+		Ok(())
+	}
+	crate::create_test!(test_wheel_long_jump);
+}
@@ -4,7 +4,12 @@
 //! Boot-time module for the kernel.
 //! 
 
-use ::x86_64::registers::model_specific::{Efer, EferFlags};
+use core::{arch::x86_64::__cpuid, sync::atomic::{AtomicBool, Ordering}};
+
+use ::x86_64::registers::{
+    control::{Cr0, Cr0Flags, Cr4, Cr4Flags},
+    model_specific::{Efer, EferFlags},
+};
 
 /// Initialises the EFER register to allow for x86_64 NO_EXECUTE page table flags.
 pub fn init_efer() {
@@ -13,4 +18,65 @@ pub fn init_efer() {
             *flags |= EferFlags::NO_EXECUTE_ENABLE;
         })
     }
-}
\ No newline at end of file
+}
+
+/// Makes the kernel honour read-only pages too. Without it kernel writes to
+/// user buffers would go straight through copy-on-write pages.
+pub fn init_write_protect() {
+    unsafe {
+        Cr0::update(|flags| flags.insert(Cr0Flags::WRITE_PROTECT));
+    }
+}
+
+/// Set by `init_simd` when the vector registers of user programs are saved
+/// with `xsave` (AVX included), `fxsave` otherwise.
+pub static XSAVE_ENABLED: AtomicBool = AtomicBool::new(false);
+
+// XCR0 state components
+const XCR0_X87: u64 = 1 << 0;
+const XCR0_SSE: u64 = 1 << 1;
+const XCR0_AVX: u64 = 1 << 2;
+/// Every state component `init_simd` may enable, what `user::FpuState` has
+/// room for.
+pub const XSAVE_COMPONENTS: u64 = XCR0_X87 | XCR0_SSE | XCR0_AVX;
+
+/// Enables SSE for userspace, plus AVX when the cpu supports XSAVE and AVX.
+///
+/// The kernel itself is built soft-float and never touches vector registers,
+/// this only exists so user programs can use them. Each process keeps its
+/// own copy of them, see `user::FpuState`.
+pub fn init_simd() {
+    let leaf1 = unsafe { __cpuid(1) };
+    let has_xsave = leaf1.ecx & (1 << 26) != 0;
+    let has_avx = leaf1.ecx & (1 << 28) != 0;
+
+    unsafe {
+        Cr0::update(|flags| {
+            flags.remove(Cr0Flags::EMULATE_COPROCESSOR);
+            flags.insert(Cr0Flags::MONITOR_COPROCESSOR);
+        });
+        Cr4::update(|flags| {
+            flags.insert(Cr4Flags::OSFXSR | Cr4Flags::OSXMMEXCPT_ENABLE);
+            if has_xsave {
+                flags.insert(Cr4Flags::OSXSAVE);
+            }
+        });
+    }
+
+    if has_xsave {
+        let mut xcr0 = XCR0_X87 | XCR0_SSE;
+        if has_avx {
+            xcr0 |= XCR0_AVX;
+        }
+        unsafe {
+            core::arch::asm!(
+                "xsetbv",
+                in("ecx") 0,
+                in("eax") xcr0 as u32,
+                in("edx") (xcr0 >> 32) as u32,
+                options(nomem, nostack)
+            );
+        }
+    }
+    XSAVE_ENABLED.store(has_xsave, Ordering::Relaxed);
+}
@@ -6,18 +6,35 @@
 
 // https://codebrowser.dev/linux/include/elf.h.html
 
-use core::{arch::asm, ptr::{copy_nonoverlapping, write_bytes}};
+use core::ptr::write_bytes;
 
-use alloc::{sync::Arc, vec::Vec};
-use x86_64::{VirtAddr, registers::control::{Cr3, Cr3Flags}, structures::paging::{FrameAllocator, Mapper, OffsetPageTable, Page, PageTable, PageTableFlags, page::PageRange}};
+use alloc::{sync::Arc, vec, vec::Vec};
+use x86_64::{VirtAddr, structures::paging::{FrameAllocator, Page, PageTableFlags, PhysFrame}};
 
-use crate::{allocator::ALLOCATOR_INFO, arch::x86_64::user::{enter_user_process, setup_user_stack}, error::NullexError, fs::{self, resolve_path}, memory::{map_range, phys_to_virt}, println, serial_println, task::{AddressSpace, Process, ProcessState, UserContext}, utils::process::{spawn_process, spawn_user_process}};
+use crate::{allocator::ALLOCATOR_INFO, arch::x86_64::user::with_kernel_page_table, ensure, error::NullexError, fs::{self, pages::{FILE_PAGE_SIZE, FileData}, ramfs::{FsError, InodeId}, resolve_path}, memory::{map_frames, overlaps_kernel_slots, phys_to_virt, virt_to_phys}, println, serial_println, task::{AddressSpace, executor}, utils::{mutex::SpinMutex, process::spawn_user_process}};
 
 const ELF_MAGIC: [u8; 4] = [0x7f, b'E', b'L', b'F'];
 
 const EI_NIDENT: usize = 16;
 
+/// Program headers past this point in the file are not looked at.
+const ELF_HEADERS_MAX: usize = 64 * 1024;
+
+/// End of the lower half, PT_LOAD segments have to stay below it.
+const USER_SPACE_END: u64 = 0x0000_8000_0000_0000;
+
+/// Parsed images `load_elf` keeps around. Each one holds a snapshot of its
+/// file's pages, so this also bounds how much of rewritten or removed files
+/// stays alive for it.
+const IMAGE_CACHE_SIZE: usize = 8;
+
+/// Images of the files run last, see `load_elf`.
+static IMAGE_CACHE: SpinMutex<ImageCache> = SpinMutex::new(ImageCache::new());
+
 pub(crate) const HELLO_ELF: &[u8] = include_bytes!(concat!(env!("CARGO_MANIFEST_DIR"), "/build/userspace/hello/hello.elf"));
+pub(crate) const STRBENCH_ELF: &[u8] = include_bytes!(concat!(env!("CARGO_MANIFEST_DIR"), "/build/userspace/strbench/strbench.elf"));
+pub(crate) const BENCH_ELF: &[u8] = include_bytes!(concat!(env!("CARGO_MANIFEST_DIR"), "/build/userspace/bench/bench.elf"));
+pub(crate) const NOP_ELF: &[u8] = include_bytes!(concat!(env!("CARGO_MANIFEST_DIR"), "/build/userspace/bench/nop.elf"));
 //pub const BARE_ELF: &[u8] = include_bytes!(concat!(env!("CARGO_MANIFEST_DIR"), "/build/userspace/bare/bare.elf"));
 
 // these are the same for 32bit and 64-bit. 
@@ -44,7 +61,7 @@ const PF_R: u32 = 0x4;
 
 /// ELF file header
 #[repr(C)]
-#[derive(Debug)]
+#[derive(Debug, Default)]
 pub struct Elf64Ehdr {
 	e_ident: [u8; EI_NIDENT],
 	e_type: ElfHalf,
@@ -167,124 +184,373 @@ pub fn pelf(args: &[&str]) {
 
 	let path = resolve_path(args[0]);
 
-	let process = fs::with_fs(|fs| {
-		match fs.read_file(path.as_str()) {
-			Ok(bytes) => spawn_user_process(bytes, args, &[""]),
-			Err(_) => {
-				println!("pelf: file not found: {}", args[0]);
-				return Err(NullexError::FileNotFound);
-			}
+	let process = match load_elf(&path) {
+		Ok(image) => spawn_user_process(&image, args, &[]),
+		Err(NullexError::FileNotFound) => {
+			println!("pelf: file not found: {}", args[0]);
+			return;
 		}
-	});
+		Err(e) => Err(e)
+	};
 
 	match process {
 		Ok(proc) => {
-			serial_println!("[INFO] Entering User Process..");
-
-			unsafe {
-				enter_user_process(&proc);
+			// runs on the executor like any other process, so it can park in
+			// `waiton` and its `split` children get scheduled next to it
+			let pid = proc.state.id;
+			match executor::EXECUTOR.lock().spawn_process(proc) {
+				Ok(()) => serial_println!("[INFO] Spawned user process {}", pid.get()),
+				Err(_) => println!("pelf: failed to queue process")
 			}
-
-			let code = crate::arch::x86_64::user::USER_EXIT_CODE
-				.load(core::sync::atomic::Ordering::SeqCst);
-			println!("Process exited with code {}", code);
 		}
 		Err(_) => println!("pelf: failed to spawn process"),
 	}
 }
 
-/// Load a ELF binary segment into memory.
-pub fn load_segment(
-    address_space: &mut AddressSpace,
-    elf_bytes: &[u8],
-    seg: &LoadSegment,
-) -> Result<(), NullexError> {
-    if seg.memsz == 0 {
-        return Ok(());
-    }
-
-    let file_start = seg.offset as usize;
-    let file_end = seg
-        .offset
-        .checked_add(seg.filesz)
-        .ok_or(NullexError::ElfMagicIncorrect)? as usize;
-
-    if file_end > elf_bytes.len() {
-        return Err(NullexError::ElfMagicIncorrect);
-    }
-
-    let seg_start = seg.vaddr as usize;
-    let seg_end = seg_start
-        .checked_add(seg.memsz as usize)
-        .ok_or(NullexError::ElfMagicIncorrect)?;
-
-    let start_page = Page::containing_address(VirtAddr::new(seg_start as u64));
-    let end_page = Page::containing_address(VirtAddr::new((seg_end - 1) as u64));
-
-    let mut fa_guard = ALLOCATOR_INFO.frame_allocator.lock();
-    let fa = fa_guard
-        .as_mut()
-        .ok_or(NullexError::FrameAllocatorNotInitialized)?;
-
-    let table_ptr = unsafe { phys_to_virt(address_space.page_table.start_address()) };
-    let pml4 = unsafe { &mut *table_ptr.as_mut_ptr::<PageTable>() };
-    let mut mapper = unsafe { OffsetPageTable::new(pml4, *crate::PHYS_MEM_OFFSET.lock()) };
-
-    let mut flags = PageTableFlags::PRESENT | PageTableFlags::USER_ACCESSIBLE;
-
-    if seg.flags & PF_W != 0 {
-        flags |= PageTableFlags::WRITABLE;
-    }
-
-    if seg.flags & PF_X == 0 {
-        flags |= PageTableFlags::NO_EXECUTE;
-    }
-
-	serial_println!(
-		"segment vaddr={:#x} memsz={:#x} filesz={:#x} pages={}",
-		seg.vaddr,
-		seg.memsz,
-		seg.filesz,
-		(seg.memsz + 0xFFF) / 0x1000
-	);
-
-    for page in Page::range_inclusive(start_page, end_page) {
-        let frame = fa.allocate_frame().ok_or(NullexError::FrameAllocationFailed)?;
-
-        match unsafe { mapper.map_to(page, frame, flags, *fa) } {
-			Ok(flush) => flush.flush(),
-			Err(e) => {
-				serial_println!("map_to failed: {:?}", e);
-				return Err(NullexError::FrameAllocationFailed);
-			}
+/// Copies the ELF header and program header table out of `image`, enough for
+/// `parse_elf`. The rest of the file is left where it is.
+pub fn read_elf_headers(image: &FileData) -> Result<Vec<u8>, NullexError> {
+	let ehdr_size = core::mem::size_of::<Elf64Ehdr>();
+	ensure!(image.len() >= ehdr_size, NullexError::ElfMagicIncorrect);
+
+	let mut ehdr = Elf64Ehdr::default();
+	let ehdr_bytes = unsafe {
+		core::slice::from_raw_parts_mut(&mut ehdr as *mut Elf64Ehdr as *mut u8, ehdr_size)
+	};
+	image.read_at(0, ehdr_bytes);
+
+	// e_phoff comes straight from the file, a huge one must not wrap around
+	let table_end = (ehdr.e_phnum as usize)
+		.checked_mul(ehdr.e_phentsize as usize)
+		.and_then(|table_len| usize::try_from(ehdr.e_phoff).ok()?.checked_add(table_len))
+		.ok_or(NullexError::ElfMagicIncorrect)?;
+	let len = core::cmp::max(ehdr_size, core::cmp::min(table_end, image.len()));
+	ensure!(len <= ELF_HEADERS_MAX, NullexError::ElfMagicIncorrect);
+
+	let mut headers = vec![0u8; len];
+	image.read_at(0, &mut headers);
+	Ok(headers)
+}
+
+/// A PT_LOAD segment of a loaded image. Nothing is mapped up front, each page
+/// is filled in by `fault_in_image_page` the first time it is touched.
+#[derive(Clone)]
+pub struct ImageSegment {
+	/// Start of the segment in the user address space.
+	pub vaddr: u64,
+	/// Offset of the segment in the image.
+	pub offset: u64,
+	/// Bytes backed by the image, the rest up to `memsz` reads as zero.
+	pub filesz: u64,
+	/// Size of the segment in memory.
+	pub memsz: u64,
+	/// Flags the pages of the segment are mapped with.
+	pub flags: PageTableFlags,
+	/// The ELF file, shared by all segments of the image.
+	pub image: Arc<FileData>
+}
+
+impl ImageSegment {
+	/// Checks `seg` against `image` and records it for demand paging.
+	pub fn new(seg: &LoadSegment, image: &Arc<FileData>) -> Result<Self, NullexError> {
+		let file_end = seg.offset.checked_add(seg.filesz).ok_or(NullexError::ElfMagicIncorrect)?;
+		let mem_end = seg.vaddr.checked_add(seg.memsz).ok_or(NullexError::ElfMagicIncorrect)?;
+		ensure!(file_end <= image.len() as u64, NullexError::ElfMagicIncorrect);
+		ensure!(seg.filesz <= seg.memsz, NullexError::ElfMagicIncorrect);
+		ensure!(mem_end <= USER_SPACE_END, NullexError::ElfMagicIncorrect);
+		ensure!(!overlaps_kernel_slots(seg.vaddr, mem_end), NullexError::ElfMagicIncorrect);
+
+		let mut flags = PageTableFlags::PRESENT | PageTableFlags::USER_ACCESSIBLE;
+		if seg.flags & PF_W != 0 {
+			flags |= PageTableFlags::WRITABLE;
+		}
+		if seg.flags & PF_X == 0 {
+			flags |= PageTableFlags::NO_EXECUTE;
+		}
+
+		Ok(Self {
+			vaddr: seg.vaddr,
+			offset: seg.offset,
+			filesz: seg.filesz,
+			memsz: seg.memsz,
+			flags,
+			image: image.clone()
+		})
+	}
+
+	/// If `addr` lies inside this segment.
+	pub fn contains(&self, addr: u64) -> bool {
+		addr >= self.vaddr && addr - self.vaddr < self.memsz
+	}
+
+	/// If `frame`, mapped at `page`, is a page of the image itself rather than
+	/// a copy made for the address space.
+	pub fn borrows(&self, page: Page, frame: PhysFrame) -> bool {
+		let start = page.start_address().as_u64();
+		start < self.vaddr + self.memsz
+			&& start + 4096 > self.vaddr
+			&& self.shared_page_frame(page) == Some(frame)
+	}
+
+	/// The image page that holds exactly what `page` should contain, if it
+	/// can be mapped as is: read-only, page aligned in the file and without
+	/// any of the zero filled tail.
+	fn shared_page_frame(&self, page: Page) -> Option<PhysFrame> {
+		if self.flags.contains(PageTableFlags::WRITABLE) || (self.vaddr ^ self.offset) & 0xFFF != 0 {
+			return None;
+		}
+
+		let page_start = page.start_address().as_u64();
+		if page_start + 4096 > self.vaddr + self.filesz && self.memsz != self.filesz {
+			return None;
 		}
 
-        let frame_virt = unsafe { phys_to_virt(frame.start_address()).as_mut_ptr::<u8>() };
+		let file_offset = (self.offset & !0xFFF) + (page_start - (self.vaddr & !0xFFF));
+		let file_page = self.image.pages().get(file_offset as usize / FILE_PAGE_SIZE)?;
+		unsafe { virt_to_phys(VirtAddr::new(file_page.addr())) }.map(PhysFrame::containing_address)
+	}
 
-        unsafe {
-            write_bytes(frame_virt, 0, 4096);
-        }
+	/// Maps `page` of this segment into `address_space`. Needs the kernel page
+	/// table active.
+	fn map_page(&self, address_space: &mut AddressSpace, page: Page) -> Result<(), NullexError> {
+		if let Some(frame) = self.shared_page_frame(page) {
+			return map_frames(address_space, page, &[frame], self.flags);
+		}
 
-        let page_start = page.start_address().as_u64() as usize;
-        let page_end = page_start + 4096;
+		let frame = {
+			let mut fa_guard = ALLOCATOR_INFO.frame_allocator.lock();
+			let fa = fa_guard.as_mut().ok_or(NullexError::FrameAllocatorNotInitialized)?;
+			fa.allocate_frame().ok_or(NullexError::FrameAllocationFailed)?
+		};
+
+		let frame_ptr = unsafe { phys_to_virt(frame.start_address()).as_mut_ptr::<u8>() };
+		unsafe { write_bytes(frame_ptr, 0, 4096) };
+
+		let page_start = page.start_address().as_u64();
+		let copy_start = core::cmp::max(page_start, self.vaddr);
+		let copy_end = core::cmp::min(page_start + 4096, self.vaddr + self.filesz);
+		if copy_start < copy_end {
+			let dst = unsafe {
+				core::slice::from_raw_parts_mut(
+					frame_ptr.add((copy_start - page_start) as usize),
+					(copy_end - copy_start) as usize
+				)
+			};
+			self.image.read_at((self.offset + (copy_start - self.vaddr)) as usize, dst);
+		}
 
-        let copy_start = core::cmp::max(seg_start, page_start);
-        let copy_end = core::cmp::min(seg_end, page_end);
+		map_frames(address_space, page, &[frame], self.flags)
+	}
+}
 
-        if copy_start < copy_end {
-            let src_off = file_start + (copy_start - seg_start);
-            let dst_off = copy_start - page_start;
-            let len = copy_end - copy_start;
+/// An ELF file parsed and checked, ready to be mapped into any number of
+/// address spaces.
+pub struct LoadedImage {
+	/// Entry point of the program.
+	pub entry: u64,
+	/// PT_LOAD segments, all on one snapshot of the file. Every process gets a
+	/// copy of the list, the read-only pages are shared and the writable ones
+	/// copied on first touch, see `ImageSegment::map_page`.
+	pub segments: Vec<ImageSegment>
+}
 
-            unsafe {
-                copy_nonoverlapping(
-                    elf_bytes.as_ptr().add(src_off),
-                    frame_virt.add(dst_off),
-                    len,
-                );
-            }
-        }
-    }
+impl LoadedImage {
+	/// Parses `image` and checks its segments against it.
+	pub fn new(image: &FileData) -> Result<Self, NullexError> {
+		let elf = parse_elf(&read_elf_headers(image)?)?;
+
+		// one snapshot of the file for all segments, later writes to it copy
+		// the pages they touch and do not show up in the image
+		let image = Arc::new(image.clone());
+		let segments = elf
+			.segments
+			.iter()
+			.map(|seg| ImageSegment::new(seg, &image))
+			.collect::<Result<Vec<_>, _>>()?;
+
+		Ok(Self { entry: elf.entry, segments })
+	}
+}
 
-    Ok(())
-}
\ No newline at end of file
+/// The last `IMAGE_CACHE_SIZE` images loaded, most recently used first. An
+/// entry is only good for the version of the file it was parsed from.
+struct ImageCache {
+	entries: Vec<(InodeId, u64, Arc<LoadedImage>)>
+}
+
+impl ImageCache {
+	const fn new() -> Self {
+		Self { entries: Vec::new() }
+	}
+
+	/// The image of `version` of file `inode`, if it is cached.
+	fn get(&mut self, inode: InodeId, version: u64) -> Option<Arc<LoadedImage>> {
+		let i = self.entries.iter().position(|&(id, v, _)| id == inode && v == version)?;
+		self.entries[..=i].rotate_right(1);
+		Some(self.entries[0].2.clone())
+	}
+
+	/// Caches `image`, replacing whatever another version of the file left.
+	fn insert(&mut self, inode: InodeId, version: u64, image: Arc<LoadedImage>) {
+		self.entries.retain(|&(id, _, _)| id != inode);
+		self.entries.insert(0, (inode, version, image));
+		self.entries.truncate(IMAGE_CACHE_SIZE);
+	}
+}
+
+/// The parsed image of the ELF file at `path`. Running the same unchanged file
+/// again reuses the image of the last time instead of reading and checking
+/// its headers again.
+pub fn load_elf(path: &str) -> Result<Arc<LoadedImage>, NullexError> {
+	let found = fs::with_fs_read(|fs| -> Result<_, FsError> {
+		let id = fs.lookup(path)?;
+		let file = fs.inode(id)?;
+		let version = file.version();
+		Ok(match IMAGE_CACHE.lock().get(id, version) {
+			Some(image) => Ok(image),
+			// only the page list is cloned, the image is paged in from the file
+			None => Err((id, version, file.content.clone()))
+		})
+	});
+
+	match found.map_err(|_| NullexError::FileNotFound)? {
+		Ok(image) => Ok(image),
+		Err((id, version, content)) => {
+			let image = Arc::new(LoadedImage::new(&content)?);
+			IMAGE_CACHE.lock().insert(id, version, image.clone());
+			Ok(image)
+		}
+	}
+}
+
+/// Page fault hook for demand paged images. Maps the page holding `addr` if it
+/// belongs to a PT_LOAD segment of the running user process, returns false if
+/// it does not (the fault is a real one then).
+///
+/// # Safety
+/// Only to be called from the page fault handler for a not-present fault.
+pub unsafe fn fault_in_image_page(addr: VirtAddr) -> bool {
+	let process = executor::current_guard();
+	if process.is_null() {
+		return false;
+	}
+	let Some(address_space) = (unsafe { &mut *process }).address_space.as_mut() else {
+		return false;
+	};
+	let Some(seg) = address_space
+		.segments
+		.iter()
+		.find(|seg| seg.contains(addr.as_u64()))
+		.cloned()
+	else {
+		return false;
+	};
+
+	let page = Page::containing_address(addr);
+	match unsafe { with_kernel_page_table(|| seg.map_page(address_space, page)) } {
+		Ok(()) => true,
+		Err(e) => {
+			serial_println!("[ERROR] demand paging {:#x} failed: {}", addr.as_u64(), e);
+			false
+		}
+	}
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use alloc::sync::Arc;
+	use x86_64::{VirtAddr, structures::paging::{Page, PageTableFlags}};
+
+	use crate::{
+		fs::pages::FileData,
+		utils::{
+			elf::{HELLO_ELF, ImageCache, ImageSegment, LoadedImage, parse_elf, read_elf_headers},
+			ktest::TestError
+		}
+	};
+
+	pub fn test_image_segments_from_file_pages() -> Result<(), TestError> {
+		let mut image = FileData::new();
+		image.append(HELLO_ELF);
+		let image = Arc::new(image);
+
+		let elf = parse_elf(&read_elf_headers(&image).unwrap()).unwrap();
+		assert!(!elf.segments.is_empty());
+
+		let mut shared = 0;
+		for seg in &elf.segments {
+			let seg = ImageSegment::new(seg, &image).unwrap();
+			let page = Page::containing_address(VirtAddr::new(seg.vaddr));
+			// read-only pages come straight from the file, writable ones never do
+			if seg.shared_page_frame(page).is_some() {
+				assert!(!seg.flags.contains(PageTableFlags::WRITABLE));
+				shared += 1;
+			}
+		}
+		assert!(shared > 0);
+		Ok(())
+	}
+	crate::create_test!(test_image_segments_from_file_pages);
+
+	pub fn test_image_cache_keyed_by_version() -> Result<(), TestError> {
+		let mut file = FileData::new();
+		file.append(HELLO_ELF);
+		let image = Arc::new(LoadedImage::new(&file).unwrap());
+		assert!(!image.segments.is_empty());
+
+		let mut cache = ImageCache::new();
+		cache.insert(1, 0, image.clone());
+		assert!(Arc::ptr_eq(&cache.get(1, 0).unwrap(), &image));
+		// a write to the file makes the cached image stale
+		assert!(cache.get(1, 1).is_none());
+
+		cache.insert(1, 1, Arc::new(LoadedImage::new(&file).unwrap()));
+		assert!(cache.get(1, 0).is_none());
+		assert!(cache.get(1, 1).is_some());
+		Ok(())
+	}
+	crate::create_test!(test_image_cache_keyed_by_version);
+
+	pub fn test_program_header_overflow_rejected() -> Result<(), TestError> {
+		let mut bytes = HELLO_ELF.to_vec();
+		// e_phoff, at offset 32 of the ELF header
+		bytes[32..40].copy_from_slice(&u64::MAX.to_le_bytes());
+		let mut image = FileData::new();
+		image.append(&bytes);
+
+		assert!(read_elf_headers(&image).is_err());
+		Ok(())
+	}
+	crate::create_test!(test_program_header_overflow_rejected);
+}
+
+#[cfg(feature = "kbench")]
+pub mod benches {
+	use core::hint::black_box;
+
+	use crate::{
+		fs::pages::FileData,
+		utils::{
+			elf::{BENCH_ELF, HELLO_ELF, LoadedImage, NOP_ELF, STRBENCH_ELF, parse_elf, read_elf_headers},
+			ktest::{self, TestError}
+		}
+	};
+
+	pub fn bench_parse_elf() -> Result<(), TestError> {
+		let elfs = [("hello", HELLO_ELF), ("strbench", STRBENCH_ELF), ("bench", BENCH_ELF), ("nop", NOP_ELF)];
+		for (name, bytes) in elfs {
+			let mut file = FileData::new();
+			file.append(bytes);
+
+			ktest::bench(&alloc::format!("parse_elf_{}", name), 1_000, |_| {
+				black_box(parse_elf(&read_elf_headers(&file).unwrap()).unwrap());
+			});
+			// what `load_elf` does when the image is not cached
+			ktest::bench(&alloc::format!("load_image_{}", name), 1_000, |_| {
+				black_box(LoadedImage::new(&file).unwrap());
+			});
+		}
+		Ok(())
+	}
+	crate::create_bench!(bench_parse_elf);
+}
@@ -8,6 +8,19 @@ use core::{slice::from_raw_parts, str::from_utf8_unchecked};
 
 use crate::{println, serial_println};
 
+#[cfg(feature = "test")]
+use alloc::{boxed::Box, vec::Vec};
+#[cfg(feature = "test")]
+use core::{
+	future::Future,
+	pin::Pin,
+	sync::atomic::{AtomicUsize, Ordering},
+	task::{Context, Poll}
+};
+
+#[cfg(feature = "test")]
+use futures::task::AtomicWaker;
+
 #[cfg(feature = "test")]
 include!(concat!(env!("OUT_DIR"), "/tests_registry.rs"));
 
@@ -24,10 +37,18 @@ type TestFn = fn() -> Result<(), TestError>;
 #[repr(C)]
 /// Structure representing all data needed for locating
 /// and running tests.
+///
+/// The fields are only public for `create_test!` and `create_bench!`.
 pub struct TestDescriptor {
-	name_ptr: *const u8,
-	name_len: usize,
-	func: TestFn
+	#[doc(hidden)]
+	pub name_ptr: *const u8,
+	#[doc(hidden)]
+	pub name_len: usize,
+	#[doc(hidden)]
+	pub func: TestFn,
+	/// Registered by `create_bench!`, only run with the `kbench` feature.
+	#[doc(hidden)]
+	pub bench: bool
 }
 
 unsafe impl Send for TestDescriptor {}
@@ -91,7 +112,8 @@ macro_rules! create_test {
 				$crate::utils::ktest::TestDescriptor {
 					name_ptr: concat!(stringify!($fn_ident), "\0").as_ptr() as *const u8,
 					name_len: stringify!($fn_ident).len(),
-					func: super::$fn_ident
+					func: super::$fn_ident,
+					bench: false
 				};
 		}
 	};
@@ -103,11 +125,52 @@ macro_rules! create_test {
 			$crate::utils::ktest::TestDescriptor {
 				name_ptr: concat!(stringify!($fn_path), "\0").as_ptr() as *const u8,
 				name_len: stringify!($fn_path).len(),
-				func: $fn_path
+				func: $fn_path,
+				bench: false
 			};
 	};
 }
 
+#[macro_export]
+/// Registers a kernel microbenchmark, the same way `create_test!` registers a
+/// test.
+///
+/// Benchmarks are plain test functions that time their hot loops with
+/// `ktest::bench`. They only take part in `make test KBENCH=1` (the `kbench`
+/// feature), after all tests passed, and run one after another so nothing
+/// else competes with them.
+///
+/// ```ignore
+/// #[cfg(feature = "kbench")]
+/// pub fn bench_my_queue() -> Result<(), TestError> {
+///     let queue = MyQueue::new();
+///     ktest::bench("my_queue_push_pop", 10_000, |i| {
+///         queue.push(i);
+///         black_box(queue.pop());
+///     });
+///     Ok(())
+/// }
+/// create_bench!(bench_my_queue);
+/// ```
+macro_rules! create_bench {
+	($fn_ident:ident) => {
+		#[allow(non_snake_case)]
+		#[allow(non_upper_case_globals)]
+		mod $fn_ident {
+			#[used]
+			#[unsafe(link_section = ".kernel_tests")]
+			#[unsafe(export_name = concat!("__kernel_bench_", stringify!($fn_ident), "_", line!()))]
+			pub static TEST_DESCRIPTOR: $crate::utils::ktest::TestDescriptor =
+				$crate::utils::ktest::TestDescriptor {
+					name_ptr: concat!(stringify!($fn_ident), "\0").as_ptr() as *const u8,
+					name_len: stringify!($fn_ident).len(),
+					func: super::$fn_ident,
+					bench: true
+				};
+		}
+	};
+}
+
 unsafe extern "C" {
 	/// The starting address where the kernel tests are stored.
 	unsafe static __start_kernel_tests: u8;
@@ -115,48 +178,128 @@ unsafe extern "C" {
 	unsafe static __stop_kernel_tests: u8;
 }
 
-/// Runs all tests that have been generated.
+/// Tests still running, `run_all_tests` waits for this to reach zero.
+#[cfg(feature = "test")]
+static REMAINING: AtomicUsize = AtomicUsize::new(0);
+#[cfg(feature = "test")]
+static PASSED: AtomicUsize = AtomicUsize::new(0);
+#[cfg(feature = "test")]
+static FAILED: AtomicUsize = AtomicUsize::new(0);
+/// Woken by the last test to finish.
+#[cfg(feature = "test")]
+static ALL_DONE: AtomicWaker = AtomicWaker::new();
+
+/// Times `iters` calls of `f` (given the iteration) with the TSC and prints
+/// `kbench: <name> <cycles> cycles/op` over serial, the format of `make bench`,
+/// so the lines of two builds can be compared as they are.
+#[cfg(feature = "kbench")]
+pub fn bench(name: &str, iters: u64, mut f: impl FnMut(u64)) {
+	// the first rounds fill the caches and the allocator magazines
+	for i in 0..iters.min(64) {
+		f(i);
+	}
+
+	let start = unsafe { core::arch::x86_64::_rdtsc() };
+	for i in 0..iters {
+		f(i);
+	}
+	let cycles = unsafe { core::arch::x86_64::_rdtsc() } - start;
+	serial_println!("kbench: {} {} cycles/op", name, cycles / iters.max(1));
+}
+
+/// Runs one registered function and prints its result and how long it took.
+#[cfg(feature = "test")]
+fn run_test(desc: &TestDescriptor) -> bool {
+	let start = unsafe { core::arch::x86_64::_rdtsc() };
+	let result = (desc.func)();
+	let cycles = unsafe { core::arch::x86_64::_rdtsc() } - start;
+
+	// one line each, tests on other cpus print theirs in between
+	match result {
+		Ok(()) => {
+			println!("test {} ... ok", desc.name());
+			serial_println!("ktest: {} ok {} cycles cpu {}", desc.name(), cycles, crate::smp::cpu_id());
+			true
+		}
+		Err(e) => {
+			println!("test {} ... FAILED: {:?}", desc.name(), e);
+			serial_println!("ktest: {} FAILED {} cycles cpu {} {:?}", desc.name(), cycles, crate::smp::cpu_id(), e);
+			false
+		}
+	}
+}
+
+/// Body of the process each test runs in.
+#[cfg(feature = "test")]
+async fn test_process(desc: &'static TestDescriptor) -> i32 {
+	let counter = if run_test(desc) { &PASSED } else { &FAILED };
+	counter.fetch_add(1, Ordering::SeqCst);
+	if REMAINING.fetch_sub(1, Ordering::SeqCst) == 1 {
+		ALL_DONE.wake();
+	}
+	0
+}
+
+/// Resolves once every test process finished.
+#[cfg(feature = "test")]
+struct AllTestsDone;
+
+#[cfg(feature = "test")]
+impl Future for AllTestsDone {
+	type Output = ();
+
+	fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<()> {
+		if REMAINING.load(Ordering::SeqCst) == 0 {
+			return Poll::Ready(());
+		}
+		ALL_DONE.register(cx.waker());
+
+		// the last one may have finished between the check and the register
+		if REMAINING.load(Ordering::SeqCst) == 0 {
+			Poll::Ready(())
+		} else {
+			Poll::Pending
+		}
+	}
+}
+
+/// Runs all tests that have been generated, each in its own process so the
+/// executor spreads them over the cpus, then the benchmarks (with the
+/// `kbench` feature) one at a time. Exits QEMU with the result.
 /// Can only run on `#cfg[feature = "test"]`
-pub fn run_all_tests() {
+pub async fn run_all_tests() -> i32 {
 	#[cfg(feature = "test")]
 	{
 		use crate::{
 			qemu_exit,
-			utils::ktest::__generated_test_registry::__kernel_test_registry_refs
+			utils::{
+				ktest::__generated_test_registry::__kernel_test_registry_refs,
+				process::spawn_process
+			}
 		};
 
 		// deref the wrapper newtype to get the array of pointers
-		let ptrs = &__kernel_test_registry_refs.0;
-
-		println!("Running {} tests...", ptrs.len());
-		serial_println!("Running {} tests...", ptrs.len());
-
-		let mut passed = 0;
-		let mut failed = 0;
-
-		for (i, ptr) in ptrs.iter().enumerate() {
-			// deref the pointer to get the TestDescriptor
-			let desc = unsafe { &**ptr };
-			let name = desc.name();
-
-			println!("test {} ({})... ", i + 1, name);
-			serial_println!("test {} ({})... ", i + 1, name);
-
-			let result = (desc.func)();
-			match result {
-				Ok(_) => {
-					println!("ok");
-					serial_println!("ok");
-					passed += 1;
-				}
-				Err(e) => {
-					println!("FAILED: {:?}", e);
-					serial_println!("FAILED: {:?}", e);
-					failed += 1;
-				}
+		let descs: Vec<&'static TestDescriptor> = __kernel_test_registry_refs.0.iter().map(|ptr| unsafe { &**ptr }).collect();
+		let (benches, tests): (Vec<_>, Vec<_>) = descs.into_iter().partition(|desc| desc.bench);
+
+		println!("Running {} tests on {} cpus...", tests.len(), crate::smp::online_cpus());
+		serial_println!("Running {} tests on {} cpus...", tests.len(), crate::smp::online_cpus());
+
+		REMAINING.store(tests.len(), Ordering::SeqCst);
+		for desc in tests {
+			let spawned = spawn_process(
+				move |_state| Box::pin(test_process(desc)) as Pin<Box<dyn Future<Output = i32>>>,
+				false
+			);
+			if spawned.is_err() {
+				// out of processes, this one runs here instead
+				test_process(desc).await;
 			}
 		}
+		AllTestsDone.await;
 
+		let passed = PASSED.load(Ordering::SeqCst);
+		let failed = FAILED.load(Ordering::SeqCst);
 		println!("\n{} passed, {} failed", passed, failed);
 		serial_println!("\n{} passed, {} failed", passed, failed);
 
@@ -164,16 +307,26 @@ pub fn run_all_tests() {
 			println!("test result: FAILED");
 			serial_println!("test result: FAILED");
 			qemu_exit(1);
-		} else {
-			println!("test result: ok");
-			serial_println!("test result: ok");
-			qemu_exit(0)
 		}
+		println!("test result: ok");
+		serial_println!("test result: ok");
+
+		// timings are only worth comparing with the tests out of the way
+		if !benches.is_empty() {
+			serial_println!("Running {} benchmarks...", benches.len());
+			if benches.into_iter().filter(|desc| !run_test(desc)).count() > 0 {
+				serial_println!("bench result: FAILED");
+				qemu_exit(1);
+			}
+			serial_println!("bench result: ok");
+		}
+		qemu_exit(0)
 	}
 
 	#[cfg(not(feature = "test"))]
 	{
 		println!("Tests not compiled (feature 'test' not enabled)");
 		serial_println!("Tests not compiled (feature 'test' not enabled)");
+		-1
 	}
 }
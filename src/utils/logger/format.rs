@@ -5,6 +5,7 @@
 //! 
 
 use alloc::string::String;
+use core::fmt;
 
 use super::{levels::LogLevel, traits::log_formatter::LogFormatter};
 
@@ -31,4 +32,11 @@ impl LogFormatter for DefaultFormatter {
 		formatted_message.push_str(message);
 		formatted_message
 	}
+
+	fn format_into(&self, level: LogLevel, message: &str, out: &mut dyn fmt::Write) -> fmt::Result {
+		if self.show_level {
+			write!(out, "[{:#?}] ", level)?;
+		}
+		out.write_str(message)
+	}
 }
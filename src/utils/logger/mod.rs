@@ -7,5 +7,6 @@
 
 pub mod format;
 pub mod levels;
+pub mod ring;
 pub mod sinks;
 pub mod traits;
@@ -0,0 +1,374 @@
+//!
+//! ring.rs
+//!
+//! Lock-free record rings used by the syslog sink.
+//!
+
+use core::{
+	cell::UnsafeCell,
+	fmt,
+	future::Future,
+	pin::Pin,
+	sync::atomic::{AtomicU32, AtomicU64, Ordering, fence},
+	task::{Context, Poll}
+};
+
+use futures::task::AtomicWaker;
+
+/// Largest record in bytes, longer lines are cut off.
+pub const LOG_RECORD_MAX: usize = 236;
+
+/// One record slot, 256 bytes (four cache lines).
+#[repr(C, align(64))]
+struct Slot {
+	/// `2 * seq + 1` while record `seq` is being written, `2 * seq + 2` once it
+	/// is complete. Readers compare it before and after copying.
+	stamp: AtomicU64,
+	/// Time stamp counter when the record was claimed, orders the records of
+	/// different rings (see `read_merged`).
+	tsc: AtomicU64,
+	len: AtomicU32,
+	data: UnsafeCell<[u8; LOG_RECORD_MAX]>
+}
+
+impl Slot {
+	const fn new() -> Self {
+		Self {
+			stamp: AtomicU64::new(0),
+			tsc: AtomicU64::new(0),
+			len: AtomicU32::new(0),
+			data: UnsafeCell::new([0; LOG_RECORD_MAX])
+		}
+	}
+}
+
+/// Result of `LogRing::read_into`.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ReadOutcome {
+	/// Bytes copied, always whole records.
+	pub copied: usize,
+	/// Records that were overwritten before the reader got to them.
+	pub lost: u64
+}
+
+/// A fixed size ring of log records.
+///
+/// Writers never block and never allocate: they claim a sequence number with
+/// one `fetch_add` and copy the line into its slot, so logging works from
+/// interrupt handlers and while the filesystem lock is held. When writers lap
+/// the readers the oldest records are overwritten, readers notice that through
+/// the slot stamp and skip ahead.
+///
+/// Readers keep their own cursor (a sequence number), any number of them can
+/// stream the ring independently.
+pub struct LogRing<const SLOTS: usize> {
+	head: AtomicU64,
+	slots: [Slot; SLOTS],
+	waker: AtomicWaker
+}
+
+// slots are only written by the writer that claimed them, readers validate
+// what they copied with the stamp
+unsafe impl<const SLOTS: usize> Sync for LogRing<SLOTS> {}
+
+impl<const SLOTS: usize> LogRing<SLOTS> {
+	/// Creates an empty ring.
+	pub const fn new() -> Self {
+		Self {
+			head: AtomicU64::new(0),
+			slots: [const { Slot::new() }; SLOTS],
+			waker: AtomicWaker::new()
+		}
+	}
+
+	/// Sequence number the next record will get.
+	pub fn head(&self) -> u64 {
+		self.head.load(Ordering::Acquire)
+	}
+
+	/// Oldest sequence number that may still be in the ring.
+	pub fn oldest(&self) -> u64 {
+		self.head().saturating_sub(SLOTS as u64)
+	}
+
+	/// Appends one record, built by `f` through `fmt::Write`. Output past
+	/// `LOG_RECORD_MAX` bytes is dropped.
+	pub fn write_with(&self, f: impl FnOnce(&mut RecordWriter<'_>)) {
+		let tsc = unsafe { core::arch::x86_64::_rdtsc() };
+		let seq = self.head.fetch_add(1, Ordering::AcqRel);
+		let slot = &self.slots[(seq % SLOTS as u64) as usize];
+
+		slot.stamp.store(2 * seq + 1, Ordering::Relaxed);
+		// the odd stamp must be visible before any of the new bytes
+		fence(Ordering::Release);
+		slot.tsc.store(tsc, Ordering::Relaxed);
+
+		let mut writer = RecordWriter {
+			buf: unsafe { &mut *slot.data.get() },
+			len: 0
+		};
+		f(&mut writer);
+
+		slot.len.store(writer.len as u32, Ordering::Relaxed);
+		slot.stamp.store(2 * seq + 2, Ordering::Release);
+		self.waker.wake();
+	}
+
+	/// Appends `bytes` as one record.
+	pub fn write(&self, bytes: &[u8]) {
+		self.write_with(|w| w.push(bytes));
+	}
+
+	/// Copies complete records starting at `*cursor` into `out`, as many as
+	/// fit, and moves `*cursor` past them. Stops early at a record that is
+	/// still being written. `out` must hold at least `LOG_RECORD_MAX` bytes to
+	/// be sure to make progress.
+	pub fn read_into(&self, cursor: &mut u64, out: &mut [u8]) -> ReadOutcome {
+		self.read_records(cursor, out, usize::MAX)
+	}
+
+	/// Time stamp of the record at `cursor`. `None` if it is not complete yet,
+	/// `Some(0)` if it was overwritten, so a merge gets to skip it first.
+	fn next_tsc(&self, cursor: u64) -> Option<u64> {
+		if cursor >= self.head() {
+			return None;
+		}
+		let slot = &self.slots[(cursor % SLOTS as u64) as usize];
+		let want = 2 * cursor + 2;
+
+		let stamp = slot.stamp.load(Ordering::Acquire);
+		if stamp < want {
+			return None;
+		}
+		let tsc = slot.tsc.load(Ordering::Relaxed);
+		fence(Ordering::Acquire);
+		if stamp > want || slot.stamp.load(Ordering::Relaxed) != stamp {
+			return Some(0);
+		}
+		Some(tsc)
+	}
+
+	/// `read_into` copying at most `limit` records.
+	fn read_records(&self, cursor: &mut u64, out: &mut [u8], limit: usize) -> ReadOutcome {
+		let mut outcome = ReadOutcome::default();
+		let mut records = 0;
+
+		while *cursor < self.head() && records < limit {
+			let seq = *cursor;
+			let slot = &self.slots[(seq % SLOTS as u64) as usize];
+			let want = 2 * seq + 2;
+
+			let before = slot.stamp.load(Ordering::Acquire);
+			if before < want {
+				// claimed but not finished yet
+				break;
+			}
+			if before == want {
+				let len = slot.len.load(Ordering::Relaxed) as usize;
+				if outcome.copied + len > out.len() {
+					break;
+				}
+				// may race with a writer that lapped us, checked right below
+				unsafe {
+					core::ptr::copy_nonoverlapping(
+						(*slot.data.get()).as_ptr(),
+						out[outcome.copied..].as_mut_ptr(),
+						len
+					);
+				}
+				fence(Ordering::Acquire);
+				if slot.stamp.load(Ordering::Relaxed) == before {
+					outcome.copied += len;
+					*cursor += 1;
+					records += 1;
+					continue;
+				}
+			}
+
+			// overwritten, resume at the oldest record still around
+			let resume = core::cmp::max(seq + 1, self.oldest());
+			outcome.lost += resume - seq;
+			*cursor = resume;
+		}
+
+		outcome
+	}
+
+}
+
+/// Reads `rings` as one stream, the oldest record of any ring first, keeping
+/// a cursor per ring in `cursors`. Otherwise like `LogRing::read_into`.
+///
+/// Records are ordered by the time stamp counter they were claimed at, which
+/// is what per cpu rings can be merged on without sharing a cache line.
+pub fn read_merged<const SLOTS: usize>(
+	rings: &[LogRing<SLOTS>],
+	cursors: &mut [u64],
+	out: &mut [u8]
+) -> ReadOutcome {
+	let mut outcome = ReadOutcome::default();
+
+	loop {
+		let next = rings
+			.iter()
+			.zip(cursors.iter())
+			.enumerate()
+			.filter_map(|(i, (ring, &cursor))| Some((ring.next_tsc(cursor)?, i)))
+			.min();
+		let Some((_, i)) = next else {
+			break;
+		};
+
+		let read = rings[i].read_records(&mut cursors[i], &mut out[outcome.copied..], 1);
+		outcome.copied += read.copied;
+		outcome.lost += read.lost;
+		if read.copied == 0 && read.lost == 0 {
+			// `out` is full
+			break;
+		}
+	}
+
+	outcome
+}
+
+/// Resolves once any of `rings` has a record at or after its cursor.
+pub fn wait_merged<'a, const SLOTS: usize>(rings: &'a [LogRing<SLOTS>], cursors: &'a [u64]) -> WaitMerged<'a, SLOTS> {
+	WaitMerged {
+		rings,
+		cursors
+	}
+}
+
+impl<const SLOTS: usize> Default for LogRing<SLOTS> {
+	fn default() -> Self {
+		Self::new()
+	}
+}
+
+/// Future returned by `wait_merged`.
+pub struct WaitMerged<'a, const SLOTS: usize> {
+	rings: &'a [LogRing<SLOTS>],
+	cursors: &'a [u64]
+}
+
+impl<const SLOTS: usize> WaitMerged<'_, SLOTS> {
+	fn ready(&self) -> bool {
+		self.rings.iter().zip(self.cursors).any(|(ring, &cursor)| ring.head() > cursor)
+	}
+}
+
+impl<const SLOTS: usize> Future for WaitMerged<'_, SLOTS> {
+	type Output = ();
+
+	fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<()> {
+		if self.ready() {
+			return Poll::Ready(());
+		}
+
+		for ring in self.rings {
+			ring.waker.register(cx.waker());
+		}
+
+		if self.ready() {
+			for ring in self.rings {
+				ring.waker.take();
+			}
+			Poll::Ready(())
+		} else {
+			Poll::Pending
+		}
+	}
+}
+
+/// Fills one ring slot, see `LogRing::write_with`.
+pub struct RecordWriter<'a> {
+	buf: &'a mut [u8; LOG_RECORD_MAX],
+	len: usize
+}
+
+impl RecordWriter<'_> {
+	/// Appends as much of `bytes` as still fits.
+	pub fn push(&mut self, bytes: &[u8]) {
+		let n = core::cmp::min(bytes.len(), LOG_RECORD_MAX - self.len);
+		self.buf[self.len..self.len + n].copy_from_slice(&bytes[..n]);
+		self.len += n;
+	}
+}
+
+impl fmt::Write for RecordWriter<'_> {
+	fn write_str(&mut self, s: &str) -> fmt::Result {
+		self.push(s.as_bytes());
+		Ok(())
+	}
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use alloc::boxed::Box;
+
+	use crate::utils::{
+		ktest::TestError,
+		logger::ring::{LOG_RECORD_MAX, LogRing, ReadOutcome, read_merged}
+	};
+
+	pub fn test_ring_read_in_order() -> Result<(), TestError> {
+		let ring: Box<LogRing<8>> = Box::new(LogRing::new());
+		ring.write(b"one\n");
+		ring.write(b"two\n");
+
+		let mut cursor = 0;
+		let mut out = [0u8; LOG_RECORD_MAX];
+		let got = ring.read_into(&mut cursor, &mut out);
+
+		assert_eq!(got, ReadOutcome { copied: 8, lost: 0 });
+		assert_eq!(&out[..8], b"one\ntwo\n");
+		assert_eq!(cursor, 2);
+		assert_eq!(ring.read_into(&mut cursor, &mut out).copied, 0);
+		Ok(())
+	}
+	crate::create_test!(test_ring_read_in_order);
+
+	pub fn test_ring_overwrite_skips_lost() -> Result<(), TestError> {
+		let ring: Box<LogRing<4>> = Box::new(LogRing::new());
+		for i in 0..6u8 {
+			ring.write(&[b'0' + i]);
+		}
+
+		let mut cursor = 0;
+		let mut out = [0u8; LOG_RECORD_MAX];
+		let got = ring.read_into(&mut cursor, &mut out);
+
+		assert_eq!(got, ReadOutcome { copied: 4, lost: 2 });
+		assert_eq!(&out[..4], b"2345");
+		Ok(())
+	}
+	crate::create_test!(test_ring_overwrite_skips_lost);
+
+	pub fn test_ring_long_record_truncated() -> Result<(), TestError> {
+		let ring: Box<LogRing<4>> = Box::new(LogRing::new());
+		ring.write(&[b'x'; LOG_RECORD_MAX + 50]);
+
+		let mut cursor = 0;
+		let mut out = [0u8; LOG_RECORD_MAX * 2];
+		assert_eq!(ring.read_into(&mut cursor, &mut out).copied, LOG_RECORD_MAX);
+		Ok(())
+	}
+	crate::create_test!(test_ring_long_record_truncated);
+
+	pub fn test_rings_merged_in_time_order() -> Result<(), TestError> {
+		let rings: Box<[LogRing<4>; 2]> = Box::new([LogRing::new(), LogRing::new()]);
+		rings[1].write(b"a");
+		rings[0].write(b"b");
+		rings[1].write(b"c");
+
+		let mut cursors = [0; 2];
+		let mut out = [0u8; LOG_RECORD_MAX];
+		let got = read_merged(&rings[..], &mut cursors, &mut out);
+
+		assert_eq!(got, ReadOutcome { copied: 3, lost: 0 });
+		assert_eq!(&out[..3], b"abc");
+		assert_eq!(cursors, [1, 2]);
+		Ok(())
+	}
+	crate::create_test!(test_rings_merged_in_time_order);
+}
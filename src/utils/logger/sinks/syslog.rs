@@ -4,18 +4,36 @@
 //! System Log sink logic for the kernel.
 //! 
 
-use alloc::boxed::Box;
+use alloc::{boxed::Box, format, vec};
 
 use crate::{
 	fs::{self, ramfs::Permission},
+	smp::{MAX_CPUS, cpu_id},
+	task::yield_now,
 	utils::logger::{
 		levels::LogLevel,
+		ring::{LOG_RECORD_MAX, LogRing, read_merged, wait_merged},
 		traits::{log_formatter::LogFormatter, logger_sink::LoggerSink}
 	}
 };
 
+/// Number of records each of the `SYSLOG_RINGS` keeps.
+pub const SYSLOG_RING_SLOTS: usize = 64;
+
+/// Bytes the drain task moves into `/logs/syslog` per filesystem write.
+const DRAIN_BATCH: usize = 16 * LOG_RECORD_MAX;
+
+/// Every syslog line goes through the ring of the cpu logging it first, so
+/// cpus logging at once do not fight over one ring head. `drain_syslog`
+/// merges them into `/logs/syslog` and userspace can stream them with
+/// `readlog`.
+pub static SYSLOG_RINGS: [LogRing<SYSLOG_RING_SLOTS>; MAX_CPUS] = [const { LogRing::new() }; MAX_CPUS];
 
 /// The SysLog sink. Logs to files inside of `/logs/syslog`
+///
+/// Lines are put into `SYSLOG_RINGS` without taking any lock, so this is safe
+/// to use from interrupt handlers. They show up in the file once the drain
+/// task has run.
 pub struct SyslogSink {
 	/// The formatting strategy used.
 	pub formatter: Box<dyn LogFormatter>
@@ -32,16 +50,9 @@ impl SyslogSink {
 
 impl LoggerSink for SyslogSink {
 	fn log(&self, message: &str, level: LogLevel) {
-		let formatted_message = self.formatter.format(level, message);
-		fs::with_fs(|fs| {
-			if !fs.exists("/logs") {
-				let _ = fs.create_dir("/logs", Permission::all());
-			}
-			if !fs.exists("/logs/syslog") {
-				let _ = fs.create_file("/logs/syslog", Permission::all());
-			}
-			let _ = fs.write_file("/logs/syslog", formatted_message.as_bytes(), false);
-		})
+		SYSLOG_RINGS[cpu_id()].write_with(|record| {
+			let _ = self.formatter.format_into(level, message, record);
+		});
 	}
 
 	fn log_async(
@@ -49,17 +60,50 @@ impl LoggerSink for SyslogSink {
 		message: &str,
 		level: LogLevel
 	) -> impl core::future::Future<Output = ()> + Send {
-		let formatted_message = self.formatter.format(level, message);
-		async move {
-			fs::with_fs(|fs| {
-				if !fs.exists("/logs") {
-					let _ = fs.create_dir("/logs", Permission::all());
-				}
-				if !fs.exists("/logs/syslog") {
-					let _ = fs.create_file("/logs/syslog", Permission::all());
-				}
-				let _ = fs.write_file("/logs/syslog", formatted_message.as_bytes(), false);
-			})
+		// the ring never blocks, there is nothing to wait for
+		self.log(message, level);
+		async move {}
+	}
+}
+
+/// Background process that moves `SYSLOG_RINGS` into `/logs/syslog`.
+///
+/// Sleeps until a line is logged, then copies everything available in batches
+/// of up to `DRAIN_BATCH` bytes, oldest line of any cpu first, taking the
+/// filesystem lock once per batch.
+pub async fn drain_syslog() -> i32 {
+	let mut cursors = [0; MAX_CPUS];
+	let mut batch = vec![0u8; DRAIN_BATCH];
+
+	loop {
+		wait_merged(&SYSLOG_RINGS, &cursors).await;
+
+		let read = read_merged(&SYSLOG_RINGS, &mut cursors, &mut batch);
+		if read.lost > 0 {
+			let note = format!("[syslog] {} lines lost, ring overrun\n", read.lost);
+			append_syslog(note.as_bytes());
 		}
+		if read.copied > 0 {
+			append_syslog(&batch[..read.copied]);
+		} else if read.lost == 0 {
+			// the next record is still being written, let its writer finish
+			yield_now().await;
+		}
+	}
+}
+
+fn append_syslog(bytes: &[u8]) {
+	// the file is there but for the first batch, which creates it
+	if fs::with_fs_read(|fs| fs.write_file("/logs/syslog", bytes, false)).is_ok() {
+		return;
 	}
+	fs::with_fs(|fs| {
+		if !fs.exists("/logs") {
+			let _ = fs.create_dir("/logs", Permission::all());
+		}
+		if !fs.exists("/logs/syslog") {
+			let _ = fs.create_file("/logs/syslog", Permission::all());
+		}
+		let _ = fs.write_file("/logs/syslog", bytes, false);
+	})
 }
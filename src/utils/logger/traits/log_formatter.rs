@@ -5,10 +5,19 @@
 //! 
 
 use alloc::string::String;
+use core::fmt;
+
 use crate::utils::logger::levels::LogLevel;
 
 /// Trait that all log formatters will need to implement.
 pub trait LogFormatter: Send + Sync {
 	/// Format the log message with a certain `LogLevel`
 	fn format(&self, level: LogLevel, message: &str) -> String;
+
+	/// Format the log message straight into `out`. Sinks that may run in
+	/// interrupt context use this, formatters should override it to avoid the
+	/// allocation in `format`.
+	fn format_into(&self, level: LogLevel, message: &str, out: &mut dyn fmt::Write) -> fmt::Result {
+		out.write_str(&self.format(level, message))
+	}
 }
@@ -34,6 +34,7 @@ pub mod oncecell;
 pub mod process;
 #[allow(missing_docs)]
 pub mod spin;
+pub mod trace;
 pub mod types;
 #[allow(missing_docs)]
 pub mod volatile;
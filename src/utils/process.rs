@@ -6,12 +6,12 @@
 
 use alloc::{boxed::Box, sync::Arc};
 use crossbeam_queue::ArrayQueue;
-use core::{future::Future, pin::Pin, sync::atomic::{AtomicBool, Ordering}};
+use core::{future::Future, pin::Pin, sync::atomic::{AtomicBool, AtomicUsize, Ordering}, task::{Context, Poll}};
 
 use futures::task::AtomicWaker;
 
 use crate::{
-	apic::{APIC_TICK_COUNT, APIC_TPS}, error::NullexError, task::{Process, ProcessId, ProcessState, executor::EXECUTOR, yield_now}, utils::oncecell::cell::OnceCell
+	arch::x86_64::user::{USER_EXIT_CODE, USER_PARKED, enter_user_process}, error::NullexError, println, smp::cpu_id, task::{Park, Process, ProcessId, ProcessState, executor::{self, EXECUTOR}, timer}, utils::{elf::LoadedImage, oncecell::cell::OnceCell}
 };
 
 /// Spawns a process using the provided future function.
@@ -41,52 +41,151 @@ where
 {
 	// lock the executor and create a new PID.
 	let mut executor = EXECUTOR.lock();
-	let pid = executor.create_pid();
+	let pid = executor.create_pid()?;
 
 	// create the process state.
 	let state = Arc::new(ProcessState {
 		id: pid,
 		is_child,
+		parent: None,
 		future_fn: Arc::new(future_fn),
 		queued: AtomicBool::new(false),
+		cpu: AtomicUsize::new(0),
+		exited: AtomicBool::new(false),
 		scancode_queue: OnceCell::uninit(),
 		waker: AtomicWaker::new()
 	});
 
 	// construct the process.
-	let process = Process::new(state)?;
+	let process = Process::new(state).inspect_err(|_| executor.release_pid(pid))?;
 	// spawn the process.
 	executor.spawn_process(process)?;
 	Ok(pid)
 }
 
 /// Spawns a new user process with restricted permissions.
-pub fn spawn_user_process(bytes: &[u8], args: &[&str], envs: &[&str]) -> Result<Process, NullexError> {
+pub fn spawn_user_process(image: &LoadedImage, args: &[&str], envs: &[&str]) -> Result<Process, NullexError> {
+	user_process(image, args, envs, Arc::new(|_| Box::pin(run_user_process())))
+}
+
+/// Spawns `/apps/bench.elf` and leaves QEMU through isa-debug-exit with its
+/// exit code once it halts, for `make bench`.
+#[cfg(feature = "bench")]
+pub fn spawn_bench() -> Result<ProcessId, NullexError> {
+	async fn run_bench() -> i32 {
+		let code = run_user_process().await;
+		crate::serial_println!("[BENCH] bench.elf exited with code {}", code);
+		crate::qemu_exit(code as u32)
+	}
+
+	const PATH: &str = "/apps/bench.elf";
+	let image = crate::utils::elf::load_elf(PATH)?;
+	let process = user_process(&image, &[PATH], &[], Arc::new(|_| Box::pin(run_bench())))?;
+	let pid = process.state.id;
+	EXECUTOR.lock().spawn_process(process)?;
+	Ok(pid)
+}
+
+/// A user process running `image` as the future `future_fn` makes.
+fn user_process(
+	image: &LoadedImage,
+	args: &[&str],
+	envs: &[&str],
+	future_fn: Arc<dyn Fn(Arc<ProcessState>) -> Pin<Box<dyn Future<Output = i32>>> + Send + Sync>
+) -> Result<Process, NullexError> {
 	let mut executor = EXECUTOR.lock();
-	let pid = executor.create_pid();
+	let pid = executor.create_pid()?;
 
 	let state = Arc::new(ProcessState {
         id: pid,
         is_child: false,
-        future_fn: Arc::new(|_| Box::pin(async { 0 })),
+        parent: None,
+        future_fn,
         queued: AtomicBool::new(false),
+        cpu: AtomicUsize::new(0),
+        exited: AtomicBool::new(false),
         scancode_queue: OnceCell::new(ArrayQueue::new(1)),
         waker: AtomicWaker::new(),
     });
 
-    Process::from_elf(state, bytes, args, envs)
+    Process::from_elf(state, image, args, envs).inspect_err(|_| executor.release_pid(pid))
 }
 
-#[allow(unused)]
-/// # Safety
-/// Should NEVER be used in kernel space. only like a API for syscalls and user space later.
-async unsafe fn sleep(ms: u64) {
-    let tps = APIC_TPS.load(Ordering::Relaxed);
-    let now = APIC_TICK_COUNT.load(Ordering::Relaxed);
-    let ticks = (ms * tps) / 1000;
-    let then = now + ticks;
-
-    while APIC_TICK_COUNT.load(Ordering::Relaxed) < then {
-        yield_now().await;
+/// Body of an executor process that runs user code, like a `split` child.
+///
+/// Enters the process being polled from its saved context and only completes
+/// when the program calls `halt`, with its exit code. A program parked in
+/// `waiton` or `nap` makes this wait for the child or the timer (other
+/// processes run meanwhile) and is then entered again with the syscall result.
+pub async fn run_user_process() -> i32 {
+    loop {
+        let process = executor::current_guard();
+        if process.is_null() {
+            return -1;
+        }
+
+        // a poll stays on one cpu, but the next one may be on another
+        let cpu = cpu_id();
+        USER_PARKED[cpu].store(false, Ordering::SeqCst);
+        unsafe { enter_user_process(&*process) };
+        // left from inside a syscall, which runs with interrupts masked
+        x86_64::instructions::interrupts::enable();
+
+        if !USER_PARKED[cpu].load(Ordering::SeqCst) {
+            let code = USER_EXIT_CODE[cpu].load(Ordering::SeqCst);
+            println!("Process exited with code {}", code);
+            return code;
+        }
+
+        let parked = unsafe { (*process).parked };
+        let code = match parked {
+            Some(Park::Child(_)) => WaitOnChild.await,
+            Some(Park::Nap(deadline)) => {
+                timer::sleep_until(deadline).await;
+                0
+            }
+            None => -1
+        };
+        // the guard is set again for this poll, the process may have moved
+        let process = unsafe { &mut *executor::current_guard() };
+        process.parked = None;
+        process.context.rax = code as i64 as u64;
     }
-}
\ No newline at end of file
+}
+
+/// Resolves with the exit code of the child the polled process waits on.
+struct WaitOnChild;
+
+impl Future for WaitOnChild {
+    type Output = i32;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<i32> {
+        let process = executor::current_guard();
+        if process.is_null() {
+            return Poll::Ready(-1);
+        }
+        let process = unsafe { &*process };
+        let Some(Park::Child(child)) = process.parked else {
+            return Poll::Ready(-1);
+        };
+
+        let mut executor = EXECUTOR.lock();
+        if let Some(code) = executor.take_exit_code(child, process.state.id) {
+            return Poll::Ready(code);
+        }
+        let Some(child_state) = executor.state(child) else {
+            // gone without leaving a code for us
+            return Poll::Ready(-1);
+        };
+        drop(executor);
+
+        // not through the child's lock, it may be running on another cpu
+        child_state.waker.register(cx.waker());
+
+        // the child may have exited between the check and the register
+        match EXECUTOR.lock().take_exit_code(child, process.state.id) {
+            Some(code) => Poll::Ready(code),
+            None => Poll::Pending
+        }
+    }
+}
@@ -0,0 +1,226 @@
+//!
+//! utils/trace.rs
+//!
+//! Binary event trace for hot paths.
+//!
+//! Every cpu records into a ring of its own of fixed size records, so an event
+//! costs a timestamp, one atomic add on a cache line no other cpu writes and
+//! four stores. Interrupts nesting into a writer reserve the next slot and
+//! never overwrite it. The oldest records are overwritten once a ring is full.
+//!
+//! Nothing is recorded until tracing is switched on, an event is then a
+//! single relaxed load. The rings are merged by timestamp when read, see
+//! `snapshot`, `publish` and `scripts/trace2json.py`.
+//!
+
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+
+use crate::{
+	fs,
+	serial_println,
+	smp::{MAX_CPUS, cpu_id},
+	task::executor
+};
+
+/// File the records are published to, refreshed whenever it is opened.
+pub const PROC_PATH: &str = "/proc/trace";
+
+/// Records each cpu keeps, a power of two. A snapshot of every ring has to
+/// fit the kernel heap next to everything else.
+const RING_RECORDS: usize = 1024;
+
+// event ids, mirrored in scripts/trace2json.py and TRACE_USER as NX_TRACE_USER
+// in nullex.h
+
+/// A process was created, args: pid, cpu it is queued on.
+pub const TRACE_SPAWN: u16 = 1;
+/// A cpu starts polling a process, args: pid.
+pub const TRACE_SWITCH_IN: u16 = 2;
+/// A cpu is done polling a process, args: pid, 1 if it finished.
+pub const TRACE_SWITCH_OUT: u16 = 3;
+/// A process was queued to run, args: pid, cpu it is queued on.
+pub const TRACE_WAKE: u16 = 4;
+/// A process ended, args: pid, exit code.
+pub const TRACE_EXIT: u16 = 5;
+/// Syscall entry, args: syscall id, first argument.
+pub const TRACE_SYSCALL_ENTER: u16 = 6;
+/// Syscall exit, args: syscall id, return value.
+pub const TRACE_SYSCALL_EXIT: u16 = 7;
+/// Interrupt handler entry, args: vector.
+pub const TRACE_IRQ_ENTER: u16 = 8;
+/// Interrupt handler exit, args: vector.
+pub const TRACE_IRQ_EXIT: u16 = 9;
+/// Page fault, args: address, error code.
+pub const TRACE_PAGE_FAULT: u16 = 10;
+/// Events from user processes are `TRACE_USER | id`, with a 15 bit `id` the
+/// program picks.
+pub const TRACE_USER: u16 = 0x8000;
+
+/// Pid recorded for events outside of any process.
+pub const NO_PID: u32 = u32::MAX;
+
+/// One event as read back and as written to `PROC_PATH`, 32 bytes little
+/// endian.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct TraceRecord {
+	/// Time stamp counter when it was recorded.
+	pub tsc: u64,
+	/// Process running on the cpu, `NO_PID` if none.
+	pub pid: u32,
+	/// Cpu it was recorded on.
+	pub cpu: u16,
+	/// One of the `TRACE_*` ids.
+	pub event: u16,
+	/// Meaning depends on the event.
+	pub args: [u64; 2]
+}
+
+/// A record as stored: the time stamp, the pid, cpu and event packed into
+/// one word, and the args. Atomic so a reader racing a writer sees a mix of
+/// old and new words at worst.
+struct Slot([AtomicU64; 4]);
+
+#[repr(align(64))]
+struct CpuRing {
+	/// Slots ever reserved, the next one goes at `head % RING_RECORDS`.
+	head: AtomicU64,
+	slots: [Slot; RING_RECORDS]
+}
+
+static RINGS: [CpuRing; MAX_CPUS] = [const {
+	CpuRing {
+		head: AtomicU64::new(0),
+		slots: [const { Slot([const { AtomicU64::new(0) }; 4]) }; RING_RECORDS]
+	}
+}; MAX_CPUS];
+
+static TRACE_ENABLED: AtomicBool = AtomicBool::new(false);
+
+/// Starts or stops recording. What was recorded stays until overwritten.
+pub fn set_enabled(enabled: bool) {
+	TRACE_ENABLED.store(enabled, Ordering::Relaxed);
+}
+
+/// Whether events are being recorded.
+pub fn enabled() -> bool {
+	TRACE_ENABLED.load(Ordering::Relaxed)
+}
+
+/// Pid of the process the calling cpu is polling.
+fn current_pid() -> u32 {
+	let process = executor::current_guard();
+	if process.is_null() {
+		return NO_PID;
+	}
+	// set only while the process is locked by this cpu, which an interrupt
+	// handler here is running on top of
+	unsafe { (*process).state.id.get() as u32 }
+}
+
+/// Records `event` with `args` on the calling cpu if tracing is on.
+#[inline]
+pub fn trace(event: u16, args: [u64; 2]) {
+	if !TRACE_ENABLED.load(Ordering::Relaxed) {
+		return;
+	}
+	record(cpu_id(), current_pid(), event, args);
+}
+
+fn record(cpu: usize, pid: u32, event: u16, args: [u64; 2]) {
+	let ring = &RINGS[cpu];
+	let tsc = unsafe { core::arch::x86_64::_rdtsc() };
+	let index = ring.head.fetch_add(1, Ordering::Relaxed) as usize % RING_RECORDS;
+	let slot = &ring.slots[index].0;
+	slot[0].store(tsc, Ordering::Relaxed);
+	slot[1].store((pid as u64) << 32 | (cpu as u64) << 16 | event as u64, Ordering::Relaxed);
+	slot[2].store(args[0], Ordering::Relaxed);
+	slot[3].store(args[1], Ordering::Relaxed);
+}
+
+/// Every record still in the rings, oldest first. Best taken with tracing
+/// off, a record written meanwhile may come out torn.
+pub fn snapshot() -> Vec<TraceRecord> {
+	let mut records = Vec::new();
+	for ring in &RINGS {
+		let head = ring.head.load(Ordering::Relaxed);
+		for n in head.saturating_sub(RING_RECORDS as u64)..head {
+			let slot = &ring.slots[n as usize % RING_RECORDS].0;
+			let word = slot[1].load(Ordering::Relaxed);
+			records.push(TraceRecord {
+				tsc: slot[0].load(Ordering::Relaxed),
+				pid: (word >> 32) as u32,
+				cpu: (word >> 16) as u16,
+				event: word as u16,
+				args: [slot[2].load(Ordering::Relaxed), slot[3].load(Ordering::Relaxed)]
+			});
+		}
+	}
+	records.sort_unstable_by_key(|record| record.tsc);
+	records
+}
+
+/// Drops every record.
+pub fn clear() {
+	for ring in &RINGS {
+		ring.head.store(0, Ordering::Relaxed);
+	}
+}
+
+/// Prints the records to serial, one `trace: tsc cpu pid event arg0 arg1`
+/// line each with the numbers in hex, as `scripts/trace2json.py` reads them
+/// from a serial log.
+pub fn dump(records: &[TraceRecord]) {
+	for record in records {
+		serial_println!(
+			"trace: {:x} {:x} {:x} {:x} {:x} {:x}",
+			record.tsc, record.cpu, record.pid, record.event, record.args[0], record.args[1]
+		);
+	}
+}
+
+/// Writes the current records to `PROC_PATH` as packed `TraceRecord`s.
+pub fn publish() {
+	let records = snapshot();
+	let mut bytes = Vec::with_capacity(records.len() * size_of::<TraceRecord>());
+	for record in &records {
+		bytes.extend_from_slice(&record.tsc.to_le_bytes());
+		bytes.extend_from_slice(&record.pid.to_le_bytes());
+		bytes.extend_from_slice(&record.cpu.to_le_bytes());
+		bytes.extend_from_slice(&record.event.to_le_bytes());
+		bytes.extend_from_slice(&record.args[0].to_le_bytes());
+		bytes.extend_from_slice(&record.args[1].to_le_bytes());
+	}
+	let _ = fs::with_fs_read(|fs| fs.write_file(PROC_PATH, &bytes, true));
+}
+
+#[cfg(feature = "test")]
+pub mod tests {
+	use crate::utils::{
+		ktest::TestError,
+		trace::{RING_RECORDS, RINGS, TRACE_USER, TraceRecord, record, snapshot}
+	};
+
+	pub fn test_trace_ring_wraps() -> Result<(), TestError> {
+		assert_eq!(size_of::<TraceRecord>(), 32);
+
+		// the last cpu slot is only ever used on a full machine
+		let cpu = RINGS.len() - 1;
+		let before = snapshot().iter().filter(|r| r.cpu as usize == cpu).count();
+		assert!(before <= RING_RECORDS);
+		for n in 0..RING_RECORDS as u64 + 3 {
+			record(cpu, 7, TRACE_USER | 1, [n, !n]);
+		}
+
+		let records: alloc::vec::Vec<_> = snapshot().into_iter().filter(|r| r.cpu as usize == cpu).collect();
+		assert_eq!(records.len(), RING_RECORDS);
+		// the three oldest were overwritten
+		assert_eq!(records[0].args, [3, !3]);
+		let last = records.last().unwrap();
+		assert_eq!((last.pid, last.event, last.args[0]), (7, TRACE_USER | 1, RING_RECORDS as u64 + 2));
+		assert!(records.windows(2).all(|pair| pair[0].tsc <= pair[1].tsc));
+		Ok(())
+	}
+	crate::create_test!(test_trace_ring_wraps);
+}
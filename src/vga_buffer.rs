@@ -5,15 +5,30 @@
 //!
 //! I have revamped it from phil-opp's blog as there was a bug where you
 //! couldn't change the vga font colour.
-//! 
+//!
+//! Writers only touch a shadow of the screen in normal memory and mark the
+//! rows they changed. Once `flush_task` runs, the changed rows are copied to
+//! the text buffer a word at a time, at most every `FLUSH_INTERVAL_NS`, so a
+//! burst of output and all the scrolling it causes costs one pass over the
+//! uncached buffer and nobody printing waits for it. Before that, and after a
+//! panic, every write goes straight through.
 //! 
 
-use core::fmt;
+use core::{
+	fmt,
+	future::Future,
+	mem,
+	pin::Pin,
+	sync::atomic::{AtomicBool, Ordering},
+	task::{Context, Poll}
+};
 
+use futures::task::AtomicWaker;
 use x86_64::instructions::port::Port;
 
 use crate::{
 	lazy_static,
+	task::timer,
 	utils::{mutex::SpinMutex, volatile::Volatile}
 };
 
@@ -33,10 +48,26 @@ lazy_static! {
 		column_position: 0,
 		current_row: 0,
 		color_code: ColorCode::new(Color::White, Color::Black),
-		buffer: unsafe { &mut *(0xb8000 as *mut Buffer) },
+		shadow: [[ScreenChar::blank(); BUFFER_WIDTH]; BUFFER_HEIGHT],
+		dirty_rows: 0,
+		cursor_dirty: false,
+		buffer: unsafe { &mut *(VGA_BUFFER_ADDR as *mut Buffer) },
 	});
 }
 
+const VGA_BUFFER_ADDR: usize = 0xb8000;
+
+/// Least time between two flushes of the shadow screen.
+const FLUSH_INTERVAL_NS: u64 = 20_000_000;
+
+/// Writes stay in the shadow screen for `flush_task`.
+static DEFERRED: AtomicBool = AtomicBool::new(false);
+/// The shadow screen changed since `flush_task` last looked.
+static PENDING: AtomicBool = AtomicBool::new(false);
+static FLUSH_WAKER: AtomicWaker = AtomicWaker::new();
+/// Keeps flushes in order, the text buffer is written outside `WRITER`.
+static FLUSHING: SpinMutex<()> = SpinMutex::new(());
+
 /// The standard color palette in VGA text mode.
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 #[repr(u8)]
@@ -115,6 +146,9 @@ impl ScreenChar {
 
 const BUFFER_HEIGHT: usize = 25;
 const BUFFER_WIDTH: usize = 80;
+const ALL_ROWS: u32 = (1 << BUFFER_HEIGHT) - 1;
+
+type Screen = [[ScreenChar; BUFFER_WIDTH]; BUFFER_HEIGHT];
 
 /// A VGA Text Buffer
 #[derive(Clone, Debug)]
@@ -124,18 +158,41 @@ pub struct Buffer {
 	chars: [[Volatile<ScreenChar>; BUFFER_WIDTH]; BUFFER_HEIGHT]
 }
 
+impl Buffer {
+	/// A buffer of blanks in normal memory.
+	fn blank() -> Buffer {
+		Buffer {
+			chars: core::array::from_fn(|_| core::array::from_fn(|_| Volatile::new(ScreenChar::blank())))
+		}
+	}
+}
+
 /// A writer type that allows writing ASCII bytes and strings to an underlying
 /// `Buffer`.
 pub struct Writer {
 	column_position: usize,
 	current_row: usize,
 	pub(self) color_code: ColorCode,
+	/// What the screen shows after the next flush.
+	shadow: Screen,
+	/// Rows of `shadow` changed since the last flush, a bit each.
+	dirty_rows: u32,
+	/// The cursor moved since the last flush.
+	cursor_dirty: bool,
 	buffer: &'static mut Buffer
 }
 
 impl Writer {
 	/// Writes an ASCII byte to the buffer.
 	fn write_byte(&mut self, byte: u8) {
+		self.put_byte(byte);
+		self.update_cursor();
+		self.present();
+	}
+
+	/// Writes an ASCII byte to the buffer without touching the hardware
+	/// cursor. Callers writing many bytes move the cursor once at the end.
+	fn put_byte(&mut self, byte: u8) {
 		match byte {
 			b'\n' => {
 				self.new_line();
@@ -149,24 +206,31 @@ impl Writer {
 				let row = self.current_row;
 				let col = self.column_position;
 
-				self.buffer.chars[row][col].write(ScreenChar::new(byte as char, self.color_code));
+				self.shadow[row][col] = ScreenChar::new(byte as char, self.color_code);
+				self.dirty_rows |= 1 << row;
 
-				// advance column & update hardware cursor immediately
 				self.column_position += 1;
-				self.update_cursor();
 			}
 		}
 	}
 
 	/// Writes the given ASCII string to the buffer.
 	fn write_string(&mut self, s: &str) {
-		for byte in s.bytes() {
+		self.write_bytes(s.as_bytes());
+	}
+
+	/// Writes raw bytes to the buffer, updating the hardware cursor once
+	/// instead of once per character.
+	fn write_bytes(&mut self, bytes: &[u8]) {
+		for &byte in bytes {
 			match byte {
 				// printable ASCII byte or newline
-				0x20..=0x7e | b'\n' => self.write_byte(byte),
-				_ => self.write_byte(0xfe)
+				0x20..=0x7e | b'\n' => self.put_byte(byte),
+				_ => self.put_byte(0xfe)
 			}
 		}
+		self.update_cursor();
+		self.present();
 	}
 
 	/// Shifts lines up when the buffer is full and moves to the next line.
@@ -174,57 +238,75 @@ impl Writer {
 		self.current_row += 1;
 
 		if self.current_row >= BUFFER_HEIGHT {
-			// scroll up
-			for row in 1..BUFFER_HEIGHT {
-				for col in 0..BUFFER_WIDTH {
-					let character = self.buffer.chars[row][col].read();
-					self.buffer.chars[row - 1][col].write(character);
-				}
-			}
+			// scroll up, the screen is redrawn whole on the next flush
+			self.shadow.copy_within(1.., 0);
+			self.dirty_rows = ALL_ROWS;
 			// clear last line
 			self.clear_row(BUFFER_HEIGHT - 1);
 			self.current_row = BUFFER_HEIGHT - 1;
 		}
 
 		self.column_position = 0;
-		self.update_cursor();
 	}
 
 	/// Clears a row by overwriting it with blank characters.
 	fn clear_row(&mut self, row: usize) {
-		let blank = ScreenChar::blank();
-		for col in 0..BUFFER_WIDTH {
-			self.buffer.chars[row][col].write(blank);
-		}
+		self.shadow[row] = [ScreenChar::blank(); BUFFER_WIDTH];
+		self.dirty_rows |= 1 << row;
 	}
 
 	/// Clear the VGA buffer and screen.
 	pub(crate) fn clear_everything(&mut self) {
-		let blank = ScreenChar::blank();
-		for row in 0..BUFFER_HEIGHT {
-			for col in 0..BUFFER_WIDTH {
-				self.buffer.chars[row][col].write(blank);
-			}
-		}
+		self.shadow = [[ScreenChar::blank(); BUFFER_WIDTH]; BUFFER_HEIGHT];
+		self.dirty_rows = ALL_ROWS;
 		// reset cursor to top-left after clearing
 		self.current_row = 0;
 		self.column_position = 0;
 		self.update_cursor();
+		self.present();
+	}
+
+	/// Marks the VGA cursor moved, it follows on the next flush.
+	fn update_cursor(&mut self) {
+		self.cursor_dirty = true;
+	}
+
+	/// Hardware cursor position, row * width + col.
+	fn cursor_position(&self) -> usize {
+		(self.current_row * BUFFER_WIDTH) + self.column_position
+	}
+
+	/// Ends a change to the shadow screen: shows it right away, or lets
+	/// `flush_task` know once writes are deferred.
+	fn present(&mut self) {
+		if self.dirty_rows == 0 && !self.cursor_dirty {
+			return;
+		}
+		if DEFERRED.load(Ordering::Acquire) {
+			if !PENDING.swap(true, Ordering::AcqRel) {
+				FLUSH_WAKER.wake();
+			}
+			return;
+		}
+
+		let rows = mem::take(&mut self.dirty_rows);
+		unsafe { write_rows(&mut *self.buffer, &self.shadow, rows) };
+		if mem::take(&mut self.cursor_dirty) {
+			set_cursor(self.cursor_position());
+		}
 	}
 
-	/// Update the VGA cursor to move on a character write.
-	fn update_cursor(&self) {
-		// hardware cursor position = row * width + col
-		let position = (self.current_row * BUFFER_WIDTH) + self.column_position;
-
-		let mut port_3d4 = Port::<u8>::new(0x3D4);
-		let mut port_3d5 = Port::<u8>::new(0x3D5);
-		unsafe {
-			port_3d4.write(0x0F);
-			port_3d5.write((position & 0xFF) as u8);
-			port_3d4.write(0x0E);
-			port_3d5.write(((position >> 8) & 0xFF) as u8);
+	/// Copies the rows changed since the last flush into `out`, returning
+	/// which ones and where the cursor moved to.
+	fn take_dirty(&mut self, out: &mut Screen) -> (u32, Option<usize>) {
+		let rows = mem::take(&mut self.dirty_rows);
+		for (row, line) in out.iter_mut().enumerate() {
+			if rows & (1 << row) != 0 {
+				*line = self.shadow[row];
+			}
 		}
+		let cursor = mem::take(&mut self.cursor_dirty).then(|| self.cursor_position());
+		(rows, cursor)
 	}
 
 	/// Copies the VGA Buffer into memory for restoration.<br>
@@ -232,7 +314,13 @@ impl Writer {
 	/// want to revert back to the original terminal screen.
 	#[allow(dead_code)]
 	pub(crate) fn copy_vga_buffer(&self) -> Buffer {
-		self.buffer.clone()
+		let mut copy = Buffer::blank();
+		for y in 0..BUFFER_HEIGHT {
+			for x in 0..BUFFER_WIDTH {
+				copy.chars[y][x].write(self.shadow[y][x]);
+			}
+		}
+		copy
 	}
 
 	/// Restores the VGA Buffer from memory. 
@@ -242,10 +330,11 @@ impl Writer {
 	pub(crate) fn restore_vga_buffer(&mut self, prev: &Buffer) {
 		for y in 0..BUFFER_HEIGHT {
 			for x in 0..BUFFER_WIDTH {
-				let ch = prev.chars[y][x].read();
-				self.buffer.chars[y][x].write(ch);
+				self.shadow[y][x] = prev.chars[y][x].read();
 			}
 		}
+		self.dirty_rows = ALL_ROWS;
+		self.present();
 	}
 
 	/// Copies the current cursor position into memory for restoration.
@@ -272,8 +361,10 @@ impl Writer {
 		}
 
 		// write blank at the new cursor position and update the cursor
-		self.buffer.chars[self.current_row][self.column_position].write(blank);
+		self.shadow[self.current_row][self.column_position] = blank;
+		self.dirty_rows |= 1 << self.current_row;
 		self.update_cursor();
+		self.present();
 	}
 
 	/// Run a closure with a temporary color, restoring the previous color
@@ -309,6 +400,92 @@ pub fn console_backspace() {
 	WRITER.lock().backspace();
 }
 
+/// Copies the rows set in `rows` from `screen` to the text buffer at `vga`,
+/// eight bytes per access instead of a character.
+///
+/// # Safety
+/// `vga` has to point to the VGA text buffer.
+unsafe fn write_rows(vga: *mut Buffer, screen: &Screen, rows: u32) {
+	const WORDS: usize = BUFFER_WIDTH * size_of::<ScreenChar>() / size_of::<u64>();
+
+	for (row, line) in screen.iter().enumerate() {
+		if rows & (1 << row) == 0 {
+			continue;
+		}
+		// rows are 160 bytes, so every row of the buffer starts 8 byte aligned
+		let src = line.as_ptr() as *const u64;
+		let dst = unsafe { (vga as *mut u64).add(row * WORDS) };
+		for word in 0..WORDS {
+			unsafe { dst.add(word).write_volatile(src.add(word).read_unaligned()) };
+		}
+	}
+}
+
+fn set_cursor(position: usize) {
+	let mut port_3d4 = Port::<u8>::new(0x3D4);
+	let mut port_3d5 = Port::<u8>::new(0x3D5);
+	unsafe {
+		port_3d4.write(0x0F);
+		port_3d5.write((position & 0xFF) as u8);
+		port_3d4.write(0x0E);
+		port_3d5.write(((position >> 8) & 0xFF) as u8);
+	}
+}
+
+/// Shows everything written so far. The text buffer is written after
+/// `WRITER` is released, printing goes on meanwhile.
+pub fn flush() {
+	let _flushing = FLUSHING.lock();
+	// written from here on wakes `flush_task` again
+	PENDING.store(false, Ordering::Release);
+
+	let mut screen = [[ScreenChar::blank(); BUFFER_WIDTH]; BUFFER_HEIGHT];
+	let (rows, cursor) = WRITER.lock().take_dirty(&mut screen);
+	unsafe { write_rows(VGA_BUFFER_ADDR as *mut Buffer, &screen, rows) };
+	if let Some(position) = cursor {
+		set_cursor(position);
+	}
+}
+
+/// Makes every write show right away again, for the panic handler. The next
+/// write shows everything not flushed yet along with it.
+pub fn stop_deferring() {
+	DEFERRED.store(false, Ordering::Release);
+}
+
+/// Background process that flushes the shadow screen. Sleeps until something
+/// is written, then waits `FLUSH_INTERVAL_NS` for more before flushing.
+pub async fn flush_task() -> i32 {
+	DEFERRED.store(true, Ordering::Release);
+	loop {
+		ScreenChanged.await;
+		timer::sleep_ns(FLUSH_INTERVAL_NS).await;
+		flush();
+	}
+}
+
+/// Resolves once the shadow screen changed after the last flush.
+struct ScreenChanged;
+
+impl Future for ScreenChanged {
+	type Output = ();
+
+	fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<()> {
+		if PENDING.load(Ordering::Acquire) {
+			return Poll::Ready(());
+		}
+
+		FLUSH_WAKER.register(cx.waker());
+
+		if PENDING.load(Ordering::Acquire) {
+			FLUSH_WAKER.take();
+			Poll::Ready(())
+		} else {
+			Poll::Pending
+		}
+	}
+}
+
 impl fmt::Write for Writer {
 	fn write_str(&mut self, s: &str) -> fmt::Result {
 		self.write_string(s);
@@ -338,6 +515,13 @@ pub fn _print(args: fmt::Arguments) {
 	WRITER.lock().write_fmt(args).unwrap();
 }
 
+/// Writes a whole byte buffer to the VGA text buffer under a single lock.
+/// Used by the console syscalls so a large userspace write doesnt go
+/// through `fmt` one `str` at a time.
+pub fn write_bytes(bytes: &[u8]) {
+	WRITER.lock().write_bytes(bytes);
+}
+
 #[doc(hidden)]
 pub fn _print_segments(segments: &[(&str, Color, Color)]) {
 	let mut w = WRITER.lock();